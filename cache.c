@@ -0,0 +1,258 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "fsock.h"
+#include "stats.h"
+
+#ifdef POSIX_FADV_DONTNEED
+# define HAVE_FADVISE 1
+#else
+/* No `posix_fadvise()` here, the hints are ignored */
+# define HAVE_FADVISE 0
+# define POSIX_FADV_SEQUENTIAL 0
+# define POSIX_FADV_WILLNEED   0
+# define POSIX_FADV_DONTNEED   0
+#endif
+
+#ifdef __linux__
+/* Write-back can be started without waiting for it */
+# define HAVE_WRITE_BEHIND 1
+#else
+# define HAVE_WRITE_BEHIND 0
+#endif
+
+cache_mode cache_policy = CACHE_DEFAULT;
+
+int cache_parse(const char *name)
+{
+    if (strcmp(name, "default") == 0) {
+        return CACHE_DEFAULT;
+    }
+    if (strcmp(name, "drop") == 0) {
+        return CACHE_DROP;
+    }
+    if (strcmp(name, "direct") == 0) {
+        return CACHE_DIRECT;
+    }
+    return -1;
+}
+
+/**
+ * Give the kernel a hint about a part of the file, where it takes hints
+ */
+static void cache_advise(int fd, off_t offset, off_t length, int advice)
+{
+#if HAVE_FADVISE
+    if (length > 0) {
+        posix_fadvise(fd, offset, length, advice);
+    }
+#else
+    (void)fd;
+    (void)offset;
+    (void)length;
+    (void)advice;
+#endif
+}
+
+/**
+ * Write back a part of the file
+ *
+ * @param fd     File descriptor
+ * @param offset Start of the part
+ * @param length Length of the part
+ * @param wait   Wait for the write-back to complete, otherwise only start it
+ */
+static void cache_write_back(int fd, off_t offset, off_t length, int wait)
+{
+#ifdef __linux__
+    unsigned flags = SYNC_FILE_RANGE_WRITE;
+
+    if (wait) {
+        flags |= SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WAIT_AFTER;
+    }
+    if (length > 0) {
+        sync_file_range(fd, offset, length, flags);
+    }
+#else
+    (void)offset;
+    (void)length;
+    if (wait) {
+        fdatasync(fd);
+    }
+#endif
+}
+
+void cache_start(cache_cursor *c, int fd, off_t offset, size_t length, int write)
+{
+    c->fd = fd;
+    c->drop = cache_policy != CACHE_DEFAULT;
+    c->active = (c->drop || (write && HAVE_WRITE_BEHIND)) && length > 0;
+    c->write = write;
+    c->end = offset + (off_t)length;
+    c->ahead = c->flushed = c->dropped = offset;
+    if (c->active && !write) {
+        cache_advise(fd, offset, (off_t)length, POSIX_FADV_SEQUENTIAL);
+    }
+}
+
+void cache_advance(cache_cursor *c, off_t pos)
+{
+    if (!c->active) {
+        return;
+    }
+
+    if (c->write) {
+        /*
+         * Start writing back every window, wait for it a window later, so
+         * no more than two windows are dirty at a time
+         */
+        while (pos - c->flushed >= CACHE_WINDOW) {
+            cache_write_back(c->fd, c->flushed, CACHE_WINDOW, 0);
+            c->flushed += CACHE_WINDOW;
+            if (c->flushed - c->dropped > CACHE_WINDOW) {
+                cache_write_back(c->fd, c->dropped, CACHE_WINDOW, 1);
+                if (c->drop) {
+                    cache_advise(c->fd, c->dropped, CACHE_WINDOW, POSIX_FADV_DONTNEED);
+                }
+                c->dropped += CACHE_WINDOW;
+            }
+        }
+        return;
+    }
+
+    /* Keep a window read ahead, and drop the pages a window behind */
+    if (c->ahead < c->end && c->ahead - pos < CACHE_WINDOW) {
+        off_t length = c->end - c->ahead < CACHE_WINDOW ? c->end - c->ahead : CACHE_WINDOW;
+
+        cache_advise(c->fd, c->ahead, length, POSIX_FADV_WILLNEED);
+        c->ahead += length;
+    }
+    if (pos - c->dropped >= 2 * CACHE_WINDOW) {
+        cache_advise(c->fd, c->dropped, pos - CACHE_WINDOW - c->dropped, POSIX_FADV_DONTNEED);
+        c->dropped = pos - CACHE_WINDOW;
+    }
+}
+
+void cache_finish(cache_cursor *c)
+{
+    if (!c->active) {
+        return;
+    }
+    if (c->write) {
+        cache_write_back(c->fd, c->dropped, c->end - c->dropped, c->drop);
+    }
+    if (c->drop) {
+        cache_advise(c->fd, c->dropped, c->end - c->dropped, POSIX_FADV_DONTNEED);
+    }
+    c->active = 0;
+}
+
+int cache_open_direct(int fd, int flags)
+{
+#ifdef __linux__
+    char path[64];
+
+    /* Reopens the same file, whatever its name is by now */
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+    return open(path, flags | O_DIRECT | O_CLOEXEC);
+#else
+    (void)fd;
+    (void)flags;
+    return -1;
+#endif
+}
+
+void *cache_alloc(size_t size)
+{
+    void *buf;
+    int rc = posix_memalign(&buf, CACHE_ALIGN, size);
+
+    if (rc != 0) {
+        errno = rc;
+        perror("posix_memalign");
+        return NULL;
+    }
+    return buf;
+}
+
+ssize_t cache_read_direct(int fd, char *buf, off_t pos, off_t end, char **data)
+{
+    off_t start = pos & ~(off_t)(CACHE_ALIGN - 1);
+    ssize_t n;
+
+    do {
+        uint64_t t = stats_start();
+
+        n = pread(fd, buf, CHUNK_SIZE, start);
+        stats_stop(STATS_READ, t, n);
+    } while (n < 0 && errno == EINTR);
+
+    if (n < 0 && errno == EINVAL) {
+        return FSOCK_UNSUPPORTED;
+    }
+    if (n < 0) {
+        perror("pread");
+        return -1;
+    }
+    if (start + n <= pos) {
+        printf("File is shorter than expected\n");
+        return -1;
+    }
+
+    *data = buf + (pos - start);
+    if (start + n > end) {
+        n = (ssize_t)(end - start);
+    }
+    return n - (pos - start);
+}
+
+/**
+ * Write the whole buffer at the given offset
+ *
+ * @return 0 on success, -1 on error
+ */
+static int cache_pwrite(int fd, const char *buf, size_t length, off_t offset)
+{
+    while (length > 0) {
+        uint64_t start = stats_start();
+        ssize_t n = pwrite(fd, buf, length, offset);
+
+        stats_stop(STATS_WRITE, start, n);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("pwrite");
+            return -1;
+        }
+        buf += n;
+        length -= (size_t)n;
+        offset += n;
+    }
+    return 0;
+}
+
+int cache_write_direct(int fd, int direct_fd, const char *buf, size_t length, off_t offset)
+{
+    size_t head = (size_t)(-offset & (CACHE_ALIGN - 1)), body;
+
+    if (head > length) {
+        head = length;
+    }
+    body = (length - head) & ~(size_t)(CACHE_ALIGN - 1);
+
+    if (cache_pwrite(fd, buf, head, offset) < 0
+        || cache_pwrite(direct_fd, buf + head, body, offset + (off_t)head) < 0
+        || cache_pwrite(fd, buf + head + body, length - head - body,
+                        offset + (off_t)(head + body)) < 0) {
+        return -1;
+    }
+    return 0;
+}
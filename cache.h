@@ -0,0 +1,160 @@
+/**
+ * @file cache.h
+ * @brief Page cache policies for the file data
+ *
+ * By default the data goes through the page cache like any other I/O,
+ * so a large transfer evicts whatever other programs keep cached. The
+ * other policies leave the cache alone:
+ *
+ * - `CACHE_DROP` keeps buffered I/O but moves a window along the file:
+ *   ahead of the cursor the data is read in advance with
+ *   `POSIX_FADV_WILLNEED`, behind it the pages are dropped with
+ *   `POSIX_FADV_DONTNEED`. Written pages can be dropped only once they
+ *   are clean, so on Linux the writer starts the write-back of every
+ *   window with `sync_file_range()` and waits for it a window later.
+ * - `CACHE_DIRECT` reads and writes with `O_DIRECT` through buffers
+ *   aligned to `CACHE_ALIGN`, bypassing the cache altogether. Where the
+ *   file system doesn't support it, `CACHE_DROP` is used instead.
+ *
+ * Whatever the policy, on Linux a written range is written back a window
+ * at a time while it's being received. Otherwise dirty pages pile up until the
+ * kernel flushes them all at once, stalling the receiver long enough for
+ * the TCP window to collapse.
+ */
+
+#pragma once
+
+#include <sys/types.h>
+
+#include "file.h"
+
+/** Alignment of `O_DIRECT` buffers, offsets and lengths */
+#define CACHE_ALIGN  4096
+
+/** Distance the cursor reads ahead and drops behind */
+#define CACHE_WINDOW ((off_t)CHUNK_SIZE * 32)
+
+typedef enum {
+    CACHE_DEFAULT,  /**< Leave caching to the kernel */
+    CACHE_DROP,     /**< Read ahead of the cursor, drop the pages behind it */
+    CACHE_DIRECT,   /**< Bypass the page cache with `O_DIRECT` */
+} cache_mode;
+
+/**
+ * Page cache policy of the transfers
+ *
+ * `CACHE_DEFAULT` by default. Set from the command line before any
+ * transfer starts.
+ */
+extern cache_mode cache_policy;
+
+/** Window moving along the range being read or written */
+typedef struct {
+    int   fd;
+    int   active;   /**< The window is moving */
+    int   drop;     /**< The policy asks for dropping */
+    int   write;    /**< The range is being written rather than read */
+    off_t end;      /**< End of the range */
+    off_t ahead;    /**< Read-ahead requested up to here */
+    off_t flushed;  /**< Write-back started up to here */
+    off_t dropped;  /**< Pages dropped up to here */
+} cache_cursor;
+
+/**
+ * Parse the name of a cache policy
+ *
+ * @param name "default", "drop" or "direct"
+ *
+ * @return The policy, or -1 if the name is unknown
+ */
+int cache_parse(const char *name);
+
+/**
+ * Start moving the window along a range
+ *
+ * A range being read is followed only if the policy is `CACHE_DROP` or
+ * `CACHE_DIRECT`, which falls back to it; one being written, also where
+ * write-back can be started in the background.
+ *
+ * @param c      Cursor to initialize
+ * @param fd     File descriptor
+ * @param offset Start of the range
+ * @param length Range length
+ * @param write  Nonzero if the range is being written
+ */
+void cache_start(cache_cursor *c, int fd, off_t offset, size_t length, int write);
+
+/**
+ * Move the window to the new position of the cursor
+ *
+ * @param c   Cursor
+ * @param pos Offset up to which the range has been read or written
+ */
+void cache_advance(cache_cursor *c, off_t pos);
+
+/**
+ * Finish with the range
+ *
+ * Starts writing back what's left of a written range. If the policy
+ * asks for dropping, waits for it and drops the rest of the range from
+ * the cache.
+ *
+ * @param c Cursor, inactive on return
+ */
+void cache_finish(cache_cursor *c);
+
+/**
+ * Open the file of a descriptor once more, bypassing the page cache
+ *
+ * The new descriptor has its own `O_DIRECT` flag, so the original one
+ * keeps working as before for `sendfile()` and the like.
+ *
+ * @param fd    Open file descriptor
+ * @param flags `O_RDONLY` or `O_WRONLY`
+ *
+ * @return New descriptor, or -1 if the system or the file system can't
+ *         bypass the cache
+ */
+int cache_open_direct(int fd, int flags);
+
+/**
+ * Allocate a buffer suitable for `O_DIRECT`
+ *
+ * @param size Buffer size, a multiple of `CACHE_ALIGN`
+ *
+ * @return Buffer to release with `free()`, or `NULL` on error
+ */
+void *cache_alloc(size_t size);
+
+/**
+ * Read the next piece of a range through an `O_DIRECT` descriptor
+ *
+ * Reads the `CHUNK_SIZE` bytes at `pos` rounded down to `CACHE_ALIGN`,
+ * so after the first call the reads stay aligned.
+ *
+ * @param fd   Descriptor from `cache_open_direct()`
+ * @param buf  Buffer of `CHUNK_SIZE` bytes from `cache_alloc()`
+ * @param pos  Offset of the piece
+ * @param end  End of the range
+ * @param data Set to the data at `pos` within `buf`
+ *
+ * @return Bytes of the range read at `data`, `FSOCK_UNSUPPORTED` if the
+ *         file system rejects the read, -1 on error
+ */
+ssize_t cache_read_direct(int fd, char *buf, off_t pos, off_t end, char **data);
+
+/**
+ * Write buffered data at a file offset, bypassing the cache where possible
+ *
+ * The part of the data between `CACHE_ALIGN` boundaries is written
+ * through `direct_fd`, the unaligned head and tail through `fd`.
+ *
+ * @param fd        Buffered descriptor of the file
+ * @param direct_fd Descriptor from `cache_open_direct()`
+ * @param buf       Data, as far past a `CACHE_ALIGN` boundary as `offset`
+ * @param length    Data length
+ * @param offset    File offset to write the data at
+ *
+ * @return 0 on success, -1 on error
+ */
+int cache_write_direct(int fd, int direct_fd, const char *buf, size_t length, off_t offset);
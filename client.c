@@ -1,4 +1,10 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -8,55 +14,198 @@
 
 #include "debug.h"
 #include "client.h"
+#include "tune.h"
+
+int connect_timeout = CONNECT_TIMEOUT;
 
 static void set_sock_options(int sock);
 
-int establish_connection(const char *host, const char *port)
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000u + (uint64_t)ts.tv_nsec / 1000000u;
+}
+
+/**
+ * Order the resolved addresses for connecting
+ *
+ * Takes the addresses in the resolver's order, but alternates between
+ * the families starting with the first one's, so a broken IPv6 path
+ * costs one attempt delay rather than one per IPv6 address.
+ *
+ * @param res   Addresses from `getaddrinfo()`
+ * @param order Filled with up to `CONNECT_MAX_ADDRS` of them
+ *
+ * @return Number of addresses in `order`
+ */
+static int order_addresses(struct addrinfo *res, struct addrinfo **order)
+{
+    struct addrinfo *ai, *same[CONNECT_MAX_ADDRS], *other[CONNECT_MAX_ADDRS];
+    int nsame = 0, nother = 0, i, j, n = 0;
+
+    for (ai = res; ai != NULL; ai = ai->ai_next) {
+        if (ai->ai_family == res->ai_family && nsame < CONNECT_MAX_ADDRS) {
+            same[nsame++] = ai;
+        } else if (ai->ai_family != res->ai_family && nother < CONNECT_MAX_ADDRS) {
+            other[nother++] = ai;
+        }
+    }
+    for (i = 0, j = 0; n < CONNECT_MAX_ADDRS && (i < nsame || j < nother); ) {
+        if (i < nsame) {
+            order[n++] = same[i++];
+        }
+        if (j < nother && n < CONNECT_MAX_ADDRS) {
+            order[n++] = other[j++];
+        }
+    }
+    return n;
+}
+
+int connect_start(const struct addrinfo *ai, int *err)
 {
-    int sock, err, rc;
-    struct addrinfo hints = {0}, *res;
+    int sock = socket(ai->ai_family, SOCK_STREAM, 0);
 
-    /* Prepare the socket */
-    sock = socket(AF_INET, SOCK_STREAM, 0);
     if (sock < 0) {
-        perror("socket");
+        *err = errno;
         return -1;
     }
-
     set_sock_options(sock);
+    if (fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK) < 0
+        || (connect(sock, ai->ai_addr, ai->ai_addrlen) < 0 && errno != EINPROGRESS)) {
+        *err = errno;
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
 
-    /* Get address info from arguments */
-    hints.ai_family = AF_INET;
+int establish_connection(const char *host, const char *port)
+{
+    struct addrinfo hints = {0}, *res, *order[CONNECT_MAX_ADDRS];
+    struct pollfd attempts[CONNECT_MAX_ADDRS];
+    uint64_t deadline, next_at = 0;
+    int naddrs, next = 0, n = 0, sock = -1, err, i, last_err = ETIMEDOUT;
+
+    /* Get address info from arguments, any family */
+    hints.ai_family = AF_UNSPEC;
     hints.ai_socktype = SOCK_STREAM;
     DPRINT("addrinfo...");
     err = getaddrinfo(host, port, &hints, &res);
     if (err) {
-        close(sock);
         fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(err));
         return -1;
     }
+    naddrs = order_addresses(res, order);
+
+    /*
+     * Race the addresses: start the next attempt whenever the ones in
+     * flight haven't connected within the attempt delay, or have failed,
+     * and take the first that connects
+     */
     DPRINT("connect...");
-    /* Connect to the reciever */
-    /* TODO: Control the connect timeout */
-    rc = connect(sock, res->ai_addr, res->ai_addrlen);
+    deadline = now_ms() + (uint64_t)connect_timeout * 1000u;
+    while (sock < 0) {
+        uint64_t now = now_ms(), until;
+        int rc;
+
+        if (now >= deadline) {
+            last_err = ETIMEDOUT;
+            break;
+        }
+        if (next < naddrs && (n == 0 || now >= next_at)) {
+            int s = connect_start(order[next++], &err);
+
+            if (s < 0) {
+                last_err = err;
+                continue;
+            }
+            attempts[n++] = (struct pollfd){.fd = s, .events = POLLOUT};
+            next_at = now + CONNECT_ATTEMPT_DELAY_MS;
+        }
+        if (n == 0) {
+            break;
+        }
+
+        until = next < naddrs && next_at < deadline ? next_at : deadline;
+        rc = poll(attempts, (nfds_t)n, (int)(until > now ? until - now : 0));
+        if (rc < 0 && errno != EINTR) {
+            last_err = errno;
+            break;
+        }
+        for (i = 0; rc > 0 && i < n; i++) {
+            socklen_t len = sizeof(err);
+
+            if (attempts[i].revents == 0) {
+                continue;
+            }
+            if (getsockopt(attempts[i].fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) {
+                err = errno;
+            }
+            if (err == 0) {
+                sock = attempts[i].fd;
+                attempts[i] = attempts[--n];
+                break;
+            }
+            /* A failed attempt doesn't hold up the next one */
+            last_err = err;
+            next_at = now;
+            close(attempts[i].fd);
+            attempts[i--] = attempts[--n];
+        }
+    }
     freeaddrinfo(res);
 
-    if (rc < 0) {
+    /* The attempts that lost the race */
+    for (i = 0; i < n; i++) {
+        close(attempts[i].fd);
+    }
+    if (sock < 0) {
+        errno = last_err;
         perror("connect");
-        close(sock);
         return -1;
     }
 
+    /* The transfer itself blocks */
+    if (fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) & ~O_NONBLOCK) < 0) {
+        perror("fcntl");
+        close(sock);
+        return -1;
+    }
     return sock;
 }
 
+const char *split_host_port(const char *dest, const char *port, char *host, size_t len)
+{
+    char *colon;
+
+    snprintf(host, len, "%s", dest);
+    if (host[0] == '[' && (colon = strchr(host, ']')) != NULL) {
+        /* "[address]:port" */
+        *colon = '\0';
+        memmove(host, host + 1, (size_t)(colon - host));
+        if (colon[1] == ':') {
+            return dest + (colon - host) + 2;
+        }
+        return port;
+    }
+    colon = strchr(host, ':');
+    if (colon != NULL && strchr(colon + 1, ':') == NULL) {
+        *colon = '\0';
+        return colon + 1;
+    }
+    return port;
+}
+
 /**
  * Configure socket options for optimal performance
  *
  * @param sock Socket file descriptor to configure
  *
  * Sets several socket options to improve performance:
- * - Increases send buffer size for better throughput
+ * - Increases send buffer size for better throughput, unless it's left
+ *   to the kernel and `tune.h` with `tune_enabled`
  * - Enables address reuse to avoid "address already in use" errors
  * - Enables TCP_NODELAY to disable Nagle's algorithm for lower latency
  *
@@ -67,10 +216,12 @@ static void set_sock_options(int sock)
 {
     int buf_size = SOCKET_BUF_SIZE, yes = 1, rc;
 
-    rc = setsockopt(sock, SOL_SOCKET, SO_SNDBUF,
-                    &buf_size, sizeof(buf_size));
-    if (rc < 0) {
-        perror("setsockopt SO_SNDBUF");
+    if (!tune_enabled) {
+        rc = setsockopt(sock, SOL_SOCKET, SO_SNDBUF,
+                        &buf_size, sizeof(buf_size));
+        if (rc < 0) {
+            perror("setsockopt SO_SNDBUF");
+        }
     }
     rc = setsockopt(sock, SOL_SOCKET, SO_REUSEADDR,
                     &yes, sizeof(yes));
@@ -1,13 +1,38 @@
 #pragma once
 
+#include <stddef.h>
+
+struct addrinfo;
+
 #define SOCKET_BUF_SIZE 1024*512
 
+/** Default seconds to wait for a connection, `connect_timeout` */
+#define CONNECT_TIMEOUT 10
+
+/** Delay before racing the next address against the ones in flight */
+#define CONNECT_ATTEMPT_DELAY_MS 250
+
+/** Most resolved addresses tried */
+#define CONNECT_MAX_ADDRS 16
+
+/**
+ * Seconds to wait for a connection before giving up on a receiver
+ *
+ * `CONNECT_TIMEOUT` by default. Set from the command line before any
+ * transfer starts.
+ */
+extern int connect_timeout;
+
 /**
  * Create a TCP socket and connect to specified host
  *
- * This function creates a TCP socket, sets socket options for performance,
- * resolves the host name to an IP address, and establishes a connection.
- * The socket is optimized with TCP_NODELAY and larger buffer sizes.
+ * Resolves the host to all its IPv4 and IPv6 addresses and races them,
+ * alternating between the families: every `CONNECT_ATTEMPT_DELAY_MS`
+ * without a connection, or as soon as an attempt fails, the next address
+ * is tried alongside the ones in flight, and the first to connect wins.
+ * Gives up after `connect_timeout` seconds instead of the kernel's
+ * minutes of SYN retries. The socket is set up for performance with
+ * `TCP_NODELAY` and larger buffer sizes, and is blocking.
  *
  * @param host Host name or IP address to connect to
  * @param port Port number as a string
@@ -15,3 +40,31 @@
  * @return Socket file descriptor on success, -1 on error
  */
 int establish_connection(const char *host, const char *port);
+
+/**
+ * Start a non-blocking connection to an address
+ *
+ * The socket is set up as by `establish_connection()`, but stays
+ * non-blocking; it becomes writable once connected or failed.
+ *
+ * @param ai  Address to connect to
+ * @param err Set to the error if the attempt has failed at once
+ *
+ * @return Socket connected or being connected, or -1 on error
+ */
+int connect_start(const struct addrinfo *ai, int *err);
+
+/**
+ * Split a receiver given as "host:port" into the host and the port
+ *
+ * A single colon separates the port; IPv6 addresses have several and
+ * are taken as a whole, unless in brackets as in "[::1]:5000".
+ *
+ * @param dest Receiver as given, "host" or "host:port"
+ * @param port Port of a receiver given without one
+ * @param host Buffer for the host
+ * @param len  Size of the buffer
+ *
+ * @return Port of the receiver, `port` or a part of `host`
+ */
+const char *split_host_port(const char *dest, const char *port, char *host, size_t len);
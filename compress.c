@@ -0,0 +1,551 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "compress.h"
+#include "fsock.h"
+#include "hash.h"
+#include "progress.h"
+#include "stats.h"
+#include "zerocopy.h"
+
+#define LZ_MIN_MATCH     4
+#define LZ_MF_LIMIT      12     /**< A match can't start closer than this to the end */
+#define LZ_LAST_LITERALS 5      /**< A block always ends with this many literals */
+#define LZ_MAX_DISTANCE  65535
+#define LZ_HASH_LOG      14
+
+/** Number of blocks over which the sender compares waiting for workers and for the socket */
+#define COMPRESS_WINDOW 16
+
+_Static_assert(COMPRESS_BLOCK == HASH_LEAF, "every block must be a leaf of the hash tree");
+
+/** Compressed block waiting to be sent */
+typedef struct {
+    unsigned char *buf;
+    size_t         raw;
+    size_t         packed;
+    uint64_t       leaf;    /**< Hash of the raw block, if the data is hashed */
+    int            ready;
+    uint32_t       token;   /**< Send of the block, see `zerocopy_done()` */
+} compress_slot;
+
+/**
+ * State shared by the sending thread and the workers
+ *
+ * Workers claim blocks in order, and block `i` goes to slot `i % nslots`
+ * once block `i - nslots` has been sent and released by the kernel.
+ * Blocks below `raw_until` are stored without trying to compress them.
+ */
+typedef struct {
+    const file      *f;
+    int              hash;    /**< Workers hash the raw blocks */
+    size_t           blocks;
+    size_t           next;
+    size_t           sent;
+    size_t           released; /**< Blocks sent whose slots may be filled again */
+    size_t           raw_until;
+    int              failed;
+    stats_transfer  *stats;   /**< Statistics of the sending thread */
+    pthread_mutex_t  lock;
+    pthread_cond_t   cond;
+    size_t           nslots;
+    compress_slot    slots[COMPRESS_MAX_THREADS * 2];
+} compress_ctx;
+
+static uint32_t read32(const unsigned char *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t lz_hash(uint32_t seq)
+{
+    return (seq * 2654435761U) >> (32 - LZ_HASH_LOG);
+}
+
+/**
+ * Write a length continuation: a run of 255s and the remainder
+ *
+ * @param op  Output position
+ * @param len Length above the 4-bit token field
+ *
+ * @return New output position
+ */
+static unsigned char *lz_put_length(unsigned char *op, size_t len)
+{
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (unsigned char)len;
+    return op;
+}
+
+/**
+ * Write a sequence: literals, then a match unless `match_len` is 0
+ *
+ * @param opp       Output position, advanced on success
+ * @param oend      End of the output buffer
+ * @param lit       Literals
+ * @param lit_len   Number of literals
+ * @param offset    Match distance
+ * @param match_len Match length, 0 for the last sequence
+ *
+ * @return 0 on success, -1 if the output buffer is too small
+ */
+static int lz_put_sequence(unsigned char **opp, unsigned char *oend,
+                           const unsigned char *lit, size_t lit_len,
+                           size_t offset, size_t match_len)
+{
+    unsigned char *op = *opp, *token;
+    size_t need = 1 + lit_len + lit_len / 255 + 1 + (match_len ? 3 + match_len / 255 : 0);
+
+    if (need > (size_t)(oend - op)) {
+        return -1;
+    }
+
+    token = op++;
+    if (lit_len >= 15) {
+        *token = 15 << 4;
+        op = lz_put_length(op, lit_len - 15);
+    } else {
+        *token = (unsigned char)(lit_len << 4);
+    }
+    memcpy(op, lit, lit_len);
+    op += lit_len;
+
+    if (match_len) {
+        size_t len = match_len - LZ_MIN_MATCH;
+
+        *op++ = (unsigned char)(offset & 0xff);
+        *op++ = (unsigned char)(offset >> 8);
+        if (len >= 15) {
+            *token |= 15;
+            op = lz_put_length(op, len - 15);
+        } else {
+            *token |= (unsigned char)len;
+        }
+    }
+
+    *opp = op;
+    return 0;
+}
+
+size_t compress_block(const unsigned char *src, size_t len,
+                      unsigned char *dst, size_t dst_len)
+{
+    uint32_t table[1 << LZ_HASH_LOG];
+    const unsigned char *ip = src, *anchor = src, *end = src + len;
+    unsigned char *op = dst, *oend = dst + dst_len;
+    unsigned misses = 0;
+
+    memset(table, 0, sizeof(table));
+
+    if (len > LZ_MF_LIMIT) {
+        const unsigned char *mf_limit = end - LZ_MF_LIMIT;
+        const unsigned char *match_limit = end - LZ_LAST_LITERALS;
+
+        while (ip < mf_limit) {
+            uint32_t seq = read32(ip), h = lz_hash(seq);
+            const unsigned char *ref = src + table[h], *m, *r;
+
+            table[h] = (uint32_t)(ip - src);
+            if (ref >= ip || ip - ref > LZ_MAX_DISTANCE || read32(ref) != seq) {
+                /* Skip faster through data that doesn't compress */
+                ip += 1 + (misses++ >> 6);
+                continue;
+            }
+            misses = 0;
+
+            m = ip + LZ_MIN_MATCH;
+            r = ref + LZ_MIN_MATCH;
+            while (m < match_limit && *m == *r) {
+                m++;
+                r++;
+            }
+            if (lz_put_sequence(&op, oend, anchor, (size_t)(ip - anchor),
+                                (size_t)(ip - ref), (size_t)(m - ip)) < 0) {
+                return 0;
+            }
+            ip = anchor = m;
+        }
+    }
+
+    if (lz_put_sequence(&op, oend, anchor, (size_t)(end - anchor), 0, 0) < 0) {
+        return 0;
+    }
+    return (size_t)(op - dst);
+}
+
+/**
+ * Read a length continuation
+ *
+ * @param ipp  Input position, advanced past the continuation
+ * @param iend End of the input
+ * @param len  Length to add to
+ *
+ * @return 0 on success, -1 if the input ends first
+ */
+static int lz_get_length(const unsigned char **ipp, const unsigned char *iend, size_t *len)
+{
+    const unsigned char *ip = *ipp;
+    unsigned char b;
+
+    do {
+        if (ip >= iend) {
+            return -1;
+        }
+        b = *ip++;
+        *len += b;
+    } while (b == 255);
+
+    *ipp = ip;
+    return 0;
+}
+
+int decompress_block(const unsigned char *src, size_t len,
+                     unsigned char *dst, size_t raw_len)
+{
+    const unsigned char *ip = src, *iend = src + len;
+    unsigned char *op = dst, *oend = dst + raw_len;
+
+    while (ip < iend) {
+        unsigned token = *ip++;
+        size_t lit_len = token >> 4, match_len = token & 15, offset;
+
+        if (lit_len == 15 && lz_get_length(&ip, iend, &lit_len) < 0) {
+            return -1;
+        }
+        if (lit_len > (size_t)(iend - ip) || lit_len > (size_t)(oend - op)) {
+            return -1;
+        }
+        memcpy(op, ip, lit_len);
+        ip += lit_len;
+        op += lit_len;
+        if (ip == iend) {
+            break;
+        }
+
+        if (iend - ip < 2) {
+            return -1;
+        }
+        offset = (size_t)ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - dst)) {
+            return -1;
+        }
+        if (match_len == 15 && lz_get_length(&ip, iend, &match_len) < 0) {
+            return -1;
+        }
+        match_len += LZ_MIN_MATCH;
+        if (match_len > (size_t)(oend - op)) {
+            return -1;
+        }
+
+        if (offset >= match_len) {
+            memcpy(op, op - offset, match_len);
+            op += match_len;
+        } else {
+            /* Overlapping match repeats the last `offset` bytes */
+            const unsigned char *ref = op - offset;
+            while (match_len--) {
+                *op++ = *ref++;
+            }
+        }
+    }
+
+    return op == oend ? 0 : -1;
+}
+
+/**
+ * Read a whole block of the file
+ *
+ * @param fd     File descriptor
+ * @param buf    Buffer for the data
+ * @param len    Block length
+ * @param offset Block offset
+ *
+ * @return 0 on success, -1 on error
+ */
+static int compress_read(int fd, unsigned char *buf, size_t len, off_t offset)
+{
+    size_t got = 0;
+
+    while (got < len) {
+        uint64_t start = stats_start();
+        ssize_t n = pread(fd, buf + got, len - got, offset + (off_t)got);
+
+        stats_stop(STATS_READ, start, n);
+        if (n <= 0) {
+            if (n < 0) {
+                perror("pread");
+            } else {
+                printf("File is shorter than expected\n");
+            }
+            return -1;
+        }
+        got += (size_t)n;
+    }
+    return 0;
+}
+
+/**
+ * Worker thread: read and compress blocks until there are none left
+ *
+ * @param arg Pointer to the shared `compress_ctx`
+ *
+ * @return Always `NULL`
+ */
+static void *compress_worker(void *arg)
+{
+    compress_ctx *ctx = arg;
+    const file *f = ctx->f;
+    unsigned char *raw = malloc(COMPRESS_BLOCK);
+
+    stats_current = ctx->stats;
+    pthread_mutex_lock(&ctx->lock);
+    if (!raw) {
+        perror("malloc");
+        ctx->failed = 1;
+        pthread_cond_broadcast(&ctx->cond);
+    }
+
+    while (!ctx->failed && ctx->next < ctx->blocks) {
+        size_t idx = ctx->next++, offset, len, packed = 0;
+        compress_slot *slot = &ctx->slots[idx % ctx->nslots];
+        int store;
+
+        while (idx >= ctx->released + ctx->nslots && !ctx->failed) {
+            pthread_cond_wait(&ctx->cond, &ctx->lock);
+        }
+        if (ctx->failed) {
+            break;
+        }
+        store = idx < ctx->raw_until;
+        pthread_mutex_unlock(&ctx->lock);
+
+        offset = f->hdr.offset + idx * COMPRESS_BLOCK;
+        len = f->hdr.offset + f->hdr.length - offset;
+        if (len > COMPRESS_BLOCK) {
+            len = COMPRESS_BLOCK;
+        }
+
+        if (compress_read(f->fd, raw, len, (off_t)offset) < 0) {
+            pthread_mutex_lock(&ctx->lock);
+            ctx->failed = 1;
+            pthread_cond_broadcast(&ctx->cond);
+            break;
+        }
+        if (ctx->hash) {
+            slot->leaf = hash64(raw, len);
+        }
+        if (!store) {
+            packed = compress_block(raw, len, slot->buf, len - len / COMPRESS_MIN_SAVING);
+        }
+        if (!packed) {
+            memcpy(slot->buf, raw, len);
+        }
+
+        pthread_mutex_lock(&ctx->lock);
+        if (!store && !packed && ctx->raw_until < idx + 1 + COMPRESS_BACKOFF) {
+            ctx->raw_until = idx + 1 + COMPRESS_BACKOFF;
+        }
+        slot->raw = len;
+        slot->packed = packed ? packed : len;
+        slot->ready = 1;
+        pthread_cond_broadcast(&ctx->cond);
+    }
+
+    pthread_mutex_unlock(&ctx->lock);
+    free(raw);
+    return NULL;
+}
+
+/**
+ * Nanoseconds elapsed since `start`
+ */
+static long long compress_elapsed(const struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000000000LL + (now.tv_nsec - start->tv_nsec);
+}
+
+/**
+ * Pick the number of worker threads
+ *
+ * @param blocks Number of blocks in the file range
+ *
+ * @return Number of threads, at least 1
+ */
+static size_t compress_threads(size_t blocks)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t n = cpus > 0 ? (size_t)cpus : 1;
+
+    if (n > COMPRESS_MAX_THREADS) {
+        n = COMPRESS_MAX_THREADS;
+    }
+    return n < blocks ? n : blocks;
+}
+
+/**
+ * Let the workers fill the slots of the blocks the kernel is done with
+ *
+ * @param ctx        Shared state
+ * @param zc         Zero-copy state of the socket
+ * @param timeout_ms How long to wait for a completion, see `zerocopy_reap()`
+ */
+static void compress_release(compress_ctx *ctx, zerocopy_socket *zc, int timeout_ms)
+{
+    int rc = zerocopy_reap(zc, timeout_ms);
+
+    pthread_mutex_lock(&ctx->lock);
+    if (rc < 0) {
+        ctx->failed = 1;
+    }
+    while (ctx->released < ctx->sent
+           && zerocopy_done(zc, ctx->slots[ctx->released % ctx->nslots].token)) {
+        ctx->released++;
+    }
+    pthread_cond_broadcast(&ctx->cond);
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+ssize_t compress_send(const file *f, int sock, hash_tree *hash)
+{
+    compress_ctx *ctx;
+    zerocopy_socket zc;
+    pthread_t threads[COMPRESS_MAX_THREADS];
+    size_t started = 0, nthreads, wire = 0, i;
+    long long wait_ns = 0, send_ns = 0;
+    ssize_t rc;
+
+    if (f->hdr.length == 0) {
+        return 0;
+    }
+
+    ctx = calloc(1, sizeof(*ctx));
+    if (!ctx) {
+        perror("calloc");
+        return -1;
+    }
+    ctx->f = f;
+    ctx->hash = hash != NULL;
+    ctx->stats = stats_current;
+    ctx->blocks = (f->hdr.length + COMPRESS_BLOCK - 1) / COMPRESS_BLOCK;
+    nthreads = compress_threads(ctx->blocks);
+    ctx->nslots = nthreads * 2;
+    pthread_mutex_init(&ctx->lock, NULL);
+    pthread_cond_init(&ctx->cond, NULL);
+
+    for (i = 0; i < ctx->nslots; i++) {
+        ctx->slots[i].buf = malloc(COMPRESS_BLOCK);
+        if (!ctx->slots[i].buf) {
+            perror("malloc");
+            ctx->failed = 1;
+            goto out;
+        }
+    }
+    while (started < nthreads) {
+        if (pthread_create(&threads[started], NULL, compress_worker, ctx) != 0) {
+            perror("pthread_create");
+            break;
+        }
+        started++;
+    }
+    if (started == 0) {
+        ctx->failed = 1;
+        goto out;
+    }
+    zerocopy_start(&zc, sock);
+
+    for (i = 0; i < ctx->blocks; i++) {
+        compress_slot *slot = &ctx->slots[i % ctx->nslots];
+        compress_frame frame;
+        struct timespec start;
+        int ready;
+
+        pthread_mutex_lock(&ctx->lock);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        while (!slot->ready && !ctx->failed) {
+            if (ctx->released < ctx->sent) {
+                /* The workers may be waiting for the kernel to let go of a slot */
+                pthread_mutex_unlock(&ctx->lock);
+                compress_release(ctx, &zc, ZEROCOPY_POLL_MS);
+                pthread_mutex_lock(&ctx->lock);
+                continue;
+            }
+            pthread_cond_wait(&ctx->cond, &ctx->lock);
+        }
+        wait_ns += compress_elapsed(&start);
+        ready = slot->ready;
+        pthread_mutex_unlock(&ctx->lock);
+        if (!ready) {
+            break;
+        }
+
+        frame.raw = (uint32_t)slot->raw;
+        frame.packed = (uint32_t)slot->packed;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (send_all(sock, &frame, sizeof(frame)) < 0
+            || zerocopy_send(&zc, slot->buf, slot->packed, &slot->token) < 0) {
+            pthread_mutex_lock(&ctx->lock);
+            ctx->failed = 1;
+            pthread_cond_broadcast(&ctx->cond);
+            pthread_mutex_unlock(&ctx->lock);
+            break;
+        }
+        send_ns += compress_elapsed(&start);
+        wire += sizeof(frame) + slot->packed;
+        if (hash) {
+            hash_tree_add_leaf(hash, slot->leaf);
+        }
+
+        pthread_mutex_lock(&ctx->lock);
+        slot->ready = 0;
+        ctx->sent++;
+        if (ctx->sent % COMPRESS_WINDOW == 0) {
+            /* Waiting for the workers longer than for the socket: the link is idle */
+            if (wait_ns > send_ns && ctx->raw_until < ctx->next + COMPRESS_BACKOFF) {
+                ctx->raw_until = ctx->next + COMPRESS_BACKOFF;
+            }
+            wait_ns = send_ns = 0;
+        }
+        pthread_cond_broadcast(&ctx->cond);
+        pthread_mutex_unlock(&ctx->lock);
+
+        progress_add(slot->raw);
+        compress_release(ctx, &zc, 0);
+    }
+
+    /* The slots are freed below */
+    if (zerocopy_flush(&zc) < 0) {
+        pthread_mutex_lock(&ctx->lock);
+        ctx->failed = 1;
+        pthread_cond_broadcast(&ctx->cond);
+        pthread_mutex_unlock(&ctx->lock);
+    }
+
+out:
+    for (i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    for (i = 0; i < ctx->nslots; i++) {
+        free(ctx->slots[i].buf);
+    }
+    progress_add_wire_bytes(wire);
+
+    rc = ctx->failed || ctx->sent < ctx->blocks ? -1 : (ssize_t)f->hdr.length;
+    pthread_cond_destroy(&ctx->cond);
+    pthread_mutex_destroy(&ctx->lock);
+    free(ctx);
+    return rc;
+}
@@ -0,0 +1,85 @@
+/**
+ * @file compress.h
+ * @brief Block compression of file contents in transit
+ *
+ * With `FHDR_COMPRESS` the file contents are sent as a sequence of
+ * blocks of up to `COMPRESS_BLOCK` bytes, each preceded by a
+ * `compress_frame`. A block is compressed with a small LZ77 coder
+ * (the LZ4 block format), or stored as is when that doesn't pay off.
+ *
+ * The sender compresses blocks on a pool of worker threads and sends
+ * them in order. Compression backs off for a while when blocks don't
+ * shrink, or when the connection has to wait for the workers, meaning
+ * the CPU rather than the link is the limit.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "file.h"
+#include "hash.h"
+
+/** Largest amount of file data in a single block */
+#define COMPRESS_BLOCK ((size_t)(CHUNK_SIZE))
+
+/** Largest number of worker threads compressing the blocks of a file */
+#define COMPRESS_MAX_THREADS 8
+
+/** A block is stored unless compression saves at least 1/COMPRESS_MIN_SAVING of it */
+#define COMPRESS_MIN_SAVING 16
+
+/** Number of blocks stored without trying after compression didn't pay off */
+#define COMPRESS_BACKOFF 16
+
+/** Header of a block; `packed == raw` means the block is stored as is */
+typedef struct {
+    uint32_t raw;     /**< Length of the file data */
+    uint32_t packed;  /**< Length of the data that follows */
+} compress_frame;
+
+/**
+ * Compress a block
+ *
+ * @param src     Data to compress
+ * @param len     Data length, at most `COMPRESS_BLOCK`
+ * @param dst     Buffer for the compressed data
+ * @param dst_len Buffer size; compression fails if it needs more
+ *
+ * @return Length of the compressed data, 0 if it doesn't fit into `dst`
+ */
+size_t compress_block(const unsigned char *src, size_t len,
+                      unsigned char *dst, size_t dst_len);
+
+/**
+ * Decompress a block
+ *
+ * Validates every length and offset, so a malformed block can't make
+ * it read or write out of bounds.
+ *
+ * @param src     Compressed data
+ * @param len     Compressed data length
+ * @param dst     Buffer for the data
+ * @param raw_len Expected length of the data
+ *
+ * @return 0 on success, -1 if the block is malformed
+ */
+int decompress_block(const unsigned char *src, size_t len,
+                     unsigned char *dst, size_t raw_len);
+
+/**
+ * Send the file range described by the header as compressed blocks
+ *
+ * Counts the data sent in the progress, and reports the bytes that
+ * actually went over the wire with `progress_add_wire_bytes()`. With
+ * `hash` the workers also hash the blocks they read, each block being
+ * a leaf of the tree.
+ *
+ * @param f    File with a `FHDR_COMPRESS` header that has been sent
+ * @param sock Socket descriptor to send data to
+ * @param hash Tree to hash the data into, or `NULL`
+ *
+ * @return Total bytes of file data sent on success, -1 on error
+ */
+ssize_t compress_send(const file *f, int sock, hash_tree *hash);
@@ -0,0 +1,1713 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "cache.h"
+#include "compress.h"
+#include "conn.h"
+#include "delta.h"
+#include "file.h"
+#include "fsock.h"
+#include "hash.h"
+#include "relay.h"
+#include "resume.h"
+#include "stats.h"
+
+static void conn_connect_relay(conn *c);
+
+void conn_init(conn *c, int sock)
+{
+    memset(c, 0, sizeof(*c));
+    c->sock = sock;
+    c->state = CONN_HEADER;
+    c->pipefd[0] = c->pipefd[1] = -1;
+    c->basis_fd = -1;
+    c->direct_fd = -1;
+    c->relay = -1;
+    c->last_active = time(NULL);
+    if (stats_enabled) {
+        c->stats = stats_begin(0);
+        c->queued.stats = c->stats;
+        stats_watch(c->stats, sock);
+    }
+    if (tune_enabled) {
+        tune_start(&c->tune, sock, 0);
+    }
+    c->limit = limit_join();
+    if (relay_host) {
+        c->relay_buf = malloc(RELAY_BUFFER);
+        if (c->relay_buf == NULL) {
+            perror("malloc");
+        }
+        conn_connect_relay(c);
+    }
+}
+
+/**
+ * Start connecting to the next receiver of a chain, at the next address
+ *
+ * Once no address is left, the data is only kept here.
+ *
+ * @param c Connection state
+ */
+static void conn_connect_relay(conn *c)
+{
+    c->relay = c->relay_buf ? relay_connect(&c->relay_next) : -1;
+    c->relay_connecting = 1;
+    c->relay_active = time(NULL);
+    if (c->relay < 0) {
+        printf("Can't relay to %s:%s, keeping the data here only\n",
+               relay_host, relay_port);
+        c->relay_failed = RELAY_FAILED;
+        c->relay_len = c->relay_sent = 0;
+    }
+}
+
+/**
+ * Close the connection to the next receiver of a chain, if any
+ *
+ * The owner forgets about its descriptor too, as the next one opened may
+ * get the same number.
+ *
+ * @param c Connection state
+ */
+static void conn_stop_relay(conn *c)
+{
+    int i;
+
+    if (c->relay < 0) {
+        return;
+    }
+    for (i = 0; i < c->nwatched; i++) {
+        if (c->watched[i].fd == c->relay) {
+            c->watched[i] = c->watched[--c->nwatched];
+            break;
+        }
+    }
+    close(c->relay);
+    c->relay = -1;
+    c->relay_connecting = 0;
+    c->relay_shut = 0;
+}
+
+/**
+ * Stop forwarding to the next receiver of a chain, keeping the data here only
+ *
+ * @param c       Connection state
+ * @param verdict Byte to reply to the client with at the end
+ */
+static void conn_fail_relay(conn *c, int verdict)
+{
+    printf("Relaying to %s:%s has failed, keeping the data here only\n",
+           relay_host, relay_port);
+    conn_stop_relay(c);
+    c->relay_failed = verdict;
+    c->relay_len = c->relay_sent = 0;
+}
+
+/**
+ * Move the connection to the next receiver of a chain along
+ *
+ * Completes connecting to it, trying the next address if that has
+ * failed, and forwards the data held as far as the socket takes it.
+ * Until the client has ended, the receiver has nothing to say; if it
+ * replies or closes the connection, it has failed.
+ *
+ * @param c Connection state
+ */
+static void conn_forward(conn *c)
+{
+    int rc;
+
+    if (c->relay >= 0 && c->relay_connecting) {
+        rc = relay_connected(c->relay);
+        if (rc < 0) {
+            conn_stop_relay(c);
+            conn_connect_relay(c);
+        }
+        if (rc <= 0) {
+            return;
+        }
+        c->relay_connecting = 0;
+        c->relay_active = time(NULL);
+    }
+    if (c->relay < 0) {
+        return;
+    }
+    while (c->relay_sent < c->relay_len) {
+        ssize_t n = relay_forward(c->relay, c->relay_buf + c->relay_sent,
+                                  c->relay_len - c->relay_sent);
+
+        if (n == FSOCK_AGAIN) {
+            break;
+        }
+        if (n < 0) {
+            conn_fail_relay(c, RELAY_FAILED);
+            return;
+        }
+        c->relay_sent += (size_t)n;
+        c->relay_active = time(NULL);
+    }
+    if (c->state != CONN_RELAY && (rc = relay_verdict(c->relay)) != FSOCK_AGAIN) {
+        conn_fail_relay(c, rc ? rc : RELAY_FAILED);
+    }
+}
+
+/**
+ * Receive from the client, accounting the call to the connection's statistics
+ *
+ * Whatever is received is held for the next receiver of a chain, if
+ * any, and forwarded as far as it takes it. While `RELAY_BUFFER` is
+ * held, nothing is received. Once forwarding fails, the data is only
+ * kept here.
+ *
+ * @param c      Connection state
+ * @param buf    Buffer for the data
+ * @param length Maximal number of bytes to receive
+ *
+ * @return Result of `recv()`
+ */
+static ssize_t conn_recv(conn *c, void *buf, size_t length)
+{
+    size_t held = c->relay_len - c->relay_sent;
+    uint64_t start;
+    ssize_t n;
+
+    if (c->relay >= 0 && held >= RELAY_BUFFER) {
+        errno = EAGAIN;
+        return -1;
+    }
+    if (c->relay >= 0 && length > RELAY_BUFFER - held) {
+        length = RELAY_BUFFER - held;
+    }
+    start = stats_start();
+    n = recv(c->sock, buf, length, 0);
+    stats_stop(STATS_RECV, start, n);
+    if (n > 0 && c->relay >= 0) {
+        if (held == 0) {
+            c->relay_len = c->relay_sent = 0;
+            if (!c->relay_connecting) {
+                c->relay_active = time(NULL);
+            }
+        } else if (c->relay_len + (size_t)n > RELAY_BUFFER) {
+            memmove(c->relay_buf, c->relay_buf + c->relay_sent, held);
+            c->relay_len = held;
+            c->relay_sent = 0;
+        }
+        memcpy(c->relay_buf + c->relay_len, buf, (size_t)n);
+        c->relay_len += (size_t)n;
+        conn_forward(c);
+    }
+    return n;
+}
+
+/**
+ * Close the basis of a delta transfer, if any
+ *
+ * @param c Connection state
+ */
+static void conn_close_basis(conn *c)
+{
+    if (c->basis_fd >= 0) {
+        close(c->basis_fd);
+        c->basis_fd = -1;
+    }
+}
+
+/**
+ * Write the data collected for `O_DIRECT` to the file
+ *
+ * @param c Connection state
+ *
+ * @return 0 on success, -1 on error
+ */
+static int conn_flush_direct(conn *c)
+{
+    size_t skew = (size_t)c->direct_pos & (CACHE_ALIGN - 1);
+
+    if (c->direct_len == 0) {
+        return 0;
+    }
+    if (cache_write_direct(c->f.fd, c->direct_fd, c->direct_buf + skew,
+                           c->direct_len, c->direct_pos) < 0) {
+        return -1;
+    }
+    c->direct_pos += (off_t)c->direct_len;
+    c->direct_len = 0;
+    return 0;
+}
+
+/**
+ * Write what's left of the data collected for `O_DIRECT` and stop using it
+ *
+ * @param c Connection state
+ *
+ * @return 0 on success, -1 on error
+ */
+static int conn_stop_direct(conn *c)
+{
+    int rc;
+
+    if (c->direct_fd < 0) {
+        return 0;
+    }
+    rc = conn_flush_direct(c);
+    close(c->direct_fd);
+    c->direct_fd = -1;
+    return rc;
+}
+
+/**
+ * Complete the file being received
+ *
+ * Waits for the queued writes, closes the file and gets ready for the
+ * next header on the connection.
+ * The header of the completed file stays in `c->f.hdr` until then.
+ *
+ * @param c Connection state
+ *
+ * @return `CONN_DONE`, or `CONN_ERROR` if a queued write failed
+ */
+static conn_result conn_finish(conn *c)
+{
+    if (c->ring && uring_rx_wait(c->ring, &c->writes) < 0) {
+        return CONN_ERROR;
+    }
+    if (c->pipe && pipeline_rx_wait(c->pipe, &c->queued) < 0) {
+        return CONN_ERROR;
+    }
+    if (conn_stop_direct(c) < 0) {
+        return CONN_ERROR;
+    }
+    cache_finish(&c->cache);
+    if (c->f.hdr.flags & FHDR_DELTA) {
+        if (delta_commit(&c->f, c->basis_fd) < 0) {
+            return CONN_ERROR;
+        }
+        printf("Rebuilt %s, %zu bytes received as data\n",
+               c->f.hdr.fname, c->delta_written - c->delta_copied);
+        conn_close_basis(c);
+    }
+    if (c->f.hdr.flags & FHDR_TREE) {
+        if (c->f.fd >= 0) {
+            printf("File %s received successfully\n", c->f.path);
+        }
+    } else if (!(c->f.hdr.flags & FHDR_STRIPE)) {
+        printf("File %s received successfully\n", c->f.hdr.fname);
+    }
+    if (c->f.hdr.flags & FHDR_RESUME) {
+        resume_remove(&c->f);
+    }
+    file_close(&c->f);
+    c->state = CONN_HEADER;
+    c->hdr_received = 0;
+    return CONN_DONE;
+}
+
+/**
+ * Start writing the body with `O_DIRECT`
+ *
+ * Falls back to buffered writes quietly if the file system doesn't
+ * support it.
+ *
+ * @param c Connection state with an accepted file
+ */
+static void conn_start_direct(conn *c)
+{
+    if (!c->direct_buf) {
+        c->direct_buf = cache_alloc(CHUNK_SIZE);
+        if (!c->direct_buf) {
+            return;
+        }
+    }
+    c->direct_fd = cache_open_direct(c->f.fd, O_WRONLY);
+    c->direct_pos = (off_t)c->f.hdr.offset;
+    c->direct_len = 0;
+}
+
+/**
+ * Get ready to receive the body of the accepted file
+ *
+ * Compressed bodies come in frames, sparse ones in runs, the others are
+ * moved to the file directly. The page cache policy applies from here on.
+ *
+ * @param c Connection state with an accepted file
+ *
+ * @return 0 on success, -1 on error
+ */
+static int conn_start_body(conn *c)
+{
+    c->left = c->f.hdr.length;
+    c->state = CONN_BODY;
+    if (c->f.hdr.flags & FHDR_HASH) {
+        hash_tree_init(&c->hash);
+    }
+    cache_start(&c->cache, c->f.fd, (off_t)c->f.hdr.offset, c->f.hdr.length, 1);
+    if (cache_policy == CACHE_DIRECT && !(c->f.hdr.flags & FHDR_COMPRESS)
+        && !c->ring && !c->pipe && c->left > 0) {
+        conn_start_direct(c);
+    }
+    if (c->f.hdr.flags & FHDR_SPARSE && c->left > 0) {
+        c->sparse_received = 0;
+        c->state = CONN_SPARSE;
+        return 0;
+    }
+    if (!(c->f.hdr.flags & FHDR_COMPRESS) || c->left == 0) {
+        return 0;
+    }
+
+    if (!c->zbuf) {
+        c->zbuf = malloc(COMPRESS_BLOCK);
+        c->zout = malloc(COMPRESS_BLOCK);
+        if (!c->zbuf || !c->zout) {
+            perror("malloc");
+            return -1;
+        }
+    }
+    c->frame_received = 0;
+    c->state = CONN_FRAME;
+    return 0;
+}
+
+/**
+ * Queue a reply to the client, sent by `conn_flush()`
+ *
+ * @param c      Connection state
+ * @param buf    Data to send
+ * @param length Data length
+ *
+ * @return 0 on success, -1 on error
+ */
+static int conn_queue(conn *c, const void *buf, size_t length)
+{
+    size_t queued = c->out_len - c->out_sent;
+
+    if (c->out_sent > 0 && c->out_len + length > c->out_cap) {
+        memmove(c->out, c->out + c->out_sent, queued);
+        c->out_len = queued;
+        c->out_sent = 0;
+    }
+    if (queued + length > c->out_cap) {
+        size_t cap = c->out_cap ? c->out_cap * 2 : 4096;
+        unsigned char *out;
+
+        while (cap < queued + length) {
+            cap *= 2;
+        }
+        out = realloc(c->out, cap);
+        if (out == NULL) {
+            perror("realloc");
+            return -1;
+        }
+        c->out = out;
+        c->out_cap = cap;
+    }
+    memcpy(c->out + c->out_len, buf, length);
+    c->out_len += length;
+    return 0;
+}
+
+/**
+ * Send as much of the queued replies as the socket takes without waiting
+ *
+ * @param c Connection state
+ *
+ * @return 0 on success, also when some are left, -1 on error
+ */
+static int conn_flush(conn *c)
+{
+    while (c->out_sent < c->out_len) {
+        uint64_t start = stats_start();
+        ssize_t n = send(c->sock, c->out + c->out_sent, c->out_len - c->out_sent,
+                         MSG_DONTWAIT);
+
+        stats_stop(STATS_SEND, start, n);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            perror("send");
+            return -1;
+        }
+        c->out_sent += (size_t)n;
+        c->last_active = time(NULL);
+    }
+    c->out_len = c->out_sent = 0;
+    return 0;
+}
+
+/**
+ * Queue the signatures of the basis and wait for the delta records
+ *
+ * @param c    Connection state with an accepted `FHDR_DELTA` file
+ * @param sh   Signature header
+ * @param sigs Signatures, freed
+ *
+ * @return 0 on success, -1 on error
+ */
+static int conn_queue_signatures(conn *c, const delta_sig_header *sh, delta_sig *sigs)
+{
+    int rc = conn_queue(c, sh, sizeof(*sh));
+
+    if (rc == 0 && sh->count > 0) {
+        rc = conn_queue(c, sigs, sh->count * sizeof(*sigs));
+    }
+    free(sigs);
+    if (rc < 0) {
+        return -1;
+    }
+
+    c->delta_block_size = sh->block_size;
+    c->delta_blocks = sh->count;
+    c->delta_written = 0;
+    c->delta_copied = 0;
+    c->record_received = 0;
+    c->state = CONN_DELTA;
+    return 0;
+}
+
+/**
+ * Open the receiver's copy of a delta transfer and start computing its
+ * signatures
+ *
+ * They are computed by a `delta_signer` while the thread serves the
+ * other connections, see `conn_receive_signatures()`. Without a copy the
+ * signature list is empty, and the sender sends all the data.
+ *
+ * @param c Connection state with an accepted `FHDR_DELTA` file
+ *
+ * @return 0 on success, -1 on error
+ */
+static int conn_start_signatures(conn *c)
+{
+    delta_sig_header sh;
+    delta_sig *sigs;
+    struct stat st;
+
+    c->basis_fd = open(c->f.hdr.fname, O_RDONLY | O_NOFOLLOW);
+    if (c->basis_fd >= 0 && (fstat(c->basis_fd, &st) < 0 || !S_ISREG(st.st_mode))) {
+        conn_close_basis(c);
+    }
+    if (c->basis_fd < 0) {
+        return delta_signatures(-1, &sh, &sigs) < 0 ? -1 : conn_queue_signatures(c, &sh, sigs);
+    }
+
+    c->signer = delta_signer_start(c->basis_fd);
+    if (c->signer == NULL) {
+        return -1;
+    }
+    c->state = CONN_SIGN;
+    return 0;
+}
+
+/**
+ * Queue the signatures of the basis once they are computed
+ *
+ * @param c Connection state
+ *
+ * @return 0 once they are queued, `FSOCK_AGAIN` if they aren't computed
+ *         yet, -1 on error
+ */
+static ssize_t conn_receive_signatures(conn *c)
+{
+    delta_sig_header sh;
+    delta_sig *sigs;
+    int rc = delta_signer_take(c->signer, &sh, &sigs);
+
+    if (rc == 0) {
+        return FSOCK_AGAIN;
+    }
+    delta_signer_free(c->signer);
+    c->signer = NULL;
+    if (rc < 0) {
+        return -1;
+    }
+    return conn_queue_signatures(c, &sh, sigs) < 0 ? -1 : 0;
+}
+
+/**
+ * Validate the received header and create the file
+ * For a resumable transfer, queues the offer and waits for the sender's
+ * For a resumable transfer, sends the offer and waits for the sender's
+ * decision before receiving the body.
+ *
+ * @param c Connection state with a complete header (and path)
+ *
+ * @return 0 on success, -1 on error
+ */
+static int conn_accept(conn *c)
+{
+    resume_offer offer;
+
+    if (relay_host && c->f.hdr.flags & (FHDR_RESUME | FHDR_DELTA)) {
+        printf("Resumable and delta transfers can't be relayed\n");
+        return -1;
+    }
+    if (file_accept(&c->f) < 0) {
+        return -1;
+    }
+
+    if (c->f.hdr.flags & FHDR_RESUME) {
+        resume_make_offer(&c->f, &offer);
+        if (conn_queue(c, &offer, sizeof(offer)) < 0) {
+            file_close(&c->f);
+            return -1;
+        }
+        c->resume_offset = offer.offset;
+        c->resume_received = 0;
+        c->state = CONN_RESUME;
+        return 0;
+    }
+
+    if (c->f.hdr.flags & FHDR_DELTA) {
+        return conn_start_signatures(c);
+    }
+
+    return conn_start_body(c);
+}
+
+/**
+ * Size of the part of the file received so far
+ *
+ * @param c Connection state in `CONN_BODY`
+ *
+ * @return Bytes from the start of the file up to the first missing one
+ */
+static size_t conn_received(const conn *c)
+{
+    return c->f.hdr.offset + c->f.hdr.length - c->left;
+}
+
+/**
+ * Check whether the connection is in the middle of a body
+ *
+ * @param c Connection state
+ *
+ * @return Nonzero while the file data is being received
+ */
+static int conn_in_body(const conn *c)
+{
+    return c->state == CONN_BODY || c->state == CONN_FRAME || c->state == CONN_SPARSE;
+}
+
+/**
+ * Body bytes to receive before the next record
+ *
+ * @param c Connection state in `CONN_BODY`
+ *
+ * @return Bytes left in the run of a sparse body, in the body otherwise
+ */
+static size_t conn_body_left(const conn *c)
+{
+    return c->f.hdr.flags & FHDR_SPARSE ? c->run : c->left;
+}
+
+/**
+ * Get ready to receive the frames of a session
+ *
+ * @param c Connection state with a `FHDR_SESSION` header
+ *
+ * @return 0 on success, -1 on error
+ */
+static int conn_start_session(conn *c)
+{
+    if (relay_host) {
+        printf("Sessions can't be relayed\n");
+        return -1;
+    }
+    c->session = calloc(1, sizeof(*c->session));
+    if (c->session == NULL) {
+        perror("calloc");
+        return -1;
+    }
+    c->state = CONN_SESSION;
+    return 0;
+}
+
+/**
+ * Receive the next part of the file header
+ *
+ * Once the header is complete, validates it and creates the file.
+ *
+ * @param c Connection state
+ *
+ * @return Number of bytes received, `FSOCK_AGAIN` if there is no data yet,
+ *         0 if the client closed the connection before a new header,
+ *         -1 on error
+ */
+static ssize_t conn_receive_header(conn *c)
+{
+    ssize_t bytes_read;
+
+    bytes_read = conn_recv(c, (char*)&c->f.hdr + c->hdr_received,
+                           FHEADER_SIZE - c->hdr_received);
+    if (bytes_read < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            return FSOCK_AGAIN;
+        }
+        perror("recv");
+        return -1;
+    }
+    if (bytes_read == 0) {
+        if (c->hdr_received > 0) {
+            printf("Unexpected amount of bytes: %zu\n", c->hdr_received);
+            return -1;
+        }
+        return 0;
+    }
+
+    c->hdr_received += (size_t)bytes_read;
+    if (c->hdr_received < FHEADER_SIZE) {
+        return bytes_read;
+    }
+
+    if (c->f.hdr.flags & FHDR_SESSION) {
+        return conn_start_session(c) < 0 ? -1 : bytes_read;
+    }
+
+    c->f.path = NULL;
+    if (c->f.hdr.flags & FHDR_TREE) {
+        if (c->f.hdr.path_len == 0 || c->f.hdr.path_len > MAX_PATH_LEN) {
+            printf("Invalid path length: %" PRIu32 "\n", c->f.hdr.path_len);
+            return -1;
+        }
+        c->path_received = 0;
+        c->state = CONN_PATH;
+        return bytes_read;
+    }
+
+    return conn_accept(c) < 0 ? -1 : bytes_read;
+}
+
+/**
+ * Receive the next part of a tree entry path
+ *
+ * Once the path is complete, validates the entry and creates it.
+ *
+ * @param c Connection state
+ *
+ * @return Number of bytes received, `FSOCK_AGAIN` if there is no data yet,
+ *         -1 on error
+ */
+static ssize_t conn_receive_path(conn *c)
+{
+    ssize_t bytes_read;
+
+    bytes_read = conn_recv(c, c->path + c->path_received,
+                           c->f.hdr.path_len - c->path_received);
+    if (bytes_read < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            return FSOCK_AGAIN;
+        }
+        perror("recv");
+        return -1;
+    }
+    if (bytes_read == 0) {
+        printf("Connection closed in the middle of a path\n");
+        return -1;
+    }
+
+    c->path_received += (size_t)bytes_read;
+    if (c->path_received < c->f.hdr.path_len) {
+        return bytes_read;
+    }
+
+    c->path[c->path_received] = '\0';
+    if (strlen(c->path) != c->path_received) {
+        printf("Invalid path: embedded null byte\n");
+        return -1;
+    }
+    c->f.path = c->path;
+    return conn_accept(c) < 0 ? -1 : bytes_read;
+}
+
+/**
+ * Receive the next part of the offset the sender resumes from
+ *
+ * Once it is complete, checks it against the offer and positions the
+ * file there.
+ *
+ * @param c Connection state
+ *
+ * @return Number of bytes received, `FSOCK_AGAIN` if there is no data yet,
+ *         -1 on error
+ */
+static ssize_t conn_receive_resume(conn *c)
+{
+    ssize_t bytes_read;
+
+    bytes_read = conn_recv(c, (char*)&c->resume_from + c->resume_received,
+                           sizeof(c->resume_from) - c->resume_received);
+    if (bytes_read < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            return FSOCK_AGAIN;
+        }
+        perror("recv");
+        return -1;
+    }
+    if (bytes_read == 0) {
+        printf("Connection closed before the resume offset\n");
+        return -1;
+    }
+
+    c->resume_received += (size_t)bytes_read;
+    if (c->resume_received < sizeof(c->resume_from)) {
+        return bytes_read;
+    }
+
+    if (c->resume_from != 0 && c->resume_from != c->resume_offset) {
+        printf("Invalid resume offset: %" PRIu64 "\n", c->resume_from);
+        return -1;
+    }
+    if (resume_start(&c->f, (size_t)c->resume_from) < 0) {
+        return -1;
+    }
+    c->resume_saved = (size_t)c->resume_from;
+    return conn_start_body(c) < 0 ? -1 : bytes_read;
+}
+
+/**
+ * Receive the next part of a delta record and carry it out
+ *
+ * A literal switches to `CONN_BODY` for its data, a block reference is
+ * copied from the basis right away. `DELTA_END` is left in `c->record`
+ * for the caller to complete the file.
+ *
+ * @param c Connection state
+ *
+ * @return Number of bytes received plus the bytes copied from the basis,
+ *         `FSOCK_AGAIN` if there is no data yet, -1 on error
+ */
+static ssize_t conn_receive_record(conn *c)
+{
+    const size_t fsize = c->f.hdr.fsize;
+    ssize_t bytes_read;
+    uint64_t arg;
+
+    bytes_read = conn_recv(c, (char*)&c->record + c->record_received,
+                           sizeof(c->record) - c->record_received);
+    if (bytes_read < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            return FSOCK_AGAIN;
+        }
+        perror("recv");
+        return -1;
+    }
+    if (bytes_read == 0) {
+        printf("Connection closed in the middle of a delta\n");
+        return -1;
+    }
+
+    c->record_received += (size_t)bytes_read;
+    if (c->record_received < sizeof(c->record)) {
+        return bytes_read;
+    }
+
+    arg = c->record.arg;
+    switch (c->record.type) {
+    case DELTA_LITERAL:
+        if (arg == 0 || arg > DELTA_LITERAL_MAX || arg > fsize - c->delta_written) {
+            printf("Invalid literal of %" PRIu64 " bytes\n", arg);
+            return -1;
+        }
+        c->delta_written += (size_t)arg;
+        c->left = (size_t)arg;
+        c->state = CONN_BODY;
+        break;
+    case DELTA_COPY:
+        if (arg >= c->delta_blocks || c->delta_block_size > fsize - c->delta_written) {
+            printf("Invalid block reference: %" PRIu64 "\n", arg);
+            return -1;
+        }
+        if (delta_copy_block(c->basis_fd, c->f.fd, (off_t)(arg * c->delta_block_size),
+                             c->delta_block_size) < 0) {
+            return -1;
+        }
+        c->delta_written += c->delta_block_size;
+        c->delta_copied += c->delta_block_size;
+        bytes_read += c->delta_block_size;
+        break;
+    case DELTA_END:
+        if (arg != fsize || c->delta_written != fsize) {
+            printf("Delta ended at %zu bytes of %zu\n", c->delta_written, fsize);
+            return -1;
+        }
+        return bytes_read;
+    default:
+        printf("Unknown delta record: %" PRIu32 "\n", c->record.type);
+        return -1;
+    }
+
+    c->record_received = 0;
+    return bytes_read;
+}
+
+/**
+ * Write the whole buffer at the given offset
+ *
+ * @param fd     File descriptor
+ * @param buf    Data to write
+ * @param length Data length
+ * @param offset File offset
+ *
+ * @return 0 on success, -1 on error
+ */
+static int conn_write_at(int fd, const unsigned char *buf, size_t length, off_t offset)
+{
+    while (length > 0) {
+        uint64_t start = stats_start();
+        ssize_t n = pwrite(fd, buf, length, offset);
+
+        stats_stop(STATS_WRITE, start, n);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("pwrite");
+            return -1;
+        }
+        buf += n;
+        length -= (size_t)n;
+        offset += n;
+    }
+    return 0;
+}
+
+/**
+ * Receive the next part of a compressed block
+ *
+ * Once the block is complete, decompresses it (unless it's stored as
+ * is) and writes it to the file.
+ *
+ * @param c Connection state
+ *
+ * @return Number of bytes received, `FSOCK_AGAIN` if there is no data yet,
+ *         -1 on error
+ */
+static ssize_t conn_receive_frame(conn *c)
+{
+    const unsigned char *data = c->zbuf;
+    size_t want;
+    char *dst;
+    ssize_t bytes_read;
+
+    if (c->frame_received < sizeof(c->frame)) {
+        dst = (char*)&c->frame + c->frame_received;
+        want = sizeof(c->frame) - c->frame_received;
+    } else {
+        dst = (char*)c->zbuf + c->frame_received - sizeof(c->frame);
+        want = sizeof(c->frame) + c->frame.packed - c->frame_received;
+    }
+
+    bytes_read = conn_recv(c, dst, want);
+    if (bytes_read < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            return FSOCK_AGAIN;
+        }
+        perror("recv");
+        return -1;
+    }
+    if (bytes_read == 0) {
+        printf("Connection closed in the middle of a compressed block\n");
+        return -1;
+    }
+
+    c->frame_received += (size_t)bytes_read;
+    if (c->frame_received == sizeof(c->frame)
+        && (c->frame.raw == 0 || c->frame.raw > COMPRESS_BLOCK || c->frame.raw > c->left
+            || c->frame.packed == 0 || c->frame.packed > c->frame.raw)) {
+        printf("Invalid compressed block: %" PRIu32 " of %" PRIu32 " bytes\n",
+               c->frame.packed, c->frame.raw);
+        return -1;
+    }
+    if (c->frame_received < sizeof(c->frame) + c->frame.packed) {
+        return bytes_read;
+    }
+
+    if (c->frame.packed < c->frame.raw) {
+        if (decompress_block(c->zbuf, c->frame.packed, c->zout, c->frame.raw) < 0) {
+            printf("Malformed compressed block\n");
+            return -1;
+        }
+        data = c->zout;
+    }
+    if (c->f.hdr.flags & FHDR_HASH) {
+        hash_tree_update(&c->hash, data, c->frame.raw);
+    }
+    if (conn_write_at(c->f.fd, data, c->frame.raw, (off_t)conn_received(c)) < 0) {
+        return -1;
+    }
+
+    c->left -= c->frame.raw;
+    c->frame_received = 0;
+    return bytes_read;
+}
+
+/**
+ * Receive the next part of a run record of a sparse body
+ *
+ * Once the record is complete, makes a hole of its zeros and switches to
+ * `CONN_BODY` for its data, if any.
+ *
+ * @param c Connection state
+ *
+ * @return Number of bytes received, `FSOCK_AGAIN` if there is no data yet,
+ *         -1 on error
+ */
+static ssize_t conn_receive_sparse(conn *c)
+{
+    uint64_t hole;
+    ssize_t bytes_read;
+    off_t pos;
+
+    bytes_read = conn_recv(c, (char*)&c->sparse + c->sparse_received,
+                           sizeof(c->sparse) - c->sparse_received);
+    if (bytes_read < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            return FSOCK_AGAIN;
+        }
+        perror("recv");
+        return -1;
+    }
+    if (bytes_read == 0) {
+        printf("Connection closed in the middle of a sparse file\n");
+        return -1;
+    }
+
+    c->sparse_received += (size_t)bytes_read;
+    if (c->sparse_received < sizeof(c->sparse)) {
+        return bytes_read;
+    }
+    c->sparse_received = 0;
+
+    hole = c->sparse.hole;
+    if ((hole == 0 && c->sparse.data == 0) || hole > c->left
+        || c->sparse.data > c->left - hole) {
+        printf("Invalid run: hole %" PRIu64 ", data %" PRIu64 "\n",
+               hole, c->sparse.data);
+        return -1;
+    }
+
+    if (hole > 0) {
+        pos = (off_t)conn_received(c);
+        /* Whatever is collected for O_DIRECT belongs before the hole */
+        if (c->direct_fd >= 0 && conn_flush_direct(c) < 0) {
+            return -1;
+        }
+        if (sparse_punch(c->f.fd, pos, hole) < 0) {
+            return -1;
+        }
+        if (c->f.hdr.flags & FHDR_HASH) {
+            hash_tree_update_zeros(&c->hash, hole);
+        }
+        c->left -= (size_t)hole;
+        pos += (off_t)hole;
+        c->direct_pos = pos;
+        if (lseek(c->f.fd, pos, SEEK_SET) < 0) {
+            perror("lseek");
+            return -1;
+        }
+    }
+    c->run = (size_t)c->sparse.data;
+    if (c->run > 0) {
+        c->state = CONN_BODY;
+    }
+    return bytes_read;
+}
+
+/**
+ * Receive the next part of the sender's hash and check it
+ *
+ * Once the trailer is complete, compares it with the hash of the body
+ * received. On mismatch removes the file, along with the progress of a
+ * resumable transfer, and tells the sender with `HASH_MISMATCH`.
+ *
+ * @param c Connection state
+ *
+ * @return Number of bytes received, `FSOCK_AGAIN` if there is no data yet,
+ *         -1 on error or mismatch
+ */
+static ssize_t conn_receive_trailer(conn *c)
+{
+    const unsigned char verdict = HASH_MISMATCH;
+    hash_trailer mine;
+    ssize_t bytes_read;
+
+    bytes_read = conn_recv(c, (char*)&c->trailer + c->trailer_received,
+                           sizeof(c->trailer) - c->trailer_received);
+    if (bytes_read < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            return FSOCK_AGAIN;
+        }
+        perror("recv");
+        return -1;
+    }
+    if (bytes_read == 0) {
+        printf("Connection closed before the hash of the data\n");
+        return -1;
+    }
+
+    c->trailer_received += (size_t)bytes_read;
+    if (c->trailer_received < sizeof(c->trailer)) {
+        return bytes_read;
+    }
+
+    hash_tree_finish(&c->hash, &mine);
+    if (mine.leaves != c->trailer.leaves || mine.root != c->trailer.root) {
+        printf("Data of %s is corrupted: hash %016" PRIx64 ", expected %016" PRIx64 "\n",
+               c->f.path ? c->f.path : c->f.hdr.fname, mine.root, c->trailer.root);
+        file_discard(&c->f);
+        if (c->f.hdr.flags & FHDR_RESUME) {
+            resume_remove(&c->f);
+        }
+        /* A single byte fits in the socket buffer, nothing else is queued there */
+        if (send(c->sock, &verdict, sizeof(verdict), MSG_DONTWAIT) < 0) {
+            perror("send");
+        }
+        return -1;
+    }
+    return bytes_read;
+}
+
+/**
+ * Close the file of a session slot, if it's open
+ *
+ * @param sf File of the session
+ */
+static void conn_session_close_file(session_file *sf)
+{
+    if (sf->f.fd >= 0) {
+        close(sf->f.fd);
+        sf->f.fd = -1;
+    }
+}
+
+/**
+ * Create the file of a `SESSION_OPEN` frame
+ *
+ * The entry must be a `FHDR_TREE` one, hashed or not. An entry the
+ * receiver can't create fails on its own, its data is dropped.
+ *
+ * @param c  Connection state with the whole payload in `c->session->open`
+ * @param sf Free slot the frame is for
+ *
+ * @return 0 on success, -1 on a protocol error
+ */
+static int conn_session_open(conn *c, session_file *sf)
+{
+    session_rx *s = c->session;
+    size_t path_len = s->frame.length - FHEADER_SIZE;
+
+    memset(&sf->f, 0, sizeof(sf->f));
+    memcpy(&sf->f.hdr, s->open, FHEADER_SIZE);
+    memcpy(sf->path, s->open + FHEADER_SIZE, path_len);
+    sf->path[path_len] = '\0';
+    if (!(sf->f.hdr.flags & FHDR_TREE) || sf->f.hdr.flags & ~(uint32_t)(FHDR_TREE | FHDR_HASH)
+        || sf->f.hdr.path_len != path_len || strlen(sf->path) != path_len) {
+        printf("Invalid session entry\n");
+        return -1;
+    }
+
+    sf->f.fd = -1;
+    sf->f.path = sf->path;
+    sf->left = sf->f.hdr.fsize;
+    sf->open = 1;
+    sf->failed = file_accept(&sf->f) < 0;
+    if (sf->failed) {
+        sf->f.fd = -1;
+    }
+    if (sf->f.hdr.flags & FHDR_HASH) {
+        hash_tree_init(&sf->hash);
+    }
+    return 0;
+}
+
+/**
+ * Complete the file of a `SESSION_END` frame and queue its acknowledgement
+ *
+ * @param c  Connection state, with the trailer of a hashed file received
+ * @param sf Slot the frame is for, with all the data received
+ *
+ * @return 0 on success, -1 if the acknowledgement can't be queued
+ */
+static int conn_session_end(conn *c, session_file *sf)
+{
+    session_ack ack = {.id = c->session->frame.id};
+    hash_trailer mine;
+
+    if (!sf->failed && sf->f.hdr.flags & FHDR_HASH) {
+        hash_tree_finish(&sf->hash, &mine);
+        if (mine.leaves != c->session->trailer.leaves
+            || mine.root != c->session->trailer.root) {
+            printf("Data of %s is corrupted: hash %016" PRIx64 ", expected %016" PRIx64 "\n",
+                   sf->path, mine.root, c->session->trailer.root);
+            file_discard(&sf->f);
+            sf->failed = 1;
+        }
+    }
+    if (!sf->failed && sf->f.fd >= 0) {
+        printf("File %s received successfully\n", sf->path);
+    }
+    conn_session_close_file(sf);
+    sf->open = 0;
+
+    ack.status = (uint32_t)sf->failed;
+    return conn_queue(c, &ack, sizeof(ack));
+}
+
+/**
+ * Check the header of a frame against the state of its slot
+ *
+ * @param c Connection state with a complete frame header
+ *
+ * @return 0 if the frame is valid, -1 otherwise
+ */
+static int conn_session_check(const conn *c)
+{
+    const session_frame *fr = &c->session->frame;
+    const session_file *sf = &c->session->files[fr->id < SESSION_MAX_OPEN ? fr->id : 0];
+    int valid = fr->id < SESSION_MAX_OPEN;
+
+    switch (fr->type) {
+    case SESSION_OPEN:
+        valid = valid && !sf->open && fr->length > FHEADER_SIZE
+                && fr->length <= FHEADER_SIZE + MAX_PATH_LEN;
+        break;
+    case SESSION_DATA:
+        valid = valid && sf->open && fr->length > 0 && fr->length <= sf->left;
+        break;
+    case SESSION_END:
+        valid = valid && sf->open && sf->left == 0
+                && fr->length == (sf->f.hdr.flags & FHDR_HASH ? sizeof(hash_trailer) : 0);
+        break;
+    default:
+        valid = 0;
+    }
+    if (!valid) {
+        printf("Invalid session frame: slot %" PRIu32 ", type %" PRIu32 ", length %" PRIu64 "\n",
+               fr->id, fr->type, fr->length);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Receive the next part of a session
+ *
+ * Data is written at its offset in the file of its slot, through `buf`.
+ *
+ * @param c   Connection state
+ * @param buf Scratch buffer of `CHUNK_SIZE` bytes
+ *
+ * @return Number of bytes received, `FSOCK_AGAIN` if there is no data yet,
+ *         0 if the client ended the session with no files open, -1 on error
+ */
+static ssize_t conn_receive_session(conn *c, char *buf)
+{
+    session_rx *s = c->session;
+    session_frame *fr = &s->frame;
+    session_file *sf = NULL;
+    size_t want = (size_t)fr->length - s->payload_received;
+    char *dst;
+    ssize_t bytes_read;
+    int i, busy = 0;
+
+    if (s->frame_received < sizeof(*fr)) {
+        dst = (char*)fr + s->frame_received;
+        want = sizeof(*fr) - s->frame_received;
+    } else {
+        sf = &s->files[fr->id];
+        if (fr->type == SESSION_OPEN) {
+            dst = (char*)s->open + s->payload_received;
+        } else if (fr->type == SESSION_DATA) {
+            dst = buf;
+            want = want < CHUNK_SIZE ? want : CHUNK_SIZE;
+        } else {
+            dst = (char*)&s->trailer + s->payload_received;
+        }
+    }
+
+    bytes_read = conn_recv(c, dst, want);
+    if (bytes_read < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            return FSOCK_AGAIN;
+        }
+        perror("recv");
+        return -1;
+    }
+    if (bytes_read == 0) {
+        for (i = 0; i < SESSION_MAX_OPEN; i++) {
+            busy += s->files[i].open;
+        }
+        if (s->frame_received == 0 && busy == 0) {
+            return 0;
+        }
+        printf("Connection closed in the middle of a session\n");
+        return -1;
+    }
+
+    if (s->frame_received < sizeof(*fr)) {
+        s->frame_received += (size_t)bytes_read;
+        if (s->frame_received < sizeof(*fr)) {
+            return bytes_read;
+        }
+        if (conn_session_check(c) < 0) {
+            return -1;
+        }
+        s->payload_received = 0;
+        sf = &s->files[fr->id];
+        if (fr->length > 0) {
+            return bytes_read;
+        }
+    } else {
+        s->payload_received += (size_t)bytes_read;
+    }
+
+    if (fr->type == SESSION_DATA) {
+        if (!sf->failed && sf->f.hdr.flags & FHDR_HASH) {
+            hash_tree_update(&sf->hash, buf, (size_t)bytes_read);
+        }
+        if (!sf->failed && conn_write_at(sf->f.fd, (const unsigned char*)buf,
+                                         (size_t)bytes_read,
+                                         (off_t)(sf->f.hdr.fsize - sf->left)) < 0) {
+            sf->failed = 1;
+        }
+        sf->left -= (size_t)bytes_read;
+    }
+    if (s->payload_received < fr->length) {
+        return bytes_read;
+    }
+
+    s->frame_received = 0;
+    if (fr->type == SESSION_OPEN && conn_session_open(c, sf) < 0) {
+        return -1;
+    }
+    if (fr->type == SESSION_END && conn_session_end(c, sf) < 0) {
+        return -1;
+    }
+    return bytes_read;
+}
+
+/**
+ * Receive the next part of the body into the `O_DIRECT` buffer
+ *
+ * The buffer is written out whenever it fills up and at the end of the
+ * body. The first piece ends at an alignment boundary, so the following
+ * ones start at one.
+ *
+ * @param c    Connection state
+ * @param hash Tree to hash the data into, or `NULL`
+ *
+ * @return Number of bytes received, `FSOCK_AGAIN` if there is no data yet,
+ *         -1 on error
+ */
+static ssize_t conn_receive_direct(conn *c, hash_tree *hash)
+{
+    size_t skew = (size_t)c->direct_pos & (CACHE_ALIGN - 1);
+    size_t room = CHUNK_SIZE - skew - c->direct_len;
+    char *buf = c->direct_buf + skew + c->direct_len;
+    ssize_t bytes_read;
+
+    bytes_read = conn_recv(c, buf, room < conn_body_left(c) ? room : conn_body_left(c));
+    if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return FSOCK_AGAIN;
+    }
+    if (bytes_read <= 0) {
+        perror("recv");
+        return -1;
+    }
+    if (hash) {
+        hash_tree_update(hash, buf, (size_t)bytes_read);
+    }
+
+    c->direct_len += (size_t)bytes_read;
+    if (((size_t)bytes_read == room || (size_t)bytes_read == c->left)
+        && conn_flush_direct(c) < 0) {
+        return -1;
+    }
+    return bytes_read;
+}
+
+/**
+ * Receive the next part of the body of a relayed connection
+ *
+ * The data goes through `buf`, so it can be forwarded, and is written
+ * at its offset, for the whole connection even once forwarding fails.
+ *
+ * @param c      Connection state
+ * @param buf    Scratch buffer of `CHUNK_SIZE` bytes
+ * @param length Maximal number of bytes to receive
+ * @param hash   Tree to hash the data into, or `NULL`
+ *
+ * @return Number of bytes received, `FSOCK_AGAIN` if there is no data yet,
+ *         -1 on error
+ */
+static ssize_t conn_receive_relayed(conn *c, char *buf, size_t length, hash_tree *hash)
+{
+    ssize_t bytes_read = conn_recv(c, buf, length);
+
+    if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return FSOCK_AGAIN;
+    }
+    if (bytes_read <= 0) {
+        perror("recv");
+        return -1;
+    }
+    if (hash) {
+        hash_tree_update(hash, buf, (size_t)bytes_read);
+    }
+    if (conn_write_at(c->f.fd, (const unsigned char*)buf, (size_t)bytes_read,
+                      (off_t)conn_received(c)) < 0) {
+        return -1;
+    }
+    return bytes_read;
+}
+
+/**
+ * Move the next chunk of the file body from the socket to the file
+ *
+ * With io_uring or a disk thread the chunk is received into one of the
+ * engine's buffers and its write is queued. Otherwise the data is
+ * spliced through the connection's pipe, which is created on first use.
+ * If splicing isn't possible, falls back to copying through `buf` for
+ * the rest of the connection. A `FHDR_HASH` body is always copied, so it
+ * can be hashed on the way.
+ *
+ * @param c   Connection state
+ * @param buf Scratch buffer of `CHUNK_SIZE` bytes
+ *
+ * @return Number of bytes written to the file, `FSOCK_AGAIN` if there
+ *         is no data yet, -1 on error
+ */
+static ssize_t conn_receive_body(conn *c, char *buf)
+{
+    size_t chunk_size = CHUNK_SIZE <= conn_body_left(c) ? CHUNK_SIZE : conn_body_left(c);
+    hash_tree *hash = c->f.hdr.flags & FHDR_HASH ? &c->hash : NULL;
+    ssize_t bytes_read;
+
+    if (c->direct_fd >= 0) {
+        return conn_receive_direct(c, hash);
+    }
+    if (relay_host) {
+        return conn_receive_relayed(c, buf, chunk_size, hash);
+    }
+    if (c->ring && !(c->f.hdr.flags & FHDR_DELTA)) {
+        off_t offset = (off_t)(c->f.hdr.offset + c->f.hdr.length - c->left);
+        return uring_rx_recv(c->ring, &c->writes, c->sock, c->f.fd,
+                             offset, chunk_size, hash);
+    }
+    if (c->pipe && !(c->f.hdr.flags & FHDR_DELTA)) {
+        off_t offset = (off_t)(c->f.hdr.offset + c->f.hdr.length - c->left);
+        return pipeline_rx_recv(c->pipe, &c->queued, c->sock, c->f.fd,
+                                offset, chunk_size, hash);
+    }
+
+    if (!c->no_splice && !hash && c->pipefd[0] < 0
+        && fsock_pipe_open(c->pipefd, CHUNK_SIZE) < 0) {
+        c->no_splice = 1;
+    }
+
+    if (!c->no_splice && !hash) {
+        bytes_read = socktof_splice(c->sock, c->f.fd, c->pipefd, chunk_size);
+        if (bytes_read != FSOCK_UNSUPPORTED) {
+            return bytes_read;
+        }
+        fsock_pipe_close(c->pipefd);
+        c->pipefd[0] = c->pipefd[1] = -1;
+        c->no_splice = 1;
+    }
+
+    bytes_read = socktof(c->sock, c->f.fd, buf, chunk_size);
+    if (bytes_read > 0 && hash) {
+        hash_tree_update(hash, buf, (size_t)bytes_read);
+    }
+    return bytes_read;
+}
+
+/**
+ * Wait for the next receiver of a chain to complete, once the client has
+ * ended between files
+ *
+ * Forwards what's left, tells the receiver the end and reads its
+ * verdict, then tells the client if it hasn't got everything.
+ *
+ * @param c Connection state
+ *
+ * @return 0 once done and the reply, if any, is sent, `FSOCK_AGAIN`
+ *         while waiting, -1 on error
+ */
+static ssize_t conn_finish_relay(conn *c)
+{
+    unsigned char reply;
+    int verdict;
+
+    if (c->relay >= 0 && !c->relay_connecting && !c->relay_shut
+        && c->relay_sent == c->relay_len) {
+        if (relay_finish(c->relay) < 0) {
+            conn_fail_relay(c, RELAY_FAILED);
+        } else {
+            c->relay_shut = 1;
+            c->relay_active = time(NULL);
+        }
+    }
+    if (c->relay >= 0) {
+        verdict = c->relay_shut ? relay_verdict(c->relay) : FSOCK_AGAIN;
+        if (verdict == FSOCK_AGAIN) {
+            return FSOCK_AGAIN;
+        }
+        conn_stop_relay(c);
+        c->relay_failed = verdict;
+    }
+    if (c->relay_failed) {
+        printf("Relaying to %s:%s has failed\n", relay_host, relay_port);
+        reply = (unsigned char)c->relay_failed;
+        c->relay_failed = 0;
+        if (conn_queue(c, &reply, sizeof(reply)) < 0) {
+            return -1;
+        }
+    }
+    if (conn_flush(c) < 0) {
+        return -1;
+    }
+    return c->out_sent < c->out_len ? FSOCK_AGAIN : 0;
+}
+
+/**
+ * Advance the state machine, see `conn_process()`
+ */
+static conn_result conn_step(conn *c, char *buf)
+{
+    size_t moved = 0;
+
+    while (moved < CONN_BURST) {
+        ssize_t rc;
+
+        if (c->limit && c->limit->tokens < 0 && (c->wait = limit_delay(c->limit)) > 0) {
+            return CONN_WAIT;
+        }
+        if (c->state == CONN_HEADER) {
+            rc = conn_receive_header(c);
+            if (rc == 0 && !relay_host) {
+                return CONN_EOF;
+            }
+            if (rc == 0) {
+                c->state = CONN_RELAY;
+            }
+        } else if (c->state == CONN_PATH) {
+            rc = conn_receive_path(c);
+        } else if (c->state == CONN_RESUME) {
+            rc = conn_receive_resume(c);
+        } else if (c->state == CONN_SIGN) {
+            rc = conn_receive_signatures(c);
+        } else if (c->state == CONN_DELTA) {
+            rc = conn_receive_record(c);
+        } else if (c->state == CONN_FRAME) {
+            rc = conn_receive_frame(c);
+        } else if (c->state == CONN_HASH) {
+            rc = conn_receive_trailer(c);
+        } else if (c->state == CONN_SPARSE) {
+            rc = conn_receive_sparse(c);
+        } else if (c->state == CONN_SESSION) {
+            rc = conn_receive_session(c, buf);
+            if (rc == 0) {
+                return CONN_EOF;
+            }
+        } else if (c->state == CONN_RELAY) {
+            rc = conn_finish_relay(c);
+            if (rc == 0) {
+                return CONN_EOF;
+            }
+        } else {
+            rc = conn_receive_body(c, buf);
+            if (rc > 0) {
+                c->left -= (size_t)rc;
+                c->run -= c->f.hdr.flags & FHDR_SPARSE ? (size_t)rc : 0;
+            }
+        }
+        if (rc > 0 && conn_in_body(c) && !(c->f.hdr.flags & FHDR_DELTA)) {
+            cache_advance(&c->cache, (off_t)conn_received(c));
+        }
+        if (rc > 0 && c->f.hdr.flags & FHDR_RESUME && conn_in_body(c)
+            && conn_received(c) - c->resume_saved >= RESUME_SAVE_INTERVAL) {
+            c->resume_saved = conn_received(c);
+            resume_save(&c->f, c->resume_saved);
+        }
+        if (rc == FSOCK_AGAIN) {
+            return CONN_AGAIN;
+        }
+        if (rc < 0) {
+            return CONN_ERROR;
+        }
+
+        c->last_active = time(NULL);
+        moved += (size_t)rc;
+        if (c->limit) {
+            limit_charge(c->limit, (size_t)rc);
+        }
+
+        if (conn_in_body(c) && c->left == 0) {
+            if (c->f.hdr.flags & FHDR_DELTA) {
+                c->state = CONN_DELTA;
+                c->record_received = 0;
+            } else if (c->f.hdr.flags & FHDR_HASH) {
+                c->state = CONN_HASH;
+                c->trailer_received = 0;
+            } else {
+                return conn_finish(c);
+            }
+        }
+        if (c->state == CONN_BODY && c->f.hdr.flags & FHDR_SPARSE && c->run == 0) {
+            c->state = CONN_SPARSE;
+        }
+        if (c->state == CONN_HASH && c->trailer_received == sizeof(c->trailer)) {
+            return conn_finish(c);
+        }
+        if (c->state == CONN_DELTA && c->record.type == DELTA_END
+            && c->record_received == sizeof(c->record)) {
+            return conn_finish(c);
+        }
+    }
+    return CONN_AGAIN;
+}
+
+conn_result conn_process(conn *c, char *buf)
+{
+    stats_transfer *prev = stats_current;
+    conn_result rc;
+
+    /* The thread serves other connections in between */
+    stats_current = c->stats;
+    conn_forward(c);
+    if (conn_flush(c) < 0) {
+        rc = CONN_ERROR;
+    } else if (c->out_len - c->out_sent >= CONN_OUT_MAX) {
+        rc = CONN_AGAIN;
+    } else {
+        rc = conn_step(c, buf);
+        if (rc != CONN_ERROR && conn_flush(c) < 0) {
+            rc = CONN_ERROR;
+        }
+    }
+    stats_current = prev;
+    tune_poll(&c->tune);
+    return rc;
+}
+
+int conn_events(const conn *c, struct pollfd *fds)
+{
+    size_t queued = c->out_len - c->out_sent, held = c->relay_len - c->relay_sent;
+    int read = queued < CONN_OUT_MAX && c->state != CONN_SIGN && c->state != CONN_RELAY
+               && (c->relay < 0 || held < RELAY_BUFFER);
+    int n = 1;
+
+    fds[0].fd = c->sock;
+    fds[0].events = (short)((read ? POLLIN : 0) | (queued ? POLLOUT : 0));
+    fds[0].revents = 0;
+    if (c->signer) {
+        fds[n].fd = delta_signer_fd(c->signer);
+        fds[n].events = POLLIN;
+        fds[n++].revents = 0;
+    }
+    if (c->relay >= 0) {
+        fds[n].fd = c->relay;
+        fds[n].events = (short)(c->relay_connecting ? POLLOUT
+                                : POLLIN | (held ? POLLOUT : 0));
+        fds[n++].revents = 0;
+    }
+    return n;
+}
+
+time_t conn_idle(const conn *c, time_t now)
+{
+    if (c->state == CONN_SIGN || (c->relay >= 0 && (c->state == CONN_RELAY
+        || c->relay_len - c->relay_sent >= RELAY_BUFFER))) {
+        return 0;
+    }
+    return now - c->last_active;
+}
+
+int conn_sweep(conn *c, time_t now)
+{
+    if (c->relay < 0 || now - c->relay_active < RELAY_TIMEOUT
+        || !(c->relay_connecting || c->relay_sent < c->relay_len || c->state == CONN_RELAY)) {
+        return 0;
+    }
+    printf("Relaying to %s:%s has stalled for %d seconds\n",
+           relay_host, relay_port, RELAY_TIMEOUT);
+    conn_fail_relay(c, RELAY_FAILED);
+    return 1;
+}
+
+void conn_close(conn *c)
+{
+    stats_transfer *prev = stats_current;
+    int written = 1, i;
+
+    stats_current = c->stats;
+    conn_flush(c);
+    if (c->ring) {
+        written = uring_rx_wait(c->ring, &c->writes) == 0;
+    }
+    if (c->pipe) {
+        written = pipeline_rx_wait(c->pipe, &c->queued) == 0 && written;
+    }
+    written = conn_stop_direct(c) == 0 && written;
+    cache_finish(&c->cache);
+    if (conn_in_body(c) && c->f.hdr.flags & FHDR_RESUME && written) {
+        resume_save(&c->f, conn_received(c));
+    }
+    if (conn_in_body(c) || c->state == CONN_RESUME || c->state == CONN_SIGN
+        || c->state == CONN_DELTA
+        || c->state == CONN_HASH) {
+        file_close(&c->f);
+        if (c->f.hdr.flags & FHDR_DELTA) {
+            delta_abort(&c->f);
+        }
+    }
+    conn_stop_relay(c);
+    delta_signer_free(c->signer);
+    c->signer = NULL;
+    conn_close_basis(c);
+    if (c->session) {
+        for (i = 0; i < SESSION_MAX_OPEN; i++) {
+            if (c->session->files[i].open) {
+                conn_session_close_file(&c->session->files[i]);
+            }
+        }
+        free(c->session);
+        c->session = NULL;
+    }
+    free(c->zbuf);
+    free(c->zout);
+    free(c->direct_buf);
+    free(c->out);
+    free(c->relay_buf);
+    c->relay_buf = NULL;
+    c->zbuf = c->zout = NULL;
+    c->direct_buf = NULL;
+    c->out = NULL;
+    c->out_len = c->out_sent = c->out_cap = 0;
+    if (c->pipefd[0] >= 0) {
+        fsock_pipe_close(c->pipefd);
+        c->pipefd[0] = c->pipefd[1] = -1;
+    }
+    if (c->stats) {
+        stats_unwatch(c->stats, c->sock);
+        stats_end(c->stats, 0, NULL);
+        c->stats = NULL;
+    }
+    tune_report(&c->tune, NULL);
+    c->tune.start = 0;
+    limit_leave(c->limit);
+    c->limit = NULL;
+    stats_current = prev;
+}
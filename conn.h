@@ -0,0 +1,246 @@
+/**
+ * @file conn.h
+ * @brief Receiving side of a client connection as a state machine
+ *
+ * A connection alternates between reading a file header (followed by
+ * the entry path for directory trees) and reading the file body, unless
+ * the client starts a session, whose frames it then reads until the end,
+ * see `session.h`. All progress is kept in the `conn` structure, so the
+ * same code serves a thread per client (driven by `poll()`) and many
+ * clients per thread (driven by an event loop), calling `conn_process()`
+ * whenever one of the events from `conn_events()` occurs. The socket is
+ * non-blocking: replies to the client are queued and sent as it takes
+ * them, so a client that doesn't read them never blocks the thread.
+ */
+
+#pragma once
+
+#include <poll.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "cache.h"
+#include "compress.h"
+#include "delta.h"
+#include "file.h"
+#include "hash.h"
+#include "limit.h"
+#include "pipeline.h"
+#include "session.h"
+#include "sparse.h"
+#include "stats.h"
+#include "tune.h"
+#include "uring.h"
+
+/** Maximal amount of data one `conn_process()` call moves before yielding */
+#define CONN_BURST (CHUNK_SIZE * 16)
+
+/** Replies queued for the client past which it isn't read until they drain */
+#define CONN_OUT_MAX (64 * 1024)
+
+/** Most descriptors a connection waits on */
+#define CONN_MAX_FDS 3
+
+typedef enum {
+    CONN_HEADER,   /**< Waiting for (the rest of) a file header */
+    CONN_PATH,     /**< Waiting for (the rest of) a tree entry path */
+    CONN_RESUME,   /**< Waiting for the offset to resume from */
+    CONN_SIGN,     /**< Waiting for the signatures of the basis to be computed */
+    CONN_DELTA,    /**< Waiting for (the rest of) a delta record */
+    CONN_FRAME,    /**< Waiting for (the rest of) a compressed block */
+    CONN_SPARSE,   /**< Waiting for (the rest of) a run record of a sparse body */
+    CONN_BODY,     /**< Receiving file contents */
+    CONN_HASH,     /**< Waiting for (the rest of) the hash of the contents */
+    CONN_SESSION,  /**< Receiving the frames of a session */
+    CONN_RELAY,    /**< Waiting for the next receiver of a chain to complete */
+} conn_state;
+
+/** Results of `conn_process()` */
+typedef enum {
+    CONN_ERROR = -1,  /**< Protocol or I/O error, the connection must be closed */
+    CONN_EOF   = 0,   /**< The client closed the connection between files */
+    CONN_AGAIN = 1,   /**< Waiting for more data */
+    CONN_DONE  = 2,   /**< A file has been received completely */
+    CONN_WAIT  = 3,   /**< Over its share of `--limit`, not to be read for `wait` ns */
+} conn_result;
+
+typedef struct conn {
+    int          sock;
+    conn_state   state;
+    file         f;
+    size_t       hdr_received;  /**< Bytes of `f.hdr` received so far */
+    size_t       path_received; /**< Bytes of `path` received so far */
+    char         path[MAX_PATH_LEN + 1]; /**< Path of the tree entry */
+    uint64_t     resume_from;   /**< Offset the sender continues from */
+    size_t       resume_received; /**< Bytes of `resume_from` received so far */
+    uint64_t     resume_offset; /**< Offset offered to the sender */
+    size_t       resume_saved;  /**< Progress last recorded in the sidecar */
+    int          basis_fd;      /**< Old copy of a delta transfer, or -1 */
+    delta_signer *signer;       /**< Computing the signatures of the basis, or `NULL` */
+    uint32_t     delta_block_size;
+    uint64_t     delta_blocks;  /**< Number of blocks in the basis */
+    size_t       delta_written; /**< Bytes of the rebuilt file so far */
+    size_t       delta_copied;  /**< Bytes of them copied from the basis */
+    delta_record record;        /**< Delta record being received */
+    size_t       record_received; /**< Bytes of `record` received so far */
+    compress_frame frame;       /**< Header of the compressed block being received */
+    size_t       frame_received; /**< Bytes of `frame` and its data received so far */
+    unsigned char *zbuf;        /**< Data of the compressed block, allocated on first use */
+    unsigned char *zout;        /**< Decompressed block */
+    sparse_record sparse;       /**< Run record being received */
+    size_t       sparse_received; /**< Bytes of `sparse` received so far */
+    size_t       run;           /**< Data bytes left in the current run */
+    hash_tree    hash;          /**< Hash of the body received so far */
+    hash_trailer trailer;       /**< Sender's hash of the body */
+    size_t       trailer_received; /**< Bytes of `trailer` received so far */
+    size_t       left;          /**< Body bytes still expected */
+    int          pipefd[2];     /**< Pipe for `splice()`, -1 until the first body */
+    int          no_splice;     /**< Splicing failed, copy through a buffer */
+    uring_rx    *ring;          /**< io_uring engine to write through, or `NULL` */
+    uring_owner  writes;        /**< Writes queued to `ring` */
+    pipeline_rx *pipe;          /**< Disk thread to write through, or `NULL` */
+    pipeline_owner queued;      /**< Writes queued to `pipe` */
+    cache_cursor cache;         /**< Cache window moving along the body */
+    int          direct_fd;     /**< `O_DIRECT` descriptor of the file, or -1 */
+    char        *direct_buf;    /**< Aligned buffer collecting the data for it */
+    size_t       direct_len;    /**< Bytes collected in `direct_buf` */
+    off_t        direct_pos;    /**< File offset of the collected bytes */
+    stats_transfer *stats;      /**< Statistics of the connection, or `NULL` */
+    tune_socket  tune;          /**< Tuning of the connection */
+    int          relay;         /**< Connection to the next receiver of a chain, or -1 */
+    int          relay_connecting; /**< `relay` isn't connected yet */
+    size_t       relay_next;    /**< Next address of the receiver to try */
+    int          relay_failed;  /**< Byte to reply once forwarding has failed, the data
+                                     is only kept here, or 0 */
+    int          relay_shut;    /**< The receiver has been told all is forwarded */
+    char        *relay_buf;     /**< Data waiting to be forwarded */
+    size_t       relay_len;     /**< Bytes in `relay_buf` */
+    size_t       relay_sent;    /**< Bytes of them forwarded so far */
+    time_t       relay_active;  /**< Last time the receiver took data, or was connected
+                                     or told the end */
+    session_rx  *session;       /**< Session the client has started, or `NULL` */
+    unsigned char *out;         /**< Replies queued for the client */
+    size_t       out_len;       /**< Bytes in `out` */
+    size_t       out_sent;      /**< Bytes of them sent so far */
+    size_t       out_cap;       /**< Size of `out` */
+    limit_flow  *limit;         /**< Share of the bandwidth limit, or `NULL` */
+    uint64_t     wait;          /**< Time to wait after `CONN_WAIT`, ns */
+    uint64_t     paused_until;  /**< Owner's: when to read it again, ns, 0 if it's read */
+    struct pollfd watched[CONN_MAX_FDS]; /**< Owner's: events it waits for on the descriptors */
+    int          nwatched;      /**< Owner's: number of them */
+    time_t       last_active;   /**< Last time any data arrived or a reply left */
+    struct conn *prev, *next;   /**< Links for the owner's connection list */
+} conn;
+
+/**
+ * Prepare a connection state for a freshly accepted socket
+ *
+ * With `stats_enabled` the connection collects statistics, printed
+ * when it's closed. With `tune_enabled` its receive buffer is tuned
+ * while the data comes in, see `tune.h`. With `relay_host` the
+ * connection is forwarded to the next receiver, see `relay.h`; the
+ * body then goes through the scratch buffer. With `limit_enabled` the
+ * connection is a flow of the bandwidth limit, see `limit.h`.
+ * The body is written with `splice()` unless the owner sets `ring`
+ * afterwards to have it written through io_uring, or `pipe` to have it
+ * written by a disk thread. Without either, `CACHE_DIRECT` has it
+ * collected in an aligned buffer and written with `O_DIRECT`.
+ *
+ * @param c    Connection state to initialize
+ * @param sock Connected socket descriptor
+ */
+void conn_init(conn *c, int sock);
+
+/**
+ * Receive whatever data is available and advance the state machine
+ *
+ * Reads the header, creates the file and moves the body to it. Returns
+ * once the socket has no more data (non-blocking sockets), a file has
+ * been completed, or `CONN_BURST` bytes have been moved, so one busy
+ * client can't starve the others sharing a thread. A connection over
+ * its share of `--limit` returns `CONN_WAIT` instead, for the owner not
+ * to read it for `wait` ns.
+ *
+ * A `FHDR_HASH` body is hashed as it arrives and completed only once the
+ * sender's hash matches; on mismatch the file is removed, so the bad
+ * data never passes for a received copy, the sender gets
+ * `HASH_MISMATCH` and the connection fails. A resumable transfer
+ * starts over next time. Within a session every file that ends is
+ * acknowledged instead, and a failing file fails only itself, removed
+ * the same way on mismatch.
+ *
+ * Queued replies are sent first, as far as the socket takes them. While
+ * `CONN_OUT_MAX` of them are still queued, the client isn't read. The
+ * same goes for the data held for the next receiver of a chain, which
+ * is also checked for a verdict given before the end. A relayed
+ * connection the client ends between files waits for the next receiver
+ * to complete, and tells the client if it hasn't, before returning
+ * `CONN_EOF`.
+ *
+ * @param c   Connection state
+ * @param buf Scratch buffer of `CHUNK_SIZE` bytes, used only when the
+ *            body can't be spliced
+ *
+ * @return One of `conn_result`
+ */
+conn_result conn_process(conn *c, char *buf);
+
+/**
+ * Tell the events the connection waits for
+ *
+ * The socket is to be read, unless too many replies are queued, the
+ * signatures of a delta basis are being computed or the next receiver
+ * of a chain is behind, and to be written while any replies are queued.
+ * Once the signatures are computed, the descriptor of their
+ * `delta_signer` becomes readable. The connection to the next receiver
+ * is to be written while it's being connected or has data to take, and
+ * read for its verdict.
+ *
+ * @param c   Connection state
+ * @param fds Filled with up to `CONN_MAX_FDS` descriptors and their
+ *            `POLLIN` and `POLLOUT` events, possibly none
+ *
+ * @return Number of descriptors in `fds`
+ */
+int conn_events(const conn *c, struct pollfd *fds);
+
+/**
+ * Tell how long the connection has been waiting for the client
+ *
+ * @param c   Connection state
+ * @param now Current time
+ *
+ * @return Seconds since any data arrived or a reply left, 0 while the
+ *         receiver itself or the next receiver of a chain is busy with it
+ */
+time_t conn_idle(const conn *c, time_t now);
+
+/**
+ * Give up on the next receiver of a chain once it's been stalled for
+ * `RELAY_TIMEOUT`
+ *
+ * The data is then only kept here, and the client gets `RELAY_FAILED`
+ * at the end.
+ *
+ * @param c   Connection state
+ * @param now Current time
+ *
+ * @return 1 if it has been given up on, and the connection is to be
+ *         processed again, otherwise 0
+ */
+int conn_sweep(conn *c, time_t now);
+
+/**
+ * Release the resources held by a connection
+ *
+ * Waits for the writes still in flight, closes the file being received
+ * (if any) and the splice pipe. The progress of an interrupted
+ * resumable transfer is recorded first, the temporary file of an
+ * interrupted delta transfer is removed, and the connection to the next
+ * receiver of a chain is dropped. Replies still queued are sent if the
+ * socket takes them right away. The socket is left to the caller.
+ *
+ * @param c Connection state
+ */
+void conn_close(conn *c);
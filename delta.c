@@ -0,0 +1,636 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "delta.h"
+#include "fsock.h"
+#include "progress.h"
+
+#define XXH_PRIME1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME3 0x165667B19E3779F9ULL
+#define XXH_PRIME4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME5 0x27D4EB2F165667C5ULL
+
+/** Marks an empty slot of the sender's signature table */
+#define DELTA_NONE SIZE_MAX
+
+/**
+ * Signatures of the receiver's blocks, looked up by weak checksum
+ *
+ * Chained hash table: `head` holds the first block with a given bucket,
+ * `next` the following one.
+ */
+typedef struct {
+    const delta_sig *sigs;
+    size_t          *head;
+    size_t          *next;
+    size_t           mask;
+} delta_table;
+
+uint32_t delta_weak(const unsigned char *buf, size_t len)
+{
+    uint32_t a = 0, b = 0;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        a += buf[i];
+        b += a;
+    }
+    return (a & 0xffff) | (b << 16);
+}
+
+static uint64_t rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t read64(const unsigned char *p)
+{
+    uint64_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint64_t xxh_round(uint64_t acc, uint64_t input)
+{
+    acc += input * XXH_PRIME2;
+    return rotl64(acc, 31) * XXH_PRIME1;
+}
+
+static uint64_t xxh_merge(uint64_t acc, uint64_t val)
+{
+    acc ^= xxh_round(0, val);
+    return acc * XXH_PRIME1 + XXH_PRIME4;
+}
+
+/* XXH64 with a zero seed */
+uint64_t delta_strong(const unsigned char *buf, size_t len)
+{
+    const unsigned char *p = buf, *end = buf + len;
+    uint64_t h;
+
+    if (len >= 32) {
+        uint64_t v1 = XXH_PRIME1 + XXH_PRIME2, v2 = XXH_PRIME2,
+                 v3 = 0, v4 = 0 - XXH_PRIME1;
+
+        do {
+            v1 = xxh_round(v1, read64(p));
+            v2 = xxh_round(v2, read64(p + 8));
+            v3 = xxh_round(v3, read64(p + 16));
+            v4 = xxh_round(v4, read64(p + 24));
+            p += 32;
+        } while (p + 32 <= end);
+
+        h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+        h = xxh_merge(h, v1);
+        h = xxh_merge(h, v2);
+        h = xxh_merge(h, v3);
+        h = xxh_merge(h, v4);
+    } else {
+        h = XXH_PRIME5;
+    }
+
+    h += (uint64_t)len;
+
+    while (p + 8 <= end) {
+        h ^= xxh_round(0, read64(p));
+        h = rotl64(h, 27) * XXH_PRIME1 + XXH_PRIME4;
+        p += 8;
+    }
+    if (p + 4 <= end) {
+        uint32_t v;
+
+        memcpy(&v, p, sizeof(v));
+        h ^= (uint64_t)v * XXH_PRIME1;
+        h = rotl64(h, 23) * XXH_PRIME2 + XXH_PRIME3;
+        p += 4;
+    }
+    while (p < end) {
+        h ^= *p * XXH_PRIME5;
+        h = rotl64(h, 11) * XXH_PRIME1;
+        p++;
+    }
+
+    h ^= h >> 33;
+    h *= XXH_PRIME2;
+    h ^= h >> 29;
+    h *= XXH_PRIME3;
+    h ^= h >> 32;
+    return h;
+}
+
+int delta_temp_name(char *buf, const char *fname)
+{
+    int len = snprintf(buf, MAX_FILE_NAME + 1, ".%s.fling-delta", fname);
+
+    return len > 0 && len <= MAX_FILE_NAME ? 0 : -1;
+}
+
+int delta_signatures(int basis, delta_sig_header *sh, delta_sig **sigs)
+{
+    struct stat st;
+    unsigned char *buf;
+    size_t size, i;
+
+    memset(sh, 0, sizeof(*sh));
+    sh->block_size = DELTA_BLOCK;
+    *sigs = NULL;
+
+    if (basis < 0) {
+        return 0;
+    }
+    if (fstat(basis, &st) < 0) {
+        perror("fstat");
+        return -1;
+    }
+
+    size = (size_t)st.st_size;
+    if (size / DELTA_BLOCK > DELTA_MAX_BLOCKS) {
+        size_t bs = (size + DELTA_MAX_BLOCKS - 1) / DELTA_MAX_BLOCKS;
+        sh->block_size = (uint32_t)((bs + DELTA_BLOCK - 1) / DELTA_BLOCK * DELTA_BLOCK);
+    }
+    sh->count = size / sh->block_size;
+    if (sh->count == 0) {
+        return 0;
+    }
+
+    buf = malloc(sh->block_size);
+    *sigs = malloc(sh->count * sizeof(**sigs));
+    if (!buf || !*sigs) {
+        perror("malloc");
+        goto err;
+    }
+
+    for (i = 0; i < sh->count; i++) {
+        size_t got = 0;
+
+        while (got < sh->block_size) {
+            ssize_t n = pread(basis, buf + got, sh->block_size - got,
+                              (off_t)(i * sh->block_size + got));
+            if (n <= 0) {
+                if (n < 0) {
+                    perror("pread");
+                }
+                goto err;
+            }
+            got += (size_t)n;
+        }
+        (*sigs)[i].weak = delta_weak(buf, sh->block_size);
+        (*sigs)[i].reserved = 0;
+        (*sigs)[i].strong = delta_strong(buf, sh->block_size);
+    }
+
+    free(buf);
+    return 0;
+
+err:
+    free(buf);
+    free(*sigs);
+    *sigs = NULL;
+    return -1;
+}
+
+struct delta_signer {
+    int              basis;      /**< The thread's own descriptor of the basis */
+    int              pipefd[2];  /**< Written to once the signatures are computed */
+    int              rc;         /**< Result of `delta_signatures()` */
+    delta_sig_header sh;
+    delta_sig       *sigs;
+    atomic_int       done;       /**< The signatures are computed */
+    atomic_int       refs;       /**< The thread and the owner, while they hold it */
+};
+
+static void delta_signer_release(delta_signer *s)
+{
+    if (atomic_fetch_sub(&s->refs, 1) == 1) {
+        close(s->pipefd[0]);
+        close(s->pipefd[1]);
+        free(s->sigs);
+        free(s);
+    }
+}
+
+/**
+ * Compute the signatures of a signer, see `delta_signer_start()`
+ *
+ * @param arg Signer
+ *
+ * @return Always `NULL`
+ */
+static void *delta_signer_run(void *arg)
+{
+    delta_signer *s = arg;
+    const char done = 1;
+
+    s->rc = delta_signatures(s->basis, &s->sh, &s->sigs);
+    close(s->basis);
+    atomic_store(&s->done, 1);
+    if (write(s->pipefd[1], &done, sizeof(done)) < 0) {
+        perror("write");
+    }
+    delta_signer_release(s);
+    return NULL;
+}
+
+delta_signer *delta_signer_start(int basis)
+{
+    delta_signer *s = calloc(1, sizeof(*s));
+    pthread_t thread;
+
+    if (s == NULL) {
+        perror("calloc");
+        return NULL;
+    }
+    if (pipe(s->pipefd) < 0) {
+        perror("pipe");
+        free(s);
+        return NULL;
+    }
+    s->basis = dup(basis);
+    if (s->basis < 0) {
+        perror("dup");
+        goto err;
+    }
+    atomic_store(&s->refs, 2);
+    if (pthread_create(&thread, NULL, delta_signer_run, s) != 0) {
+        perror("pthread_create");
+        close(s->basis);
+        goto err;
+    }
+    pthread_detach(thread);
+    return s;
+
+err:
+    close(s->pipefd[0]);
+    close(s->pipefd[1]);
+    free(s);
+    return NULL;
+}
+
+int delta_signer_fd(const delta_signer *s)
+{
+    return s->pipefd[0];
+}
+
+int delta_signer_take(delta_signer *s, delta_sig_header *sh, delta_sig **sigs)
+{
+    if (!atomic_load(&s->done)) {
+        return 0;
+    }
+    if (s->rc < 0) {
+        return -1;
+    }
+    *sh = s->sh;
+    *sigs = s->sigs;
+    s->sigs = NULL;
+    return 1;
+}
+
+void delta_signer_free(delta_signer *s)
+{
+    if (s) {
+        delta_signer_release(s);
+    }
+}
+
+int delta_copy_block(int basis, int fd, off_t offset, size_t block_size)
+{
+    char buf[CHUNK_SIZE];
+    size_t done = 0;
+
+#ifdef __linux__
+    /* Lets the filesystem share the extents instead of copying the data */
+    while (done < block_size) {
+        off_t in = offset + (off_t)done;
+        ssize_t n = copy_file_range(basis, &in, fd, NULL, block_size - done, 0);
+
+        if (n <= 0) {
+            if (n == 0 || errno == EXDEV || errno == EINVAL
+                || errno == ENOSYS || errno == EOPNOTSUPP) {
+                break;
+            }
+            perror("copy_file_range");
+            return -1;
+        }
+        done += (size_t)n;
+    }
+#endif
+
+    while (done < block_size) {
+        size_t want = block_size - done < sizeof(buf) ? block_size - done : sizeof(buf);
+        ssize_t n = pread(basis, buf, want, offset + (off_t)done);
+        size_t written = 0;
+
+        if (n <= 0) {
+            if (n < 0) {
+                perror("pread");
+            } else {
+                printf("Basis block is beyond the end of the file\n");
+            }
+            return -1;
+        }
+        while (written < (size_t)n) {
+            ssize_t w = write(fd, buf + written, (size_t)n - written);
+            if (w < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                perror("write");
+                return -1;
+            }
+            written += (size_t)w;
+        }
+        done += (size_t)n;
+    }
+    return 0;
+}
+
+int delta_commit(const file *f, int basis)
+{
+    char temp[MAX_FILE_NAME + 1];
+    struct stat st;
+
+    if (delta_temp_name(temp, f->hdr.fname) < 0) {
+        return -1;
+    }
+    if (basis >= 0 && fstat(basis, &st) == 0
+        && fchmod(f->fd, st.st_mode & 07777) < 0) {
+        perror("fchmod");
+    }
+    if (rename(temp, f->hdr.fname) < 0) {
+        perror("rename");
+        return -1;
+    }
+    return 0;
+}
+
+void delta_abort(const file *f)
+{
+    char temp[MAX_FILE_NAME + 1];
+
+    if (delta_temp_name(temp, f->hdr.fname) == 0
+        && unlink(temp) < 0 && errno != ENOENT) {
+        perror("unlink");
+    }
+}
+
+/**
+ * Build the lookup table for the receiver's signatures
+ *
+ * @param t     Table to fill
+ * @param sigs  Signatures
+ * @param count Number of signatures
+ *
+ * @return 0 on success, -1 on error
+ */
+static int delta_table_init(delta_table *t, const delta_sig *sigs, size_t count)
+{
+    size_t size = 1, i;
+
+    while (size < count * 2) {
+        size <<= 1;
+    }
+    t->sigs = sigs;
+    t->mask = size - 1;
+    t->head = malloc(size * sizeof(*t->head));
+    t->next = malloc((count ? count : 1) * sizeof(*t->next));
+    if (!t->head || !t->next) {
+        perror("malloc");
+        free(t->head);
+        free(t->next);
+        return -1;
+    }
+
+    for (i = 0; i < size; i++) {
+        t->head[i] = DELTA_NONE;
+    }
+    /* Backwards, so that equal blocks resolve to the first one */
+    for (i = count; i-- > 0;) {
+        size_t bucket = sigs[i].weak & t->mask;
+        t->next[i] = t->head[bucket];
+        t->head[bucket] = i;
+    }
+    return 0;
+}
+
+/**
+ * Find the receiver's block matching the window
+ *
+ * @param t    Signature table
+ * @param weak Weak checksum of the window
+ * @param buf  Window data
+ * @param len  Window length, equal to the block size
+ *
+ * @return Block number, or `DELTA_NONE` if no block matches
+ */
+static size_t delta_table_find(const delta_table *t, uint32_t weak,
+                               const unsigned char *buf, size_t len)
+{
+    size_t i = t->head[weak & t->mask];
+    uint64_t strong = 0;
+    int have_strong = 0;
+
+    for (; i != DELTA_NONE; i = t->next[i]) {
+        if (t->sigs[i].weak != weak) {
+            continue;
+        }
+        if (!have_strong) {
+            strong = delta_strong(buf, len);
+            have_strong = 1;
+        }
+        if (t->sigs[i].strong == strong) {
+            return i;
+        }
+    }
+    return DELTA_NONE;
+}
+
+/**
+ * Send a record, followed by data for literals
+ *
+ * @param sock Connected socket descriptor
+ * @param type Record type
+ * @param arg  Record argument
+ * @param data Literal data, `arg` bytes
+ *
+ * @return 0 on success, -1 on error
+ */
+static int delta_send_record(int sock, uint32_t type, uint64_t arg,
+                             const unsigned char *data)
+{
+    delta_record rec = {.type = type, .arg = arg};
+
+    if (send_all(sock, &rec, sizeof(rec)) < 0) {
+        return -1;
+    }
+    if (type == DELTA_LITERAL && send_all(sock, data, (size_t)arg) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Send a range of the file as literal records of at most `DELTA_LITERAL_MAX`
+ *
+ * @param sock Connected socket descriptor
+ * @param data Range data
+ * @param len  Range length
+ *
+ * @return 0 on success, -1 on error
+ */
+static int delta_send_literal(int sock, const unsigned char *data, size_t len)
+{
+    while (len > 0) {
+        size_t n = len < DELTA_LITERAL_MAX ? len : DELTA_LITERAL_MAX;
+
+        if (delta_send_record(sock, DELTA_LITERAL, n, data) < 0) {
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * Receive the signatures of the receiver's copy
+ *
+ * @param sock Connected socket descriptor
+ * @param sh   Set to the signature header
+ * @param sigs Set to a `malloc()`ed array of signatures
+ *
+ * @return 0 on success, -1 on error
+ */
+static int delta_recv_signatures(int sock, delta_sig_header *sh, delta_sig **sigs)
+{
+    *sigs = NULL;
+    if (recv_all(sock, sh, sizeof(*sh)) < 0) {
+        return -1;
+    }
+    if (sh->block_size == 0 || sh->count > DELTA_MAX_BLOCKS) {
+        printf("Invalid signatures: block size %" PRIu32 ", %" PRIu64 " blocks\n",
+               sh->block_size, sh->count);
+        return -1;
+    }
+    if (sh->count == 0) {
+        return 0;
+    }
+
+    *sigs = malloc(sh->count * sizeof(**sigs));
+    if (!*sigs) {
+        perror("malloc");
+        return -1;
+    }
+    if (recv_all(sock, *sigs, sh->count * sizeof(**sigs)) < 0) {
+        free(*sigs);
+        *sigs = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+ssize_t delta_send(file *f, int sock, delta_stats *stats)
+{
+    const size_t fsize = f->hdr.fsize;
+    const unsigned char *map = NULL;
+    delta_sig_header sh;
+    delta_sig *sigs;
+    delta_table t;
+    size_t bs, pos = 0, lit = 0;
+    uint32_t a = 0, b = 0;
+    int have_weak = 0, rc = -1;
+
+    stats->literal = stats->matched = 0;
+
+    if (file_send_header(f, sock) < 0
+        || delta_recv_signatures(sock, &sh, &sigs) < 0) {
+        return -1;
+    }
+    if (delta_table_init(&t, sigs, sh.count) < 0) {
+        free(sigs);
+        return -1;
+    }
+    bs = sh.block_size;
+
+    if (fsize > 0) {
+        map = mmap(NULL, fsize, PROT_READ, MAP_PRIVATE, f->fd, 0);
+        if (map == MAP_FAILED) {
+            perror("mmap");
+            map = NULL;
+            goto out;
+        }
+    }
+
+    while (sh.count > 0 && pos + bs <= fsize) {
+        size_t i, block;
+
+        if (!have_weak) {
+            a = b = 0;
+            for (i = 0; i < bs; i++) {
+                a += map[pos + i];
+                b += a;
+            }
+            have_weak = 1;
+        }
+
+        block = delta_table_find(&t, (a & 0xffff) | (b << 16), map + pos, bs);
+        if (block != DELTA_NONE) {
+            if (delta_send_literal(sock, map + lit, pos - lit) < 0
+                || delta_send_record(sock, DELTA_COPY, block, NULL) < 0) {
+                goto out;
+            }
+            stats->literal += pos - lit;
+            stats->matched += bs;
+            pos += bs;
+            progress_add(pos - lit);
+            lit = pos;
+            have_weak = 0;
+            continue;
+        }
+
+        if (pos + bs < fsize) {
+            a = a - map[pos] + map[pos + bs];
+            b = b - (uint32_t)bs * map[pos] + a;
+        }
+        pos++;
+
+        if (pos - lit == DELTA_LITERAL_MAX) {
+            if (delta_send_literal(sock, map + lit, pos - lit) < 0) {
+                goto out;
+            }
+            stats->literal += pos - lit;
+            progress_add(pos - lit);
+            lit = pos;
+        }
+    }
+
+    if (delta_send_literal(sock, map + lit, fsize - lit) < 0
+        || delta_send_record(sock, DELTA_END, fsize, NULL) < 0) {
+        goto out;
+    }
+    stats->literal += fsize - lit;
+    progress_add(fsize - lit);
+    rc = 0;
+
+out:
+    if (map) {
+        munmap((void*)map, fsize);
+    }
+    free(t.head);
+    free(t.next);
+    free(sigs);
+    return rc < 0 ? -1 : (ssize_t)fsize;
+}
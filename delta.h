@@ -0,0 +1,204 @@
+/**
+ * @file delta.h
+ * @brief Delta transfer of a file the receiver already has an old copy of
+ *
+ * The receiver splits its copy (the basis) into blocks and sends their
+ * signatures: a rolling weak checksum and a strong hash of each block.
+ * The sender slides a window over its file, and wherever the window
+ * matches a block of the basis, sends a reference to the block instead
+ * of the data. The negotiation goes as follows:
+ *
+ * 1. The sender sends the header with `FHDR_DELTA`.
+ * 2. The receiver replies with a `delta_sig_header` followed by `count`
+ *    `delta_sig`s, none if it has no basis.
+ * 3. The sender sends `delta_record`s: `DELTA_LITERAL` followed by `arg`
+ *    bytes of data, `DELTA_COPY` of basis block number `arg`, and finally
+ *    `DELTA_END` with the file size in `arg`.
+ *
+ * The receiver rebuilds the file into a temporary `.<name>.fling-delta`
+ * and renames it into place once it's complete, so an interrupted delta
+ * transfer leaves the old copy intact.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "file.h"
+
+/** Smallest block size, used for basis files of up to `DELTA_MAX_BLOCKS` of them */
+#define DELTA_BLOCK ((size_t)64 * 1024)
+
+/** Most blocks a basis is split into, larger files get larger blocks */
+#define DELTA_MAX_BLOCKS ((size_t)1 << 20)
+
+/** Largest amount of data sent with a single literal record */
+#define DELTA_LITERAL_MAX CHUNK_SIZE
+
+/** Types of `delta_record` */
+enum {
+    DELTA_LITERAL = 1,
+    DELTA_COPY    = 2,
+    DELTA_END     = 3,
+};
+
+/** Receiver's reply to a `FHDR_DELTA` header, followed by the signatures */
+typedef struct {
+    uint32_t block_size;
+    uint32_t reserved;
+    uint64_t count;      /**< Number of whole blocks in the basis */
+} delta_sig_header;
+
+/** Signature of a basis block */
+typedef struct {
+    uint32_t weak;       /**< See `delta_weak()` */
+    uint32_t reserved;
+    uint64_t strong;     /**< See `delta_strong()` */
+} delta_sig;
+
+/** Instruction for rebuilding the file on the receiving side */
+typedef struct {
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t arg;
+} delta_record;
+
+/** Numbers of a finished delta transfer */
+typedef struct {
+    size_t literal;  /**< Bytes sent as data */
+    size_t matched;  /**< Bytes taken from the receiver's copy */
+} delta_stats;
+
+/**
+ * Rolling checksum of a block, as in rsync
+ *
+ * @param buf Block data
+ * @param len Block length
+ *
+ * @return Checksum, the sum of the bytes in the low half and the sum
+ *         of the running sums in the high half
+ */
+uint32_t delta_weak(const unsigned char *buf, size_t len);
+
+/**
+ * Strong hash of a block, checked when the weak checksums match
+ *
+ * @param buf Block data
+ * @param len Block length
+ *
+ * @return 64-bit hash
+ */
+uint64_t delta_strong(const unsigned char *buf, size_t len);
+
+/**
+ * Make the name of the temporary file a delta transfer is rebuilt into
+ *
+ * @param buf   Buffer of `MAX_FILE_NAME + 1` bytes
+ * @param fname Name of the file being received
+ *
+ * @return 0 on success, -1 if the name would be too long
+ */
+int delta_temp_name(char *buf, const char *fname);
+
+/**
+ * Compute the signatures of a basis file
+ *
+ * @param basis Basis file descriptor, or -1 if there is no basis
+ * @param sh    Set to the signature header
+ * @param sigs  Set to a `malloc()`ed array of `sh->count` signatures
+ *
+ * @return 0 on success, -1 on error
+ */
+int delta_signatures(int basis, delta_sig_header *sh, delta_sig **sigs);
+
+/** Signatures of a basis being computed on a thread of their own */
+typedef struct delta_signer delta_signer;
+
+/**
+ * Start computing the signatures of a basis on a thread of their own
+ *
+ * Reading a large basis takes as long as the disk needs, so a thread
+ * serving other connections leaves it to a thread of its own and waits
+ * for `delta_signer_fd()` to become readable.
+ *
+ * @param basis Basis file descriptor, duplicated for the thread
+ *
+ * @return Signer to end with `delta_signer_free()`, or `NULL` on error
+ */
+delta_signer *delta_signer_start(int basis);
+
+/**
+ * Descriptor that becomes readable once the signatures are computed
+ *
+ * @param s Signer
+ *
+ * @return File descriptor
+ */
+int delta_signer_fd(const delta_signer *s);
+
+/**
+ * Take the signatures, if they are computed
+ *
+ * @param s    Signer
+ * @param sh   Set to the signature header
+ * @param sigs Set to a `malloc()`ed array of `sh->count` signatures,
+ *             now the caller's
+ *
+ * @return 1 if they are taken, 0 if they aren't computed yet, -1 if
+ *         computing them has failed
+ */
+int delta_signer_take(delta_signer *s, delta_sig_header *sh, delta_sig **sigs);
+
+/**
+ * Free a signer, leaving a thread still computing to finish on its own
+ *
+ * @param s Signer, or `NULL` to do nothing
+ */
+void delta_signer_free(delta_signer *s);
+
+/**
+ * Append a basis block to the file being rebuilt
+ *
+ * @param basis      Basis file descriptor
+ * @param fd         File being rebuilt, written at its current position
+ * @param offset     Offset of the block in the basis
+ * @param block_size Block length
+ *
+ * @return 0 on success, -1 on error
+ */
+int delta_copy_block(int basis, int fd, off_t offset, size_t block_size);
+
+/**
+ * Put the rebuilt file in place of the basis
+ *
+ * Gives the rebuilt file the permissions of the basis, if there is one,
+ * and renames it to the name of the file.
+ *
+ * @param f     File being received, with the rebuilt file open in `fd`
+ * @param basis Basis file descriptor, or -1
+ *
+ * @return 0 on success, -1 on error
+ */
+int delta_commit(const file *f, int basis);
+
+/**
+ * Remove the temporary file of an interrupted delta transfer
+ *
+ * @param f File being received
+ */
+void delta_abort(const file *f);
+
+/**
+ * Send a file as a delta against the receiver's copy
+ *
+ * Sends the `FHDR_DELTA` header, receives the signatures, and sends the
+ * records. Counts the part of the file each record covers in the progress.
+ *
+ * @param f     Opened file with a `FHDR_DELTA` header
+ * @param sock  Connected socket descriptor
+ * @param stats Set to the numbers of the transfer
+ *
+ * @return File size on success, -1 on error
+ */
+ssize_t delta_send(file *f, int sock, delta_stats *stats);
@@ -1,3 +1,6 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
 #include <inttypes.h>
 #include <libgen.h>
 #include <sys/stat.h>
@@ -5,11 +8,21 @@
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 
+#include "cache.h"
+#include "compress.h"
+#include "delta.h"
 #include "file.h"
 #include "fsock.h"
+#include "hash.h"
+#include "pipeline.h"
 #include "progress.h"
+#include "resume.h"
+#include "sparse.h"
+#include "tune.h"
+#include "uring.h"
 
 int file_open(file *f, char *fname)
 {
@@ -33,48 +46,294 @@ int file_open(file *f, char *fname)
     }
     strncpy(f->hdr.fname, basename(fname), sizeof(f->hdr.fname) - 1);
     f->hdr.fsize = (size_t)file_stat.st_size;
+    f->hdr.offset = 0;
+    f->hdr.length = f->hdr.fsize;
+    f->hdr.flags = 0;
+    f->hdr.mode = (uint32_t)file_stat.st_mode;
+    f->hdr.path_len = 0;
     f->fd = fd;
+    f->path = NULL;
     return 0;
 }
 
 /**
- * Send file contents over socket with progress tracking
+ * Send file contents over socket by copying them through a user buffer
  *
  * Reads the file in chunks and sends each chunk over the socket until
- * the entire file is transferred. Updates progress bar if callback is set.
+ * the entire range is transferred, counting it in the progress.
  * Uses `ftosock()` to handle the actual data transfer for each chunk.
+ * This is the fallback for systems and files where `sendfile()` can't be used.
+ *
+ * @param f      Pointer to file structure with open file descriptor
+ * @param sock   Socket descriptor to send data to
+ * @param offset File offset to continue from
+ * @param hash   Tree to hash the data into, or `NULL`
+ * @param cache  Cache window to move along
+ * @return       Total bytes sent on success, -1 on error
+ */
+static ssize_t file_send_contents_copy(file *f, int sock, off_t offset, hash_tree *hash,
+                                       cache_cursor *cache)
+{
+    char buf[CHUNK_SIZE];
+    size_t end = f->hdr.offset + f->hdr.length;
+
+    while ((size_t)offset < end) {
+        size_t left = end - (size_t)offset;
+        ssize_t bytes_sent = ftosock(f->fd, sock, &offset, buf,
+                                     CHUNK_SIZE <= left ? CHUNK_SIZE : left);
+        if (bytes_sent < 0) {
+            return -1;
+        }
+        if (hash) {
+            hash_tree_update(hash, buf, (size_t)bytes_sent);
+        }
+        cache_advance(cache, offset);
+        progress_add((size_t)bytes_sent);
+    }
+
+    return (ssize_t)f->hdr.length;
+}
+
+/**
+ * Send file contents over socket, reading them with `O_DIRECT`
+ *
+ * Used with `CACHE_DIRECT`, so sending a file doesn't evict anything
+ * from the page cache. The reads go through a descriptor of their own,
+ * the one shared with the other stripes stays buffered.
  *
  * @param f    Pointer to file structure with open file descriptor
  * @param sock Socket descriptor to send data to
- * @return     Total bytes sent on success, -1 on error
+ * @param hash Tree to hash the data into, or `NULL`
+ * @return     Total bytes sent on success, `FSOCK_UNSUPPORTED` if the file
+ *             can't be read with `O_DIRECT`, -1 on error
+ */
+static ssize_t file_send_contents_direct(file *f, int sock, hash_tree *hash)
+{
+    off_t pos = (off_t)f->hdr.offset, end = pos + (off_t)f->hdr.length;
+    ssize_t rc = (ssize_t)f->hdr.length;
+    char *buf;
+    int fd;
+
+    fd = cache_open_direct(f->fd, O_RDONLY);
+    if (fd < 0) {
+        return FSOCK_UNSUPPORTED;
+    }
+    buf = cache_alloc(CHUNK_SIZE);
+    if (buf == NULL) {
+        close(fd);
+        return -1;
+    }
+
+    while (pos < end) {
+        char *data;
+        ssize_t n = cache_read_direct(fd, buf, pos, end, &data);
+
+        if (n == FSOCK_UNSUPPORTED && pos == (off_t)f->hdr.offset) {
+            /* Nothing has been sent yet, another way will do */
+            rc = FSOCK_UNSUPPORTED;
+            break;
+        }
+        if (n < 0 || send_all(sock, data, (size_t)n) < 0) {
+            rc = -1;
+            break;
+        }
+        if (hash) {
+            hash_tree_update(hash, data, (size_t)n);
+        }
+        pos += n;
+        progress_add((size_t)n);
+    }
+
+    free(buf);
+    close(fd);
+    return rc;
+}
+
+/**
+ * Send file contents over socket with `sendfile()`
+ *
+ * Streams the `hdr.length` bytes at `hdr.offset` straight from the page
+ * cache with `ftosock_sendfile()`, one chunk per call so the progress
+ * keeps moving at the same pace. The chunk grows on fat paths with
+ * `tune_enabled`, see `tune_chunk()`. Falls back to `file_send_contents_copy()`
+ * from the current offset when zero-copy is not supported for this file
+ * or socket.
+ *
+ * With `hash` the range is mapped into memory, and every chunk is hashed
+ * from the mapping right after `sendfile()` has sent it, so the data is
+ * read from the disk only once. If it can't be mapped, the data is copied.
+ *
+ * @param f     Pointer to file structure with open file descriptor
+ * @param sock  Socket descriptor to send data to
+ * @param hash  Tree to hash the data into, or `NULL`
+ * @param cache Cache window to move along
+ * @return      Total bytes sent on success, -1 on error
  */
-static ssize_t file_send_contents(file *f, int sock)
+static ssize_t file_send_contents_sendfile(file *f, int sock, hash_tree *hash,
+                                           cache_cursor *cache)
 {
-    size_t offset = 0;
-    char buf[CHUNK_SIZE] = {0};
+    off_t offset = (off_t)f->hdr.offset;
+    size_t end = f->hdr.offset + f->hdr.length;
+    size_t map_len = 0;
+    off_t map_start = 0;
+    char *map = NULL;
+    ssize_t rc = (ssize_t)f->hdr.length;
 
-    while (offset < f->hdr.fsize) {
-        ssize_t bytes_sent = ftosock(f->fd, sock, buf, CHUNK_SIZE);
+    if (hash) {
+        map_start = offset & ~(off_t)(sysconf(_SC_PAGESIZE) - 1);
+        map_len = end - (size_t)map_start;
+        map = mmap(NULL, map_len, PROT_READ, MAP_SHARED, f->fd, map_start);
+        if (map == MAP_FAILED) {
+            return file_send_contents_copy(f, sock, offset, hash, cache);
+        }
+        posix_madvise(map, map_len, POSIX_MADV_SEQUENTIAL);
+    }
+
+    while ((size_t)offset < end) {
+        size_t left = end - (size_t)offset, chunk = tune_chunk();
+        off_t start = offset;
+        ssize_t bytes_sent = ftosock_sendfile(f->fd, sock, &offset,
+                                              chunk <= left ? chunk : left);
+        if (bytes_sent == FSOCK_UNSUPPORTED) {
+            rc = file_send_contents_copy(f, sock, offset, hash, cache);
+            break;
+        }
         if (bytes_sent < 0) {
-            return -1;
+            rc = -1;
+            break;
         }
-        offset += (size_t)bytes_sent;
-        if (progress_bar_callback) {
-            progress_bar_callback(offset, f->hdr.fsize);
+        if (hash) {
+            hash_tree_update(hash, map + (start - map_start), (size_t)bytes_sent);
         }
+        cache_advance(cache, offset);
+        progress_add((size_t)bytes_sent);
     }
 
-    return (ssize_t)offset;
+    if (map) {
+        munmap(map, map_len);
+    }
+    return rc;
+}
+
+/**
+ * Send file contents over socket with progress tracking
+ *
+ * With `FHDR_COMPRESS` the data goes through `compress_send()`, with
+ * `FHDR_SPARSE` through `sparse_send()`. Otherwise the io_uring engine
+ * is tried first with `uring_enabled`, then the file is read on a
+ * thread of its own with `pipeline_enabled`, and the rest goes through
+ * `file_send_contents_sendfile()`.
+ *
+ * `CACHE_DIRECT` reads the file with `O_DIRECT` instead, unless another
+ * engine is enabled or the file system doesn't allow it. Everything else
+ * follows the cache policy by dropping the pages behind the data sent.
+ *
+ * @param f    Pointer to file structure with open file descriptor
+ * @param sock Socket descriptor to send data to
+ * @param hash Tree to hash the data into, or `NULL`
+ * @return     Total bytes sent on success, -1 on error
+ */
+static ssize_t file_send_contents(file *f, int sock, hash_tree *hash)
+{
+    cache_cursor cache;
+    ssize_t rc = FSOCK_UNSUPPORTED;
+
+    if (f->hdr.length == 0) {
+        return 0;
+    }
+
+    if (cache_policy == CACHE_DIRECT && !(f->hdr.flags & (FHDR_COMPRESS | FHDR_SPARSE))
+        && !uring_enabled && !pipeline_enabled) {
+        rc = file_send_contents_direct(f, sock, hash);
+        if (rc != FSOCK_UNSUPPORTED) {
+            return rc;
+        }
+    }
+
+    cache_start(&cache, f->fd, (off_t)f->hdr.offset, f->hdr.length, 0);
+    if (f->hdr.flags & FHDR_COMPRESS) {
+        rc = compress_send(f, sock, hash);
+    } else if (f->hdr.flags & FHDR_SPARSE) {
+        rc = sparse_send(f, sock, hash, &cache);
+    } else if (uring_enabled) {
+        rc = uring_file_send(f, sock, hash);
+    }
+    if (rc == FSOCK_UNSUPPORTED && pipeline_enabled) {
+        rc = pipeline_file_send(f, sock, hash, &cache);
+    }
+    if (rc == FSOCK_UNSUPPORTED) {
+        rc = file_send_contents_sendfile(f, sock, hash, &cache);
+    }
+    cache_finish(&cache);
+    return rc;
+}
+
+int file_send_header(file *f, int sock)
+{
+    if (send_all(sock, &f->hdr, FHEADER_SIZE) < 0) {
+        return -1;
+    }
+    if (f->hdr.flags & FHDR_TREE
+        && send_all(sock, f->path, f->hdr.path_len) < 0) {
+        return -1;
+    }
+    if (f->hdr.flags & FHDR_RESUME && resume_negotiate(f, sock) < 0) {
+        return -1;
+    }
+    return 0;
 }
 
 ssize_t file_send(file *f, int sock)
 {
-    if (send(sock, &f->hdr, FHEADER_SIZE, 0) < 0) {
-        perror("send header");
+    hash_tree tree, *hash = f->hdr.flags & FHDR_HASH ? &tree : NULL;
+    ssize_t rc;
+
+    if (file_send_header(f, sock) < 0) {
+        return -1;
+    }
+
+    /* After the header, as resuming narrows the range */
+    if (f->hdr.flags & FHDR_RESUME) {
+        progress_set_total(progress_current, f->hdr.length);
+    }
+    if (hash) {
+        hash_tree_init(hash);
+    }
+    rc = file_send_contents(f, sock, hash);
+    if (rc >= 0 && hash && hash_send_trailer(hash, sock) < 0) {
         return -1;
     }
+    return rc;
+}
 
-    return file_send_contents(f, sock);
+/**
+ * Reserve disk space for the data about to be received
+ *
+ * Allocates the range in one go, so the file doesn't fragment growing
+ * extent by extent, and a full disk fails the transfer before any data
+ * moves. The file size is left as is, so an interrupted transfer doesn't
+ * look complete. Where the file system can't preallocate, the file
+ * grows as it's written.
+ *
+ * @param fd     File descriptor
+ * @param offset Start of the range
+ * @param length Range length
+ * @return 0 on success, -1 if there is no space for the range
+ */
+static int file_preallocate(int fd, off_t offset, size_t length)
+{
+#ifdef __linux__
+    if (length > 0 && fallocate(fd, FALLOC_FL_KEEP_SIZE, offset, (off_t)length) < 0
+        && (errno == ENOSPC || errno == EFBIG || errno == EDQUOT)) {
+        perror("fallocate");
+        return -1;
+    }
+#else
+    (void)fd;
+    (void)offset;
+    (void)length;
+#endif
+    return 0;
 }
 
 /**
@@ -84,18 +343,69 @@ ssize_t file_send(file *f, int sock)
  * If the file already exists, it will be truncated to zero length.
  * The file is created with standard permissions (0644).
  *
+ * A stripe must not destroy what the other stripes have written, so for
+ * `FHDR_STRIPE` the file is opened without truncation, sized to the full
+ * `hdr.fsize` and positioned at `hdr.offset`. A `FHDR_RESUME` file keeps
+ * its contents too, `resume_start()` takes care of it afterwards.
+ * A `FHDR_DELTA` file is created under its temporary name.
+ * The space for the data is reserved with `file_preallocate()`.
+ *
  * @param f Pointer to file structure with filename in header
  * @returns 0 on success, -1 on error
  */
 static int file_create(file *f)
 {
-    int fd = open(f->hdr.fname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    char name[MAX_FILE_NAME + 1];
+    struct stat file_stat;
+    int fd, flags = O_WRONLY | O_CREAT;
+
+    if (f->hdr.flags & FHDR_RESUME) {
+        /* The kept prefix is read back to checksum it */
+        flags = O_RDWR | O_CREAT;
+    } else if (!(f->hdr.flags & FHDR_STRIPE)) {
+        flags |= O_TRUNC;
+    }
+
+    if (f->hdr.flags & FHDR_DELTA) {
+        if (delta_temp_name(name, f->hdr.fname) < 0) {
+            printf("File name is too long for a delta transfer: %s\n", f->hdr.fname);
+            return -1;
+        }
+    } else {
+        strcpy(name, f->hdr.fname);
+    }
+
+    fd = open(name, flags, 0644);
     if (fd < 0) {
         perror("open");
         return -1;
     }
     f->fd = fd;
+
+    if (file_preallocate(fd, (off_t)f->hdr.offset, f->hdr.length) < 0) {
+        goto err;
+    }
+    if (!(f->hdr.flags & FHDR_STRIPE)) {
+        return 0;
+    }
+    if (fstat(fd, &file_stat) < 0) {
+        perror("fstat");
+        goto err;
+    }
+    if ((size_t)file_stat.st_size != f->hdr.fsize
+        && ftruncate(fd, (off_t)f->hdr.fsize) < 0) {
+        perror("ftruncate");
+        goto err;
+    }
+    if (lseek(fd, (off_t)f->hdr.offset, SEEK_SET) < 0) {
+        perror("lseek");
+        goto err;
+    }
     return 0;
+
+err:
+    file_close(f);
+    return -1;
 }
 
 void file_close(file *f)
@@ -104,72 +414,191 @@ void file_close(file *f)
     f->fd = 0;
 }
 
+void file_discard(const file *f)
+{
+    const char *name = f->hdr.flags & FHDR_TREE ? f->path : f->hdr.fname;
+
+    if (unlink(name) < 0 && errno != ENOENT) {
+        perror("unlink");
+    }
+}
+
 /**
- * Receive file data from socket and write to file
+ * Check that a tree entry path stays within the receiver's directory
  *
- * Reads data from the socket in chunks and writes it to the file
- * until the expected number of bytes (f->hdr.fsize) is received.
- * Uses socktof() to handle the actual data transfer for each chunk.
+ * The path must be relative, and each of its components must be a plain
+ * name: not empty, not `.` or `..`, and not longer than `MAX_FILE_NAME`.
  *
- * @param f Pointer to file structure with open file descriptor and size info
- * @param sock Socket descriptor to receive data from
- * @return Total bytes received on success, -1 on error
+ * @param path Null-terminated relative path
+ * @return 1 if the path is safe, 0 otherwise
  */
-static ssize_t file_receive_contents(file *f, int sock)
+static int tree_path_is_safe(const char *path)
 {
-    size_t left = f->hdr.fsize;
-    char buf[CHUNK_SIZE] = {0};
+    const char *p = path;
+
+    do {
+        const char *slash = strchr(p, '/');
+        size_t len = slash ? (size_t)(slash - p) : strlen(p);
 
-    while (left > 0) {
-        size_t chunk_size = CHUNK_SIZE <= left ? CHUNK_SIZE : left;
-        ssize_t bytes_read = socktof(sock, f->fd, buf, chunk_size);
-        if (bytes_read < 0) {
+        if (len == 0 || len > MAX_FILE_NAME
+            || (len == 1 && p[0] == '.')
+            || (len == 2 && p[0] == '.' && p[1] == '.')) {
+            return 0;
+        }
+        p = slash ? slash + 1 : NULL;
+    } while (p);
+
+    return 1;
+}
+
+/**
+ * Open the parent directory of a tree entry, creating it if needed
+ *
+ * Walks the path one component at a time with `openat()` and `O_NOFOLLOW`,
+ * creating the missing directories, so a symbolic link already present
+ * in the receiver's directory can't redirect the entry elsewhere.
+ *
+ * @param path Safe relative path, see `tree_path_is_safe()`
+ * @param name Set to the last component of the path
+ * @return Directory file descriptor on success, -1 on error
+ */
+static int tree_open_parent(const char *path, const char **name)
+{
+    char component[MAX_FILE_NAME + 1];
+    const char *p = path, *slash;
+    int dirfd = open(".", O_RDONLY | O_DIRECTORY);
+
+    while (dirfd >= 0 && (slash = strchr(p, '/')) != NULL) {
+        size_t len = (size_t)(slash - p);
+        int next;
+
+        memcpy(component, p, len);
+        component[len] = '\0';
+        if (mkdirat(dirfd, component, 0755) < 0 && errno != EEXIST) {
+            perror("mkdir");
+            close(dirfd);
             return -1;
         }
-        left -= (size_t)bytes_read;
+        next = openat(dirfd, component, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+        if (next < 0) {
+            perror("open directory");
+        }
+        close(dirfd);
+        dirfd = next;
+        p = slash + 1;
     }
-    return (ssize_t)f->hdr.fsize;
+    *name = p;
+    return dirfd;
 }
 
-ssize_t receive_file(int sock)
+/**
+ * Create a directory or a file of a tree entry
+ *
+ * @param f Pointer to file structure with a `FHDR_TREE` header and path
+ * @return 0 on success, -1 on error
+ */
+static int tree_create(file *f)
+{
+    mode_t perm = (mode_t)f->hdr.mode & 0777;
+    const char *name;
+    struct stat st;
+    int dirfd, rc = 0;
+
+    dirfd = tree_open_parent(f->path, &name);
+    if (dirfd < 0) {
+        return -1;
+    }
+
+    if (S_ISDIR(f->hdr.mode)) {
+        printf("Creating directory %s\n", f->path);
+        f->fd = -1;
+        if (mkdirat(dirfd, name, perm | 0700) < 0
+            && (errno != EEXIST
+                || fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) < 0
+                || !S_ISDIR(st.st_mode))) {
+            perror("mkdir");
+            rc = -1;
+        }
+    } else {
+        printf("Accepting file: name %s, size %zd...\n", f->path, f->hdr.fsize);
+        f->fd = openat(dirfd, name, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW, perm);
+        if (f->fd < 0) {
+            perror("open");
+            rc = -1;
+        } else if (file_preallocate(f->fd, 0, f->hdr.fsize) < 0) {
+            file_close(f);
+            rc = -1;
+        }
+    }
+
+    close(dirfd);
+    return rc;
+}
+
+int file_accept(file *f)
 {
-    ssize_t bytes_read, rc, retval;
-    file f = {0};
     char clean_name[MAX_FILE_NAME + 1];
     const char *base;
 
-    bytes_read = recv(sock, &f, FHEADER_SIZE, 0);
-    if (bytes_read <= 0 || (size_t)bytes_read < FHEADER_SIZE) {
-        printf("Unexpected amount of bytes: %zd\n", bytes_read);
+    f->hdr.fname[MAX_FILE_NAME] = '\0';
+
+    if ((f->hdr.flags & FHDR_SPARSE) && (f->hdr.flags & (FHDR_DELTA | FHDR_COMPRESS))) {
+        printf("Sparse transfers are neither compressed nor deltas: %s\n", f->hdr.fname);
         return -1;
     }
-    f.hdr.fname[MAX_FILE_NAME] = '\0';
 
-    base = basename(f.hdr.fname);
-    strncpy(clean_name, base, MAX_FILE_NAME);
-    clean_name[MAX_FILE_NAME] = '\0';
+    if (f->hdr.flags & FHDR_TREE) {
+        if ((f->hdr.flags & (FHDR_STRIPE | FHDR_RESUME | FHDR_DELTA))
+            || !(S_ISDIR(f->hdr.mode) || S_ISREG(f->hdr.mode))
+            || (S_ISDIR(f->hdr.mode) && f->hdr.fsize != 0)) {
+            printf("Invalid tree entry: %s\n", f->path);
+            return -1;
+        }
+        if (!tree_path_is_safe(f->path)) {
+            printf("Refusing unsafe path: %s\n", f->path);
+            return -1;
+        }
+        f->hdr.offset = 0;
+        f->hdr.length = f->hdr.fsize;
+        return tree_create(f);
+    }
 
-    strncpy(f.hdr.fname, clean_name, MAX_FILE_NAME);
+    if ((f->hdr.flags & FHDR_RESUME) && (f->hdr.flags & FHDR_STRIPE)) {
+        printf("Stripes can't be resumed: %s\n", f->hdr.fname);
+        return -1;
+    }
+    if ((f->hdr.flags & FHDR_DELTA)
+        && (f->hdr.flags & (FHDR_STRIPE | FHDR_RESUME | FHDR_COMPRESS | FHDR_HASH))) {
+        printf("Delta transfers are sent whole and unhashed: %s\n", f->hdr.fname);
+        return -1;
+    }
 
-    printf("Accepting file: name %s, size %zd...\n",
-           f.hdr.fname, f.hdr.fsize);
+    if (!(f->hdr.flags & FHDR_STRIPE)) {
+        f->hdr.offset = 0;
+        f->hdr.length = f->hdr.fsize;
+    } else if (f->hdr.offset > f->hdr.fsize
+               || f->hdr.length > f->hdr.fsize - f->hdr.offset) {
+        printf("Invalid stripe: offset %zu, length %zu, size %zu\n",
+               f->hdr.offset, f->hdr.length, f->hdr.fsize);
+        return -1;
+    }
 
-    retval = (ssize_t)f.hdr.fsize;
+    base = basename(f->hdr.fname);
+    strncpy(clean_name, base, MAX_FILE_NAME);
+    clean_name[MAX_FILE_NAME] = '\0';
 
-    rc = file_create(&f);
-    if (rc < 0) {
-        retval = rc;
-        goto ret;
-    }
-    rc = file_receive_contents(&f, sock);
-    if (rc < 0) {
-        retval = rc;
-        goto fclose;
+    strncpy(f->hdr.fname, clean_name, MAX_FILE_NAME);
+
+    if (f->hdr.flags & FHDR_STRIPE) {
+        printf("Accepting stripe: name %s, offset %zu, length %zu...\n",
+               f->hdr.fname, f->hdr.offset, f->hdr.length);
+    } else if (f->hdr.flags & FHDR_DELTA) {
+        printf("Accepting delta: name %s, size %zd...\n",
+               f->hdr.fname, f->hdr.fsize);
+    } else {
+        printf("Accepting file: name %s, size %zd...\n",
+               f->hdr.fname, f->hdr.fsize);
     }
-    printf("File %s received successfully\n", f.hdr.fname);
 
-fclose:
-    file_close(&f);
-ret:
-    return retval;
+    return file_create(f);
 }
@@ -4,30 +4,100 @@
 
 #define MAX_FILE_NAME 255
 
+/** Maximal length of a relative path within a directory tree */
+#define MAX_PATH_LEN  4096
+
+/** Header flag: the transfer carries only `length` bytes at `offset` */
+#define FHDR_STRIPE 0x1
+
+/**
+ * Header flag: an entry of a directory tree
+ *
+ * The header is followed by `path_len` bytes of the entry's path relative
+ * to the receiver's directory, and `mode` tells a directory from a file.
+ */
+#define FHDR_TREE   0x2
+
+/**
+ * Header flag: the transfer may continue a previously interrupted one
+ *
+ * The sender waits for the receiver's offer before sending the data,
+ * see `resume.h`.
+ */
+#define FHDR_RESUME 0x4
+
+/**
+ * Header flag: the file is sent as a delta against the receiver's copy
+ *
+ * See `delta.h`.
+ */
+#define FHDR_DELTA  0x8
+
+/**
+ * Header flag: the contents are sent as compressed blocks
+ *
+ * See `compress.h`.
+ */
+#define FHDR_COMPRESS 0x10
+
+/**
+ * Header flag: the data is followed by its hash for the receiver to verify
+ *
+ * See `hash.h`.
+ */
+#define FHDR_HASH   0x20
+
+/**
+ * Header flag: runs of zeros are sent as holes rather than data
+ *
+ * See `sparse.h`.
+ */
+#define FHDR_SPARSE 0x40
+
+/**
+ * Header flag: the files of a tree follow as interleaved frames
+ *
+ * The header has no file of its own, see `session.h`.
+ */
+#define FHDR_SESSION 0x80
+
 typedef struct {
-    char   fname[MAX_FILE_NAME + 1];
-    size_t fsize;
+    char     fname[MAX_FILE_NAME + 1];
+    size_t   fsize;
+    size_t   offset;
+    size_t   length;
+    uint32_t flags;
+    uint32_t mode;      /**< File type and permissions, as in `st_mode` */
+    uint32_t path_len;  /**< Length of the path following a `FHDR_TREE` header */
 } file_header;
 
 typedef struct {
     file_header hdr;
     int fd;
+    char *path;  /**< Null-terminated path of a `FHDR_TREE` entry */
 } file;
 
 #define FHEADER_SIZE (size_t)sizeof(file_header)
 #define CHUNK_SIZE   1024*256
 
 /**
- * Receive file with header from socket and save it
+ * Validate a received file header and create the file it describes
  *
- * @param sock Socket descriptor to receive data from
- * @return Size of received file in bytes on success, -1 on error
+ * Makes sure the file name is null-terminated and strips any directory
+ * components from it to prevent path traversal, checks that a stripe
+ * fits into the file, then creates (or, for a stripe, opens) the file
+ * and positions it at the start of the expected data.
  *
- * Receives the file header first, then creates a new file with the
- * received filename and writes the file contents to it. The function
- * handles the entire file receiving process, from header to content.
+ * A `FHDR_TREE` entry is created at `f->path` instead. The path must be
+ * relative and free of `.` and `..` components. Missing parent directories
+ * are created, and symbolic links on the way are never followed, so an
+ * entry can't escape the receiver's directory. Directory entries have
+ * no data; their file descriptor is set to -1.
+ *
+ * @param f Pointer to file structure with the received header
+ * @return 0 on success, -1 on error
  */
-ssize_t receive_file(int sock);
+int file_accept(file*);
 
 /**
  * Open a file and prepare its header for transfer
@@ -35,6 +105,8 @@ ssize_t receive_file(int sock);
  * Opens the specified file, reads its metadata (size), and populates
  * the file structure with filename and size information. The filename
  * is extracted from the path and copied to the header structure.
+ * The header describes the whole file; stripes adjust `offset`, `length`
+ * and `flags` afterwards.
  *
  * @param f     Pointer to file structure to be filled
  * @param fname Path to the file to be opened
@@ -52,14 +124,41 @@ int file_open  (file*, char*);
  */
 void file_close (file*);
 
+/**
+ * Remove a received file whose data can't be trusted
+ *
+ * Unlinks the file created by `file_accept()`, at `f->path` for a
+ * `FHDR_TREE` entry, so that a corrupted copy doesn't pass for a good
+ * one. Data still being written goes to the unlinked file.
+ *
+ * @param f File that has been accepted
+ */
+void file_discard(const file*);
+
+/**
+ * Send the file header
+ *
+ * Sends the header, followed by the path of a `FHDR_TREE` entry. With
+ * `FHDR_RESUME` also negotiates the range to send with the receiver.
+ *
+ * @param f    Pointer to file structure with prepared header
+ * @param sock Socket descriptor to send data to
+ * @return 0 on success, -1 on error
+ */
+int file_send_header(file*, int sock);
+
 /**
  * Send file header and contents over socket
  *
  * @param f Pointer to file structure with open file and prepared header
  * @param sock Socket descriptor to send data to
  *
- * First sends the file header containing filename and size information,
- * then sends the file contents by calling file_send_contents().
+ * First sends the file header with `file_send_header()`, then sends the
+ * file contents by calling file_send_contents(). Only the
+ * `hdr.length` bytes at `hdr.offset` are sent, so a copy of the structure
+ * with a narrowed range can be used to send a single stripe.
+ * With `FHDR_HASH` the data is hashed as it goes and followed by
+ * a `hash_trailer`.
  *
  * Return: Total bytes sent on success, -1 on error
  */
@@ -1,44 +1,277 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <sys/socket.h>
+#ifdef __linux__
+# include <sys/sendfile.h>
+#endif
 
 #include "fsock.h"
+#include "limit.h"
+#include "stats.h"
+
+ssize_t send_all(int sock, const void *buf, size_t length)
+{
+    size_t sent = 0;
+
+    while (sent < length) {
+        uint64_t start = stats_start();
+        ssize_t rc = send(sock, (const char*)buf + sent, length - sent, 0);
+
+        stats_stop(STATS_SEND, start, rc);
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("send");
+            return -1;
+        }
+        sent += (size_t)rc;
+        limit_wait((size_t)rc);
+    }
+    return (ssize_t)sent;
+}
+
+ssize_t recv_all(int sock, void *buf, size_t length)
+{
+    size_t received = 0;
+
+    while (received < length) {
+        uint64_t start = stats_start();
+        ssize_t rc = recv(sock, (char*)buf + received, length - received, 0);
+
+        stats_stop(STATS_RECV, start, rc);
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("recv");
+            return -1;
+        }
+        if (rc == 0) {
+            printf("recv: connection closed\n");
+            return -1;
+        }
+        received += (size_t)rc;
+    }
+    return (ssize_t)received;
+}
 
-ssize_t ftosock(int fd, int sock, char *buf, size_t length)
+ssize_t ftosock(int fd, int sock, off_t *offset, char *buf, size_t length)
 {
-    ssize_t bytes_read, bytes_sent;
+    uint64_t start = stats_start();
+    ssize_t bytes_read;
 
-    bytes_read = read(fd, buf, length);
+    bytes_read = pread(fd, buf, length, *offset);
+    stats_stop(STATS_READ, start, bytes_read);
     if (bytes_read <= 0) {
         if (bytes_read < 0) {
             perror("read");
         }
         return -1;
     }
+    *offset += bytes_read;
+
+    return send_all(sock, buf, (size_t)bytes_read);
+}
+
+ssize_t ftosock_sendfile(int fd, int sock, off_t *offset, size_t length)
+{
+#ifdef __linux__
+    ssize_t bytes_sent;
+
+    do {
+        uint64_t start = stats_start();
+
+        bytes_sent = sendfile(sock, fd, offset, length);
+        stats_stop(STATS_MOVE, start, bytes_sent);
+    } while (bytes_sent < 0 && errno == EINTR);
 
-    bytes_sent = send(sock, buf, (size_t)bytes_read, 0);
     if (bytes_sent < 0) {
-        perror("send");
+        if (errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP) {
+            return FSOCK_UNSUPPORTED;
+        }
+        perror("sendfile");
         return -1;
     }
+    if (bytes_sent == 0) {
+        fprintf(stderr, "sendfile: unexpected end of file\n");
+        return -1;
+    }
+    limit_wait((size_t)bytes_sent);
     return bytes_sent;
+#else
+    (void)fd;
+    (void)sock;
+    (void)offset;
+    (void)length;
+    return FSOCK_UNSUPPORTED;
+#endif
+}
+
+/**
+ * Write the whole buffer to file
+ *
+ * @param fd     File descriptor to write to
+ * @param buf    Buffer with the data
+ * @param length Number of bytes to write
+ *
+ * @return Number of bytes written on success, -1 on error
+ */
+static ssize_t write_all(int fd, const char *buf, size_t length)
+{
+    size_t written = 0;
+
+    while (written < length) {
+        uint64_t start = stats_start();
+        ssize_t rc = write(fd, buf + written, length - written);
+
+        stats_stop(STATS_WRITE, start, rc);
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("write");
+            return -1;
+        }
+        if (rc == 0) {
+            fprintf(stderr, "write: no space left\n");
+            return -1;
+        }
+        written += (size_t)rc;
+    }
+    return (ssize_t)written;
 }
 
 ssize_t socktof(int sock, int fd, char *buf, size_t length)
 {
-    ssize_t bytes_read, bytes_written;
+    uint64_t start = stats_start();
+    ssize_t bytes_read;
 
     bytes_read = recv(sock, buf, length, 0);
+    stats_stop(STATS_RECV, start, bytes_read);
+    if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return FSOCK_AGAIN;
+    }
     if (bytes_read <= 0) {
         perror("recv");
         return -1;
     }
 
-    bytes_written = write(fd, buf, (size_t)bytes_read);
-    if (bytes_written < 1) {
-        perror("write");
+    return write_all(fd, buf, (size_t)bytes_read);
+}
+
+int fsock_pipe_open(int pipefd[2], size_t size)
+{
+#ifdef __linux__
+    if (pipe(pipefd) < 0) {
+        return FSOCK_UNSUPPORTED;
+    }
+    /* Too big for `/proc/sys/fs/pipe-max-size` is fine, the default still works */
+    fcntl(pipefd[1], F_SETPIPE_SZ, (int)size);
+    return 0;
+#else
+    (void)pipefd;
+    (void)size;
+    return FSOCK_UNSUPPORTED;
+#endif
+}
+
+void fsock_pipe_close(int pipefd[2])
+{
+    close(pipefd[0]);
+    close(pipefd[1]);
+}
+
+#ifdef __linux__
+/**
+ * Move bytes stuck in the pipe to the file by copying them
+ *
+ * Used when the file doesn't accept `splice()` after the data has
+ * already been pulled from the socket into the pipe.
+ *
+ * @param pipefd Pipe holding the data
+ * @param fd     File descriptor to write to
+ * @param length Number of bytes in the pipe
+ *
+ * @return 0 on success, -1 on error
+ */
+static int pipe_drain(int pipefd[2], int fd, size_t length)
+{
+    char buf[64 * 1024];
+
+    while (length > 0) {
+        ssize_t rc = read(pipefd[0], buf, length < sizeof(buf) ? length : sizeof(buf));
+        if (rc <= 0) {
+            perror("read pipe");
+            return -1;
+        }
+        if (write_all(fd, buf, (size_t)rc) < 0) {
+            return -1;
+        }
+        length -= (size_t)rc;
+    }
+    return 0;
+}
+#endif
+
+ssize_t socktof_splice(int sock, int fd, int pipefd[2], size_t length)
+{
+#ifdef __linux__
+    ssize_t bytes_read;
+    size_t left;
+
+    do {
+        uint64_t start = stats_start();
+
+        bytes_read = splice(sock, NULL, pipefd[1], NULL, length,
+                            SPLICE_F_MOVE | SPLICE_F_MORE);
+        stats_stop(STATS_RECV, start, bytes_read);
+    } while (bytes_read < 0 && errno == EINTR);
+
+    if (bytes_read < 0 && (errno == EINVAL || errno == ENOSYS)) {
+        return FSOCK_UNSUPPORTED;
+    }
+    if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return FSOCK_AGAIN;
+    }
+    if (bytes_read < 0) {
+        perror("splice recv");
+        return -1;
+    }
+    if (bytes_read == 0) {
+        fprintf(stderr, "splice recv: connection closed\n");
         return -1;
     }
 
-    return bytes_written;
+    left = (size_t)bytes_read;
+    while (left > 0) {
+        uint64_t start = stats_start();
+        ssize_t bytes_written = splice(pipefd[0], NULL, fd, NULL, left,
+                                       SPLICE_F_MOVE | SPLICE_F_MORE);
+
+        stats_stop(STATS_WRITE, start, bytes_written);
+        if (bytes_written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EINVAL) {
+                return pipe_drain(pipefd, fd, left) < 0 ? -1 : bytes_read;
+            }
+            perror("splice write");
+            return -1;
+        }
+        left -= (size_t)bytes_written;
+    }
+    return bytes_read;
+#else
+    (void)sock;
+    (void)fd;
+    (void)pipefd;
+    (void)length;
+    return FSOCK_UNSUPPORTED;
+#endif
 }
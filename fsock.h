@@ -2,21 +2,77 @@
 
 #include <sys/types.h>
 
+/** Returned by zero-copy helpers when the kernel can't do it for the given descriptors */
+#define FSOCK_UNSUPPORTED -2
+
+/** Returned by receive helpers when a non-blocking socket has no data yet */
+#define FSOCK_AGAIN -3
+
+/**
+ * Send the whole buffer to socket
+ *
+ * `send()` on a blocking socket may still return less than requested
+ * (e.g. when interrupted by a signal), so keep sending the rest until
+ * the buffer is drained. The data counts against the calling thread's
+ * share of `--limit`, see `limit.h`.
+ *
+ * @param sock   Socket descriptor to send data to
+ * @param buf    Buffer with the data
+ * @param length Number of bytes to send
+ *
+ * @return Number of bytes sent on success, -1 on error
+ */
+ssize_t send_all(int sock, const void *buf, size_t length);
+
+/**
+ * Receive exactly `length` bytes from a blocking socket
+ *
+ * @param sock   Socket descriptor to receive from
+ * @param buf    Buffer for the data
+ * @param length Number of bytes to receive
+ *
+ * @return Number of bytes received on success, -1 on error or if the
+ *         connection is closed before all of them arrive
+ */
+ssize_t recv_all(int sock, void *buf, size_t length);
+
 /**
  * Read from file and send data to socket
  *
- * Reads up to `length` bytes from the file descriptor and sends
- * the data to the socket. This is the core transfer mechanism for
- * sending files over the network.
+ * Reads up to `length` bytes from the file descriptor at `*offset` and
+ * sends the data to the socket. This is the core transfer mechanism for
+ * sending files over the network. The file position of `fd` is not used,
+ * so several threads may send different parts of one file through it.
  *
  * @param fd     File descriptor to read from
  * @param sock   Socket descriptor to send data to
+ * @param offset File offset to read from, updated on return
  * @param buf    Buffer to use for the data transfer
  * @param length Maximum number of bytes to read/send (buffer size)
  *
  * @return Number of bytes sent on success, -1 on error
  */
-ssize_t ftosock(int fd, int sock, char *buf, size_t length);
+ssize_t ftosock(int fd, int sock, off_t *offset, char *buf, size_t length);
+
+/**
+ * Send file data to socket straight from the page cache
+ *
+ * Uses `sendfile()` to move up to `length` bytes starting at `*offset`
+ * from the file to the socket without copying them through user space.
+ * `*offset` is advanced by the number of bytes sent; the file position
+ * of `fd` is left untouched. The data counts against the calling
+ * thread's share of `--limit`, as with `send_all()`.
+ *
+ * @param fd     File descriptor to read from
+ * @param sock   Socket descriptor to send data to
+ * @param offset File offset to start from, updated on return
+ * @param length Maximum number of bytes to send
+ *
+ * @return Number of bytes sent on success, `FSOCK_UNSUPPORTED` if zero-copy
+ *         is not available for these descriptors (the caller should fall
+ *         back to `ftosock()`), -1 on error
+ */
+ssize_t ftosock_sendfile(int fd, int sock, off_t *offset, size_t length);
 
 /**
  * Receive data from socket and write to file
@@ -30,6 +86,47 @@ ssize_t ftosock(int fd, int sock, char *buf, size_t length);
  * @param buf    Buffer to use for the data transfer
  * @param length Maximum number of bytes to receive/write (buffer size)
  *
- * @return Number of bytes written to file on success, -1 on error
+ * @return Number of bytes written to file on success, `FSOCK_AGAIN` if
+ *         a non-blocking socket has no data, -1 on error
  */
 ssize_t socktof(int sock, int fd, char *buf, size_t length);
+
+/**
+ * Create a pipe for `socktof_splice()`
+ *
+ * Creates a pipe and tries to enlarge its buffer to `size` bytes
+ * with `F_SETPIPE_SZ`, so a single `splice()` can move a whole chunk.
+ * Failing to enlarge it is not an error.
+ *
+ * @param pipefd Array to store the read and write ends of the pipe
+ * @param size   Desired pipe buffer size
+ *
+ * @return 0 on success, `FSOCK_UNSUPPORTED` if the pipe can't be used
+ */
+int fsock_pipe_open(int pipefd[2], size_t size);
+
+/**
+ * Close both ends of a pipe created with `fsock_pipe_open()`
+ *
+ * @param pipefd Pipe to close
+ */
+void fsock_pipe_close(int pipefd[2]);
+
+/**
+ * Receive data from socket and write to file without copying to user space
+ *
+ * Moves up to `length` bytes from the socket into the pipe and then from
+ * the pipe into the file with `splice()`, so the data never crosses into
+ * user space. The pipe is empty again on return.
+ *
+ * @param sock   Socket descriptor to receive data from
+ * @param fd     File descriptor to write to
+ * @param pipefd Pipe from `fsock_pipe_open()`
+ * @param length Maximum number of bytes to receive/write
+ *
+ * @return Number of bytes written to file on success, `FSOCK_UNSUPPORTED`
+ *         if `splice()` is not available for the socket (nothing has been
+ *         received then, so the caller may fall back to `socktof()`),
+ *         `FSOCK_AGAIN` if a non-blocking socket has no data, -1 on error
+ */
+ssize_t socktof_splice(int sock, int fd, int pipefd[2], size_t length);
@@ -0,0 +1,452 @@
+#include <pthread.h>
+#include <string.h>
+
+#include "fsock.h"
+#include "hash.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+# define HASH_X86 1
+# include <immintrin.h>
+#endif
+
+#define XXH_PRIME1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME3 0x165667B19E3779F9ULL
+#define XXH_PRIME4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME5 0x27D4EB2F165667C5ULL
+#define XXH_PRIME32 0x9E3779B1U
+
+/** Stripes accumulated between two scrambles of the lanes */
+#define HASH_BLOCK_STRIPES 16
+
+/** Words of the key material: a key per stripe of a block, then the scramble key */
+#define HASH_SECRET_WORDS (HASH_BLOCK_STRIPES + 8)
+
+/** Tells the inner nodes of a Merkle tree from leaves of the same bytes */
+#define HASH_NODE_TAG 0x6e6f6465ULL
+
+/**
+ * Accumulate stripes into the lanes
+ *
+ * @param acc     Lane accumulators
+ * @param p       Data, `stripes * HASH_STRIPE` bytes
+ * @param stripes Number of stripes, at most `HASH_BLOCK_STRIPES - first`
+ * @param first   Position of the first stripe within its block
+ */
+typedef void (*hash_accumulate_func)(uint64_t acc[4], const unsigned char *p,
+                                     size_t stripes, size_t first);
+
+/** Key material, the same on every host */
+static uint64_t hash_secret[HASH_SECRET_WORDS];
+
+static hash_accumulate_func hash_accumulate;
+
+static pthread_once_t hash_once = PTHREAD_ONCE_INIT;
+
+static uint64_t rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t read64(const unsigned char *p)
+{
+    uint64_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint64_t xxh_round(uint64_t acc, uint64_t input)
+{
+    acc += input * XXH_PRIME2;
+    return rotl64(acc, 31) * XXH_PRIME1;
+}
+
+static void accumulate_scalar(uint64_t acc[4], const unsigned char *p,
+                              size_t stripes, size_t first)
+{
+    const uint64_t *key = hash_secret + first;
+    size_t s;
+    int i;
+
+    for (s = 0; s < stripes; s++, p += HASH_STRIPE, key++) {
+        for (i = 0; i < 4; i++) {
+            uint64_t d = read64(p + 8 * i), dk = d ^ key[i];
+
+            acc[i ^ 1] += d;
+            acc[i] += (dk & 0xffffffff) * (dk >> 32);
+        }
+    }
+}
+
+#ifdef HASH_X86
+
+__attribute__((target("sse2")))
+static void accumulate_sse2(uint64_t acc[4], const unsigned char *p,
+                            size_t stripes, size_t first)
+{
+    __m128i a0 = _mm_loadu_si128((const __m128i*)acc);
+    __m128i a1 = _mm_loadu_si128((const __m128i*)(acc + 2));
+    const uint64_t *key = hash_secret + first;
+    size_t s;
+
+    for (s = 0; s < stripes; s++, p += HASH_STRIPE, key++) {
+        __m128i d0 = _mm_loadu_si128((const __m128i*)p);
+        __m128i d1 = _mm_loadu_si128((const __m128i*)(p + 16));
+        __m128i k0 = _mm_xor_si128(d0, _mm_loadu_si128((const __m128i*)key));
+        __m128i k1 = _mm_xor_si128(d1, _mm_loadu_si128((const __m128i*)(key + 2)));
+
+        a0 = _mm_add_epi64(a0, _mm_shuffle_epi32(d0, _MM_SHUFFLE(1, 0, 3, 2)));
+        a1 = _mm_add_epi64(a1, _mm_shuffle_epi32(d1, _MM_SHUFFLE(1, 0, 3, 2)));
+        a0 = _mm_add_epi64(a0, _mm_mul_epu32(k0, _mm_srli_epi64(k0, 32)));
+        a1 = _mm_add_epi64(a1, _mm_mul_epu32(k1, _mm_srli_epi64(k1, 32)));
+    }
+    _mm_storeu_si128((__m128i*)acc, a0);
+    _mm_storeu_si128((__m128i*)(acc + 2), a1);
+}
+
+__attribute__((target("avx2")))
+static void accumulate_avx2(uint64_t acc[4], const unsigned char *p,
+                            size_t stripes, size_t first)
+{
+    __m256i a = _mm256_loadu_si256((const __m256i*)acc);
+    const uint64_t *key = hash_secret + first;
+    size_t s;
+
+    for (s = 0; s < stripes; s++, p += HASH_STRIPE, key++) {
+        __m256i d = _mm256_loadu_si256((const __m256i*)p);
+        __m256i dk = _mm256_xor_si256(d, _mm256_loadu_si256((const __m256i*)key));
+
+        /* Swapping the 64-bit halves of each 128-bit lane adds lane i^1 */
+        a = _mm256_add_epi64(a, _mm256_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2)));
+        a = _mm256_add_epi64(a, _mm256_mul_epu32(dk, _mm256_srli_epi64(dk, 32)));
+    }
+    _mm256_storeu_si256((__m256i*)acc, a);
+}
+
+#endif /* HASH_X86 */
+
+/**
+ * Fill the key material and pick the best kernel
+ *
+ * The key material comes from splitmix64 with a fixed seed, so that
+ * both ends of a transfer agree on it without shipping a table.
+ */
+static void hash_setup(void)
+{
+    uint64_t x = XXH_PRIME5;
+    int i;
+
+    for (i = 0; i < HASH_SECRET_WORDS; i++) {
+        uint64_t z = (x += 0x9E3779B97F4A7C15ULL);
+
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        hash_secret[i] = z ^ (z >> 31);
+    }
+
+    hash_accumulate = accumulate_scalar;
+#ifdef HASH_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        hash_accumulate = accumulate_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        hash_accumulate = accumulate_sse2;
+    }
+#endif
+}
+
+int hash_use_kernel(hash_kernel kernel)
+{
+    pthread_once(&hash_once, hash_setup);
+
+    switch (kernel) {
+    case HASH_KERNEL_SCALAR:
+        hash_accumulate = accumulate_scalar;
+        return 0;
+#ifdef HASH_X86
+    case HASH_KERNEL_SSE2:
+        if (__builtin_cpu_supports("sse2")) {
+            hash_accumulate = accumulate_sse2;
+            return 0;
+        }
+        break;
+    case HASH_KERNEL_AVX2:
+        if (__builtin_cpu_supports("avx2")) {
+            hash_accumulate = accumulate_avx2;
+            return 0;
+        }
+        break;
+#endif
+    default:
+        break;
+    }
+    return -1;
+}
+
+/**
+ * Mix the lanes at the end of a block
+ *
+ * @param acc Lane accumulators
+ */
+static void hash_scramble(uint64_t acc[4])
+{
+    const uint64_t *key = hash_secret + HASH_BLOCK_STRIPES + 4;
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        acc[i] ^= acc[i] >> 47;
+        acc[i] ^= key[i];
+        acc[i] *= XXH_PRIME32;
+    }
+}
+
+/**
+ * Accumulate whole stripes, scrambling the lanes at block boundaries
+ *
+ * @param st      Hash state
+ * @param p       Data
+ * @param stripes Number of stripes in the data
+ */
+static void hash_stripes(hash_state *st, const unsigned char *p, size_t stripes)
+{
+    while (stripes > 0) {
+        size_t n = HASH_BLOCK_STRIPES - st->stripes;
+
+        if (n > stripes) {
+            n = stripes;
+        }
+        hash_accumulate(st->acc, p, n, st->stripes);
+        p += n * HASH_STRIPE;
+        stripes -= n;
+        st->stripes += n;
+        if (st->stripes == HASH_BLOCK_STRIPES) {
+            hash_scramble(st->acc);
+            st->stripes = 0;
+        }
+    }
+}
+
+void hash64_init(hash_state *st)
+{
+    pthread_once(&hash_once, hash_setup);
+
+    st->acc[0] = XXH_PRIME1;
+    st->acc[1] = XXH_PRIME2;
+    st->acc[2] = XXH_PRIME3;
+    st->acc[3] = XXH_PRIME4;
+    st->total = 0;
+    st->stripes = 0;
+    st->buffered = 0;
+}
+
+void hash64_update(hash_state *st, const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+    size_t stripes;
+
+    st->total += len;
+    if (st->buffered > 0) {
+        size_t n = HASH_STRIPE - st->buffered;
+
+        if (n > len) {
+            n = len;
+        }
+        memcpy(st->buf + st->buffered, p, n);
+        st->buffered += n;
+        p += n;
+        len -= n;
+        if (st->buffered < HASH_STRIPE) {
+            return;
+        }
+        hash_stripes(st, st->buf, 1);
+        st->buffered = 0;
+    }
+
+    stripes = len / HASH_STRIPE;
+    hash_stripes(st, p, stripes);
+    p += stripes * HASH_STRIPE;
+    len -= stripes * HASH_STRIPE;
+
+    memcpy(st->buf, p, len);
+    st->buffered = len;
+}
+
+/* Lanes are merged and the tail is mixed in the way of XXH64 */
+uint64_t hash64_digest(const hash_state *st)
+{
+    const unsigned char *p = st->buf, *end = st->buf + st->buffered;
+    uint64_t h = st->total * XXH_PRIME1 + XXH_PRIME5;
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        h ^= xxh_round(0, st->acc[i]);
+        h = rotl64(h, 27) * XXH_PRIME1 + XXH_PRIME4;
+    }
+    while (p + 8 <= end) {
+        h ^= xxh_round(0, read64(p));
+        h = rotl64(h, 27) * XXH_PRIME1 + XXH_PRIME4;
+        p += 8;
+    }
+    if (p + 4 <= end) {
+        uint32_t v;
+
+        memcpy(&v, p, sizeof(v));
+        h ^= (uint64_t)v * XXH_PRIME1;
+        h = rotl64(h, 23) * XXH_PRIME2 + XXH_PRIME3;
+        p += 4;
+    }
+    while (p < end) {
+        h ^= *p * XXH_PRIME5;
+        h = rotl64(h, 11) * XXH_PRIME1;
+        p++;
+    }
+
+    h ^= h >> 33;
+    h *= XXH_PRIME2;
+    h ^= h >> 29;
+    h *= XXH_PRIME3;
+    h ^= h >> 32;
+    return h;
+}
+
+uint64_t hash64(const void *buf, size_t len)
+{
+    hash_state st;
+
+    hash64_init(&st);
+    hash64_update(&st, buf, len);
+    return hash64_digest(&st);
+}
+
+/**
+ * Hash of an inner node of a Merkle tree
+ *
+ * @param left  Hash of the left subtree
+ * @param right Hash of the right subtree
+ *
+ * @return Hash of the node
+ */
+static uint64_t hash_node(uint64_t left, uint64_t right)
+{
+    uint64_t node[3] = {left, right, HASH_NODE_TAG};
+
+    return hash64(node, sizeof(node));
+}
+
+void hash_tree_init(hash_tree *t)
+{
+    hash64_init(&t->leaf);
+    t->leaf_len = 0;
+    t->leaves = 0;
+    t->depth = 0;
+}
+
+/*
+ * The subtrees on the stack are complete and get smaller towards the
+ * top, like the bits of the leaf count: adding a leaf merges the equal
+ * subtrees it completes, the way a carry propagates.
+ */
+void hash_tree_add_leaf(hash_tree *t, uint64_t leaf)
+{
+    uint64_t n;
+
+    for (n = t->leaves; n & 1; n >>= 1) {
+        leaf = hash_node(t->stack[--t->depth], leaf);
+    }
+    t->stack[t->depth++] = leaf;
+    t->leaves++;
+}
+
+void hash_tree_update(hash_tree *t, const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+
+    while (len > 0) {
+        size_t n = HASH_LEAF - t->leaf_len;
+
+        if (n > len) {
+            n = len;
+        }
+        hash64_update(&t->leaf, p, n);
+        t->leaf_len += n;
+        p += n;
+        len -= n;
+        if (t->leaf_len == HASH_LEAF) {
+            hash_tree_add_leaf(t, hash64_digest(&t->leaf));
+            hash64_init(&t->leaf);
+            t->leaf_len = 0;
+        }
+    }
+}
+
+/** Block of zeros to hash holes from */
+static const unsigned char hash_zeros[4096];
+
+/** Hash of a whole leaf of zeros */
+static uint64_t hash_zero_leaf;
+static pthread_once_t hash_zero_leaf_once = PTHREAD_ONCE_INIT;
+
+static void hash_zero_leaf_init(void)
+{
+    hash_state st;
+    size_t i;
+
+    hash64_init(&st);
+    for (i = 0; i < HASH_LEAF; i += sizeof(hash_zeros)) {
+        hash64_update(&st, hash_zeros, sizeof(hash_zeros));
+    }
+    hash_zero_leaf = hash64_digest(&st);
+}
+
+/* Whole leaves of zeros all hash the same, so a long run costs next to nothing */
+void hash_tree_update_zeros(hash_tree *t, uint64_t len)
+{
+    pthread_once(&hash_zero_leaf_once, hash_zero_leaf_init);
+
+    while (len > 0) {
+        size_t n = sizeof(hash_zeros);
+
+        if (t->leaf_len == 0 && len >= HASH_LEAF) {
+            hash_tree_add_leaf(t, hash_zero_leaf);
+            len -= HASH_LEAF;
+            continue;
+        }
+        if (n > HASH_LEAF - t->leaf_len) {
+            n = HASH_LEAF - t->leaf_len;
+        }
+        if (n > len) {
+            n = (size_t)len;
+        }
+        hash_tree_update(t, hash_zeros, n);
+        len -= n;
+    }
+}
+
+/* An empty range is a single empty leaf */
+void hash_tree_finish(hash_tree *t, hash_trailer *tr)
+{
+    uint64_t root;
+    unsigned i;
+
+    if (t->leaf_len > 0 || t->leaves == 0) {
+        hash_tree_add_leaf(t, hash64_digest(&t->leaf));
+        hash64_init(&t->leaf);
+        t->leaf_len = 0;
+    }
+
+    root = t->stack[t->depth - 1];
+    for (i = t->depth - 1; i > 0; i--) {
+        root = hash_node(t->stack[i - 1], root);
+    }
+    tr->leaves = t->leaves;
+    tr->root = root;
+}
+
+int hash_send_trailer(hash_tree *t, int sock)
+{
+    hash_trailer tr;
+
+    hash_tree_finish(t, &tr);
+    return send_all(sock, &tr, sizeof(tr)) < 0 ? -1 : 0;
+}
@@ -0,0 +1,178 @@
+/**
+ * @file hash.h
+ * @brief Integrity hashing of the data in transit
+ *
+ * With `FHDR_HASH` both sides hash the transferred range while it
+ * streams: every `HASH_LEAF` bytes of it with `hash64()`, and these leaf
+ * hashes into a binary Merkle tree. After the data the sender sends a
+ * `hash_trailer` with the number of leaves and the root of the tree. The
+ * receiver compares it with its own before reporting success; on
+ * mismatch it replies with a single `HASH_MISMATCH` byte and drops the
+ * connection.
+ *
+ * Leaves don't depend on each other, so they can be hashed on several
+ * threads and added to the tree in order afterwards, and every stripe
+ * of a file is a tree of its own, checked independently.
+ *
+ * `hash64()` accumulates 32-byte stripes in four 64-bit lanes, the way
+ * XXH3 does, which maps onto SIMD registers. The lanes are processed by
+ * an SSE2 or AVX2 kernel when the CPU has one, picked at runtime; all
+ * kernels give the same result.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "file.h"
+
+/** Amount of data hashed into a single leaf */
+#define HASH_LEAF ((size_t)(CHUNK_SIZE))
+
+/** Bytes processed by one step of the lane accumulators */
+#define HASH_STRIPE 32
+
+/** Deepest Merkle tree, enough for 2^64 leaves */
+#define HASH_MAX_DEPTH 64
+
+/** Receiver's reply when the hash of the data doesn't match */
+#define HASH_MISMATCH 0xff
+
+/** Implementations of the lane accumulators */
+typedef enum {
+    HASH_KERNEL_SCALAR,
+    HASH_KERNEL_SSE2,
+    HASH_KERNEL_AVX2,
+} hash_kernel;
+
+/** State of an incremental `hash64()` */
+typedef struct {
+    uint64_t      acc[4];
+    uint64_t      total;     /**< Bytes hashed so far */
+    size_t        stripes;   /**< Stripes accumulated since the last scramble */
+    size_t        buffered;  /**< Bytes waiting in `buf` for a whole stripe */
+    unsigned char buf[HASH_STRIPE];
+} hash_state;
+
+/** Incremental Merkle tree over the leaves of a range */
+typedef struct {
+    hash_state leaf;        /**< Hash of the leaf being filled */
+    size_t     leaf_len;    /**< Bytes in the leaf being filled */
+    uint64_t   leaves;      /**< Number of completed leaves */
+    unsigned   depth;       /**< Number of subtrees in `stack` */
+    uint64_t   stack[HASH_MAX_DEPTH]; /**< Roots of the complete subtrees, largest first */
+} hash_tree;
+
+/** Sent after the data of a `FHDR_HASH` range */
+typedef struct {
+    uint64_t leaves;  /**< Number of leaves in the tree */
+    uint64_t root;    /**< Root of the tree */
+} hash_trailer;
+
+/**
+ * Switch the lane accumulators to the given implementation
+ *
+ * The best kernel the CPU supports is picked on first use; this is
+ * meant for tests and benchmarks.
+ *
+ * @param kernel Kernel to use
+ *
+ * @return 0 on success, -1 if the CPU or the build doesn't support it
+ */
+int hash_use_kernel(hash_kernel kernel);
+
+/**
+ * Start an incremental hash
+ *
+ * @param st State to initialize
+ */
+void hash64_init(hash_state *st);
+
+/**
+ * Add data to an incremental hash
+ *
+ * @param st  Hash state
+ * @param buf Data
+ * @param len Data length
+ */
+void hash64_update(hash_state *st, const void *buf, size_t len);
+
+/**
+ * Get the hash of all the data added so far
+ *
+ * @param st Hash state, left unchanged
+ *
+ * @return 64-bit hash
+ */
+uint64_t hash64_digest(const hash_state *st);
+
+/**
+ * Hash a buffer in one go
+ *
+ * @param buf Data
+ * @param len Data length
+ *
+ * @return Same as `hash64_update()` of the whole buffer and `hash64_digest()`
+ */
+uint64_t hash64(const void *buf, size_t len);
+
+/**
+ * Start a Merkle tree for a range
+ *
+ * @param t Tree to initialize
+ */
+void hash_tree_init(hash_tree *t);
+
+/**
+ * Hash the next part of the range
+ *
+ * The data is split into leaves of `HASH_LEAF` bytes counted from the
+ * start of the range, however it's divided between the calls.
+ *
+ * @param t   Tree
+ * @param buf Data
+ * @param len Data length
+ */
+void hash_tree_update(hash_tree *t, const void *buf, size_t len);
+
+/**
+ * Hash a run of zeros as the next part of the range
+ *
+ * Same as `hash_tree_update()` of that many zero bytes, for the holes
+ * of a sparse file.
+ *
+ * @param t   Tree
+ * @param len Number of zero bytes
+ */
+void hash_tree_update_zeros(hash_tree *t, uint64_t len);
+
+/**
+ * Add the hash of a leaf computed elsewhere
+ *
+ * Lets the leaves of a range be hashed in parallel with `hash64()`. Must
+ * not be mixed with a partial leaf from `hash_tree_update()`, and only the
+ * last leaf of the range may be shorter than `HASH_LEAF`.
+ *
+ * @param t    Tree
+ * @param leaf Hash of the next leaf
+ */
+void hash_tree_add_leaf(hash_tree *t, uint64_t leaf);
+
+/**
+ * Complete the tree and fill the trailer
+ *
+ * @param t  Tree, completed on return
+ * @param tr Set to the number of leaves and the root
+ */
+void hash_tree_finish(hash_tree *t, hash_trailer *tr);
+
+/**
+ * Complete the tree and send the trailer
+ *
+ * @param t    Tree of the data that has been sent
+ * @param sock Socket descriptor
+ *
+ * @return 0 on success, -1 on error
+ */
+int hash_send_trailer(hash_tree *t, int sock);
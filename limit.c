@@ -0,0 +1,286 @@
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "limit.h"
+#include "progress.h"
+#include "tune.h"
+
+int limit_enabled = 0;
+_Atomic uint64_t limit_rate = 0;
+_Thread_local limit_flow *limit_current = NULL;
+
+/** Tokens a flow gets between looks at the rate while there's no limit */
+#define LIMIT_UNLIMITED ((int64_t)16 * 1024 * 1024)
+
+/** File to read the rate from, or `NULL` */
+static const char *limit_file;
+
+/** What was wrong with it last time, an `errno`, -1 for no rate, 0 for nothing */
+static int limit_file_error;
+
+/** Lock of the flows and the sharing out */
+static pthread_mutex_t limit_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Flows of the process */
+static limit_flow *limit_flows;
+static size_t limit_nflows;
+
+/** When to share out the rate next, ns, 0 for as soon as possible */
+static _Atomic uint64_t limit_next;
+
+/** When it was last shared out, ns */
+static uint64_t limit_last;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * Read the rate from `limit_file`
+ *
+ * A file that can't be read or holds no rate leaves the rate as it was.
+ * As it's read 10 times a second, that is reported only once, until the
+ * file is right again or wrong in another way. Called with the lock
+ * held, or before any transfer.
+ *
+ * @return 0 on success, -1 on error
+ */
+static int limit_read_file(void)
+{
+    char text[64];
+    size_t rate, n;
+    FILE *fp;
+
+    fp = fopen(limit_file, "r");
+    if (fp == NULL) {
+        if (errno != limit_file_error) {
+            limit_file_error = errno;
+            perror(limit_file);
+        }
+        return -1;
+    }
+    n = fread(text, 1, sizeof(text) - 1, fp);
+    fclose(fp);
+    text[n] = '\0';
+    while (n > 0 && isspace((unsigned char)text[n - 1])) {
+        text[--n] = '\0';
+    }
+    rate = strcmp(text, "0") == 0 ? 0 : tune_parse_size(text);
+    if (rate == 0 && strcmp(text, "0") != 0) {
+        if (limit_file_error != -1) {
+            limit_file_error = -1;
+            printf("Incorrect rate '%s' in %s\n", text, limit_file);
+        }
+        return -1;
+    }
+    limit_file_error = 0;
+    if (rate != atomic_load(&limit_rate)) {
+        if (rate) {
+            printf("Bandwidth limit: %.2f MB/s\n", (double)rate / SIZE_MB);
+        } else {
+            printf("Bandwidth limit: none\n");
+        }
+        atomic_store(&limit_rate, rate);
+    }
+    return 0;
+}
+
+int limit_parse(const char *arg)
+{
+    if (arg[0] == '@') {
+        limit_file = arg + 1;
+        if (limit_read_file() < 0) {
+            return -1;
+        }
+    } else {
+        size_t rate = tune_parse_size(arg);
+
+        if (rate == 0) {
+            printf("Incorrect rate '%s'\n", arg);
+            return -1;
+        }
+        atomic_store(&limit_rate, rate);
+    }
+    limit_enabled = 1;
+    return 0;
+}
+
+/**
+ * Share the rate out between the flows, max-min fair
+ *
+ * Flows that haven't had to wait and used less than `LIMIT_BUSY` of their
+ * share keep what they used with `LIMIT_HEADROOM`, the others split the
+ * rest evenly. Called with the lock held.
+ *
+ * @param now Current time, ns
+ */
+static void limit_share(uint64_t now)
+{
+    double interval = limit_last ? (double)(now - limit_last) / 1e9 : 0;
+    double left, fair;
+    uint64_t rate, floor;
+    size_t open = limit_nflows;
+    limit_flow *l;
+    int changed;
+
+    if (limit_file) {
+        limit_read_file();
+    }
+    rate = atomic_load(&limit_rate);
+    if (limit_nflows == 0) {
+        return;
+    }
+    if (rate == 0) {
+        for (l = limit_flows; l; l = l->next) {
+            atomic_store(&l->share, 0);
+            l->seen = atomic_load(&l->used);
+        }
+        return;
+    }
+
+    /* An idle flow keeps a little, to be seen wanting more once it isn't */
+    floor = rate / (limit_nflows * 8) + 1;
+    for (l = limit_flows; l; l = l->next) {
+        uint64_t used = atomic_load(&l->used), share = atomic_load(&l->share);
+        double demand = interval > 0 ? (double)(used - l->seen) / interval : 0;
+
+        l->seen = used;
+        l->fixed = 0;
+        l->demand = share == 0 || interval == 0 || atomic_exchange(&l->waited, 0)
+                    || demand >= LIMIT_BUSY * (double)share ? -1 : demand * LIMIT_HEADROOM;
+    }
+
+    /* Water-filling: fix the flows wanting less than an even split */
+    left = (double)rate;
+    do {
+        changed = 0;
+        fair = left / (double)open;
+        for (l = limit_flows; l && open > 1; l = l->next) {
+            if (!l->fixed && l->demand >= 0 && l->demand < fair) {
+                uint64_t share = l->demand > (double)floor ? (uint64_t)l->demand : floor;
+
+                atomic_store(&l->share, share);
+                l->fixed = 1;
+                left -= (double)share;
+                open--;
+                changed = 1;
+            }
+        }
+    } while (changed && left > 0);
+    fair = left > 0 ? left / (double)open : 0;
+    for (l = limit_flows; l; l = l->next) {
+        if (!l->fixed) {
+            atomic_store(&l->share, fair > (double)floor ? (uint64_t)fair : floor);
+        }
+    }
+}
+
+limit_flow *limit_join(void)
+{
+    limit_flow *l;
+    uint64_t rate;
+
+    if (!limit_enabled) {
+        return NULL;
+    }
+    l = calloc(1, sizeof(*l));
+    if (l == NULL) {
+        perror("calloc");
+        return NULL;
+    }
+    l->tokens = LIMIT_MIN_BURST;
+    l->refilled = now_ns();
+
+    pthread_mutex_lock(&limit_lock);
+    l->next = limit_flows;
+    if (limit_flows) {
+        limit_flows->prev = l;
+    }
+    limit_flows = l;
+    limit_nflows++;
+    rate = atomic_load(&limit_rate);
+    atomic_store(&l->share, rate ? rate / limit_nflows + 1 : 0);
+    atomic_store(&limit_next, 0);
+    pthread_mutex_unlock(&limit_lock);
+    return l;
+}
+
+void limit_leave(limit_flow *l)
+{
+    if (l == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&limit_lock);
+    if (l->prev) {
+        l->prev->next = l->next;
+    } else {
+        limit_flows = l->next;
+    }
+    if (l->next) {
+        l->next->prev = l->prev;
+    }
+    limit_nflows--;
+    atomic_store(&limit_next, 0);
+    pthread_mutex_unlock(&limit_lock);
+    free(l);
+}
+
+uint64_t limit_delay(limit_flow *l)
+{
+    uint64_t now = now_ns(), share;
+    int64_t burst;
+
+    atomic_fetch_add(&l->used, l->charged);
+    l->charged = 0;
+    if (now >= atomic_load(&limit_next) && pthread_mutex_trylock(&limit_lock) == 0) {
+        if (now >= atomic_load(&limit_next)) {
+            limit_share(now);
+            limit_last = now;
+            atomic_store(&limit_next, now + (uint64_t)LIMIT_INTERVAL_MS * 1000000u);
+        }
+        pthread_mutex_unlock(&limit_lock);
+    }
+
+    share = atomic_load(&l->share);
+    if (share == 0) {
+        l->tokens = LIMIT_UNLIMITED;
+        l->refilled = now;
+        return 0;
+    }
+    l->tokens += (int64_t)((double)share * (double)(now - l->refilled) / 1e9);
+    l->refilled = now;
+    burst = (int64_t)(share * LIMIT_BURST_MS / 1000);
+    if (burst < LIMIT_MIN_BURST) {
+        burst = LIMIT_MIN_BURST;
+    }
+    if (l->tokens > burst) {
+        l->tokens = burst;
+    }
+    if (l->tokens >= 0) {
+        return 0;
+    }
+    atomic_store(&l->waited, 1);
+    return (uint64_t)((double)-l->tokens * 1e9 / (double)share) + 1;
+}
+
+void limit_take(limit_flow *l, size_t bytes)
+{
+    uint64_t wait;
+
+    limit_charge(l, bytes);
+    while ((wait = limit_delay(l)) > 0) {
+        struct timespec ts = {.tv_sec = (time_t)(wait / 1000000000u),
+                              .tv_nsec = (long)(wait % 1000000000u)};
+
+        nanosleep(&ts, NULL);
+    }
+}
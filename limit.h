@@ -0,0 +1,150 @@
+/**
+ * @file limit.h
+ * @brief Bandwidth limit shared fairly by the transfers of a process
+ *
+ * With `--limit` every connection of the process, every stream of a
+ * striped transfer and every receiver of a fan-out, is a flow of a single
+ * token bucket filling at `limit_rate`. Every `LIMIT_INTERVAL_MS` the rate
+ * is shared out max-min fair: flows that used less than their share keep
+ * what they used with some room to grow, and the rest is split evenly
+ * between the others. A lone transfer gets the whole rate, a second one
+ * gets half of it within an interval.
+ *
+ * Each flow keeps its own tokens, spent without locks or clock reads
+ * until they run out, so the limit costs a subtraction per send while
+ * there's room. The sender sleeps once they run out; the receiver stops
+ * reading the connection for as long and serves the others meanwhile,
+ * and the sender's TCP backs off. Without `--limit` nothing is counted.
+ *
+ * The rate may be read from a file instead, read again every time it's
+ * shared out, so it can be changed while transfers are running.
+ */
+
+#pragma once
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/** Interval between sharing out the rate */
+#define LIMIT_INTERVAL_MS 100
+
+/** Longest sending a flow may save up tokens for while idle */
+#define LIMIT_BURST_MS 20
+
+/** Least tokens a flow may save up, whatever its share */
+#define LIMIT_MIN_BURST ((int64_t)64 * 1024)
+
+/** Share of its share a flow uses from which it's taken as wanting more, if it hasn't waited */
+#define LIMIT_BUSY 0.9
+
+/** Room a flow using less than its share gets over what it used */
+#define LIMIT_HEADROOM 1.25
+
+/**
+ * Limit the transfers of the process
+ *
+ * Off by default. Set from the command line before any transfer starts.
+ */
+extern int limit_enabled;
+
+/** Bytes per second shared by the flows, 0 for no limit */
+extern _Atomic uint64_t limit_rate;
+
+/** A flow of the bandwidth limit, used by a single thread at a time */
+typedef struct limit_flow {
+    int64_t             tokens;    /**< Bytes the flow may still move */
+    uint64_t            refilled;  /**< When the tokens were last refilled, ns */
+    uint64_t            charged;   /**< Bytes moved since then */
+    _Atomic uint64_t    used;      /**< Bytes moved, published on refills */
+    _Atomic uint64_t    share;     /**< Bytes per second of the rate, 0 for no limit */
+    atomic_int          waited;    /**< Has had to wait since the rate was shared out */
+    uint64_t            seen;      /**< `used` when the rate was last shared out */
+    double              demand;    /**< Rate it wants then, -1 for more than its share */
+    int                 fixed;     /**< Its share is set while sharing out */
+    struct limit_flow  *prev, *next; /**< Links for the flows of the process */
+} limit_flow;
+
+/**
+ * Flow the calling thread sends under, or `NULL` to send unlimited
+ *
+ * Set by the sender for the threads of a transfer, from
+ * `limit_join()`.
+ */
+extern _Thread_local limit_flow *limit_current;
+
+/**
+ * Parse the value of `--limit`
+ *
+ * Turns the limit on, at a rate such as "50M" bytes per second, or read
+ * from the file after "@", holding such a rate or 0 for no limit.
+ *
+ * @param arg Option argument
+ *
+ * @return 0 on success, -1 if the value is invalid
+ */
+int limit_parse(const char *arg);
+
+/**
+ * Start a flow with the process's rate shared out again to take it in
+ *
+ * @return Flow to end with `limit_leave()`, or `NULL` if the limit is
+ *         off or on error
+ */
+limit_flow *limit_join(void);
+
+/**
+ * End a flow, leaving its share to the others
+ *
+ * @param l Flow, or `NULL` to do nothing
+ */
+void limit_leave(limit_flow *l);
+
+/**
+ * Refill a flow's tokens and tell how long it has to wait for more
+ *
+ * Shares the rate out again once `LIMIT_INTERVAL_MS` has passed.
+ *
+ * @param l Flow
+ *
+ * @return Nanoseconds to wait before moving more data, 0 if it may
+ */
+uint64_t limit_delay(limit_flow *l);
+
+/**
+ * Count data moved, then sleep as long as the flow is over its share
+ *
+ * @param l     Flow
+ * @param bytes Bytes moved
+ */
+void limit_take(limit_flow *l, size_t bytes);
+
+/**
+ * Count data moved by a flow, without waiting
+ *
+ * @param l     Flow
+ * @param bytes Bytes moved
+ */
+static inline void limit_charge(limit_flow *l, size_t bytes)
+{
+    l->tokens -= (int64_t)bytes;
+    l->charged += bytes;
+}
+
+/**
+ * Count data sent by the calling thread, sleeping as long as it's over
+ * its share
+ *
+ * Costs a thread-local read without `--limit`.
+ *
+ * @param bytes Bytes sent
+ */
+static inline void limit_wait(size_t bytes)
+{
+    if (limit_current) {
+        limit_charge(limit_current, bytes);
+        if (limit_current->tokens < 0) {
+            limit_take(limit_current, 0);
+        }
+    }
+}
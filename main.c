@@ -1,24 +1,147 @@
+#include <getopt.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include "cache.h"
 #include "const.h"
 #include "file.h"
 #include "client.h"
 #include "server.h"
+#include "pipeline.h"
+#include "limit.h"
 #include "progress.h"
+#include "relay.h"
 #include "receiver.h"
 #include "sender.h"
+#include "stats.h"
+#include "tune.h"
+#include "uring.h"
 #include "version.h"
+#include "zerocopy.h"
 
 static void print_usage(const char *progname)
 {
     printf("fling %s. Usage:\n", FLING_VERSION);
-    printf("  %s serve [port]               Start in server mode "
+    printf("  %s serve [options] [port]     Start in server mode "
            "(default port: " DEFAULT_PORT_STR ")\n", progname);
-    printf("  %s send <file> <host> [port]  Send a file "
+    printf("  %s send [options] <path> <host> [port]\n"
+           "                                Send a file or directory "
            "(default port: " DEFAULT_PORT_STR ")\n", progname);
+    printf("  %s send [options] <file> <host>... [port]\n"
+           "                                Send a file to several receivers, "
+           "reading it once\n", progname);
+    printf("\nServe options:\n");
+    printf("  -j, --threads <n>             Serve clients with n threads "
+           "(default: %d)\n", RECEIVER_THREADS);
+    printf("  -t, --timeout <seconds>       Drop clients idle for that long "
+           "(default: %d)\n", RECEIVER_IDLE_TIMEOUT);
+    printf("  -u, --io-uring                Write files through io_uring "
+           "when available\n");
+    printf("  -p, --pipeline                Write files on separate threads, "
+           "overlapping disk and network\n");
+    printf("  -c, --cache <policy>          Page cache use: default, drop "
+           "or direct (O_DIRECT)\n");
+    printf("  -i, --stats                   Report where the time of every "
+           "connection went\n");
+    printf("  -a, --autotune[=<max>]        Size the receive buffers to the "
+           "path, up to max (default: %zuM)\n", TUNE_MAX_BUFFER / SIZE_MB);
+    printf("  -R, --relay <host[:port]>     Forward everything received to "
+           "the next receiver of a chain\n");
+    printf("  -U, --udp                     Also receive files over UDP on "
+           "the same port\n");
+    printf("  -l, --limit <rate|@file>      Share rate bytes per second fairly "
+           "between the clients,\n"
+           "                                or the rate in file, read again "
+           "as it changes\n");
+    printf("\nSend options:\n");
+    printf("  -s, --streams <n|auto>        Split the file over n parallel "
+           "connections (max %d)\n", STREAMS_MAX);
+    printf("  -u, --io-uring                Read and send through io_uring "
+           "when available\n");
+    printf("  -p, --pipeline                Read the file on a separate thread, "
+           "overlapping disk and network\n");
+    printf("  -c, --cache <policy>          Page cache use: default, drop "
+           "or direct (O_DIRECT)\n");
+    printf("  -r, --resume                  Continue an interrupted transfer, "
+           "sending only what's missing\n");
+    printf("  -d, --delta                   Send only the blocks that differ "
+           "from the receiver's copy\n");
+    printf("  -z, --compress                Compress the data in transit "
+           "when that pays off\n");
+    printf("  -v, --verify                  Hash the data in transit and have "
+           "the receiver verify it\n");
+    printf("  -S, --sparse                  Send holes and runs of zeros as holes, "
+           "not data\n");
+    printf("  -i, --stats[=<file>]          Report where the time went and the "
+           "bottleneck,\n"
+           "                                dumping the TCP samples to a JSON "
+           "file if given\n");
+    printf("  -P, --progress <output>       Progress output: bar, json (a JSON "
+           "object per line) or none\n");
+    printf("  -a, --autotune[=<max>]        Size the send buffers and chunks to "
+           "the path, use BBR on long\n"
+           "                                paths, buffers up to max "
+           "(default: %zuM)\n", TUNE_MAX_BUFFER / SIZE_MB);
+    printf("  -Z, --zerocopy                Send the data buffered in user space "
+           "with MSG_ZEROCOPY (Linux)\n");
+    printf("  -m, --multiplex               Interleave the files of a "
+           "directory, acknowledged one by one\n");
+    printf("  -L, --max-lag <seconds>       Drop a receiver holding the others "
+           "back for that long\n"
+           "                                in total (default: %d)\n", FANOUT_MAX_LAG);
+    printf("  -T, --connect-timeout <seconds>\n"
+           "                                Give up on a receiver not connecting "
+           "for that long (default: %d)\n", CONNECT_TIMEOUT);
+    printf("  -U, --udp                     Send the file over UDP with rate-based "
+           "congestion control\n");
+    printf("  -l, --limit <rate|@file>      Send at most rate bytes per second, "
+           "such as 50M,\n"
+           "                                or the rate in file, read again "
+           "as it changes\n");
+}
+
+/**
+ * Parse the value of `--streams`
+ *
+ * @param arg Option argument, a number or "auto"
+ *
+ * @return Number of streams, `STREAMS_AUTO`, or -1 if the value is invalid
+ */
+static int parse_streams(const char *arg)
+{
+    int streams;
+
+    if (strcmp(arg, "auto") == 0) {
+        return STREAMS_AUTO;
+    }
+    streams = atoi(arg);
+    if (streams < 1 || streams > STREAMS_MAX) {
+        return -1;
+    }
+    return streams;
+}
+
+/**
+ * Turn tuning on, with the buffer limit of `--autotune` if given
+ *
+ * @param arg Option argument, a size such as "64M", or `NULL`
+ *
+ * @return 0 on success, -1 if the size is invalid
+ */
+static int parse_autotune(const char *arg)
+{
+    if (arg) {
+        tune_max_buffer = tune_parse_size(arg);
+        if (tune_max_buffer == 0) {
+            printf("Incorrect buffer size '%s'\n", arg);
+            return -1;
+        }
+    }
+    tune_enabled = 1;
+    return 0;
 }
 
 int main(int argc, char *argv[])
@@ -30,34 +153,236 @@ int main(int argc, char *argv[])
 
     if (strcmp(argv[1], "serve") == 0) {
         /* Server mode - receive files */
-        int port = DEFAULT_PORT;
-        if (argc > 2) {
-            port = atoi(argv[2]);
-            if (port == 0) {
-                printf("Incorrect port number '%s'\n", argv[2]);
+        static const struct option serve_options[] = {
+            {"threads", required_argument, NULL, 'j'},
+            {"timeout", required_argument, NULL, 't'},
+            {"io-uring", no_argument, NULL, 'u'},
+            {"pipeline", no_argument, NULL, 'p'},
+            {"cache", required_argument, NULL, 'c'},
+            {"stats", no_argument, NULL, 'i'},
+            {"autotune", optional_argument, NULL, 'a'},
+            {"relay", required_argument, NULL, 'R'},
+            {"udp", no_argument, NULL, 'U'},
+            {"limit", required_argument, NULL, 'l'},
+            {NULL, 0, NULL, 0},
+        };
+        receiver_opts opts = {
+            .port = DEFAULT_PORT,
+            .threads = RECEIVER_THREADS,
+            .idle_timeout = RECEIVER_IDLE_TIMEOUT,
+        };
+        int opt, cache;
+
+        optind = 2;
+        while ((opt = getopt_long(argc, argv, "j:t:upc:ia::R:Ul:", serve_options, NULL)) != -1) {
+            switch (opt) {
+            case 'j':
+                opts.threads = atoi(optarg);
+                if (opts.threads < 1) {
+                    printf("Incorrect number of threads '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 't':
+                opts.idle_timeout = atoi(optarg);
+                if (opts.idle_timeout < 1) {
+                    printf("Incorrect timeout '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'u':
+                uring_enabled = 1;
+                break;
+            case 'p':
+                pipeline_enabled = 1;
+                break;
+            case 'c':
+                cache = cache_parse(optarg);
+                if (cache < 0) {
+                    printf("Unknown cache policy '%s'\n", optarg);
+                    return 1;
+                }
+                cache_policy = (cache_mode)cache;
+                break;
+            case 'i':
+                stats_enabled = 1;
+                break;
+            case 'a':
+                if (parse_autotune(optarg) < 0) {
+                    return 1;
+                }
+                break;
+            case 'R':
+                if (relay_parse(optarg) < 0) {
+                    printf("Incorrect relay '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'U':
+                opts.udp = 1;
+                break;
+            case 'l':
+                if (limit_parse(optarg) < 0) {
+                    return 1;
+                }
+                break;
+            default:
+                print_usage(argv[0]);
+                return 1;
+            }
+        }
+
+        if (optind < argc) {
+            opts.port = atoi(argv[optind]);
+            if (opts.port == 0) {
+                printf("Incorrect port number '%s'\n", argv[optind]);
                 return 1;
             }
         }
-        return exec_receiver(port);
+
+        /* A client or the next receiver closing the connection fails only it */
+        signal(SIGPIPE, SIG_IGN);
+
+        return exec_receiver(&opts);
     }
 
     if (strcmp(argv[1], "send") == 0) {
         /* Client mode - send file */
-        if (argc < 4) {
+        static const struct option send_options[] = {
+            {"streams", required_argument, NULL, 's'},
+            {"io-uring", no_argument, NULL, 'u'},
+            {"pipeline", no_argument, NULL, 'p'},
+            {"cache", required_argument, NULL, 'c'},
+            {"resume", no_argument, NULL, 'r'},
+            {"delta", no_argument, NULL, 'd'},
+            {"compress", no_argument, NULL, 'z'},
+            {"verify", no_argument, NULL, 'v'},
+            {"sparse", no_argument, NULL, 'S'},
+            {"stats", optional_argument, NULL, 'i'},
+            {"progress", required_argument, NULL, 'P'},
+            {"autotune", optional_argument, NULL, 'a'},
+            {"max-lag", required_argument, NULL, 'L'},
+            {"multiplex", no_argument, NULL, 'm'},
+            {"connect-timeout", required_argument, NULL, 'T'},
+            {"zerocopy", no_argument, NULL, 'Z'},
+            {"udp", no_argument, NULL, 'U'},
+            {"limit", required_argument, NULL, 'l'},
+            {NULL, 0, NULL, 0},
+        };
+        sender_opts opts = {.streams = 1, .max_lag = FANOUT_MAX_LAG};
+        int opt, cache, progress;
+
+        optind = 2;
+        while ((opt = getopt_long(argc, argv, "s:upc:rdzvSi::P:a::L:mT:ZUl:", send_options, NULL)) != -1) {
+            switch (opt) {
+            case 's':
+                opts.streams = parse_streams(optarg);
+                if (opts.streams < 0) {
+                    printf("Incorrect number of streams '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'u':
+                uring_enabled = 1;
+                break;
+            case 'p':
+                pipeline_enabled = 1;
+                break;
+            case 'c':
+                cache = cache_parse(optarg);
+                if (cache < 0) {
+                    printf("Unknown cache policy '%s'\n", optarg);
+                    return 1;
+                }
+                cache_policy = (cache_mode)cache;
+                break;
+            case 'r':
+                opts.resume = 1;
+                break;
+            case 'd':
+                opts.delta = 1;
+                break;
+            case 'z':
+                opts.compress = 1;
+                break;
+            case 'v':
+                opts.verify = 1;
+                break;
+            case 'S':
+                opts.sparse = 1;
+                break;
+            case 'i':
+                opts.stats = 1;
+                opts.stats_json = optarg;
+                break;
+            case 'P':
+                progress = progress_parse(optarg);
+                if (progress < 0) {
+                    printf("Unknown progress output '%s'\n", optarg);
+                    return 1;
+                }
+                progress_output = (progress_mode)progress;
+                break;
+            case 'a':
+                if (parse_autotune(optarg) < 0) {
+                    return 1;
+                }
+                break;
+            case 'm':
+                opts.multiplex = 1;
+                break;
+            case 'L':
+                opts.max_lag = atoi(optarg);
+                if (opts.max_lag < 1) {
+                    printf("Incorrect lag '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'Z':
+                zerocopy_enabled = 1;
+                break;
+            case 'U':
+                opts.udp = 1;
+                break;
+            case 'l':
+                if (limit_parse(optarg) < 0) {
+                    return 1;
+                }
+                break;
+            case 'T':
+                connect_timeout = atoi(optarg);
+                if (connect_timeout < 1) {
+                    printf("Incorrect connect timeout '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            default:
+                print_usage(argv[0]);
+                return 1;
+            }
+        }
+
+        if (argc - optind < 2) {
             printf("Error: Missing file or host arguments for send command\n");
             print_usage(argv[0]);
             return 1;
         }
 
-        char *filename = argv[2];
-        const char *host = argv[3];
+        char *filename = argv[optind];
+        const char *const *hosts = (const char *const *)argv + optind + 1;
         const char *port = DEFAULT_PORT_STR;
-        
-        if (argc > 4) {
-            port = argv[4];
+        int nhosts = argc - optind - 1;
+
+        /* Receivers are named, a trailing number is the port of all of them */
+        if (nhosts > 1 && strspn(argv[argc - 1], "0123456789") == strlen(argv[argc - 1])) {
+            port = argv[argc - 1];
+            nhosts--;
         }
+
+        /* A receiver rejecting the data closes the connection, report it instead of dying */
+        signal(SIGPIPE, SIG_IGN);
         
-        return exec_sender(filename, host, port);
+        return exec_sender(filename, hosts, nhosts, port, &opts);
     }
 
     printf("Unknown command: %s\n", argv[1]);
@@ -0,0 +1,393 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "fsock.h"
+#include "hash.h"
+#include "pipeline.h"
+#include "progress.h"
+#include "stats.h"
+#include "zerocopy.h"
+
+int pipeline_enabled = 0;
+
+/** A chunk buffer of the ring and what to do with it */
+typedef struct {
+    int             fd;      /**< File the chunk is written to (receiver) */
+    off_t           offset;  /**< File offset of the chunk */
+    size_t          length;  /**< Chunk length */
+    pipeline_owner *owner;   /**< Receiver waiting for the write */
+} pipeline_slot;
+
+/**
+ * Single-producer/single-consumer ring of chunk buffers
+ *
+ * The producer fills slot `tail % PIPELINE_DEPTH` and advances `tail`,
+ * the consumer empties slot `head % PIPELINE_DEPTH` and advances `head`.
+ * Neither takes the lock unless it has to sleep: a side about to sleep
+ * registers in `sleepers` and rechecks, the other side wakes it up after
+ * every change if it sees a sleeper.
+ */
+typedef struct {
+    char            *bufs;
+    pipeline_slot    slots[PIPELINE_DEPTH];
+    atomic_size_t    head;
+    atomic_size_t    tail;
+    atomic_int       done;     /**< The producer won't fill more slots */
+    atomic_int       stopped;  /**< The consumer won't empty more slots */
+    atomic_int       sleepers;
+    pthread_mutex_t  lock;
+    pthread_cond_t   cond;
+} pipeline_ring;
+
+struct pipeline_rx {
+    pipeline_ring ring;
+    pthread_t     writer;
+};
+
+/**
+ * Sleep until `pred` holds
+ *
+ * The condition is rechecked after registering as a sleeper and under
+ * the lock, so a wake-up between the check and the sleep isn't lost.
+ */
+#define RING_WAIT(r, pred) \
+    do { \
+        if (!(pred)) { \
+            pthread_mutex_lock(&(r)->lock); \
+            atomic_fetch_add(&(r)->sleepers, 1); \
+            while (!(pred)) { \
+                pthread_cond_wait(&(r)->cond, &(r)->lock); \
+            } \
+            atomic_fetch_sub(&(r)->sleepers, 1); \
+            pthread_mutex_unlock(&(r)->lock); \
+        } \
+    } while (0)
+
+/**
+ * Wake up the other side if it sleeps
+ *
+ * @param r Ring that has just changed
+ */
+static void ring_notify(pipeline_ring *r)
+{
+    if (atomic_load(&r->sleepers) > 0) {
+        pthread_mutex_lock(&r->lock);
+        pthread_cond_broadcast(&r->cond);
+        pthread_mutex_unlock(&r->lock);
+    }
+}
+
+/**
+ * Allocate the buffers of a ring
+ *
+ * @param r Ring to initialize
+ *
+ * @return 0 on success, -1 on error
+ */
+static int ring_init(pipeline_ring *r)
+{
+    r->bufs = malloc((size_t)PIPELINE_DEPTH * CHUNK_SIZE);
+    if (r->bufs == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    atomic_init(&r->head, 0);
+    atomic_init(&r->tail, 0);
+    atomic_init(&r->done, 0);
+    atomic_init(&r->stopped, 0);
+    atomic_init(&r->sleepers, 0);
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->cond, NULL);
+    return 0;
+}
+
+static void ring_free(pipeline_ring *r)
+{
+    pthread_cond_destroy(&r->cond);
+    pthread_mutex_destroy(&r->lock);
+    free(r->bufs);
+}
+
+/**
+ * Buffer of the slot at the given position
+ */
+static char *ring_buf(pipeline_ring *r, size_t pos)
+{
+    return r->bufs + pos % PIPELINE_DEPTH * CHUNK_SIZE;
+}
+
+/** Reader thread of a sending ring */
+typedef struct {
+    pipeline_ring   ring;
+    const file     *f;
+    stats_transfer *stats;  /**< Statistics of the sending thread */
+} pipeline_tx;
+
+/**
+ * Reader thread: read the range chunk by chunk into the ring
+ *
+ * @param arg Pointer to the `pipeline_tx`
+ *
+ * @return Always `NULL`
+ */
+static void *pipeline_reader(void *arg)
+{
+    pipeline_tx *tx = arg;
+    pipeline_ring *r = &tx->ring;
+    size_t offset = tx->f->hdr.offset, end = tx->f->hdr.offset + tx->f->hdr.length;
+
+    stats_current = tx->stats;
+    while (offset < end) {
+        size_t tail = atomic_load(&r->tail), len = end - offset, got = 0;
+        char *buf = ring_buf(r, tail);
+
+        RING_WAIT(r, tail - atomic_load(&r->head) < PIPELINE_DEPTH
+                     || atomic_load(&r->stopped));
+        if (atomic_load(&r->stopped)) {
+            break;
+        }
+
+        if (len > CHUNK_SIZE) {
+            len = CHUNK_SIZE;
+        }
+        while (got < len) {
+            uint64_t start = stats_start();
+            ssize_t n = pread(tx->f->fd, buf + got, len - got, (off_t)(offset + got));
+
+            stats_stop(STATS_READ, start, n);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                if (n < 0) {
+                    perror("pread");
+                } else {
+                    printf("File is shorter than expected\n");
+                }
+                goto out;
+            }
+            got += (size_t)n;
+        }
+
+        r->slots[tail % PIPELINE_DEPTH].length = len;
+        atomic_store(&r->tail, tail + 1);
+        ring_notify(r);
+        offset += len;
+    }
+
+out:
+    atomic_store(&r->done, 1);
+    ring_notify(r);
+    return NULL;
+}
+
+ssize_t pipeline_file_send(const file *f, int sock, hash_tree *hash, cache_cursor *cache)
+{
+    pipeline_tx *tx;
+    pipeline_ring *r;
+    pthread_t reader;
+    zerocopy_socket zc;
+    uint32_t tokens[PIPELINE_DEPTH];
+    size_t sent = 0, inflight = 0;
+    int flushed;
+
+    tx = calloc(1, sizeof(*tx));
+    if (tx == NULL) {
+        perror("calloc");
+        return -1;
+    }
+    tx->f = f;
+    tx->stats = stats_current;
+    r = &tx->ring;
+    if (ring_init(r) < 0) {
+        free(tx);
+        return -1;
+    }
+    if (pthread_create(&reader, NULL, pipeline_reader, tx) != 0) {
+        perror("pthread_create");
+        ring_free(r);
+        free(tx);
+        return -1;
+    }
+
+    zerocopy_start(&zc, sock);
+    while (sent < f->hdr.length) {
+        size_t head = atomic_load(&r->head), pos = head + inflight;
+        pipeline_slot *s = &r->slots[pos % PIPELINE_DEPTH];
+
+        /* Chunks sent that the kernel is done with may be read over */
+        if (zerocopy_reap(&zc, 0) < 0) {
+            break;
+        }
+        while (inflight > 0 && zerocopy_done(&zc, tokens[head % PIPELINE_DEPTH])) {
+            inflight--;
+            atomic_store(&r->head, ++head);
+            ring_notify(r);
+        }
+        if (inflight > 0 && pos == atomic_load(&r->tail) && !atomic_load(&r->done)) {
+            /* Nothing to send until the reader gets room for more */
+            if (zerocopy_reap(&zc, ZEROCOPY_POLL_MS) < 0) {
+                break;
+            }
+            continue;
+        }
+
+        RING_WAIT(r, pos < atomic_load(&r->tail) || atomic_load(&r->done));
+        if (pos == atomic_load(&r->tail)) {
+            /* The reader has given up */
+            break;
+        }
+
+        if (hash) {
+            hash_tree_update(hash, ring_buf(r, pos), s->length);
+        }
+        /* Not read over before `head` moves past it */
+        if (zerocopy_send(&zc, ring_buf(r, pos), s->length, &tokens[pos % PIPELINE_DEPTH]) < 0) {
+            break;
+        }
+        inflight++;
+        sent += s->length;
+        cache_advance(cache, (off_t)(f->hdr.offset + sent));
+        progress_add(s->length);
+    }
+
+    /* The ring is freed below */
+    flushed = zerocopy_flush(&zc) == 0;
+    atomic_store(&r->stopped, 1);
+    ring_notify(r);
+    pthread_join(reader, NULL);
+    ring_free(r);
+    free(tx);
+
+    return flushed && sent == f->hdr.length ? (ssize_t)sent : -1;
+}
+
+/**
+ * Disk thread of a receiver: write the queued chunks until stopped
+ *
+ * @param arg Pointer to the `pipeline_rx`
+ *
+ * @return Always `NULL`
+ */
+static void *pipeline_writer(void *arg)
+{
+    pipeline_rx *rx = arg;
+    pipeline_ring *r = &rx->ring;
+
+    while (1) {
+        size_t head = atomic_load(&r->head), done = 0;
+        pipeline_slot *s = &r->slots[head % PIPELINE_DEPTH];
+        const char *buf = ring_buf(r, head);
+
+        RING_WAIT(r, head < atomic_load(&r->tail) || atomic_load(&r->stopped));
+        if (head == atomic_load(&r->tail)) {
+            break;
+        }
+
+        /* Written for whichever receiver queued the chunk */
+        stats_current = s->owner->stats;
+        while (done < s->length && !atomic_load(&s->owner->failed)) {
+            uint64_t start = stats_start();
+            ssize_t n = pwrite(s->fd, buf + done, s->length - done, s->offset + (off_t)done);
+
+            stats_stop(STATS_WRITE, start, n);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                if (n < 0) {
+                    perror("pwrite");
+                } else {
+                    fprintf(stderr, "pwrite: no space left\n");
+                }
+                atomic_store(&s->owner->failed, 1);
+                break;
+            }
+            done += (size_t)n;
+        }
+
+        atomic_fetch_sub(&s->owner->inflight, 1);
+        atomic_store(&r->head, head + 1);
+        ring_notify(r);
+    }
+    return NULL;
+}
+
+pipeline_rx *pipeline_rx_create(void)
+{
+    pipeline_rx *rx = calloc(1, sizeof(*rx));
+
+    if (rx == NULL) {
+        perror("calloc");
+        return NULL;
+    }
+    if (ring_init(&rx->ring) < 0) {
+        free(rx);
+        return NULL;
+    }
+    if (pthread_create(&rx->writer, NULL, pipeline_writer, rx) != 0) {
+        perror("pthread_create");
+        ring_free(&rx->ring);
+        free(rx);
+        return NULL;
+    }
+    return rx;
+}
+
+void pipeline_rx_destroy(pipeline_rx *rx)
+{
+    atomic_store(&rx->ring.stopped, 1);
+    ring_notify(&rx->ring);
+    pthread_join(rx->writer, NULL);
+    ring_free(&rx->ring);
+    free(rx);
+}
+
+ssize_t pipeline_rx_recv(pipeline_rx *rx, pipeline_owner *owner, int sock, int fd,
+                         off_t offset, size_t length, hash_tree *hash)
+{
+    pipeline_ring *r = &rx->ring;
+    size_t tail = atomic_load(&r->tail);
+    pipeline_slot *s = &r->slots[tail % PIPELINE_DEPTH];
+    char *buf = ring_buf(r, tail);
+    ssize_t bytes_read;
+    uint64_t start;
+
+    RING_WAIT(r, tail - atomic_load(&r->head) < PIPELINE_DEPTH);
+    if (atomic_load(&owner->failed)) {
+        return -1;
+    }
+
+    start = stats_start();
+    bytes_read = recv(sock, buf, length < CHUNK_SIZE ? length : CHUNK_SIZE, 0);
+    stats_stop(STATS_RECV, start, bytes_read);
+    if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return FSOCK_AGAIN;
+    }
+    if (bytes_read <= 0) {
+        perror("recv");
+        return -1;
+    }
+    if (hash) {
+        hash_tree_update(hash, buf, (size_t)bytes_read);
+    }
+
+    s->fd = fd;
+    s->offset = offset;
+    s->length = (size_t)bytes_read;
+    s->owner = owner;
+    atomic_fetch_add(&owner->inflight, 1);
+    atomic_store(&r->tail, tail + 1);
+    ring_notify(r);
+    return bytes_read;
+}
+
+int pipeline_rx_wait(pipeline_rx *rx, pipeline_owner *owner)
+{
+    RING_WAIT(&rx->ring, atomic_load(&owner->inflight) == 0);
+    return atomic_load(&owner->failed) ? -1 : 0;
+}
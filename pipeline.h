@@ -0,0 +1,113 @@
+/**
+ * @file pipeline.h
+ * @brief Disk and network I/O on separate threads
+ *
+ * A disk thread and a network thread pass chunks to each other through
+ * a lock-free single-producer/single-consumer ring of `PIPELINE_DEPTH`
+ * preallocated buffers. While one of them waits for the disk, the other
+ * keeps the socket busy, so a transfer runs at the pace of the slower of
+ * the two rather than of both in turn. A full ring holds the producer
+ * back, an empty one the consumer; a side sleeps only when it has to.
+ *
+ * Used only when enabled with `pipeline_enabled`. Unlike io_uring this
+ * needs no kernel support, but it gives up `sendfile()`/`splice()`: the
+ * data is copied through the ring, unless sent from it with `zerocopy.h`.
+ */
+
+#pragma once
+
+#include <stdatomic.h>
+#include <sys/types.h>
+
+#include "cache.h"
+#include "file.h"
+#include "hash.h"
+#include "stats.h"
+
+/** Number of chunk buffers in a ring */
+#define PIPELINE_DEPTH 8
+
+/**
+ * Move disk I/O to a thread of its own
+ *
+ * Off by default. Set from the command line before any transfer starts.
+ */
+extern int pipeline_enabled;
+
+/**
+ * Completion state of the writes queued for one receiver
+ *
+ * Embedded in the owner's state; the disk thread updates it as the
+ * writes queued with `pipeline_rx_recv()` complete.
+ */
+typedef struct {
+    atomic_uint inflight;  /**< Writes queued but not completed yet */
+    atomic_int  failed;    /**< Any of the writes failed */
+    stats_transfer *stats; /**< Statistics to account the writes to, or `NULL` */
+} pipeline_owner;
+
+/** Write-behind engine of a receiver thread */
+typedef struct pipeline_rx pipeline_rx;
+
+/**
+ * Send file contents over socket, reading them on a separate thread
+ *
+ * Sends the `hdr.length` bytes at `hdr.offset`. A reader thread keeps
+ * up to `PIPELINE_DEPTH` chunks read ahead while the calling thread
+ * sends them in order, counting them in the progress.
+ *
+ * @param f     Pointer to file structure with open file descriptor
+ * @param sock  Socket descriptor to send data to
+ * @param hash  Tree to hash the data into, or `NULL`
+ * @param cache Cache window to move along as the data is sent
+ *
+ * @return Total bytes sent on success, -1 on error
+ */
+ssize_t pipeline_file_send(const file *f, int sock, hash_tree *hash, cache_cursor *cache);
+
+/**
+ * Create a write-behind engine and start its disk thread
+ *
+ * @return New engine, or `NULL` on error
+ */
+pipeline_rx *pipeline_rx_create(void);
+
+/**
+ * Stop the disk thread and free the engine
+ *
+ * All owners must have waited for their writes.
+ *
+ * @param rx Engine
+ */
+void pipeline_rx_destroy(pipeline_rx *rx);
+
+/**
+ * Receive a chunk from socket and queue its write to file
+ *
+ * Receives up to `length` bytes into a free buffer of the ring and
+ * hands it to the disk thread to write at `offset`. When all buffers
+ * are busy, waits for the disk thread to free one.
+ *
+ * @param rx     Engine of the current thread
+ * @param owner  Completion state of the caller
+ * @param sock   Socket descriptor to receive data from
+ * @param fd     File descriptor to write to
+ * @param offset File offset to write the data at
+ * @param length Maximum number of bytes to receive
+ * @param hash   Tree to hash the data into, or `NULL`
+ *
+ * @return Number of bytes received, `FSOCK_AGAIN` if a non-blocking socket
+ *         has no data, -1 on error
+ */
+ssize_t pipeline_rx_recv(pipeline_rx *rx, pipeline_owner *owner, int sock, int fd,
+                         off_t offset, size_t length, hash_tree *hash);
+
+/**
+ * Wait until all writes queued for the owner have completed
+ *
+ * @param rx    Engine of the current thread
+ * @param owner Completion state of the caller
+ *
+ * @return 0 if all the writes succeeded, -1 otherwise
+ */
+int pipeline_rx_wait(pipeline_rx *rx, pipeline_owner *owner);
@@ -1,14 +1,14 @@
+#include <errno.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <string.h>
 #include <inttypes.h>
 
 #include "progress.h"
-#include "file.h"
 
-progress_bar_func progress_bar_callback = NULL;
+progress_mode progress_output = PROGRESS_BAR;
 
-struct timespec start_time = {0};
-struct timespec last_update = {0};
+_Thread_local progress_transfer *progress_current;
 
 static void human_readable_size(char *buf, size_t size, size_t bytes);
 static void calculate_speed(char *buf, size_t size, size_t bytes, double elapsed);
@@ -17,52 +17,181 @@ static double get_elapsed_time(struct timespec start, struct timespec end);
 static void render_progress_bar(int bars, int percentage, const char *sent_str,
                                 const char *total_str, const char *speed_str,
                                 const char *eta_str);
-static void print_progress(size_t sent, size_t total, int force_complete);
-static void update_progress_bar(size_t current, size_t total);
+static void print_progress(size_t sent, size_t total, double elapsed, int force_complete);
+static void print_json(const char *event, const progress_transfer *p, size_t sent,
+                       size_t total, double elapsed);
 
-void start_progress_bar(void)
+int progress_parse(const char *name)
 {
-    clock_gettime(CLOCK_MONOTONIC, &start_time);
-    last_update = start_time;
-    progress_bar_callback = update_progress_bar;
+    if (strcmp(name, "bar") == 0) {
+        return PROGRESS_BAR;
+    }
+    if (strcmp(name, "json") == 0) {
+        return PROGRESS_JSON;
+    }
+    if (strcmp(name, "none") == 0) {
+        return PROGRESS_NONE;
+    }
+    return -1;
+}
+
+/**
+ * Seconds since the start of the transfer
+ */
+static double progress_elapsed(const progress_transfer *p)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return get_elapsed_time(p->start, now);
+}
+
+/**
+ * Report the counters of the transfer as they are now
+ *
+ * @param p Progress of the transfer
+ */
+static void progress_report(progress_transfer *p)
+{
+    size_t sent = atomic_load_explicit(&p->done, memory_order_relaxed);
+    size_t total = atomic_load_explicit(&p->total, memory_order_relaxed);
+    double elapsed = progress_elapsed(p);
+
+    if (p->mode == PROGRESS_JSON) {
+        print_json("progress", p, sent, total, elapsed);
+    } else {
+        print_progress(sent, total, elapsed, 0);
+        p->shown = 1;
+    }
 }
 
 /**
- * Update progress bar at regular intervals
+ * Report the progress every `PROGRESS_INTERVAL_MS` until stopped
  *
- * Updates the progress bar display, but only at certain intervals to avoid
- * excessive updates that could slow down the transfer. Updates occur every
- * `UPDATE_INTERVAL` bytes (e.g., every 500KB).
+ * @param arg Pointer to the `progress_transfer`
  *
- * @param current Current number of bytes transferred
- * @param total   Total number of bytes to transfer
+ * @return Always `NULL`
  */
-static void update_progress_bar(size_t current, size_t total)
+static void *progress_reporter(void *arg)
+{
+    progress_transfer *p = arg;
+
+    pthread_mutex_lock(&p->lock);
+    while (!p->stopping) {
+        struct timespec deadline;
+
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += (long)(PROGRESS_INTERVAL_MS % 1000) * 1000000;
+        deadline.tv_sec += PROGRESS_INTERVAL_MS / 1000 + deadline.tv_nsec / 1000000000;
+        deadline.tv_nsec %= 1000000000;
+        while (!p->stopping
+               && pthread_cond_timedwait(&p->cond, &p->lock, &deadline) != ETIMEDOUT)
+            ;
+        if (p->stopping) {
+            break;
+        }
+        progress_report(p);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+progress_transfer *progress_begin(size_t total)
+{
+    progress_transfer *p = calloc(1, sizeof(*p));
+
+    if (p == NULL) {
+        perror("calloc");
+        return NULL;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &p->start);
+    atomic_init(&p->done, 0);
+    atomic_init(&p->total, total);
+    atomic_init(&p->wire, 0);
+    p->mode = progress_output;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->cond, NULL);
+
+    if (p->mode != PROGRESS_NONE) {
+        if (pthread_create(&p->reporter, NULL, progress_reporter, p) == 0) {
+            p->reporting = 1;
+        } else {
+            perror("pthread_create");
+        }
+    }
+    return p;
+}
+
+void progress_set_total(progress_transfer *p, size_t total)
 {
-    if (current % UPDATE_INTERVAL < CHUNK_SIZE) {
-        print_progress(current, total, current >= total);
+    if (p) {
+        atomic_store_explicit(&p->total, total, memory_order_relaxed);
     }
 }
 
-void stop_progress_bar(size_t total)
+void progress_add_wire_bytes(size_t bytes)
+{
+    if (progress_current) {
+        atomic_fetch_add(&progress_current->wire, bytes);
+    }
+}
+
+void progress_end(progress_transfer *p, ssize_t total)
 {
     double elapsed;
-    struct timespec end_time;
     char speed_str[32];
+    size_t wire_bytes;
+
+    if (p == NULL) {
+        return;
+    }
+    if (p->reporting) {
+        pthread_mutex_lock(&p->lock);
+        p->stopping = 1;
+        pthread_cond_signal(&p->cond);
+        pthread_mutex_unlock(&p->lock);
+        pthread_join(p->reporter, NULL);
+    }
 
-    /* Print the progress bar with "100%" */
-    print_progress(total, total, 1);
+    elapsed = progress_elapsed(p);
+    wire_bytes = atomic_load(&p->wire);
 
-    /* Print final stats */
-    clock_gettime(CLOCK_MONOTONIC, &end_time);
-    elapsed = get_elapsed_time(start_time, end_time);
+    if (p->mode == PROGRESS_JSON) {
+        print_json(total < 0 ? "failed" : "done", p,
+                   total < 0 ? atomic_load(&p->done) : (size_t)total,
+                   total < 0 ? atomic_load(&p->total) : (size_t)total, elapsed);
+    }
+
+    if (total < 0) {
+        /* Don't leave the error messages on the line of the bar */
+        if (p->shown) {
+            printf("\n");
+        }
+    } else {
+        /* Print the progress bar with "100%" */
+        if (p->mode == PROGRESS_BAR) {
+            print_progress((size_t)total, (size_t)total, elapsed, 1);
+            printf("\n");
+        }
+
+        calculate_speed(speed_str, sizeof(speed_str), (size_t)total, elapsed);
+        printf("File sent successfully! Completed in %.2f seconds (%s avg)\n",
+               elapsed, speed_str);
 
-    calculate_speed(speed_str, sizeof(speed_str), total, elapsed);
+        if (wire_bytes > 0) {
+            char wire_str[32], wire_speed_str[32];
 
-    printf("\nFile sent successfully! Completed in %.2f seconds (%s avg)\n",
-           elapsed, speed_str);
+            human_readable_size(wire_str, sizeof(wire_str), wire_bytes);
+            calculate_speed(wire_speed_str, sizeof(wire_speed_str), wire_bytes, elapsed);
+            printf("Compressed to %s on the wire (ratio %.2f, %s on the link)\n",
+                   wire_str, (double)total / (double)wire_bytes, wire_speed_str);
+        }
+    }
+    fflush(stdout);
 
-    progress_bar_callback = NULL;
+    pthread_cond_destroy(&p->cond);
+    pthread_mutex_destroy(&p->lock);
+    free(p);
 }
 
 /**
@@ -163,44 +292,60 @@ static void render_progress_bar(int bars, int percentage, const char *sent_str,
  * Display progress bar and transfer statistics
  *
  * Prints a progress bar with percentage, transfer amount, speed, and ETA.
- * Updates are rate-limited to avoid excessive screen updates.
  * If `force_complete` is set, displays 100% completion regardless
  * of sent/total.
  *
  * @param sent           Number of bytes sent so far
  * @param total          Total number of bytes to send
+ * @param elapsed        Seconds since the start of the transfer
  * @param force_complete Flag to force display of completed progress (100%)
  */
-static void print_progress(size_t sent, size_t total, int force_complete)
+static void print_progress(size_t sent, size_t total, double elapsed, int force_complete)
 {
-    struct timespec now = {0, 0};
-    double elapsed, total_elapsed;
     int percentage, bars;
     char sent_str[32], total_str[32], speed_str[32], eta_str[32] = "";
 
-    clock_gettime(CLOCK_MONOTONIC, &now);
-    
-    elapsed = get_elapsed_time(last_update, now);
-    if (!force_complete && elapsed < 0.2) {
-        return;
-    }
-    last_update = now;
-
-    if (start_time.tv_sec == 0 && start_time.tv_nsec == 0) {
-        clock_gettime(CLOCK_MONOTONIC, &start_time);
+    if (force_complete) {
+        percentage = 100;
+    } else {
+        percentage = total > 0 ? (int)(sent * 100 / total) : 0;
+        percentage = percentage < 100 ? percentage : 100;
     }
-
-    total_elapsed = get_elapsed_time(start_time, now);
-    percentage = force_complete ? 100 : (sent * 100) / total;
     bars = (percentage * PROGRESS_BAR_WIDTH) / 100;
 
     human_readable_size(sent_str, sizeof(sent_str), sent);
     human_readable_size(total_str, sizeof(total_str), total);
-    calculate_speed(speed_str, sizeof(speed_str), sent, total_elapsed);
-    
+    calculate_speed(speed_str, sizeof(speed_str), sent, elapsed);
+
     if (percentage > 0 && !force_complete) {
-        calculate_eta(eta_str, sizeof(eta_str), total_elapsed, percentage);
+        calculate_eta(eta_str, sizeof(eta_str), elapsed, percentage);
     }
 
     render_progress_bar(bars, percentage, sent_str, total_str, speed_str, eta_str);
 }
+
+/**
+ * Print the progress as a JSON object on a line of its own
+ *
+ * @param event   "progress", or "done" or "failed" at the end
+ * @param p       Progress of the transfer
+ * @param sent    Number of bytes sent so far
+ * @param total   Total number of bytes to send
+ * @param elapsed Seconds since the start of the transfer
+ */
+static void print_json(const char *event, const progress_transfer *p, size_t sent,
+                       size_t total, double elapsed)
+{
+    double rate = elapsed > 0 ? (double)sent / elapsed : 0;
+
+    printf("{\"event\": \"%s\", \"elapsed_s\": %.3f, \"bytes\": %zu, \"total\": %zu, "
+           "\"bytes_per_s\": %.0f", event, elapsed, sent, total, rate);
+    if (rate > 0 && sent < total) {
+        printf(", \"eta_s\": %.1f", (double)(total - sent) / rate);
+    }
+    if (atomic_load(&p->wire) > 0) {
+        printf(", \"wire_bytes\": %zu", atomic_load(&p->wire));
+    }
+    printf("}\n");
+    fflush(stdout);
+}
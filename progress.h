@@ -1,16 +1,22 @@
 /**
  * @file progress.h
- * @brief Terminal progress bar display for file transfers
+ * @brief Progress reporting of file transfers
  *
- * Provides a callback-based progress bar system that displays transfer
- * progress, speed, and ETA. The progress bar is automatically throttled
- * to avoid excessive terminal updates.
+ * The threads moving the data only add the bytes they have sent to the
+ * atomic counters of their transfer, reached through `progress_current`.
+ * A reporter thread of the transfer samples the counters every
+ * `PROGRESS_INTERVAL_MS` and shows them as a progress bar with speed and
+ * ETA, or as a stream of JSON objects, one per line, for tools driving
+ * the transfer.
  */
 
 #pragma once
 
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <sys/types.h>
 #include <time.h>
 
 /** Visual representation of progress bar using hash characters */
@@ -19,66 +25,122 @@
 /** Width of the progress bar in terminal columns */
 #define PROGRESS_BAR_WIDTH  40
 
-/** Update threshold in bytes - progress bar updates every 500KB */
-#define UPDATE_INTERVAL    (500*1024)
+/** Interval between reports */
+#define PROGRESS_INTERVAL_MS 200
 
 #define SIZE_KB  1024                /**< Bytes in a kilobyte */
 #define SIZE_MB (1024*1024)          /**< Bytes in a megabyte */
 #define SIZE_GB (1024*1024*1024)     /**< Bytes in a gigabyte */
 
+/** How the progress is reported */
+typedef enum {
+    PROGRESS_BAR,   /**< Progress bar on the terminal */
+    PROGRESS_JSON,  /**< A JSON object per line on standard output */
+    PROGRESS_NONE,  /**< Only the summary at the end */
+} progress_mode;
+
 /**
- * Progress callback function signature
+ * Progress output of the transfers
  *
- * Callback function invoked during file transfer to update progress display.
- * Implementations should handle throttling to avoid excessive updates.
+ * `PROGRESS_BAR` by default. Set from the command line before any
+ * transfer starts.
+ */
+extern progress_mode progress_output;
+
+/** Progress of a transfer */
+typedef struct {
+    atomic_size_t   done;       /**< Bytes of the data sent so far */
+    atomic_size_t   total;      /**< Bytes of the data to send */
+    atomic_size_t   wire;       /**< Bytes sent over the wire for them, if accounted */
+    struct timespec start;
+    progress_mode   mode;
+    int             reporting;  /**< The reporter thread is running */
+    int             stopping;   /**< The reporter is asked to stop, under `lock` */
+    int             shown;      /**< The bar has been drawn */
+    pthread_t       reporter;
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+} progress_transfer;
+
+/**
+ * Progress the calling thread's transfer counts to, or `NULL`
  *
- * @param current Current number of bytes transferred
- * @param total Total number of bytes to transfer
+ * Threads sending the data of a transfer set it to the transfer's
+ * progress before sending any of it.
  */
-typedef void (*progress_bar_func)(size_t current, size_t total);
+extern _Thread_local progress_transfer *progress_current;
 
 /**
- * Global progress callback pointer
+ * Parse the name of a progress output
+ *
+ * @param name "bar", "json" or "none"
  *
- * Set by `start_progress_bar()` to enable progress updates.
- * Called from file transfer routines (e.g., `file_send()`).
- * Set to `NULL` to disable progress updates.
+ * @return The output, or -1 if the name is unknown
  */
-extern progress_bar_func progress_bar_callback;
+int progress_parse(const char *name);
 
 /**
- * Transfer start time
+ * Start reporting the progress of a transfer
+ *
+ * Starts the reporter thread unless the output is `PROGRESS_NONE`. The
+ * bytes are counted once the threads sending them set `progress_current`
+ * to the transfer.
  *
- * Recorded when `start_progress_bar()` is called.
- * Used to calculate overall transfer speed and elapsed time.
+ * @param total Bytes to send, may be corrected with `progress_set_total()`
+ *
+ * @return Progress to end with `progress_end()`, or `NULL` on error
  */
-extern struct timespec start_time;
+progress_transfer *progress_begin(size_t total);
 
 /**
- * Last update timestamp
+ * Count bytes of the data sent
+ *
+ * The only thing done on the transfer path, for every chunk: an atomic
+ * add to the transfer of the calling thread, if any.
  *
- * Tracks when the progress bar was last rendered.
- * Used to throttle updates to avoid terminal flicker (0.2s minimum interval).
+ * @param bytes Bytes of the data sent since the last call
  */
-extern struct timespec last_update;
+static inline void progress_add(size_t bytes)
+{
+    if (progress_current) {
+        atomic_fetch_add_explicit(&progress_current->done, bytes, memory_order_relaxed);
+    }
+}
 
 /**
- * Initialize and start the progress bar
+ * Change the number of bytes to send
  *
- * Records the start time for speed calculations and sets up the
- * callback function for progress updates. This should be called
- * before starting the file transfer.
+ * For transfers learning it on the way, e.g. of a tree being walked, or
+ * of a file the receiver already has a part of.
+ *
+ * @param p     Progress, or `NULL` to do nothing
+ * @param total Bytes to send
  */
-void start_progress_bar(void);
+void progress_set_total(progress_transfer *p, size_t total);
 
 /**
- * Finalize the progress bar and show summary
+ * Account bytes that went over the wire for the transferred data
  *
- * Completes the progress bar (showing 100%), calculates the total elapsed time
- * and average transfer speed, and displays a summary of the completed transfer.
- * Also disables the progress callback to prevent further updates.
+ * Called by senders that transform the data, e.g. compress it. When any
+ * bytes have been accounted for the transfer of the calling thread, the
+ * summary also shows the ratio of the data to the wire bytes. Safe to
+ * call from several threads.
  *
- * @param total Total number of bytes transferred
+ * @param bytes Bytes sent over the connection
  */
-void stop_progress_bar(size_t total);
+void progress_add_wire_bytes(size_t bytes);
 
+/**
+ * Stop reporting, show the summary and free the progress
+ *
+ * After a successful transfer shows the progress at 100%, the total
+ * elapsed time and average speed. The speed counts the file data, so
+ * for compressed transfers it is the effective throughput, shown along
+ * with the compression ratio. With `PROGRESS_JSON` the summary is also
+ * reported as the last object, for a failed transfer too.
+ *
+ * @param p     Progress, or `NULL` to do nothing
+ * @param total Total number of bytes transferred, negative if the
+ *              transfer has failed
+ */
+void progress_end(progress_transfer *p, ssize_t total);
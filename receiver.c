@@ -1,46 +1,586 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#ifdef __linux__
+# include <sys/epoll.h>
+#endif
 
+#include "conn.h"
 #include "server.h"
 #include "file.h"
+#include "pipeline.h"
 #include "receiver.h"
+#include "udp.h"
+#include "uring.h"
+
+#ifdef __linux__
+
+/** Maximal number of events handled per `epoll_wait()` call */
+#define WORKER_MAX_EVENTS 64
+
+/** Per-thread state of the event-driven receiver */
+typedef struct {
+    int                  listener;
+    int                  epfd;
+    const receiver_opts *opts;
+    conn                *conns;   /**< Connections served by this thread */
+    char                *buf;     /**< Scratch buffer shared by them */
+    uring_rx            *ring;    /**< io_uring engine shared by them, or `NULL` */
+    pipeline_rx         *pipe;    /**< Disk thread shared by them, or `NULL` */
+    int                  paused;  /**< Connections over their share of `--limit` */
+} worker;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
 
 /**
- * Execute the file receiving server process
- * 
- * Sets up a listening socket, then enters an infinite loop to
- * accept connections and receive files. Each client connection
- * is handled sequentially. After receiving a file, the connection
- * is closed and the server waits for the next connection.
+ * Have epoll wait for the events the connection waits for
  *
- * @param port Port number to listen on
+ * Registers the descriptors with `conn_events()` that aren't yet,
+ * updates the ones whose events have changed and removes the ones the
+ * connection has stopped waiting on. A socket with no events leaves the
+ * set, so not even a hangup wakes the worker up for it. The events of a
+ * paused connection are those of a connection not to be read.
  *
- * @return 0 on normal exit, -1 on startup error
+ * @param w Worker state
+ * @param c Connection
+ *
+ * @return 0 on success, -1 on error
  */
-int exec_receiver(int port)
+static int worker_watch(worker *w, conn *c)
 {
-    int listener;
+    struct pollfd want[CONN_MAX_FDS];
+    int n = conn_events(c, want), i, j;
 
-    listener = start_listener(port);
-    if (listener < 0) {
+    for (i = 0; i < n; i++) {
+        struct epoll_event ev = {.data.ptr = c};
+        int op = EPOLL_CTL_ADD;
+
+        if (c->paused_until && want[i].fd == c->sock) {
+            want[i].events &= (short)~POLLIN;
+        }
+        ev.events = (want[i].events & POLLIN ? EPOLLIN : 0u)
+                    | (want[i].events & POLLOUT ? EPOLLOUT : 0u);
+        for (j = 0; j < c->nwatched && c->watched[j].fd != want[i].fd; j++) {
+        }
+        if (j < c->nwatched) {
+            if (c->watched[j].events == want[i].events) {
+                continue;
+            }
+            op = want[i].events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
+        } else if (!want[i].events) {
+            continue;
+        }
+        if (epoll_ctl(w->epfd, op, want[i].fd, &ev) < 0) {
+            perror("epoll_ctl");
+            return -1;
+        }
+    }
+    for (j = 0; j < c->nwatched; j++) {
+        for (i = 0; i < n && want[i].fd != c->watched[j].fd; i++) {
+        }
+        if (i == n) {
+            epoll_ctl(w->epfd, EPOLL_CTL_DEL, c->watched[j].fd, NULL);
+        }
+    }
+
+    c->nwatched = 0;
+    for (i = 0; i < n; i++) {
+        if (want[i].events) {
+            c->watched[c->nwatched++] = want[i];
+        }
+    }
+    return 0;
+}
+
+/**
+ * Accept a new client and start watching it
+ *
+ * The listener is shared by all workers, so another one may have taken
+ * the connection already; that is not an error.
+ *
+ * @param w Worker state
+ */
+static void worker_accept(worker *w)
+{
+    conn *c;
+    int sock;
+
+    sock = accept_connection(w->listener);
+    if (sock < 0) {
+        return;
+    }
+    if (fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK) < 0) {
+        perror("fcntl O_NONBLOCK");
+        close(sock);
+        return;
+    }
+
+    c = malloc(sizeof(*c));
+    if (c == NULL) {
+        perror("malloc");
+        close(sock);
+        return;
+    }
+    conn_init(c, sock);
+    c->ring = w->ring;
+    c->pipe = w->pipe;
+
+    if (worker_watch(w, c) < 0) {
+        conn_close(c);
+        close(sock);
+        free(c);
+        return;
+    }
+
+    c->next = w->conns;
+    if (w->conns) {
+        w->conns->prev = c;
+    }
+    w->conns = c;
+}
+
+/**
+ * Stop serving a client and release everything it holds
+ *
+ * @param w Worker state
+ * @param c Connection to drop
+ */
+static void worker_drop(worker *w, conn *c)
+{
+    int i;
+
+    for (i = 0; i < c->nwatched; i++) {
+        epoll_ctl(w->epfd, EPOLL_CTL_DEL, c->watched[i].fd, NULL);
+    }
+    if (c->paused_until) {
+        w->paused--;
+    }
+    conn_close(c);
+    close(c->sock);
+
+    if (c->prev) {
+        c->prev->next = c->next;
+    } else {
+        w->conns = c->next;
+    }
+    if (c->next) {
+        c->next->prev = c->prev;
+    }
+    free(c);
+}
+
+/**
+ * Stop reading a client over its share of the bandwidth limit
+ *
+ * The socket isn't waited on for reading until `worker_resume()` puts it
+ * back after `c->wait`; queued replies still go out meanwhile.
+ *
+ * @param w Worker state
+ * @param c Connection that has returned `CONN_WAIT`
+ *
+ * @return 0 on success, -1 on error
+ */
+static int worker_pause(worker *w, conn *c)
+{
+    if (!c->paused_until) {
+        w->paused++;
+    }
+    c->paused_until = now_ns() + c->wait;
+    return worker_watch(w, c);
+}
+
+/**
+ * Read again the paused clients whose wait is over
+ *
+ * @param w Worker state
+ *
+ * @return Milliseconds until the next paused client is due, -1 if none
+ */
+static int worker_resume(worker *w)
+{
+    uint64_t now = now_ns(), next = UINT64_MAX;
+    conn *c = w->conns;
+
+    while (c && w->paused > 0) {
+        conn *following = c->next;
+
+        if (c->paused_until && c->paused_until <= now) {
+            c->paused_until = 0;
+            c->last_active = time(NULL);
+            w->paused--;
+            if (worker_watch(w, c) < 0) {
+                worker_drop(w, c);
+            }
+        } else if (c->paused_until && c->paused_until < next) {
+            next = c->paused_until;
+        }
+        c = following;
+    }
+    return next == UINT64_MAX ? -1 : (int)((next - now + 999999) / 1000000);
+}
+
+/**
+ * Advance a connection and wait for its next events
+ *
+ * @param w Worker state
+ * @param c Connection
+ *
+ * @return 0 on success, -1 if the connection is to be dropped
+ */
+static int worker_process(worker *w, conn *c)
+{
+    conn_result rc = conn_process(c, w->buf);
+
+    if (rc == CONN_EOF || rc == CONN_ERROR) {
+        return -1;
+    }
+    return rc == CONN_WAIT ? worker_pause(w, c) : worker_watch(w, c);
+}
+
+/**
+ * Drop the clients that have been silent for too long
+ *
+ * Paused clients aren't read, so they aren't taken as silent. The
+ * connections whose next receiver of a chain has stalled go on without
+ * it.
+ *
+ * @param w   Worker state
+ * @param now Current time
+ */
+static void worker_sweep(worker *w, time_t now)
+{
+    conn *c = w->conns;
+
+    while (c) {
+        conn *next = c->next;
+        time_t idle = c->paused_until ? 0 : conn_idle(c, now);
+
+        if (idle >= w->opts->idle_timeout) {
+            printf("Dropping connection idle for %ld seconds\n", (long)idle);
+            worker_drop(w, c);
+        } else if (conn_sweep(c, now) && worker_process(w, c) < 0) {
+            worker_drop(w, c);
+        }
+        c = next;
+    }
+}
+
+/**
+ * Serve connections of one worker thread
+ *
+ * Waits for readiness of the listener and the worker's connections and
+ * advances the state machines of the ready ones. Once a second the idle
+ * connections are swept. Connections over their share of `--limit`
+ * are left alone until they may go on.
+ *
+ * @param arg Pointer to the `worker`
+ *
+ * @return `NULL` if the event loop fails
+ */
+static void *worker_loop(void *arg)
+{
+    worker *w = arg;
+    struct epoll_event events[WORKER_MAX_EVENTS];
+    time_t last_sweep = time(NULL);
+
+    while (1) {
+        int i, j, n, timeout = 1000;
+        time_t now;
+
+        if (w->paused > 0) {
+            int due = worker_resume(w);
+
+            if (due >= 0 && due < timeout) {
+                timeout = due;
+            }
+        }
+        n = epoll_wait(w->epfd, events, WORKER_MAX_EVENTS, timeout);
+
+        if (n < 0 && errno != EINTR) {
+            perror("epoll_wait");
+            return NULL;
+        }
+        for (i = 0; i < n; i++) {
+            conn *c = events[i].data.ptr;
+
+            if (c == NULL) {
+                worker_accept(w);
+                continue;
+            }
+            if (worker_process(w, c) < 0) {
+                /* Its other descriptors may have events in this batch too */
+                for (j = i + 1; j < n; j++) {
+                    if (events[j].data.ptr == c) {
+                        events[j--] = events[--n];
+                    }
+                }
+                worker_drop(w, c);
+            }
+        }
+
+        now = time(NULL);
+        if (now != last_sweep) {
+            worker_sweep(w, now);
+            last_sweep = now;
+        }
+    }
+}
+
+/**
+ * Set up a worker with its own epoll instance watching the listener
+ *
+ * @param w        Worker state to initialize
+ * @param listener Non-blocking listening socket shared by all workers
+ * @param opts     Receiver options
+ *
+ * @return 0 on success, -1 on error
+ */
+static int worker_init(worker *w, int listener, const receiver_opts *opts)
+{
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+
+#ifdef EPOLLEXCLUSIVE
+    /* Wake up only one worker per incoming connection */
+    ev.events |= EPOLLEXCLUSIVE;
+#endif
+
+    w->listener = listener;
+    w->opts = opts;
+    w->conns = NULL;
+    w->paused = 0;
+    w->ring = uring_enabled ? uring_rx_create() : NULL;
+    w->pipe = pipeline_enabled && !w->ring ? pipeline_rx_create() : NULL;
+    w->buf = malloc(CHUNK_SIZE);
+    if (w->buf == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    w->epfd = epoll_create1(0);
+    if (w->epfd < 0) {
+        perror("epoll_create1");
+        free(w->buf);
+        return -1;
+    }
+    if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, listener, &ev) < 0) {
+        perror("epoll_ctl");
+        close(w->epfd);
+        free(w->buf);
         return -1;
     }
+    return 0;
+}
+
+/**
+ * Serve clients with a pool of event-driven worker threads
+ *
+ * @param listener Listening socket
+ * @param opts     Receiver options
+ *
+ * @return -1 if the workers can't be started or fail
+ */
+static int serve(int listener, const receiver_opts *opts)
+{
+    worker *workers;
+    pthread_t *threads;
+    int i;
+
+    if (fcntl(listener, F_SETFL, fcntl(listener, F_GETFL) | O_NONBLOCK) < 0) {
+        perror("fcntl O_NONBLOCK");
+        return -1;
+    }
+
+    workers = calloc((size_t)opts->threads, sizeof(*workers));
+    threads = calloc((size_t)opts->threads, sizeof(*threads));
+    if (workers == NULL || threads == NULL) {
+        perror("calloc");
+        return -1;
+    }
+
+    for (i = 0; i < opts->threads; i++) {
+        if (worker_init(&workers[i], listener, opts) < 0) {
+            return -1;
+        }
+    }
+    if (uring_enabled && workers[0].ring == NULL) {
+        printf("io_uring is not available, using splice()\n");
+    }
+    /* The main thread serves as the last worker */
+    for (i = 0; i < opts->threads - 1; i++) {
+        if (pthread_create(&threads[i], NULL, worker_loop, &workers[i]) != 0) {
+            perror("pthread_create");
+            return -1;
+        }
+    }
+    worker_loop(&workers[opts->threads - 1]);
+    return -1;
+}
+
+#else /* !__linux__ */
+
+typedef struct {
+    int                  sock;
+    const receiver_opts *opts;
+} client;
+
+/**
+ * Serve a single client connection
+ *
+ * Receives files from the connection until the client closes it,
+ * something goes wrong, or the client stays silent for too long,
+ * then closes the socket. Runs in its own thread, waiting for the
+ * events of the connection with `poll()`.
+ *
+ * @param arg Pointer to a heap-allocated `client`
+ *
+ * @return Always `NULL`
+ */
+static void *handle_client(void *arg)
+{
+    client *cl = arg;
+    char *buf = malloc(CHUNK_SIZE);
+    conn_result rc = CONN_ERROR;
+    conn c;
+
+    conn_init(&c, cl->sock);
+    c.pipe = pipeline_enabled ? pipeline_rx_create() : NULL;
+    if (fcntl(cl->sock, F_SETFL, fcntl(cl->sock, F_GETFL) | O_NONBLOCK) < 0) {
+        perror("fcntl O_NONBLOCK");
+        free(buf);
+        buf = NULL;
+    }
+
+    while (buf) {
+        rc = conn_process(&c, buf);
+        if (rc == CONN_AGAIN) {
+            struct pollfd fds[CONN_MAX_FDS];
+
+            if (poll(fds, (nfds_t)conn_events(&c, fds), 1000) < 0 && errno != EINTR) {
+                perror("poll");
+                break;
+            }
+            if (conn_idle(&c, time(NULL)) >= cl->opts->idle_timeout) {
+                printf("Dropping connection idle for %d seconds\n",
+                       cl->opts->idle_timeout);
+                break;
+            }
+            conn_sweep(&c, time(NULL));
+        }
+        if (rc == CONN_EOF || rc == CONN_ERROR) {
+            break;
+        }
+        if (rc == CONN_WAIT) {
+            struct timespec ts = {.tv_sec = (time_t)(c.wait / 1000000000u),
+                                  .tv_nsec = (long)(c.wait % 1000000000u)};
+
+            nanosleep(&ts, NULL);
+            c.last_active = time(NULL);
+        }
+    }
+
+    conn_close(&c);
+    if (c.pipe) {
+        pipeline_rx_destroy(c.pipe);
+    }
+    close(cl->sock);
+    free(buf);
+    free(cl);
 
-    /* Start accepting connections */
+    return NULL;
+}
+
+/**
+ * Serve clients with a thread per connection
+ *
+ * @param listener Listening socket
+ * @param opts     Receiver options
+ *
+ * @return Never returns normally
+ */
+static int serve(int listener, const receiver_opts *opts)
+{
     while (1) {
+        pthread_t thread;
+        client *cl;
         int sock = accept_connection(listener);
         if (sock < 0) {
             continue;
         }
 
-        receive_file(sock);
-        close(sock);
+        cl = malloc(sizeof(*cl));
+        if (cl == NULL) {
+            perror("malloc");
+            close(sock);
+            continue;
+        }
+        cl->sock = sock;
+        cl->opts = opts;
+        if (pthread_create(&thread, NULL, handle_client, cl) != 0) {
+            perror("pthread_create");
+            close(sock);
+            free(cl);
+            continue;
+        }
+        pthread_detach(thread);
     }
+    return 0;
+}
+
+#endif /* __linux__ */
+
+/**
+ * Allow as many open descriptors as the hard limit permits
+ *
+ * Every client takes a socket, a file and a splice pipe, so the default
+ * soft limit of 1024 descriptors runs out after a few hundred clients.
+ */
+static void raise_fd_limit(void)
+{
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
 
+int exec_receiver(const receiver_opts *opts)
+{
+    udp_server *udp = NULL;
+    int listener, rc;
+
+    raise_fd_limit();
+
+    listener = start_listener(opts->port);
+    if (listener < 0) {
+        return -1;
+    }
+    if (opts->udp) {
+        udp = udp_server_start(opts->port, opts->idle_timeout);
+        if (udp == NULL) {
+            close(listener);
+            return -1;
+        }
+    }
+
+    rc = serve(listener, opts);
+
+    udp_server_stop(udp);
     close(listener);
 
     printf("\nShutting down...\n");
-    return 0;
+    return rc;
 }
-
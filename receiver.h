@@ -1,15 +1,32 @@
 #pragma once
 
+/** Default number of threads serving client connections */
+#define RECEIVER_THREADS 4
+
+/** Default number of seconds a client may stay silent before it's dropped */
+#define RECEIVER_IDLE_TIMEOUT 60
+
+typedef struct {
+    int port;          /**< Port number to listen on */
+    int threads;       /**< Number of threads serving connections */
+    int idle_timeout;  /**< Seconds of inactivity before dropping a client */
+    int udp;           /**< Also receive over UDP on the same port, see `udp.h` */
+} receiver_opts;
+
 /**
  * Execute the file receiving server process
  *
- * Sets up a listening socket, then enters an infinite loop to
- * accept connections and receive files. Each client connection
- * is handled sequentially. After receiving a file, the connection
- * is closed and the server waits for the next connection.
+ * Sets up a listening socket and serves client connections until the
+ * process is killed. On Linux a small pool of threads multiplexes all
+ * connections with `epoll`, each connection being a `conn` state machine
+ * over a non-blocking socket, so a slow or stalled client doesn't hold up
+ * the others. Elsewhere each connection gets a thread of its own.
+ * Clients that send nothing for `idle_timeout` seconds are disconnected.
+ * With `udp` transfers over UDP are served alongside, by `udp_server_start()`.
+ * With `limit_enabled` the clients share the bandwidth limit, see `limit.h`.
  *
- * @param port Port number to listen on
+ * @param opts Receiver options
  *
  * @return 0 on normal exit, -1 on startup error
  */
-int exec_receiver(int port);
+int exec_receiver(const receiver_opts *opts);
@@ -0,0 +1,123 @@
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "client.h"
+#include "const.h"
+#include "fsock.h"
+#include "relay.h"
+
+const char *relay_host = NULL;
+const char *relay_port = NULL;
+
+/** Host part of the `--relay` argument */
+static char relay_name[256];
+
+/** Addresses of the next receiver, resolved once for all the connections */
+static struct addrinfo *relay_addrs;
+
+int relay_parse(const char *dest)
+{
+    struct addrinfo hints = {0};
+    int err;
+
+    relay_port = split_host_port(dest, DEFAULT_PORT_STR, relay_name, sizeof(relay_name));
+    if (relay_name[0] == '\0' || relay_port[0] == '\0') {
+        return -1;
+    }
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    err = getaddrinfo(relay_name, relay_port, &hints, &relay_addrs);
+    if (err) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(err));
+        return -1;
+    }
+    relay_host = relay_name;
+    return 0;
+}
+
+int relay_connect(size_t *next)
+{
+    struct addrinfo *ai = relay_addrs;
+    size_t i;
+    int sock, err;
+
+    for (i = 0; ai && i < *next; i++) {
+        ai = ai->ai_next;
+    }
+    for (; ai && *next < CONNECT_MAX_ADDRS; ai = ai->ai_next) {
+        ++*next;
+        sock = connect_start(ai, &err);
+        if (sock >= 0) {
+            return sock;
+        }
+        errno = err;
+        perror("connect");
+    }
+    return -1;
+}
+
+int relay_connected(int sock)
+{
+    struct pollfd pfd = {.fd = sock, .events = POLLOUT};
+    socklen_t len = sizeof(int);
+    int err = 0;
+
+    if (poll(&pfd, 1, 0) == 0) {
+        return 0;
+    }
+    if (getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &len) < 0) {
+        perror("getsockopt SO_ERROR");
+        return -1;
+    }
+    if (err) {
+        errno = err;
+        perror("connect");
+        return -1;
+    }
+    return 1;
+}
+
+ssize_t relay_forward(int sock, const void *buf, size_t length)
+{
+    ssize_t n;
+
+    while ((n = send(sock, buf, length, MSG_DONTWAIT)) < 0 && errno == EINTR)
+        ;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return FSOCK_AGAIN;
+    }
+    if (n < 0) {
+        perror("send");
+    }
+    return n;
+}
+
+int relay_finish(int sock)
+{
+    if (shutdown(sock, SHUT_WR) < 0) {
+        perror("shutdown");
+        return -1;
+    }
+    return 0;
+}
+
+int relay_verdict(int sock)
+{
+    unsigned char verdict;
+    ssize_t rc;
+
+    while ((rc = recv(sock, &verdict, sizeof(verdict), MSG_DONTWAIT)) < 0 && errno == EINTR)
+        ;
+    if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return FSOCK_AGAIN;
+    }
+    if (rc < 0) {
+        perror("recv");
+        return RELAY_FAILED;
+    }
+    return rc > 0 ? verdict : 0;
+}
@@ -0,0 +1,120 @@
+/**
+ * @file relay.h
+ * @brief Forwarding the received data down a chain of receivers
+ *
+ * With `--relay` a receiver connects every client connection to the next
+ * receiver of a chain and forwards whatever arrives on it right away,
+ * before writing it to its own disk. The stream is forwarded as is, so
+ * the next receiver sees the sender's headers, records and hashes, and
+ * may relay it further. Delivering to N hosts this way takes about one
+ * transfer plus a chunk's delay per hop, instead of N transfers from a
+ * sender's single link.
+ *
+ * Nothing blocks: the relay connects while the client's first data
+ * arrives, and holds up to `RELAY_BUFFER` of it for a next receiver
+ * slower than the client, not reading the client meanwhile. A next
+ * receiver that takes nothing for `RELAY_TIMEOUT` is given up on.
+ *
+ * When the client is done, the relay waits for the next receiver to
+ * complete before it closes the client's connection, so the sender
+ * knows the whole chain has the data. A failure down the chain doesn't
+ * stop the relay from receiving its own copy; the sender is told with a
+ * `RELAY_FAILED` byte at the end instead.
+ *
+ * Transfers that need replies from the receiver, resumable and delta
+ * ones, can't be relayed.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/** Relay's reply when a receiver down the chain hasn't got the data */
+#define RELAY_FAILED 0xfe
+
+/** Seconds a relay waits for the next receiver before giving up on it */
+#define RELAY_TIMEOUT 60
+
+/** Data a relay holds for the next receiver before it stops reading the client */
+#define RELAY_BUFFER (1024 * 1024)
+
+/**
+ * Next receiver of the chain, or `NULL` when not relaying
+ *
+ * Set with `relay_parse()` from the command line before any client
+ * connects.
+ */
+extern const char *relay_host;
+
+/** Port of the next receiver of the chain */
+extern const char *relay_port;
+
+/**
+ * Set the next receiver of the chain and resolve its addresses
+ *
+ * @param dest Receiver as "host" or "host:port"
+ *
+ * @return 0 on success, -1 if it's empty or can't be resolved
+ */
+int relay_parse(const char *dest);
+
+/**
+ * Start connecting to the next receiver of the chain
+ *
+ * The connection isn't waited for: the socket is non-blocking and
+ * becomes writable once connected or failed, see `relay_connected()`.
+ * The addresses are tried in turn, from `*next` on, so after a failed
+ * attempt the next address is tried by calling it again.
+ *
+ * @param next Index of the address to try first, advanced past the one
+ *             being connected to
+ *
+ * @return Socket being connected, or -1 once no address is left
+ */
+int relay_connect(size_t *next);
+
+/**
+ * Tell whether a connection from `relay_connect()` is established
+ *
+ * @param sock Socket from `relay_connect()`
+ *
+ * @return 1 if connected, 0 if still connecting, -1 if it has failed
+ */
+int relay_connected(int sock);
+
+/**
+ * Forward received data to the next receiver, as much as the socket
+ * takes without blocking
+ *
+ * @param sock   Socket from `relay_connect()`, connected
+ * @param buf    Data received
+ * @param length Data length
+ *
+ * @return Number of bytes forwarded, `FSOCK_AGAIN` if none can be yet,
+ *         -1 on error
+ */
+ssize_t relay_forward(int sock, const void *buf, size_t length);
+
+/**
+ * Tell the next receiver that all the data has been forwarded
+ *
+ * @param sock Socket from `relay_connect()`, with all the data forwarded
+ *
+ * @return 0 on success, -1 on error
+ */
+int relay_finish(int sock);
+
+/**
+ * Read the next receiver's verdict, without blocking
+ *
+ * A receiver that has got everything closes the connection once told
+ * with `relay_finish()`; one that replies or closes it before has failed.
+ *
+ * @param sock Socket from `relay_connect()`
+ *
+ * @return 0 if the receiver has closed the connection, the byte it has
+ *         replied with, `FSOCK_AGAIN` if it hasn't done either yet, or
+ *         `RELAY_FAILED` on error
+ */
+int relay_verdict(int sock);
@@ -0,0 +1,187 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "fsock.h"
+#include "resume.h"
+
+/** Identifies a sidecar file and its format version */
+#define RESUME_MAGIC 0x31534552474e4c46ULL  /* "FLNGRES1" */
+
+/** Contents of a sidecar file */
+typedef struct {
+    uint64_t magic;
+    uint64_t fsize;     /**< Size of the complete file */
+    uint64_t received;  /**< Bytes already written from the start of the file */
+} resume_state;
+
+/**
+ * Make the sidecar name for a file: `.<name>.fling`
+ *
+ * @param buf   Buffer of `MAX_FILE_NAME + 1` bytes
+ * @param fname Name of the file being received
+ *
+ * @return 0 on success, -1 if the name would be too long
+ */
+static int resume_sidecar(char *buf, const char *fname)
+{
+    int len = snprintf(buf, MAX_FILE_NAME + 1, ".%s.fling", fname);
+
+    return len > 0 && len <= MAX_FILE_NAME ? 0 : -1;
+}
+
+/**
+ * Start of the verification block that ends at `offset`
+ *
+ * @param offset End of the block, greater than 0
+ *
+ * @return Offset of the block start
+ */
+static size_t resume_block_start(size_t offset)
+{
+    return (offset - 1) / RESUME_BLOCK * RESUME_BLOCK;
+}
+
+int resume_checksum(int fd, size_t offset, uint64_t *sum)
+{
+    char buf[CHUNK_SIZE];
+    size_t pos = resume_block_start(offset);
+    uint64_t h = 0xcbf29ce484222325ULL;  /* FNV-1a */
+
+    while (pos < offset) {
+        size_t want = offset - pos < sizeof(buf) ? offset - pos : sizeof(buf);
+        ssize_t n = pread(fd, buf, want, (off_t)pos);
+        ssize_t i;
+
+        if (n <= 0) {
+            if (n < 0) {
+                perror("pread");
+            }
+            return -1;
+        }
+        for (i = 0; i < n; i++) {
+            h = (h ^ (unsigned char)buf[i]) * 0x100000001b3ULL;
+        }
+        pos += (size_t)n;
+    }
+
+    *sum = h;
+    return 0;
+}
+
+void resume_make_offer(const file *f, resume_offer *offer)
+{
+    char sidecar[MAX_FILE_NAME + 1];
+    resume_state state;
+    struct stat file_stat;
+    int fd;
+
+    offer->offset = 0;
+    offer->checksum = 0;
+    if (resume_sidecar(sidecar, f->hdr.fname) < 0) {
+        return;
+    }
+
+    fd = open(sidecar, O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+    if (read(fd, &state, sizeof(state)) != sizeof(state)
+        || state.magic != RESUME_MAGIC
+        || state.fsize != f->hdr.fsize
+        || state.received == 0
+        || state.received > state.fsize
+        || fstat(f->fd, &file_stat) < 0
+        || (uint64_t)file_stat.st_size < state.received
+        || resume_checksum(f->fd, state.received, &offer->checksum) < 0) {
+        close(fd);
+        return;
+    }
+    close(fd);
+
+    offer->offset = state.received;
+}
+
+int resume_start(file *f, size_t start)
+{
+    if (ftruncate(f->fd, (off_t)start) < 0) {
+        perror("ftruncate");
+        return -1;
+    }
+    if (lseek(f->fd, (off_t)start, SEEK_SET) < 0) {
+        perror("lseek");
+        return -1;
+    }
+    if (start > 0) {
+        printf("Resuming %s from %zu bytes\n", f->hdr.fname, start);
+    }
+    f->hdr.offset = start;
+    f->hdr.length = f->hdr.fsize - start;
+    return 0;
+}
+
+void resume_save(const file *f, size_t received)
+{
+    char sidecar[MAX_FILE_NAME + 1];
+    resume_state state = {
+        .magic = RESUME_MAGIC,
+        .fsize = f->hdr.fsize,
+        .received = received < f->hdr.fsize
+                    ? received / RESUME_BLOCK * RESUME_BLOCK : f->hdr.fsize,
+    };
+    int fd;
+
+    if (resume_sidecar(sidecar, f->hdr.fname) < 0) {
+        return;
+    }
+    fd = open(sidecar, O_WRONLY | O_CREAT, 0644);
+    if (fd < 0) {
+        perror("open sidecar");
+        return;
+    }
+    if (pwrite(fd, &state, sizeof(state), 0) != sizeof(state)) {
+        perror("write sidecar");
+    }
+    close(fd);
+}
+
+void resume_remove(const file *f)
+{
+    char sidecar[MAX_FILE_NAME + 1];
+
+    if (resume_sidecar(sidecar, f->hdr.fname) == 0
+        && unlink(sidecar) < 0 && errno != ENOENT) {
+        perror("unlink sidecar");
+    }
+}
+
+int resume_negotiate(file *f, int sock)
+{
+    resume_offer offer;
+    uint64_t start = 0, sum;
+
+    if (recv_all(sock, &offer, sizeof(offer)) < 0) {
+        return -1;
+    }
+
+    if (offer.offset > 0 && offer.offset <= f->hdr.fsize
+        && resume_checksum(f->fd, offer.offset, &sum) == 0
+        && sum == offer.checksum) {
+        start = offer.offset;
+        printf("Resuming from %" PRIu64 " bytes\n", start);
+    } else if (offer.offset > 0) {
+        printf("The partial file doesn't match, sending it again\n");
+    }
+
+    if (send_all(sock, &start, sizeof(start)) < 0) {
+        return -1;
+    }
+    f->hdr.offset = start;
+    f->hdr.length = f->hdr.fsize - start;
+    return 0;
+}
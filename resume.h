@@ -0,0 +1,107 @@
+/**
+ * @file resume.h
+ * @brief Resuming interrupted transfers
+ *
+ * A transfer started with `FHDR_RESUME` keeps a small sidecar file next
+ * to the partial file on the receiving side, recording how much of it
+ * has been written, in whole `RESUME_BLOCK`s. When the same file is sent
+ * again, the negotiation goes as follows:
+ *
+ * 1. The sender sends the header with `FHDR_RESUME`.
+ * 2. The receiver replies with a `resume_offer`: the recorded offset and
+ *    the checksum of the block right before it.
+ * 3. The sender checks the block against its own copy and sends the
+ *    offset to continue from as a `uint64_t`: the offered one if the
+ *    checksums match, 0 otherwise.
+ * 4. The sender sends the data from that offset on.
+ *
+ * At most one block of data that had already been received is sent again.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "file.h"
+
+/** Granularity of the recorded progress and of the checksum check */
+#define RESUME_BLOCK ((size_t)4 * 1024 * 1024)
+
+/** How often the receiver records the progress of a resumable transfer */
+#define RESUME_SAVE_INTERVAL (RESUME_BLOCK * 16)
+
+/** Receiver's reply to a `FHDR_RESUME` header */
+typedef struct {
+    uint64_t offset;    /**< Bytes the receiver already has */
+    uint64_t checksum;  /**< Checksum of the block before `offset`, see `resume_checksum()` */
+} resume_offer;
+
+/**
+ * Checksum the verification block that ends at `offset`
+ *
+ * The block starts at the previous multiple of `RESUME_BLOCK`, so it is
+ * shorter than that only at the end of the file.
+ *
+ * @param fd     File descriptor to read from
+ * @param offset End of the block, greater than 0
+ * @param sum    Set to the checksum
+ *
+ * @return 0 on success, -1 on error (including a file shorter than `offset`)
+ */
+int resume_checksum(int fd, size_t offset, uint64_t *sum);
+
+/**
+ * Work out how much of a partial file can be kept
+ *
+ * Reads the sidecar of the file opened by `file_accept()` and checks it
+ * against the header and the file on disk.
+ *
+ * @param f     Accepted file with a `FHDR_RESUME` header
+ * @param offer Set to the offer for the sender; the offset is 0 when
+ *              there is nothing to resume
+ */
+void resume_make_offer(const file *f, resume_offer *offer);
+
+/**
+ * Position the file at the offset the sender agreed to continue from
+ *
+ * Drops anything past `start` and narrows `hdr.offset` and `hdr.length`
+ * to the remaining part of the file.
+ *
+ * @param f     Accepted file with a `FHDR_RESUME` header
+ * @param start Offset sent by the sender, at most the offered one
+ *
+ * @return 0 on success, -1 on error
+ */
+int resume_start(file *f, size_t start);
+
+/**
+ * Record that the file has been written up to `received` bytes
+ *
+ * Rounds `received` down to a whole block, unless the file is complete.
+ *
+ * @param f        File being received
+ * @param received Bytes of the file written so far from its start
+ */
+void resume_save(const file *f, size_t received);
+
+/**
+ * Remove the sidecar of a completely received file
+ *
+ * @param f File that has been received
+ */
+void resume_remove(const file *f);
+
+/**
+ * Negotiate the offset to continue from on the sending side
+ *
+ * Called right after a `FHDR_RESUME` header has been sent. Narrows
+ * `hdr.offset` and `hdr.length` to the part that still has to be sent.
+ *
+ * @param f    File being sent
+ * @param sock Connected socket descriptor
+ *
+ * @return 0 on success, -1 on error
+ */
+int resume_negotiate(file *f, int sock);
@@ -1,54 +1,986 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 
+#include "cache.h"
 #include "client.h"
 #include "debug.h"
+#include "delta.h"
 #include "file.h"
+#include "fsock.h"
+#include "hash.h"
+#include "limit.h"
 #include "progress.h"
+#include "relay.h"
+#include "sender.h"
+#include "stats.h"
+#include "tree.h"
+#include "tune.h"
+#include "udp.h"
+#include "zerocopy.h"
+
+/** Average number of segments per stream, so a slow stream can't hold up the rest */
+#define STRIPE_SEGMENTS_PER_STREAM 4
+
+/** Largest byte range sent with a single stripe header */
+#define STRIPE_MAX_SEGMENT ((size_t)64 * SIZE_MB)
+
+/** How often the striped sender checks the throughput in auto mode */
+#define STRIPE_POLL_US 200000
+
+/** Number of polls between stream count adjustments in auto mode */
+#define STRIPE_ADAPT_POLLS 5
+
+/** Minimal throughput gain for auto mode to keep adding streams */
+#define STRIPE_ADAPT_GAIN 1.1
+
+/** Chunks a receiver of a fan-out may be behind the reads, 16 MB */
+#define FANOUT_DEPTH 64
+
+/** How often the reads of a fan-out charge the receivers holding them back */
+#define FANOUT_POLL_MS 100
+
+/**
+ * State shared by the streams of a striped transfer
+ *
+ * Streams take segments of `segment` bytes from `next` until the file
+ * is exhausted, so a faster connection simply ends up sending more of them.
+ */
+typedef struct {
+    const file  *f;
+    const char  *host;
+    const char  *port;
+    stats_transfer *stats;
+    progress_transfer *progress;
+    tune_transfer *tune;
+    size_t       segment;
+    atomic_size_t next;
+    atomic_int   running;
+    atomic_int   failed;
+} stripe_ctx;
+
+/**
+ * Wait until the receiver is done with the file
+ *
+ * Half-closes the connection and waits for the receiver to close its end,
+ * which it does only after the whole file has been written. Without this
+ * the sender could report success while the data is still in flight.
+ * The receiver sends nothing back at this point unless it has found the
+ * data corrupted, see `HASH_MISMATCH`.
+ *
+ * @param sock Connected socket descriptor
+ *
+ * @return 0 if the receiver closed the connection cleanly, -1 otherwise
+ */
+static int wait_receiver(int sock)
+{
+    ssize_t rc;
+    unsigned char c;
+
+    if (shutdown(sock, SHUT_WR) < 0) {
+        perror("shutdown");
+        return -1;
+    }
+    while ((rc = recv(sock, &c, sizeof(c), 0)) < 0 && errno == EINTR)
+        ;
+    if (rc < 0) {
+        perror("recv");
+        return -1;
+    }
+    if (rc > 0 && c == RELAY_FAILED) {
+        printf("A receiver down the relay chain hasn't got the data\n");
+        return -1;
+    }
+    if (rc > 0) {
+        printf("The receiver has found the data corrupted\n");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Send segments of the file over a connection of its own
+ *
+ * Connects to the receiver and keeps sending the next unclaimed segment
+ * with a `FHDR_STRIPE` header until none are left or another stream fails.
+ *
+ * @param arg Pointer to the shared `stripe_ctx`
+ *
+ * @return Always `NULL`
+ */
+static void *stripe_worker(void *arg)
+{
+    stripe_ctx *ctx = arg;
+    int sock;
+
+    stats_current = ctx->stats;
+    progress_current = ctx->progress;
+    tune_current = ctx->tune;
+    sock = establish_connection(ctx->host, ctx->port);
+    if (sock < 0) {
+        ctx->failed = 1;
+        ctx->running--;
+        return NULL;
+    }
+    stats_watch(ctx->stats, sock);
+    tune_watch(ctx->tune, sock);
+    limit_current = limit_join();
+
+    while (!ctx->failed) {
+        file stripe = *ctx->f;
+        size_t offset = atomic_fetch_add(&ctx->next, ctx->segment);
+
+        if (offset >= stripe.hdr.fsize) {
+            break;
+        }
+        stripe.hdr.flags |= FHDR_STRIPE;
+        stripe.hdr.offset = offset;
+        stripe.hdr.length = stripe.hdr.fsize - offset < ctx->segment
+                            ? stripe.hdr.fsize - offset : ctx->segment;
+
+        if (file_send(&stripe, sock) < 0) {
+            ctx->failed = 1;
+        }
+    }
+
+    if (!ctx->failed && wait_receiver(sock) < 0) {
+        ctx->failed = 1;
+    }
+    limit_leave(limit_current);
+    limit_current = NULL;
+    stats_unwatch(ctx->stats, sock);
+    tune_unwatch(ctx->tune, sock);
+    close(sock);
+    ctx->running--;
+    return NULL;
+}
+
+/**
+ * Pick the segment size for a striped transfer
+ *
+ * Aims at `STRIPE_SEGMENTS_PER_STREAM` segments per stream, rounded up
+ * to whole chunks and capped at `STRIPE_MAX_SEGMENT`.
+ *
+ * @param fsize   File size
+ * @param streams Maximal number of streams
+ *
+ * @return Segment size in bytes
+ */
+static size_t stripe_segment(size_t fsize, int streams)
+{
+    size_t segment = fsize / ((size_t)streams * STRIPE_SEGMENTS_PER_STREAM);
+
+    segment = (segment + CHUNK_SIZE - 1) / CHUNK_SIZE * CHUNK_SIZE;
+    if (segment < CHUNK_SIZE) {
+        return CHUNK_SIZE;
+    }
+    return segment < STRIPE_MAX_SEGMENT ? segment : STRIPE_MAX_SEGMENT;
+}
+
+/**
+ * Send the file over several connections at once
+ *
+ * Starts the stream threads and waits until they are done, all of them
+ * counting the data in the progress of the calling thread, which must
+ * have one. With `STREAMS_AUTO` the transfer starts with a single stream and
+ * adds one more every `STRIPE_ADAPT_POLLS` polls for as long as that
+ * raises the throughput by at least `STRIPE_ADAPT_GAIN`.
+ *
+ * @param f       Opened file to send
+ * @param host    Hostname or IP address of the receiver
+ * @param port    Port number as a string
+ * @param streams Number of streams or `STREAMS_AUTO`, set to the number
+ *                of streams actually used on return
+ *
+ * @return Total bytes sent on success, -1 on error
+ */
+static ssize_t send_striped(const file *f, const char *host, const char *port,
+                            int *streams)
+{
+    stripe_ctx ctx = {.f = f, .host = host, .port = port, .stats = stats_current,
+                      .progress = progress_current, .tune = tune_current};
+    pthread_t threads[STREAMS_MAX];
+    int adaptive = *streams == STREAMS_AUTO, started = 0, polls = 0, i;
+    size_t last_sent = 0;
+    double best_rate = 0;
+
+    if (adaptive) {
+        *streams = 1;
+    }
+    ctx.segment = stripe_segment(f->hdr.fsize, adaptive ? STREAMS_MAX : *streams);
+
+    while (started < *streams) {
+        ctx.running++;
+        if (pthread_create(&threads[started], NULL, stripe_worker, &ctx) != 0) {
+            perror("pthread_create");
+            ctx.running--;
+            ctx.failed = 1;
+            break;
+        }
+        started++;
+    }
+
+    while (adaptive && ctx.running > 0) {
+        usleep(STRIPE_POLL_US);
+        if (++polls % STRIPE_ADAPT_POLLS) {
+            continue;
+        }
+
+        size_t sent = atomic_load(&ctx.progress->done);
+        double rate = (double)(sent - last_sent);
+        last_sent = sent;
+        if (rate > best_rate * STRIPE_ADAPT_GAIN && started < STREAMS_MAX
+            && ctx.next < f->hdr.fsize && !ctx.failed) {
+            best_rate = rate;
+            ctx.running++;
+            if (pthread_create(&threads[started], NULL, stripe_worker, &ctx) != 0) {
+                ctx.running--;
+                adaptive = 0;
+                continue;
+            }
+            started++;
+        } else {
+            adaptive = 0;
+        }
+    }
+
+    for (i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    *streams = started;
+    return ctx.failed ? -1 : (ssize_t)f->hdr.fsize;
+}
+
+/**
+ * Send a directory tree over a single connection
+ *
+ * @param path  Path to the directory to send
+ * @param host  Hostname or IP address of the receiver
+ * @param port  Port number as a string
+ * @param flags Header flags to add to every entry
+ *
+ * @return 0 on success, 1 on error
+ */
+static int send_tree(const char *path, const char *host, const char *port,
+                     uint32_t flags)
+{
+    size_t entries;
+    ssize_t total_size;
+    int sock;
+
+    sock = establish_connection(host, port);
+    if (sock < 0) {
+        return 1;
+    }
+    stats_watch(stats_current, sock);
+    tune_watch(tune_current, sock);
+    limit_current = limit_join();
+
+    /* The walker finds out the total on the way */
+    progress_current = progress_begin(0);
+    if (progress_current == NULL) {
+        total_size = -1;
+    } else {
+        total_size = tree_send(path, sock, flags, &entries);
+        /* A session has waited for the receiver already */
+        if (total_size >= 0 && !(flags & FHDR_SESSION) && wait_receiver(sock) < 0) {
+            total_size = -1;
+        }
+        progress_end(progress_current, total_size);
+        progress_current = NULL;
+    }
+    if (total_size >= 0) {
+        printf("Sent %zu entries\n", entries);
+    }
+
+    limit_leave(limit_current);
+    limit_current = NULL;
+    stats_unwatch(stats_current, sock);
+    tune_unwatch(tune_current, sock);
+    close(sock);
+    return total_size < 0;
+}
+
+/**
+ * Receiver of a fan-out transfer
+ *
+ * Everything but the address and `ctx` is protected by the lock of the
+ * context.
+ */
+typedef struct {
+    const char  *host;       /**< Receiver as given, "host" or "host:port" */
+    char         name[256];  /**< Host to connect to */
+    const char  *port;       /**< Port to connect to */
+    struct fanout_ctx *ctx;
+    pthread_t    thread;
+    int          sock;       /**< Connection, -1 until connected */
+    size_t       head;       /**< Chunks sent so far */
+    int          active;     /**< Still taking chunks */
+    int          failed;
+    int          dropped;    /**< Dropped for holding the others back */
+    double       stall;      /**< Seconds the reads have waited for it */
+    double       seconds;    /**< Time it took to receive the file */
+} fanout_dest;
+
+/**
+ * State of a fan-out transfer
+ *
+ * The file is read once into a ring of `FANOUT_DEPTH` chunks, and every
+ * receiver's thread sends the chunks from there at the receiver's pace.
+ * A chunk is read over only once all the receivers have sent it.
+ */
+typedef struct fanout_ctx {
+    const file      *f;
+    stats_transfer  *stats;
+    tune_transfer   *tune;
+    char            *bufs;
+    size_t           lengths[FANOUT_DEPTH];
+    size_t           chunks;     /**< Chunks of the file */
+    size_t           tail;       /**< Chunks read so far */
+    int              read_done;  /**< All the chunks have been read, and hashed */
+    int              read_failed;
+    hash_trailer     trailer;    /**< Hash of the file, complete with `read_done` */
+    struct timespec  start;
+    pthread_mutex_t  lock;
+    pthread_cond_t   cond;
+    fanout_dest     *dests;
+    int              ndests;
+} fanout_ctx;
+
+/**
+ * Seconds since a point in time
+ */
+static double fanout_since(const struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)(now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/**
+ * Send the chunks of the ring to a receiver as they're read
+ *
+ * @param arg Pointer to the `fanout_dest`
+ *
+ * @return Always `NULL`
+ */
+static void *fanout_worker(void *arg)
+{
+    fanout_dest *d = arg;
+    fanout_ctx *ctx = d->ctx;
+    file f = *ctx->f;
+    zerocopy_socket zc;
+    uint32_t tokens[FANOUT_DEPTH];
+    size_t sent = 0;
+    int sock, ok = 0;
+
+    stats_current = ctx->stats;
+    tune_current = ctx->tune;
+    sock = establish_connection(d->name, d->port);
+    if (sock >= 0) {
+        stats_watch(ctx->stats, sock);
+        tune_watch(ctx->tune, sock);
+        limit_current = limit_join();
+        zerocopy_start(&zc, sock);
+        pthread_mutex_lock(&ctx->lock);
+        d->sock = sock;
+        pthread_mutex_unlock(&ctx->lock);
+        ok = file_send_header(&f, sock) == 0;
+    }
+
+    while (ok) {
+        size_t slot, head = d->head;
+        int idle;
+
+        /* Chunks sent that the kernel is done with may be read over */
+        if (zerocopy_reap(&zc, 0) < 0) {
+            ok = 0;
+            break;
+        }
+        while (head < sent && zerocopy_done(&zc, tokens[head % FANOUT_DEPTH])) {
+            head++;
+        }
+
+        pthread_mutex_lock(&ctx->lock);
+        if (head != d->head) {
+            d->head = head;
+            pthread_cond_broadcast(&ctx->cond);
+        }
+        while (d->active && sent < ctx->chunks && sent == ctx->tail && head == sent
+               && !ctx->read_failed) {
+            pthread_cond_wait(&ctx->cond, &ctx->lock);
+        }
+        if (!d->active || ctx->read_failed) {
+            ok = 0;
+        }
+        if (!ok || sent == ctx->chunks) {
+            pthread_mutex_unlock(&ctx->lock);
+            break;
+        }
+        idle = sent == ctx->tail;
+        slot = sent % FANOUT_DEPTH;
+        pthread_mutex_unlock(&ctx->lock);
+
+        if (idle) {
+            /* Nothing to send until the reads get room for more */
+            if (zerocopy_reap(&zc, ZEROCOPY_POLL_MS) < 0) {
+                ok = 0;
+            }
+            continue;
+        }
+        /* Not read over before this receiver's `head` moves past it */
+        if (zerocopy_send(&zc, ctx->bufs + slot * (size_t)CHUNK_SIZE, ctx->lengths[slot],
+                          &tokens[slot]) < 0) {
+            ok = 0;
+            break;
+        }
+        sent++;
+    }
+    /* Not even a failed connection may send from the ring once it's freed */
+    if (sock >= 0 && zerocopy_flush(&zc) < 0) {
+        ok = 0;
+    }
+    if (ok) {
+        pthread_mutex_lock(&ctx->lock);
+        d->head = sent;
+        pthread_cond_broadcast(&ctx->cond);
+        pthread_mutex_unlock(&ctx->lock);
+    }
+
+    if (ok && f.hdr.flags & FHDR_HASH) {
+        pthread_mutex_lock(&ctx->lock);
+        while (d->active && !ctx->read_done && !ctx->read_failed) {
+            pthread_cond_wait(&ctx->cond, &ctx->lock);
+        }
+        ok = d->active && ctx->read_done;
+        pthread_mutex_unlock(&ctx->lock);
+        if (ok && send_all(sock, &ctx->trailer, sizeof(ctx->trailer)) < 0) {
+            ok = 0;
+        }
+    }
+    if (ok && wait_receiver(sock) < 0) {
+        ok = 0;
+    }
+
+    pthread_mutex_lock(&ctx->lock);
+    d->seconds = fanout_since(&ctx->start);
+    d->failed = !ok;
+    d->active = 0;
+    d->sock = -1;
+    pthread_cond_broadcast(&ctx->cond);
+    pthread_mutex_unlock(&ctx->lock);
+
+    if (sock >= 0) {
+        limit_leave(limit_current);
+        limit_current = NULL;
+        stats_unwatch(ctx->stats, sock);
+        tune_unwatch(ctx->tune, sock);
+        close(sock);
+    }
+    return NULL;
+}
 
 /**
- * Execute the file sending process
+ * Wait until every receiver still taking chunks has room for the next one
+ *
+ * Receivers a full ring behind hold the reads back. The time waited is
+ * charged to them, and one charged more than `max_lag` in total is
+ * dropped, so it can't hold the others back any longer. Called with the
+ * lock held.
+ *
+ * @param ctx     Fan-out context
+ * @param max_lag Seconds a receiver may hold the others back
+ *
+ * @return Number of receivers still taking chunks
+ */
+static int fanout_wait_room(fanout_ctx *ctx, int max_lag)
+{
+    for (;;) {
+        struct timespec deadline, before;
+        double waited;
+        int i, active = 0, full = 0;
+
+        for (i = 0; i < ctx->ndests; i++) {
+            fanout_dest *d = &ctx->dests[i];
+
+            if (d->active) {
+                active++;
+                full += ctx->tail - d->head >= FANOUT_DEPTH;
+            }
+        }
+        if (!full) {
+            return active;
+        }
+
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += (long)FANOUT_POLL_MS * 1000000;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000;
+        deadline.tv_nsec %= 1000000000;
+        clock_gettime(CLOCK_MONOTONIC, &before);
+        pthread_cond_timedwait(&ctx->cond, &ctx->lock, &deadline);
+        waited = fanout_since(&before);
+
+        for (i = 0; i < ctx->ndests; i++) {
+            fanout_dest *d = &ctx->dests[i];
+
+            if (!d->active || ctx->tail - d->head < FANOUT_DEPTH) {
+                continue;
+            }
+            d->stall += waited;
+            if (d->stall > max_lag) {
+                d->active = 0;
+                d->dropped = 1;
+                if (d->sock >= 0) {
+                    /* Fails the send it's blocked in */
+                    shutdown(d->sock, SHUT_RDWR);
+                }
+            }
+        }
+    }
+}
+
+/**
+ * Read a chunk of the file
+ *
+ * @return 0 on success, -1 on error
+ */
+static int fanout_read(int fd, char *buf, size_t length, off_t offset)
+{
+    size_t got = 0;
+
+    while (got < length) {
+        uint64_t start = stats_start();
+        ssize_t n = pread(fd, buf + got, length - got, offset + (off_t)got);
+
+        stats_stop(STATS_READ, start, n);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0) {
+                perror("pread");
+            } else {
+                printf("File is shorter than expected\n");
+            }
+            return -1;
+        }
+        got += (size_t)n;
+    }
+    return 0;
+}
+
+/**
+ * Read the whole file into the ring, chunk by chunk
+ *
+ * @param ctx     Fan-out context, with the receivers' threads started
+ * @param max_lag Seconds a receiver may hold the others back
+ *
+ * @return 0 on success, -1 if the file can't be read or no receiver is left
+ */
+static int fanout_read_file(fanout_ctx *ctx, int max_lag)
+{
+    hash_tree tree, *hash = ctx->f->hdr.flags & FHDR_HASH ? &tree : NULL;
+    cache_cursor cache;
+    size_t i;
+    int rc = 0;
+
+    if (hash) {
+        hash_tree_init(hash);
+    }
+    cache_start(&cache, ctx->f->fd, 0, ctx->f->hdr.fsize, 0);
+
+    for (i = 0; i < ctx->chunks; i++) {
+        size_t slot = i % FANOUT_DEPTH;
+        size_t offset = i * (size_t)CHUNK_SIZE, length;
+        int active;
+
+        pthread_mutex_lock(&ctx->lock);
+        active = fanout_wait_room(ctx, max_lag);
+        pthread_mutex_unlock(&ctx->lock);
+        if (active == 0) {
+            rc = -1;
+            break;
+        }
+
+        length = ctx->f->hdr.fsize - offset < CHUNK_SIZE
+                 ? ctx->f->hdr.fsize - offset : CHUNK_SIZE;
+        if (fanout_read(ctx->f->fd, ctx->bufs + slot * (size_t)CHUNK_SIZE, length,
+                        (off_t)offset) < 0) {
+            rc = -1;
+            break;
+        }
+        if (hash) {
+            hash_tree_update(hash, ctx->bufs + slot * (size_t)CHUNK_SIZE, length);
+        }
+        cache_advance(&cache, (off_t)(offset + length));
+        progress_add(length);
+
+        pthread_mutex_lock(&ctx->lock);
+        ctx->lengths[slot] = length;
+        ctx->tail++;
+        pthread_cond_broadcast(&ctx->cond);
+        pthread_mutex_unlock(&ctx->lock);
+    }
+
+    cache_finish(&cache);
+    if (rc == 0 && hash) {
+        hash_tree_finish(hash, &ctx->trailer);
+    }
+    pthread_mutex_lock(&ctx->lock);
+    ctx->read_done = rc == 0;
+    ctx->read_failed = rc < 0;
+    pthread_cond_broadcast(&ctx->cond);
+    pthread_mutex_unlock(&ctx->lock);
+    return rc;
+}
+
+/**
+ * Send a file to several receivers, reading it only once
+ *
+ * Every receiver gets a connection and a thread of its own, all sending
+ * from a ring of `FANOUT_DEPTH` chunks the calling thread reads the file
+ * into. The reads wait for the slowest receiver, for `opts->max_lag`
+ * seconds in total at most, then it's dropped. The throughput of every
+ * receiver is reported at the end.
+ *
+ * @param filename Path to the file to send
+ * @param hosts    Hostnames or IP addresses of the receivers, each may
+ *                 be followed by ":port"
+ * @param nhosts   Number of receivers
+ * @param port     Port number as a string, of receivers without their own
+ * @param opts     Sender options
+ *
+ * @return 0 if all the receivers got the file, 1 otherwise
+ */
+static int send_fanout(char *filename, const char *const *hosts, int nhosts,
+                       const char *port, const sender_opts *opts)
+{
+    fanout_ctx ctx = {.stats = stats_current, .tune = tune_current};
+    int i, started = 0, received = 0;
+    struct stat st;
+    file f = {0};
+
+    if (stat(filename, &st) == 0 && S_ISDIR(st.st_mode)) {
+        printf("Directories are sent to one receiver at a time\n");
+        return 1;
+    }
+    if (opts->streams != 1 || opts->resume || opts->delta || opts->compress || opts->sparse) {
+        printf("Fanning out sends the whole file as is, over one stream per receiver\n");
+    }
+    if (opts->udp) {
+        printf("Fanning out sends over TCP\n");
+    }
+    if (file_open(&f, filename) < 0) {
+        return 1;
+    }
+    if (opts->verify) {
+        f.hdr.flags |= FHDR_HASH;
+    }
+
+    ctx.f = &f;
+    ctx.chunks = (f.hdr.fsize + (size_t)(CHUNK_SIZE) - 1) / (size_t)(CHUNK_SIZE);
+    ctx.bufs = malloc((size_t)FANOUT_DEPTH * CHUNK_SIZE);
+    ctx.dests = calloc((size_t)nhosts, sizeof(*ctx.dests));
+    progress_current = progress_begin(f.hdr.fsize);
+    if (ctx.bufs == NULL || ctx.dests == NULL || progress_current == NULL) {
+        perror("malloc");
+        progress_end(progress_current, -1);
+        progress_current = NULL;
+        free(ctx.bufs);
+        free(ctx.dests);
+        file_close(&f);
+        return 1;
+    }
+    pthread_mutex_init(&ctx.lock, NULL);
+    pthread_cond_init(&ctx.cond, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &ctx.start);
+
+    ctx.ndests = nhosts;
+    for (i = 0; i < nhosts; i++) {
+        fanout_dest *d = &ctx.dests[i];
+
+        d->host = hosts[i];
+        d->port = split_host_port(hosts[i], port, d->name, sizeof(d->name));
+        d->ctx = &ctx;
+        d->sock = -1;
+        d->active = 1;
+        if (pthread_create(&d->thread, NULL, fanout_worker, d) != 0) {
+            perror("pthread_create");
+            d->active = 0;
+            d->failed = 1;
+            break;
+        }
+        started++;
+    }
+
+    if (started == nhosts) {
+        fanout_read_file(&ctx, opts->max_lag);
+    } else {
+        pthread_mutex_lock(&ctx.lock);
+        ctx.read_failed = 1;
+        pthread_cond_broadcast(&ctx.cond);
+        pthread_mutex_unlock(&ctx.lock);
+    }
+    for (i = 0; i < started; i++) {
+        pthread_join(ctx.dests[i].thread, NULL);
+    }
+    for (i = 0; i < nhosts; i++) {
+        received += !ctx.dests[i].failed;
+    }
+
+    progress_end(progress_current, received == nhosts ? (ssize_t)f.hdr.fsize : -1);
+    progress_current = NULL;
+
+    printf("Sent to %d of %d receivers:\n", received, nhosts);
+    for (i = 0; i < nhosts; i++) {
+        fanout_dest *d = &ctx.dests[i];
+        double mb = (double)d->head * CHUNK_SIZE / SIZE_MB;
+
+        if (mb > (double)f.hdr.fsize / SIZE_MB) {
+            mb = (double)f.hdr.fsize / SIZE_MB;
+        }
+        if (!d->failed) {
+            printf("  %s: %.2f MB in %.2f seconds (%.2f MB/s)\n", d->host, mb, d->seconds,
+                   d->seconds > 0 ? mb / d->seconds : 0);
+        } else if (d->dropped) {
+            printf("  %s: dropped after %.2f MB, holding the others back for %d seconds\n",
+                   d->host, mb, opts->max_lag);
+        } else {
+            printf("  %s: failed after %.2f MB\n", d->host, mb);
+        }
+    }
+
+    pthread_cond_destroy(&ctx.cond);
+    pthread_mutex_destroy(&ctx.lock);
+    free(ctx.dests);
+    free(ctx.bufs);
+    file_close(&f);
+    return received < nhosts;
+}
+
+/**
+ * Send a file over UDP, see `udp.h`
+ *
+ * @param filename Path to the file to send
+ * @param host     Hostname or IP address of the receiver
+ * @param port     Port number as a string
+ * @param opts     Sender options
+ *
+ * @return 0 on success, 1 on error
+ */
+static int send_udp(char *filename, const char *host, const char *port,
+                    const sender_opts *opts)
+{
+    ssize_t total_size;
+    file f = {0};
+
+    if (opts->streams != 1 || opts->resume || opts->delta || opts->compress || opts->verify
+        || opts->sparse) {
+        printf("UDP transfers send the whole file as is\n");
+    }
+    if (file_open(&f, filename) < 0) {
+        return 1;
+    }
+
+    progress_current = progress_begin(f.hdr.fsize);
+    limit_current = limit_join();
+    total_size = progress_current ? udp_send(&f, host, port) : -1;
+    limit_leave(limit_current);
+    limit_current = NULL;
+    progress_end(progress_current, total_size);
+    progress_current = NULL;
+
+    file_close(&f);
+    return total_size < 0;
+}
+
+/**
+ * Send a file or a directory
  *
  * Opens the file, establishes a connection with the receiver,
  * sends the file with progress tracking, and cleans up resources.
  * The entire sending process is handled, from file opening to socket closing.
  *
- * @param filename Path to the file to send
+ * A directory is sent with all its contents over a single connection.
+ *
+ * @param filename Path to the file or directory to send
  * @param host     Hostname or IP address of the receiver
  * @param port     Port number as a string
+ * @param opts     Sender options
  *
  * @return 0 on success, 1 on error
  */
-int exec_sender(char *filename, const char *host, const char *port)
+static int send_path(char *filename, const char *host, const char *port,
+                     const sender_opts *opts)
 {
-    int retval = 0, rc, sock;
+    int streams = opts->streams;
+    int retval = 0, rc, sock = -1;
     file f = {0};
 
     ssize_t total_size;
+    delta_stats stats;
+    struct stat st;
+    int sparse = opts->sparse;
+
+    if (sparse && (opts->delta || opts->compress)) {
+        printf("Delta and compressed transfers send zeros as they are\n");
+        sparse = 0;
+    }
+
+    if (stat(filename, &st) == 0 && S_ISDIR(st.st_mode)) {
+        if (opts->udp) {
+            printf("Directories are sent over TCP\n");
+        }
+        if (streams != 1 || opts->resume) {
+            printf("Directories are sent over a single stream, from scratch\n");
+        }
+        if (opts->multiplex) {
+            if (opts->compress || sparse) {
+                printf("Multiplexed files are sent as they are\n");
+            }
+            return send_tree(filename, host, port,
+                             FHDR_SESSION | (opts->verify ? FHDR_HASH : 0));
+        }
+        return send_tree(filename, host, port,
+                         (opts->compress ? FHDR_COMPRESS : 0) | (opts->verify ? FHDR_HASH : 0)
+                         | (sparse ? FHDR_SPARSE : 0));
+    }
+    if (opts->multiplex) {
+        printf("Only the files of a directory are multiplexed\n");
+    }
+    if (opts->udp) {
+        return send_udp(filename, host, port, opts);
+    }
 
     rc = file_open(&f, filename);
     if (rc < 0) {
         return 1;
     }
 
-    sock = establish_connection(host, port);
-    if (sock < 0) {
-        file_close(&f);
-        return 1;
+    /* Not worth a second connection */
+    if (f.hdr.fsize <= CHUNK_SIZE) {
+        streams = 1;
+    }
+    if (opts->delta) {
+        if (streams != 1 || opts->resume) {
+            printf("Delta transfers use a single stream and can't be resumed\n");
+            streams = 1;
+        }
+        f.hdr.flags |= FHDR_DELTA;
+    } else if (opts->resume) {
+        if (streams != 1) {
+            printf("Resuming uses a single stream\n");
+            streams = 1;
+        }
+        f.hdr.flags |= FHDR_RESUME;
+    }
+    if (opts->compress) {
+        if (opts->delta) {
+            printf("Delta transfers are sent uncompressed\n");
+        } else {
+            f.hdr.flags |= FHDR_COMPRESS;
+        }
+    }
+    if (opts->verify) {
+        if (opts->delta) {
+            printf("Delta transfers are sent unverified\n");
+        } else {
+            f.hdr.flags |= FHDR_HASH;
+        }
+    }
+    if (sparse) {
+        f.hdr.flags |= FHDR_SPARSE;
+    }
+
+    if (streams == 1) {
+        sock = establish_connection(host, port);
+        if (sock < 0) {
+            file_close(&f);
+            return 1;
+        }
+        stats_watch(stats_current, sock);
+        tune_watch(tune_current, sock);
+        limit_current = limit_join();
     }
 
-    start_progress_bar();
+    progress_current = progress_begin(f.hdr.fsize);
+
+    if (progress_current == NULL) {
+        total_size = -1;
+    } else if (opts->delta) {
+        total_size = delta_send(&f, sock, &stats);
+        if (total_size >= 0 && wait_receiver(sock) < 0) {
+            total_size = -1;
+        }
+    } else if (streams == 1) {
+        total_size = file_send(&f, sock);
+        if (total_size >= 0 && wait_receiver(sock) < 0) {
+            total_size = -1;
+        }
+    } else {
+        total_size = send_striped(&f, host, port, &streams);
+    }
+    progress_end(progress_current, total_size);
+    progress_current = NULL;
 
-    total_size = file_send(&f, sock);
     if (total_size >= 0) {
-        stop_progress_bar((size_t)total_size);
+        if (streams > 1) {
+            printf("Sent over %d streams\n", streams);
+        }
+        if (opts->delta) {
+            printf("Sent %zu bytes as data, reused %zu bytes of the receiver's copy\n",
+                   stats.literal, stats.matched);
+        }
     } else {
         retval = total_size;
     }
 
     /* Cleanup */
-    close(sock);
+    if (sock >= 0) {
+        limit_leave(limit_current);
+        limit_current = NULL;
+        stats_unwatch(stats_current, sock);
+        tune_unwatch(tune_current, sock);
+        close(sock);
+    }
     file_close(&f);
 
     return retval;
 }
+
+int exec_sender(char *filename, const char *const *hosts, int nhosts, const char *port,
+                const sender_opts *opts)
+{
+    stats_transfer *stats = NULL;
+    int rc;
+
+    if (opts->stats) {
+        stats = stats_begin(1);
+        stats_current = stats;
+    }
+    if (tune_enabled) {
+        tune_current = tune_begin();
+    }
+    if (nhosts > 1) {
+        rc = send_fanout(filename, hosts, nhosts, port, opts);
+    } else {
+        char host[256];
+
+        port = split_host_port(hosts[0], port, host, sizeof(host));
+        rc = send_path(filename, host, port, opts);
+    }
+    tune_end(tune_current);
+    tune_current = NULL;
+    if (stats_end(stats, 1, opts->stats_json) < 0) {
+        rc = 1;
+    }
+    return rc;
+}
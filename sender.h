@@ -1,5 +1,28 @@
 #pragma once
 
+/** Let the sender pick the number of streams from the observed throughput */
+#define STREAMS_AUTO 0
+
+/** Maximal number of parallel connections for a single file */
+#define STREAMS_MAX 16
+
+/** Seconds a receiver of a fan-out may hold the others back by default */
+#define FANOUT_MAX_LAG 10
+
+typedef struct {
+    int streams;  /**< Number of parallel connections or `STREAMS_AUTO` */
+    int resume;   /**< Continue an interrupted transfer of the file */
+    int delta;    /**< Send only what differs from the receiver's copy */
+    int compress; /**< Compress the contents in transit */
+    int verify;   /**< Have the receiver verify the hash of the data */
+    int sparse;   /**< Send holes and runs of zeros as holes */
+    int stats;    /**< Report where the time went and the likely bottleneck */
+    const char *stats_json; /**< File to dump the statistics to, or `NULL` */
+    int max_lag;  /**< Seconds a receiver of a fan-out may hold the others back */
+    int multiplex; /**< Interleave the files of a directory over a session */
+    int udp;      /**< Send a file over UDP with rate-based congestion control */
+} sender_opts;
+
 /**
  * Execute the file sending process
  *
@@ -7,10 +30,39 @@
  * sends the file with progress tracking, and cleans up resources.
  * The entire sending process is handled, from file opening to socket closing.
  *
- * @param filename Path to the file to send
- * @param host     Hostname or IP address of the receiver
- * @param port     Port number as a string
+ * A directory is sent with all its contents, over a single connection.
+ * With `multiplex` its files are interleaved over a session and
+ * acknowledged one by one, see `session.h`.
+ * With more than one stream the file is split into byte ranges, each sent
+ * with a stripe header over one of several parallel connections.
+ *
+ * With `resume` the receiver is asked how much of the file it already
+ * has from an interrupted transfer, and only the rest is sent. With
+ * `delta` the file is sent as a delta against the receiver's copy. With
+ * `compress` the contents are compressed in transit, backing off when
+ * that doesn't pay off. With `verify` the data is hashed on both sides
+ * and the transfer fails if the receiver finds it corrupted. With
+ * `sparse` zeros aren't sent, and the receiver leaves holes for them.
+ * With `stats` the time spent reading and sending and the `TCP_INFO` of
+ * the connections are reported at the end, see `stats.h`. With `udp` a
+ * file is sent as is over UDP instead, see `udp.h`.
+ *
+ * With several receivers the file is read once and sent to all of them
+ * at the same time, each over a connection of its own. A receiver that
+ * holds the others back for `max_lag` seconds in total is dropped. The
+ * throughput of every receiver is reported at the end. With
+ * `tune_enabled` the connections are tuned to the path, see `tune.h`.
+ * With `limit_enabled` every connection sends within its share of the
+ * bandwidth limit, see `limit.h`.
+ *
+ * @param filename Path to the file or directory to send
+ * @param hosts    Hostnames or IP addresses of the receivers, each with
+ *                 an optional port as in `split_host_port()`
+ * @param nhosts   Number of receivers, more than one only for a file
+ * @param port     Port number as a string, for the receivers without one
+ * @param opts     Sender options
  *
  * @return 0 on success, 1 on error
  */
-int exec_sender(char *filename, const char *host, const char *port);
+int exec_sender(char *filename, const char *const *hosts, int nhosts, const char *port,
+                const sender_opts *opts);
@@ -1,4 +1,5 @@
 #include <arpa/inet.h>
+#include <errno.h>
 #include <stdio.h>
 #include <fcntl.h>
 #include <unistd.h>
@@ -8,8 +9,10 @@
 #include <netinet/tcp.h>
 
 #include "server.h"
+#include "tune.h"
 
-static int bind_listener(int, int);
+static int open_listener(int, int, int*);
+static int bind_listener(int, int, int);
 static void set_listener_options(int);
 static void set_client_sock_options(int);
 
@@ -17,9 +20,8 @@ static void set_client_sock_options(int);
 /**
  * Create and set up a listening TCP socket
  *
- * Creates a TCP socket, sets socket options, binds it to the specified port
- * on all network interfaces (0.0.0.0), and puts it into listening mode.
- * Configures the socket with reuse address option for fast restarts.
+ * Creates a TCP socket with `open_listener()`, bound to the specified port
+ * on all network interfaces, and puts it into listening mode.
  *
  * @param port Port number to bind the socket to
  * @return Socket file descriptor on success, -1 on error
@@ -28,18 +30,10 @@ int start_listener(int port)
 {
     int listener, rc;
     int backlog = 10;
+    int family;
 
-    listener = socket(AF_INET, SOCK_STREAM, 0);
+    listener = open_listener(SOCK_STREAM, port, &family);
     if (listener < 0) {
-        perror("socket");
-        return -1;
-    }
-
-    set_listener_options(listener);
-
-    rc = bind_listener(listener, port);
-    if (rc < 0) {
-        close(listener);
         return -1;
     }
 
@@ -48,36 +42,142 @@ int start_listener(int port)
         perror("listen");
         return -1;
     }
-    printf("Listening on 0:%d...\n", port);
+    printf("Listening on %s:%d...\n", family == AF_INET6 ? "[::]" : "0", port);
     return listener;
 }
 
 /**
- * Bind the listener socket to 0.0.0.0:port
+ * Create a UDP socket bound to the port on all network interfaces
+ *
+ * @param port Port number to bind the socket to
+ * @return Socket file descriptor on success, -1 on error
+ */
+int start_udp_listener(int port)
+{
+    int sock, family;
+
+    sock = open_listener(SOCK_DGRAM, port, &family);
+    if (sock < 0) {
+        return -1;
+    }
+    printf("Listening on %s:%d over UDP...\n", family == AF_INET6 ? "[::]" : "0", port);
+    return sock;
+}
+
+/**
+ * Create a socket bound to all interfaces on the port
+ *
+ * The socket is an IPv6 one taking IPv4 clients too, or an IPv4 one where
+ * the system has no IPv6. Configures a TCP socket with reuse address option
+ * for fast restarts; not a UDP one, where it would let two servers share
+ * the port.
+ *
+ * @param type   `SOCK_STREAM` or `SOCK_DGRAM`
+ * @param port   Port number to bind the socket to
+ * @param family Set to the family of the socket
+ *
+ * @return Socket file descriptor on success, -1 on error
+ */
+static int open_listener(int type, int port, int *family)
+{
+    int sock;
+
+    *family = AF_INET6;
+    sock = socket(AF_INET6, type, 0);
+    if (sock < 0 && errno == EAFNOSUPPORT) {
+        *family = AF_INET;
+        sock = socket(AF_INET, type, 0);
+    }
+    if (sock < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    if (type == SOCK_STREAM) {
+        set_listener_options(sock);
+    }
+
+    if (bind_listener(sock, *family, port) < 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+/**
+ * Bind the listener socket to all interfaces on the port
  *
- * Sets up the `sockaddr_in` structure to bind the socket to all network
- * interfaces (`INADDR_ANY`) on the specified port number.
+ * An IPv6 listener is bound to `in6addr_any` with `IPV6_V6ONLY` off, so
+ * IPv4 clients reach it as IPv4-mapped addresses whatever the system's
+ * default; an IPv4 one to `INADDR_ANY`.
  *
  * @param listener Socket file descriptor to bind
+ * @param family   Its family, `AF_INET6` or `AF_INET`
  * @param port     Port number to bind to
  *
  * @return 0 on success, -1 on error
  */
-static int bind_listener(int listener, int port)
+static int bind_listener(int listener, int family, int port)
 {
-    struct sockaddr_in addr;
+    struct sockaddr_storage addr = {0};
+    socklen_t len;
+    int off = 0;
+
+    if (family == AF_INET6) {
+        struct sockaddr_in6 *addr6 = (struct sockaddr_in6*)&addr;
 
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(port);
-    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        if (setsockopt(listener, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off)) < 0) {
+            perror("setsockopt IPV6_V6ONLY");
+        }
+        addr6->sin6_family = AF_INET6;
+        addr6->sin6_port = htons(port);
+        addr6->sin6_addr = in6addr_any;
+        len = sizeof(*addr6);
+    } else {
+        struct sockaddr_in *addr4 = (struct sockaddr_in*)&addr;
 
-    if (bind(listener, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        addr4->sin_family = AF_INET;
+        addr4->sin_port = htons(port);
+        addr4->sin_addr.s_addr = htonl(INADDR_ANY);
+        len = sizeof(*addr4);
+    }
+
+    if (bind(listener, (struct sockaddr*)&addr, len) < 0) {
         perror("bind");
         return -1;
     }
     return 0;
 }
 
+/**
+ * Format a client's address for the log
+ *
+ * IPv4 clients of an IPv6 listener are shown as plain IPv4 addresses.
+ *
+ * @param addr Client's address from `accept()`
+ * @param ip   Buffer for the address
+ * @param port Set to the client's port
+ */
+static void format_client_addr(const struct sockaddr_storage *addr,
+                               char ip[INET6_ADDRSTRLEN], int *port)
+{
+    if (addr->ss_family == AF_INET6) {
+        const struct sockaddr_in6 *addr6 = (const struct sockaddr_in6*)addr;
+
+        if (IN6_IS_ADDR_V4MAPPED(&addr6->sin6_addr)) {
+            inet_ntop(AF_INET, &addr6->sin6_addr.s6_addr[12], ip, INET6_ADDRSTRLEN);
+        } else {
+            inet_ntop(AF_INET6, &addr6->sin6_addr, ip, INET6_ADDRSTRLEN);
+        }
+        *port = ntohs(addr6->sin6_port);
+    } else {
+        const struct sockaddr_in *addr4 = (const struct sockaddr_in*)addr;
+
+        inet_ntop(AF_INET, &addr4->sin_addr, ip, INET6_ADDRSTRLEN);
+        *port = ntohs(addr4->sin_port);
+    }
+}
+
 /**
  * Accept a client connection on the listener socket
  *
@@ -91,22 +191,25 @@ static int bind_listener(int listener, int port)
  */
 int accept_connection(int listener)
 {
-    int sock;
-    struct sockaddr_in client_addr;
+    int sock, client_port;
+    struct sockaddr_storage client_addr;
     socklen_t client_addr_len = sizeof(client_addr);
 
     sock = accept(listener, (struct sockaddr*)&client_addr, &client_addr_len);
     if (sock < 0) {
-        perror("accept");
+        /* Another thread has taken the connection from a shared listener */
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            perror("accept");
+        }
         return -1;
     }
 
     /* Get client IP */
-    char client_ip[INET_ADDRSTRLEN];
-    inet_ntop(AF_INET, &(client_addr.sin_addr), client_ip, INET_ADDRSTRLEN);
+    char client_ip[INET6_ADDRSTRLEN];
+    format_client_addr(&client_addr, client_ip, &client_port);
     printf(
         "Accepted connection from client of %s:%d\n",
-        client_ip, ntohs(client_addr.sin_port)
+        client_ip, client_port
     );
     set_client_sock_options(sock);
 
@@ -135,7 +238,9 @@ static void set_listener_options(int listener)
  * Configure socket options for client connections
  *
  * Sets performance-oriented socket options on client connections:
- * - Increases receive buffer size to 512KB for better throughput
+ * - Increases receive buffer size to 512KB for better throughput, unless
+ *   it's left to the kernel and `tune.h` with `tune_enabled`, as a buffer
+ *   set before the first data caps the window for good
  * - Enables `TCP_NODELAY` to disable Nagle's algorithm for lower latency
  *
  * No error checking on the return value as these are optimizations
@@ -148,10 +253,12 @@ static void set_client_sock_options(int sock)
     int flag = 1, rc;
     int recv_buf_size = 1024 * 512;
 
-    rc = setsockopt(sock, SOL_SOCKET, SO_RCVBUF,
-                    &recv_buf_size, sizeof(recv_buf_size));
-    if (rc < 0) {
-        perror("setsockopt SO_RCVBUF");
+    if (!tune_enabled) {
+        rc = setsockopt(sock, SOL_SOCKET, SO_RCVBUF,
+                        &recv_buf_size, sizeof(recv_buf_size));
+        if (rc < 0) {
+            perror("setsockopt SO_RCVBUF");
+        }
     }
 
     rc = setsockopt(sock, IPPROTO_TCP, TCP_NODELAY,
@@ -1,4 +1,5 @@
 #pragma once
 
 int start_listener(int port);
+int start_udp_listener(int port);
 int accept_connection(int listener);
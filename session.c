@@ -0,0 +1,374 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "fsock.h"
+#include "progress.h"
+#include "session.h"
+#include "stats.h"
+
+/** File of a session being sent */
+typedef struct {
+    file      f;
+    int       busy;    /**< The slot is taken */
+    off_t     offset;  /**< Next byte of the file to send */
+    hash_tree hash;
+} session_slot;
+
+/** Sending side of a session */
+typedef struct {
+    int             sock;
+    session_slot    slots[SESSION_MAX_OPEN];
+    char           *buf;       /**< Scratch buffer of `SESSION_SLICE` bytes */
+    char           *pending[SESSION_WINDOW]; /**< Paths of the ended files, oldest first */
+    uint32_t        ids[SESSION_WINDOW];     /**< Their slots */
+    size_t          head, count;
+    size_t          acked;     /**< Files acknowledged as received */
+    int             failed;    /**< A file has failed */
+    int             broken;    /**< The connection has failed */
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+} session_tx;
+
+/**
+ * Receive the next acknowledgement
+ *
+ * @param sock Socket descriptor
+ * @param ack  Set to the acknowledgement
+ *
+ * @return 1 on success, 0 if the receiver has ended the connection
+ *         before it, -1 on error
+ */
+static int session_recv_ack(int sock, session_ack *ack)
+{
+    size_t received = 0;
+
+    while (received < sizeof(*ack)) {
+        uint64_t start = stats_start();
+        ssize_t rc = recv(sock, (char*)ack + received, sizeof(*ack) - received, 0);
+
+        stats_stop(STATS_RECV, start, rc);
+        if (rc < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rc < 0) {
+            perror("recv");
+            return -1;
+        }
+        if (rc == 0) {
+            return received == 0 ? 0 : -1;
+        }
+        received += (size_t)rc;
+    }
+    return 1;
+}
+
+/**
+ * Read the acknowledgements until the receiver ends the connection
+ *
+ * @param arg Pointer to the `session_tx`
+ *
+ * @return Always `NULL`
+ */
+static void *session_acker(void *arg)
+{
+    session_tx *s = arg;
+    session_ack ack;
+
+    for (;;) {
+        int rc = session_recv_ack(s->sock, &ack);
+        char *path;
+
+        pthread_mutex_lock(&s->lock);
+        if (rc <= 0 || s->count == 0 || ack.id != s->ids[s->head]) {
+            /* The connection has ended; early if anything is still pending */
+            if (rc != 0 || s->count > 0) {
+                if (rc > 0) {
+                    printf("Unexpected acknowledgement for slot %u\n", ack.id);
+                }
+                s->broken = 1;
+            }
+            pthread_cond_broadcast(&s->cond);
+            pthread_mutex_unlock(&s->lock);
+            return NULL;
+        }
+        path = s->pending[s->head];
+        s->head = (s->head + 1) % SESSION_WINDOW;
+        s->count--;
+        if (ack.status != 0) {
+            printf("The receiver has failed to receive %s\n", path);
+            s->failed = 1;
+        } else {
+            s->acked++;
+        }
+        pthread_cond_broadcast(&s->cond);
+        pthread_mutex_unlock(&s->lock);
+        free(path);
+    }
+}
+
+/**
+ * Send a frame header
+ *
+ * @return 0 on success, -1 on error
+ */
+static int session_send_frame(int sock, uint32_t id, uint32_t type, uint64_t length)
+{
+    session_frame frame = {.id = id, .type = type, .length = length};
+
+    return send_all(sock, &frame, sizeof(frame)) < 0 ? -1 : 0;
+}
+
+/**
+ * Take a slot for a new entry and send its `SESSION_OPEN`
+ *
+ * Entries are opened in the order they come, so a directory is created
+ * before what's in it.
+ *
+ * @param s  Session
+ * @param id Free slot
+ * @param f  Entry from the source
+ *
+ * @return 0 on success, -1 on error
+ */
+static int session_open(session_tx *s, uint32_t id, const file *f)
+{
+    session_slot *slot = &s->slots[id];
+
+    slot->f = *f;
+    slot->busy = 1;
+    slot->offset = 0;
+    if (f->hdr.flags & FHDR_HASH) {
+        hash_tree_init(&slot->hash);
+    }
+    if (session_send_frame(s->sock, id, SESSION_OPEN, FHEADER_SIZE + f->hdr.path_len) < 0
+        || send_all(s->sock, &f->hdr, FHEADER_SIZE) < 0
+        || send_all(s->sock, f->path, f->hdr.path_len) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Send the next slice of an entry's data
+ *
+ * A hashed entry goes through the scratch buffer, the others straight
+ * from the page cache where possible.
+ *
+ * @param s  Session
+ * @param id Slot of the entry, with data left to send
+ *
+ * @return Bytes of the data sent, -1 on error
+ */
+static ssize_t session_send_slice(session_tx *s, uint32_t id)
+{
+    session_slot *slot = &s->slots[id];
+    size_t left = slot->f.hdr.length - (size_t)slot->offset;
+    size_t length = left < SESSION_SLICE ? left : SESSION_SLICE;
+    size_t sent = 0;
+
+    if (session_send_frame(s->sock, id, SESSION_DATA, length) < 0) {
+        return -1;
+    }
+    while (sent < length) {
+        ssize_t n = FSOCK_UNSUPPORTED;
+
+        if (!(slot->f.hdr.flags & FHDR_HASH)) {
+            n = ftosock_sendfile(slot->f.fd, s->sock, &slot->offset, length - sent);
+        }
+        if (n == FSOCK_UNSUPPORTED) {
+            off_t offset = slot->offset;
+
+            n = ftosock(slot->f.fd, s->sock, &slot->offset, s->buf, length - sent);
+            if (n > 0 && slot->f.hdr.flags & FHDR_HASH) {
+                hash_tree_update(&slot->hash, s->buf, (size_t)(slot->offset - offset));
+            }
+        }
+        if (n < 0) {
+            return -1;
+        }
+        sent += (size_t)n;
+        progress_add((size_t)n);
+    }
+    return (ssize_t)sent;
+}
+
+/**
+ * End an entry, free its slot and count it as waiting for its acknowledgement
+ *
+ * Waits while `SESSION_WINDOW` entries are waiting already.
+ *
+ * @param s  Session
+ * @param id Slot of the entry, with all its data sent
+ *
+ * @return 0 on success, -1 on error
+ */
+static int session_end(session_tx *s, uint32_t id)
+{
+    session_slot *slot = &s->slots[id];
+    hash_trailer trailer;
+    int hashed = slot->f.hdr.flags & FHDR_HASH;
+    int rc = 0;
+
+    pthread_mutex_lock(&s->lock);
+    while (s->count == SESSION_WINDOW && !s->broken) {
+        pthread_cond_wait(&s->cond, &s->lock);
+    }
+    if (s->broken) {
+        rc = -1;
+    } else {
+        s->pending[(s->head + s->count) % SESSION_WINDOW] = slot->f.path;
+        s->ids[(s->head + s->count) % SESSION_WINDOW] = id;
+        s->count++;
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    if (slot->f.fd >= 0) {
+        close(slot->f.fd);
+    }
+    slot->busy = 0;
+    if (rc < 0) {
+        free(slot->f.path);
+        return -1;
+    }
+
+    if (hashed) {
+        hash_tree_finish(&slot->hash, &trailer);
+    }
+    if (session_send_frame(s->sock, id, SESSION_END, hashed ? sizeof(trailer) : 0) < 0
+        || (hashed && send_all(s->sock, &trailer, sizeof(trailer)) < 0)) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Send all the entries of the source, taking turns between the open ones
+ *
+ * @param s     Session
+ * @param next  Source of the entries
+ * @param arg   Argument to `next`
+ *
+ * @return Total bytes of file contents sent, -1 on error
+ */
+static ssize_t session_run(session_tx *s, session_next next, void *arg)
+{
+    size_t total = 0;
+    int busy = 0, more = 1;
+    uint32_t id;
+
+    while (busy > 0 || more) {
+        /* Open new entries while there's room, waiting only if idle */
+        for (id = 0; id < SESSION_MAX_OPEN && more; id++) {
+            file f;
+            int rc;
+
+            if (s->slots[id].busy) {
+                continue;
+            }
+            rc = next(arg, &f, busy == 0);
+            if (rc <= 0) {
+                more = rc == 0;
+                break;
+            }
+            busy++;
+            if (session_open(s, id, &f) < 0) {
+                return -1;
+            }
+        }
+
+        for (id = 0; id < SESSION_MAX_OPEN; id++) {
+            session_slot *slot = &s->slots[id];
+
+            if (!slot->busy) {
+                continue;
+            }
+            if ((size_t)slot->offset < slot->f.hdr.length) {
+                ssize_t n = session_send_slice(s, id);
+
+                if (n < 0) {
+                    return -1;
+                }
+                total += (size_t)n;
+            }
+            if ((size_t)slot->offset == slot->f.hdr.length) {
+                busy--;
+                if (session_end(s, id) < 0) {
+                    return -1;
+                }
+            }
+        }
+    }
+    return (ssize_t)total;
+}
+
+ssize_t session_send(int sock, session_next next, void *arg, size_t *entries)
+{
+    session_tx *s;
+    file_header hdr = {.flags = FHDR_SESSION};
+    pthread_t acker;
+    ssize_t total;
+    uint32_t id;
+
+    *entries = 0;
+    s = calloc(1, sizeof(*s));
+    if (s == NULL || (s->buf = malloc(SESSION_SLICE)) == NULL) {
+        perror("malloc");
+        free(s);
+        return -1;
+    }
+    s->sock = sock;
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->cond, NULL);
+
+    if (send_all(sock, &hdr, FHEADER_SIZE) < 0) {
+        total = -1;
+    } else if (pthread_create(&acker, NULL, session_acker, s) != 0) {
+        perror("pthread_create");
+        total = -1;
+    } else {
+        total = session_run(s, next, arg);
+
+        /* Wait for the acknowledgements, then let the receiver end it */
+        pthread_mutex_lock(&s->lock);
+        while (total >= 0 && s->count > 0 && !s->broken) {
+            pthread_cond_wait(&s->cond, &s->lock);
+        }
+        pthread_mutex_unlock(&s->lock);
+        if (shutdown(sock, total >= 0 ? SHUT_WR : SHUT_RDWR) < 0) {
+            perror("shutdown");
+        }
+        pthread_join(acker, NULL);
+        if (s->broken && total >= 0) {
+            printf("The receiver has ended the session early\n");
+            total = -1;
+        }
+        if (s->failed) {
+            total = -1;
+        }
+        *entries = s->acked;
+    }
+
+    /* Whatever wasn't sent or acknowledged */
+    for (id = 0; id < SESSION_MAX_OPEN; id++) {
+        if (s->slots[id].busy) {
+            if (s->slots[id].f.fd >= 0) {
+                close(s->slots[id].f.fd);
+            }
+            free(s->slots[id].f.path);
+        }
+    }
+    while (s->count > 0) {
+        free(s->pending[s->head]);
+        s->head = (s->head + 1) % SESSION_WINDOW;
+        s->count--;
+    }
+    pthread_cond_destroy(&s->cond);
+    pthread_mutex_destroy(&s->lock);
+    free(s->buf);
+    free(s);
+    return total;
+}
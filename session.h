@@ -0,0 +1,111 @@
+/**
+ * @file session.h
+ * @brief Many files over one connection, interleaved
+ *
+ * With `FHDR_SESSION` the connection carries the entries of a tree as
+ * frames instead of one file after another. The session starts with a
+ * `FHDR_SESSION` header that has no file of its own, followed by
+ * `session_frame`s, each for one of up to `SESSION_MAX_OPEN` files open
+ * at a time:
+ *
+ * 1. `SESSION_OPEN` with the entry's `FHDR_TREE` header and path.
+ * 2. `SESSION_DATA` with the next up to `SESSION_SLICE` bytes of it.
+ * 3. `SESSION_END`, with the `hash_trailer` of a `FHDR_HASH` entry.
+ *
+ * The sender takes turns between the open files, a slice each, so small
+ * files don't wait behind a big one, and opens the next file as soon as
+ * one ends. The receiver acknowledges every file with a `session_ack`
+ * once it has ended, in the order they end; the sender doesn't wait for
+ * the acknowledgements, except to keep at most `SESSION_WINDOW` of them
+ * outstanding. A file failing on the receiver fails only itself.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "file.h"
+#include "hash.h"
+
+/** Most files open at a time */
+#define SESSION_MAX_OPEN 16
+
+/** Most data of a file sent in its turn */
+#define SESSION_SLICE ((size_t)(CHUNK_SIZE))
+
+/** Most files ended but not acknowledged yet */
+#define SESSION_WINDOW 1024
+
+/** Kinds of frames */
+enum {
+    SESSION_OPEN = 1,  /**< The header and path of a new file */
+    SESSION_DATA = 2,  /**< The next data of a file */
+    SESSION_END  = 3,  /**< A file is complete, its hash follows if any */
+};
+
+/** Header of a frame, followed by `length` bytes */
+typedef struct {
+    uint32_t id;      /**< Slot of the file, below `SESSION_MAX_OPEN` */
+    uint32_t type;    /**< One of `SESSION_OPEN`, `SESSION_DATA`, `SESSION_END` */
+    uint64_t length;
+} session_frame;
+
+/** Receiver's acknowledgement of an ended file */
+typedef struct {
+    uint32_t id;      /**< Slot the file had */
+    uint32_t status;  /**< 0 if the file has been received, nonzero otherwise */
+} session_ack;
+
+/** File of a session being received */
+typedef struct {
+    file      f;
+    char      path[MAX_PATH_LEN + 1];
+    size_t    left;    /**< Bytes of the file still expected */
+    int       open;    /**< The slot is taken */
+    int       failed;  /**< Failed on the receiver, the rest of it is dropped */
+    hash_tree hash;
+} session_file;
+
+/** Receiving side of a session */
+typedef struct {
+    session_file  files[SESSION_MAX_OPEN];
+    session_frame frame;           /**< Frame being received */
+    size_t        frame_received;  /**< Bytes of `frame` received so far */
+    size_t        payload_received; /**< Bytes of its payload received so far */
+    unsigned char open[FHEADER_SIZE + MAX_PATH_LEN]; /**< Payload of `SESSION_OPEN` */
+    hash_trailer  trailer;         /**< Payload of `SESSION_END` */
+} session_rx;
+
+/**
+ * Source of the files of a session
+ *
+ * @param arg  State of the source
+ * @param f    Set to the next entry, with its header, an opened file (or
+ *             -1 for a directory) and a path owned by the session
+ * @param wait Nonzero to wait for the next entry, zero to return at once
+ *             if it isn't ready
+ *
+ * @return 1 if an entry has been set, 0 if none is ready yet, -1 if
+ *         there are no more
+ */
+typedef int (*session_next)(void *arg, file *f, int wait);
+
+/**
+ * Send files over a session and wait for the receiver to acknowledge them
+ *
+ * Sends the `FHDR_SESSION` header, then the entries from `next` as
+ * frames, while a thread of its own reads the acknowledgements. Closes
+ * the files and frees the paths once sent. Ends the connection when
+ * everything has been acknowledged, so the caller needn't wait for the
+ * receiver.
+ *
+ * @param sock    Connected socket descriptor
+ * @param next    Source of the entries
+ * @param arg     Argument to `next`
+ * @param entries Set to the number of entries acknowledged as received
+ *
+ * @return Total bytes of file contents sent, -1 on error or if any
+ *         entry has failed
+ */
+ssize_t session_send(int sock, session_next next, void *arg, size_t *entries);
@@ -0,0 +1,293 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "fsock.h"
+#include "progress.h"
+#include "sparse.h"
+#include "stats.h"
+
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
+
+int sparse_is_zero(const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+    size_t i = 0;
+
+#ifdef __SSE2__
+    /* 64 bytes per step, OR-ed together and compared with zero once */
+    for (; i + 64 <= len; i += 64) {
+        __m128i a = _mm_or_si128(_mm_loadu_si128((const __m128i*)(p + i)),
+                                 _mm_loadu_si128((const __m128i*)(p + i + 16)));
+        __m128i b = _mm_or_si128(_mm_loadu_si128((const __m128i*)(p + i + 32)),
+                                 _mm_loadu_si128((const __m128i*)(p + i + 48)));
+
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_or_si128(a, b), _mm_setzero_si128()))
+            != 0xffff) {
+            return 0;
+        }
+    }
+#else
+    for (; i + 8 <= len; i += 8) {
+        uint64_t w;
+
+        memcpy(&w, p + i, sizeof(w));
+        if (w != 0) {
+            return 0;
+        }
+    }
+#endif
+    for (; i < len; i++) {
+        if (p[i] != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Find the next data region of the file
+ *
+ * @param fd    File descriptor
+ * @param pos   Offset to look from
+ * @param end   End of the range
+ * @param start Set to the start of the data, `end` if there's none left
+ * @param stop  Set to the end of the data, capped at `end`
+ */
+static void sparse_next_data(int fd, off_t pos, off_t end, off_t *start, off_t *stop)
+{
+    *start = pos;
+    *stop = end;
+#ifdef SEEK_DATA
+    {
+        off_t data = lseek(fd, pos, SEEK_DATA);
+        off_t hole;
+
+        if (data < 0) {
+            /* ENXIO: only a hole up to the end; otherwise unsupported, all data */
+            *start = errno == ENXIO ? end : pos;
+            return;
+        }
+        *start = data < end ? data : end;
+        hole = lseek(fd, *start, SEEK_HOLE);
+        if (hole >= 0 && hole < end) {
+            *stop = hole;
+        }
+    }
+#else
+    (void)fd;
+#endif
+}
+
+/**
+ * Read a whole piece of the file
+ *
+ * @param fd     File descriptor
+ * @param buf    Buffer for the data
+ * @param len    Piece length
+ * @param offset Piece offset
+ *
+ * @return 0 on success, -1 on error
+ */
+static int sparse_read(int fd, char *buf, size_t len, off_t offset)
+{
+    size_t got = 0;
+
+    while (got < len) {
+        uint64_t start = stats_start();
+        ssize_t n = pread(fd, buf + got, len - got, offset + (off_t)got);
+
+        stats_stop(STATS_READ, start, n);
+        if (n <= 0) {
+            if (n < 0) {
+                perror("pread");
+            } else {
+                printf("File is shorter than expected\n");
+            }
+            return -1;
+        }
+        got += (size_t)n;
+    }
+    return 0;
+}
+
+/**
+ * Find where a run of zero blocks, or of blocks with data, ends
+ *
+ * @param buf  Data
+ * @param len  Data length
+ * @param i    Start of the run
+ * @param zero Nonzero to look for zero blocks, zero for data blocks
+ *
+ * @return End of the run
+ */
+static size_t sparse_run(const char *buf, size_t len, size_t i, int zero)
+{
+    while (i < len) {
+        size_t n = len - i < SPARSE_BLOCK ? len - i : SPARSE_BLOCK;
+
+        if (sparse_is_zero(buf + i, n) != zero) {
+            break;
+        }
+        i += n;
+    }
+    return i;
+}
+
+/**
+ * Send a run of the body
+ *
+ * @return 0 on success, -1 on error
+ */
+static int sparse_send_run(int sock, uint64_t hole, const char *data, size_t length)
+{
+    sparse_record rec = {.hole = hole, .data = length};
+
+    if (send_all(sock, &rec, sizeof(rec)) < 0
+        || (length > 0 && send_all(sock, data, length) < 0)) {
+        return -1;
+    }
+    return 0;
+}
+
+ssize_t sparse_send(const file *f, int sock, hash_tree *hash, cache_cursor *cache)
+{
+    off_t pos = (off_t)f->hdr.offset, end = pos + (off_t)f->hdr.length;
+    uint64_t hole = 0;
+    ssize_t rc = (ssize_t)f->hdr.length;
+    char *buf;
+
+    buf = malloc(CHUNK_SIZE);
+    if (buf == NULL) {
+        perror("malloc");
+        return -1;
+    }
+
+    while (pos < end && rc >= 0) {
+        off_t data, data_end;
+
+        sparse_next_data(f->fd, pos, end, &data, &data_end);
+        if (data > pos) {
+            if (hash) {
+                hash_tree_update_zeros(hash, (uint64_t)(data - pos));
+            }
+            hole += (uint64_t)(data - pos);
+            progress_add((size_t)(data - pos));
+            pos = data;
+        }
+
+        while (pos < data_end) {
+            size_t len = data_end - pos < CHUNK_SIZE ? (size_t)(data_end - pos) : CHUNK_SIZE;
+            size_t i = 0;
+
+            if (sparse_read(f->fd, buf, len, pos) < 0) {
+                rc = -1;
+                break;
+            }
+
+            /* Split the chunk into runs of zero blocks and of data */
+            while (i < len) {
+                size_t j = sparse_run(buf, len, i, 1);
+
+                hole += j - i;
+                if (hash) {
+                    hash_tree_update_zeros(hash, j - i);
+                }
+                i = j;
+                j = sparse_run(buf, len, i, 0);
+                if (j == i) {
+                    continue;
+                }
+                if (sparse_send_run(sock, hole, buf + i, j - i) < 0) {
+                    rc = -1;
+                    break;
+                }
+                if (hash) {
+                    hash_tree_update(hash, buf + i, j - i);
+                }
+                hole = 0;
+                i = j;
+            }
+            if (rc < 0) {
+                break;
+            }
+
+            pos += (off_t)len;
+            cache_advance(cache, pos);
+            progress_add(len);
+        }
+    }
+
+    if (rc >= 0 && hole > 0 && sparse_send_run(sock, hole, NULL, 0) < 0) {
+        rc = -1;
+    }
+    free(buf);
+    return rc;
+}
+
+/**
+ * Write zeros over a part of the file
+ *
+ * @return 0 on success, -1 on error
+ */
+static int sparse_write_zeros(int fd, off_t offset, uint64_t length)
+{
+    static const char zeros[64 * 1024];
+
+    while (length > 0) {
+        size_t n = length < sizeof(zeros) ? (size_t)length : sizeof(zeros);
+        uint64_t start = stats_start();
+        ssize_t rc = pwrite(fd, zeros, n, offset);
+
+        stats_stop(STATS_WRITE, start, rc);
+
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("pwrite");
+            return -1;
+        }
+        offset += rc;
+        length -= (uint64_t)rc;
+    }
+    return 0;
+}
+
+int sparse_punch(int fd, off_t offset, uint64_t length)
+{
+    off_t end = offset + (off_t)length;
+    int punched = 0;
+    struct stat st;
+
+    if (fstat(fd, &st) < 0) {
+        perror("fstat");
+        return -1;
+    }
+    /* Grown first, as holes are punched only up to the end of the file */
+    if (end > st.st_size && ftruncate(fd, end) < 0) {
+        perror("ftruncate");
+        return -1;
+    }
+
+#ifdef FALLOC_FL_PUNCH_HOLE
+    /* Also releases the space preallocated for the range */
+    punched = fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                        offset, (off_t)length) == 0;
+#endif
+    /* Past the old end of the file there is nothing to overwrite */
+    if (!punched && offset < st.st_size
+        && sparse_write_zeros(fd, offset, (uint64_t)((end < st.st_size ? end : st.st_size)
+                                                     - offset)) < 0) {
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,73 @@
+/**
+ * @file sparse.h
+ * @brief Sending holes and runs of zeros without the zeros
+ *
+ * With `FHDR_SPARSE` the body is a sequence of runs, each a
+ * `sparse_record` followed by `data` bytes of data. The `hole` bytes
+ * before the data are zeros that aren't sent; the receiver punches
+ * a hole in their place, so the file stays sparse on its side too.
+ * The runs cover the range exactly, the last one may be a hole alone.
+ *
+ * The sender skips the holes of the file with `SEEK_DATA`/`SEEK_HOLE`,
+ * and checks the data it reads for blocks of `SPARSE_BLOCK` zeros, as
+ * files written with `dd if=/dev/zero` and many disk images have them
+ * allocated.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "cache.h"
+#include "file.h"
+#include "hash.h"
+
+/** Smallest run of zeros sent as a hole, also its alignment */
+#define SPARSE_BLOCK 4096
+
+/** Run of a `FHDR_SPARSE` body */
+typedef struct {
+    uint64_t hole;  /**< Bytes of zeros before the data */
+    uint64_t data;  /**< Bytes of data following the record */
+} sparse_record;
+
+/**
+ * Check that a buffer has only zeros
+ *
+ * @param buf Data
+ * @param len Data length
+ *
+ * @return 1 if all the bytes are zero, 0 otherwise
+ */
+int sparse_is_zero(const void *buf, size_t len);
+
+/**
+ * Send file contents over socket as a `FHDR_SPARSE` body
+ *
+ * Sends the `hdr.length` bytes at `hdr.offset`, reading only the data
+ * regions of the file. Counts the holes in the progress like the data.
+ *
+ * @param f     Pointer to file structure with open file descriptor
+ * @param sock  Socket descriptor to send data to
+ * @param hash  Tree to hash the data into, holes included, or `NULL`
+ * @param cache Cache window to move along
+ *
+ * @return Total bytes of the range on success, -1 on error
+ */
+ssize_t sparse_send(const file *f, int sock, hash_tree *hash, cache_cursor *cache);
+
+/**
+ * Make a part of the file a hole
+ *
+ * Punches a hole where the file system allows it, or writes zeros over
+ * whatever the file already has there. Grows the file if the hole ends
+ * past its end, so a trailing hole counts in its size.
+ *
+ * @param fd     File descriptor
+ * @param offset Start of the hole
+ * @param length Hole length
+ *
+ * @return 0 on success, -1 on error
+ */
+int sparse_punch(int fd, off_t offset, uint64_t length);
@@ -0,0 +1,494 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#ifdef __linux__
+# include <linux/tcp.h>
+#endif
+
+#include "progress.h"
+#include "stats.h"
+
+/** Connections of a transfer that are told apart, later ones are left out */
+#define STATS_MAX_STREAMS 32
+
+/** Share of the time that makes something the bottleneck */
+#define STATS_DOMINANT 0.5
+
+/** Share of the sending time held back by a window or buffer that makes it the limit */
+#define STATS_LIMITED 0.3
+
+/** Share of retransmitted segments that makes loss the limit */
+#define STATS_LOSSY 0.01
+
+_Thread_local stats_transfer *stats_current;
+int stats_enabled = 0;
+
+struct stats_transfer {
+    atomic_uint_least64_t ns[STATS_KINDS];
+    atomic_uint_least64_t calls[STATS_KINDS];
+    atomic_uint_least64_t bytes[STATS_KINDS];
+    uint64_t        start;      /**< When collecting started, ns */
+    pthread_mutex_t lock;       /**< Protects everything below */
+    pthread_cond_t  cond;
+    pthread_t       sampler;
+    int             sampling;   /**< The sampler thread is running */
+    int             stop;       /**< The sampler thread is to exit */
+    int             socks[STATS_MAX_STREAMS];  /**< Watched sockets by stream, -1 once unwatched */
+    int             nstreams;   /**< Streams watched so far */
+    stats_tcp       last[STATS_MAX_STREAMS];   /**< Last sample of each stream */
+    stats_tcp      *samples;
+    uint32_t       *rounds;     /**< Sampling round of each sample */
+    size_t          nsamples;
+    uint32_t        round;
+    unsigned        interval;   /**< Between the rounds, ms */
+};
+
+static const char *kind_names[STATS_KINDS] = {
+    [STATS_READ] = "file reads",
+    [STATS_WRITE] = "file writes",
+    [STATS_SEND] = "socket sends",
+    [STATS_RECV] = "socket receives",
+    [STATS_MOVE] = "sendfile/io_uring",
+};
+
+static const char *kind_keys[STATS_KINDS] = {
+    [STATS_READ] = "read",
+    [STATS_WRITE] = "write",
+    [STATS_SEND] = "send",
+    [STATS_RECV] = "recv",
+    [STATS_MOVE] = "move",
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+uint64_t stats_start(void)
+{
+    return stats_current ? now_ns() : 0;
+}
+
+void stats_stop(stats_kind kind, uint64_t start, ssize_t bytes)
+{
+    stats_transfer *s = stats_current;
+
+    if (start == 0 || s == NULL) {
+        return;
+    }
+    atomic_fetch_add_explicit(&s->ns[kind], now_ns() - start, memory_order_relaxed);
+    atomic_fetch_add_explicit(&s->calls[kind], 1, memory_order_relaxed);
+    if (bytes > 0) {
+        atomic_fetch_add_explicit(&s->bytes[kind], (uint64_t)bytes, memory_order_relaxed);
+    }
+}
+
+/**
+ * Read `TCP_INFO` of a connection
+ *
+ * @param sock Connected socket
+ * @param t    Sample to fill in, apart from `t` and `stream`
+ *
+ * @return 0 on success, -1 where it isn't available
+ */
+static int tcp_sample(int sock, stats_tcp *t)
+{
+#if defined(__linux__) && defined(TCP_INFO)
+    struct tcp_info ti;
+    socklen_t len = sizeof(ti);
+
+    /* Older kernels fill in less of it, leaving the rest zero */
+    memset(&ti, 0, sizeof(ti));
+    if (getsockopt(sock, IPPROTO_TCP, TCP_INFO, &ti, &len) < 0) {
+        return -1;
+    }
+    t->rtt_us = ti.tcpi_rtt;
+    t->rttvar_us = ti.tcpi_rttvar;
+    t->min_rtt_us = ti.tcpi_min_rtt;
+    t->cwnd = ti.tcpi_snd_cwnd;
+    t->mss = ti.tcpi_snd_mss;
+    t->retrans = ti.tcpi_total_retrans;
+    t->segs_out = ti.tcpi_segs_out;
+    t->delivery_rate = ti.tcpi_delivery_rate;
+    t->busy_us = ti.tcpi_busy_time;
+    t->rwnd_limited_us = ti.tcpi_rwnd_limited;
+    t->sndbuf_limited_us = ti.tcpi_sndbuf_limited;
+    return 0;
+#else
+    (void)sock;
+    (void)t;
+    return -1;
+#endif
+}
+
+/**
+ * Sample a stream and keep the sample, with the lock held
+ */
+static void stats_record(stats_transfer *s, int stream)
+{
+    stats_tcp t = {0};
+
+    if (tcp_sample(s->socks[stream], &t) < 0) {
+        return;
+    }
+    t.t = (double)(now_ns() - s->start) / 1e9;
+    t.stream = stream;
+    s->last[stream] = t;
+
+    if (s->samples == NULL) {
+        return;
+    }
+    if (s->nsamples == STATS_MAX_SAMPLES) {
+        /* Keep every other round, sampling half as often from now on */
+        size_t i, kept = 0;
+
+        for (i = 0; i < s->nsamples; i++) {
+            if (s->rounds[i] % 2 == 0) {
+                s->samples[kept] = s->samples[i];
+                s->rounds[kept++] = s->rounds[i] / 2;
+            }
+        }
+        s->nsamples = kept;
+        s->round /= 2;
+        s->interval *= 2;
+    }
+    s->samples[s->nsamples] = t;
+    s->rounds[s->nsamples++] = s->round;
+}
+
+/**
+ * Sampler thread: sample the watched connections until stopped
+ *
+ * @param arg Pointer to the `stats_transfer`
+ *
+ * @return Always `NULL`
+ */
+static void *stats_sampler(void *arg)
+{
+    stats_transfer *s = arg;
+
+    pthread_mutex_lock(&s->lock);
+    while (!s->stop) {
+        struct timespec deadline;
+        int i;
+
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += (long)(s->interval % 1000) * 1000000;
+        deadline.tv_sec += s->interval / 1000 + deadline.tv_nsec / 1000000000;
+        deadline.tv_nsec %= 1000000000;
+        while (!s->stop && pthread_cond_timedwait(&s->cond, &s->lock, &deadline) != ETIMEDOUT)
+            ;
+        if (s->stop) {
+            break;
+        }
+
+        s->round++;
+        for (i = 0; i < s->nstreams; i++) {
+            if (s->socks[i] >= 0) {
+                stats_record(s, i);
+            }
+        }
+    }
+    pthread_mutex_unlock(&s->lock);
+    return NULL;
+}
+
+stats_transfer *stats_begin(int sample)
+{
+    stats_transfer *s = calloc(1, sizeof(*s));
+
+    if (s == NULL) {
+        perror("calloc");
+        return NULL;
+    }
+    s->start = now_ns();
+    s->interval = STATS_INTERVAL_MS;
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->cond, NULL);
+
+    if (sample) {
+        s->samples = malloc(STATS_MAX_SAMPLES * sizeof(*s->samples));
+        s->rounds = malloc(STATS_MAX_SAMPLES * sizeof(*s->rounds));
+        if (s->samples == NULL || s->rounds == NULL) {
+            perror("malloc");
+        } else if (pthread_create(&s->sampler, NULL, stats_sampler, s) == 0) {
+            s->sampling = 1;
+        } else {
+            perror("pthread_create");
+        }
+    }
+
+    return s;
+}
+
+void stats_watch(stats_transfer *s, int sock)
+{
+    if (s == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&s->lock);
+    if (s->nstreams < STATS_MAX_STREAMS) {
+        s->socks[s->nstreams++] = sock;
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+void stats_unwatch(stats_transfer *s, int sock)
+{
+    int i;
+
+    if (s == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&s->lock);
+    for (i = 0; i < s->nstreams; i++) {
+        if (s->socks[i] == sock) {
+            stats_record(s, i);
+            s->socks[i] = -1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+/**
+ * Seconds spent in the calls of a kind
+ */
+static double kind_seconds(const stats_transfer *s, stats_kind kind)
+{
+    return (double)atomic_load(&s->ns[kind]) / 1e9;
+}
+
+/**
+ * Name the likely bottleneck of the transfer
+ *
+ * @param s       Statistics
+ * @param sending Nonzero for the sender
+ * @param elapsed Duration of the transfer
+ * @param cpu     CPU seconds of the process, or -1 if unknown
+ *
+ * @return Description of the bottleneck
+ */
+static const char *stats_bottleneck(const stats_transfer *s, int sending, double elapsed,
+                                    double cpu)
+{
+    double streams = s->nstreams > 0 ? s->nstreams : 1, share[STATS_KINDS];
+    double busy = 0, rwnd = 0, sndbuf = 0, retrans = 0, segs = 0;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int i;
+
+    if (elapsed <= 0) {
+        return "none, the transfer took no time";
+    }
+    /* Per connection, as each of them has its own calls in flight */
+    for (i = 0; i < STATS_KINDS; i++) {
+        share[i] = kind_seconds(s, (stats_kind)i) / elapsed / streams;
+    }
+    for (i = 0; i < s->nstreams; i++) {
+        busy += (double)s->last[i].busy_us;
+        rwnd += (double)s->last[i].rwnd_limited_us;
+        sndbuf += (double)s->last[i].sndbuf_limited_us;
+        retrans += s->last[i].retrans;
+        segs += s->last[i].segs_out;
+    }
+    if (cpus < 1) {
+        cpus = 1;
+    }
+
+    if (!sending) {
+        if (share[STATS_WRITE] > STATS_DOMINANT) {
+            return "the disk, writing the file takes most of the time";
+        }
+        if (share[STATS_RECV] + share[STATS_WRITE] + share[STATS_MOVE] < STATS_DOMINANT) {
+            return "the sender or the network, the receiver mostly waits for data";
+        }
+        return "the CPU, the receiver is busy moving the data";
+    }
+
+    if (share[STATS_READ] > STATS_DOMINANT) {
+        return "the disk, reading the file takes most of the time";
+    }
+    if (busy > 0 && rwnd / busy > STATS_LIMITED) {
+        return "the receiver, its receive window stays full";
+    }
+    if (busy > 0 && sndbuf / busy > STATS_LIMITED) {
+        return "the send buffer, smaller than the bandwidth-delay product";
+    }
+    if (segs > 0 && retrans / segs > STATS_LOSSY) {
+        return "the network, segments are lost and retransmitted";
+    }
+    if (cpu >= 0 && cpu > STATS_DOMINANT * elapsed * (streams < (double)cpus ? streams : (double)cpus)
+        && share[STATS_SEND] + share[STATS_MOVE] > STATS_DOMINANT) {
+        return "the CPU, copying the data to the socket keeps it busy";
+    }
+    if (share[STATS_SEND] + share[STATS_MOVE] > STATS_DOMINANT) {
+        return "the network, sending waits for the congestion window";
+    }
+    return "none in particular, the transfer is short or waits on round trips";
+}
+
+/**
+ * CPU seconds used by the process so far
+ */
+static double process_cpu(double *user, double *system)
+{
+    struct rusage ru;
+
+    if (getrusage(RUSAGE_SELF, &ru) < 0) {
+        *user = *system = 0;
+        return -1;
+    }
+    *user = (double)ru.ru_utime.tv_sec + (double)ru.ru_utime.tv_usec / 1e6;
+    *system = (double)ru.ru_stime.tv_sec + (double)ru.ru_stime.tv_usec / 1e6;
+    return *user + *system;
+}
+
+/**
+ * Print the time spent in each kind of call and the last `TCP_INFO`
+ */
+static void stats_print(const stats_transfer *s, int sending, double elapsed, double user,
+                        double system, const char *bottleneck)
+{
+    int i;
+
+    printf("Statistics over %.2f seconds:\n", elapsed);
+    for (i = 0; i < STATS_KINDS; i++) {
+        uint64_t calls = atomic_load(&s->calls[i]);
+
+        if (calls > 0) {
+            printf("  %-18s %8.3f s %10llu calls %10.2f MB\n", kind_names[i],
+                   kind_seconds(s, (stats_kind)i), (unsigned long long)calls,
+                   (double)atomic_load(&s->bytes[i]) / SIZE_MB);
+        }
+    }
+    if (sending) {
+        printf("  CPU: %.3f s user, %.3f s system\n", user, system);
+    }
+
+    for (i = 0; i < s->nstreams; i++) {
+        const stats_tcp *t = &s->last[i];
+        char label[32] = "TCP";
+
+        if (t->mss == 0) {
+            continue;
+        }
+        if (s->nstreams > 1) {
+            snprintf(label, sizeof(label), "TCP stream %d", i + 1);
+        }
+        printf("  %s: rtt %.3f ms (min %.3f ms, var %.3f ms), cwnd %u, "
+               "%u of %u segments retransmitted", label,
+               t->rtt_us / 1e3, t->min_rtt_us / 1e3, t->rttvar_us / 1e3, t->cwnd,
+               t->retrans, t->segs_out);
+        if (t->delivery_rate > 0) {
+            printf(", delivery rate %.2f MB/s", (double)t->delivery_rate / SIZE_MB);
+        }
+        printf("\n");
+        if (t->busy_us > 0) {
+            printf("  %s: sending held back by the receive window %.0f%%, "
+                   "by the send buffer %.0f%% of the time\n", label,
+                   100.0 * (double)t->rwnd_limited_us / (double)t->busy_us,
+                   100.0 * (double)t->sndbuf_limited_us / (double)t->busy_us);
+        }
+    }
+    printf("Bottleneck: %s\n", bottleneck);
+}
+
+/**
+ * Dump the counters and the samples as JSON
+ *
+ * @return 0 on success, -1 on error
+ */
+static int stats_dump(const stats_transfer *s, const char *path, double elapsed, double user,
+                      double system, const char *bottleneck)
+{
+    FILE *out = fopen(path, "w");
+    size_t i;
+    int k;
+
+    if (out == NULL) {
+        perror(path);
+        return -1;
+    }
+    fprintf(out, "{\n  \"elapsed_s\": %.6f,\n  \"cpu\": {\"user_s\": %.6f, \"system_s\": %.6f},\n"
+            "  \"streams\": %d,\n  \"bottleneck\": \"%s\",\n  \"io\": {",
+            elapsed, user, system, s->nstreams, bottleneck);
+    for (k = 0; k < STATS_KINDS; k++) {
+        fprintf(out, "%s\n    \"%s\": {\"seconds\": %.6f, \"calls\": %llu, \"bytes\": %llu}",
+                k ? "," : "", kind_keys[k], kind_seconds(s, (stats_kind)k),
+                (unsigned long long)atomic_load(&s->calls[k]),
+                (unsigned long long)atomic_load(&s->bytes[k]));
+    }
+    fprintf(out, "\n  },\n  \"tcp_samples\": [");
+    for (i = 0; i < s->nsamples; i++) {
+        const stats_tcp *t = &s->samples[i];
+
+        fprintf(out, "%s\n    {\"t\": %.3f, \"stream\": %d, \"rtt_us\": %u, \"rttvar_us\": %u, "
+                "\"min_rtt_us\": %u, \"cwnd\": %u, \"mss\": %u, \"retrans\": %u, "
+                "\"segs_out\": %u, \"delivery_rate\": %llu, \"busy_us\": %llu, "
+                "\"rwnd_limited_us\": %llu, \"sndbuf_limited_us\": %llu}",
+                i ? "," : "", t->t, t->stream, t->rtt_us, t->rttvar_us, t->min_rtt_us,
+                t->cwnd, t->mss, t->retrans, t->segs_out,
+                (unsigned long long)t->delivery_rate, (unsigned long long)t->busy_us,
+                (unsigned long long)t->rwnd_limited_us,
+                (unsigned long long)t->sndbuf_limited_us);
+    }
+    fprintf(out, "\n  ]\n}\n");
+
+    if (fclose(out) != 0) {
+        perror(path);
+        return -1;
+    }
+    return 0;
+}
+
+int stats_end(stats_transfer *s, int sending, const char *json)
+{
+    double elapsed, user = 0, system = 0, cpu = -1;
+    const char *bottleneck;
+    int rc = 0;
+
+    if (s == NULL) {
+        return 0;
+    }
+    if (s->sampling) {
+        pthread_mutex_lock(&s->lock);
+        s->stop = 1;
+        pthread_cond_signal(&s->cond);
+        pthread_mutex_unlock(&s->lock);
+        pthread_join(s->sampler, NULL);
+    }
+    if (stats_current == s) {
+        stats_current = NULL;
+    }
+
+    elapsed = (double)(now_ns() - s->start) / 1e9;
+    /* Only the sender's process is all about its transfer */
+    if (sending) {
+        cpu = process_cpu(&user, &system);
+    }
+    bottleneck = stats_bottleneck(s, sending, elapsed, cpu);
+    stats_print(s, sending, elapsed, user, system, bottleneck);
+    if (json) {
+        rc = stats_dump(s, json, elapsed, user, system, bottleneck);
+    }
+
+    pthread_cond_destroy(&s->cond);
+    pthread_mutex_destroy(&s->lock);
+    free(s->samples);
+    free(s->rounds);
+    free(s);
+    return rc;
+}
@@ -0,0 +1,136 @@
+/**
+ * @file stats.h
+ * @brief Where the time of a transfer goes
+ *
+ * With `--stats` the calls moving the data are timed and counted by
+ * kind: reading and writing the file, sending and receiving, and the
+ * calls doing both at once in the kernel. The I/O helpers reach the
+ * statistics of the transfer through `stats_current`, so they needn't
+ * know about transfers; with statistics off they cost a thread-local
+ * load per call.
+ *
+ * The connections are also sampled with `TCP_INFO` (Linux), every
+ * `STATS_INTERVAL_MS` on the sender and at the end on the receiver.
+ * Besides RTT, congestion window, retransmits and delivery rate, the
+ * kernel tells for how long sending was held back by the receive window
+ * or by the send buffer, which together with the time spent in each
+ * kind of call points at the bottleneck.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/** Interval between `TCP_INFO` samples on the sender */
+#define STATS_INTERVAL_MS 100
+
+/** Samples kept, older ones are thinned out past it */
+#define STATS_MAX_SAMPLES 4096
+
+/** Kinds of timed calls */
+typedef enum {
+    STATS_READ,   /**< Reading the file */
+    STATS_WRITE,  /**< Writing the file */
+    STATS_SEND,   /**< Sending to the socket */
+    STATS_RECV,   /**< Receiving from the socket */
+    STATS_MOVE,   /**< `sendfile()` and io_uring waits: file and socket at once */
+    STATS_KINDS
+} stats_kind;
+
+/** `TCP_INFO` of a connection at a point in time */
+typedef struct {
+    double   t;                  /**< Seconds since the start of the transfer */
+    int      stream;             /**< Connection, in the order they were watched */
+    uint32_t rtt_us;             /**< Smoothed round-trip time */
+    uint32_t rttvar_us;          /**< Its variation */
+    uint32_t min_rtt_us;
+    uint32_t cwnd;               /**< Congestion window, in segments */
+    uint32_t mss;
+    uint32_t retrans;            /**< Segments retransmitted so far */
+    uint32_t segs_out;           /**< Segments sent so far */
+    uint64_t delivery_rate;      /**< Bytes per second, as last measured */
+    uint64_t busy_us;            /**< Time spent with data to send */
+    uint64_t rwnd_limited_us;    /**< Of it, held back by the receive window */
+    uint64_t sndbuf_limited_us;  /**< Of it, held back by the send buffer */
+} stats_tcp;
+
+/** Statistics of a transfer, or of a receiver's connection */
+typedef struct stats_transfer stats_transfer;
+
+/**
+ * Statistics the calling thread's I/O is accounted to, or `NULL`
+ *
+ * Threads working on a transfer set it to the transfer's statistics
+ * before doing any I/O for it.
+ */
+extern _Thread_local stats_transfer *stats_current;
+
+/**
+ * Collect statistics of every connection of the receiver
+ *
+ * Off by default. Set from the command line before any transfer starts.
+ */
+extern int stats_enabled;
+
+/**
+ * Start collecting statistics of a transfer
+ *
+ * The I/O is accounted to them once the threads doing it set
+ * `stats_current` to them.
+ *
+ * @param sample Nonzero to sample the watched connections periodically,
+ *               otherwise they're sampled only once they are unwatched
+ *
+ * @return Statistics to end with `stats_end()`, or `NULL` on error
+ */
+stats_transfer *stats_begin(int sample);
+
+/**
+ * Timestamp the start of a call to account
+ *
+ * @return Start of the call, 0 if the thread collects no statistics
+ */
+uint64_t stats_start(void);
+
+/**
+ * Account a call started with `stats_start()`
+ *
+ * @param kind  Kind of the call
+ * @param start Value of `stats_start()`, nothing is done for 0
+ * @param bytes Result of the call, bytes moved if positive
+ */
+void stats_stop(stats_kind kind, uint64_t start, ssize_t bytes);
+
+/**
+ * Start sampling a connection of the transfer
+ *
+ * @param s    Statistics, or `NULL` to do nothing
+ * @param sock Connected socket
+ */
+void stats_watch(stats_transfer *s, int sock);
+
+/**
+ * Take the last sample of a connection and stop sampling it
+ *
+ * Must be called before the socket is closed.
+ *
+ * @param s    Statistics, or `NULL` to do nothing
+ * @param sock Socket passed to `stats_watch()`
+ */
+void stats_unwatch(stats_transfer *s, int sock);
+
+/**
+ * Stop collecting, print the summary and free the statistics
+ *
+ * The summary shows the time spent in each kind of call, the last
+ * `TCP_INFO` of the connections and the likely bottleneck.
+ *
+ * @param s       Statistics, or `NULL` to do nothing
+ * @param sending Nonzero for the sender, zero for a receiver's connection
+ * @param json    File to dump the counters and all the samples to as
+ *                JSON, or `NULL`
+ *
+ * @return 0 on success, -1 if the JSON can't be written
+ */
+int stats_end(stats_transfer *s, int sending, const char *json);
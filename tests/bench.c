@@ -0,0 +1,779 @@
+/**
+ * @file bench.c
+ * @brief Loopback benchmark of the transfers
+ *
+ * For every setting starts `fling serve` in `BENCH_DIR` and sends each
+ * generated file to it over loopback, `runs` times. Measured per run:
+ *
+ * - throughput, from the start of the sender until it exits, which it
+ *   does once the receiver has acknowledged the file
+ * - time to first byte, until the receiver has written any data, from
+ *   the bytes it has dirtied; the received file may have its full size
+ *   and its space allocated before then
+ * - CPU time and peak RSS of the sender, from `wait4()`, and of the
+ *   receiver, from its `/proc` entry
+ *
+ * The delta settings give the receiver a copy of the file before every
+ * run, with a share of its blocks changed, to be compared with a full
+ * copy by the default setting.
+ *
+ * Syscalls are counted in one more run of each file with both processes
+ * traced with `ptrace()`, as tracing every syscall would slow down the
+ * runs being timed.
+ *
+ * The medians of the runs go to a JSON file, so that the results of two
+ * commits can be compared. MB and GB are 2^20 and 2^30 bytes, as in the
+ * progress bar.
+ *
+ * Usage: bin/bench [output.json] [runs]
+ */
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netdb.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ptrace.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/utsname.h>
+#include <sys/wait.h>
+
+#define BENCH_PORT "54322"
+#define BENCH_DIR  "tests/bench-data"
+#define BENCH_RUNS 3
+
+/** Interval of checking the receiver for the first byte written, µs */
+#define BENCH_POLL 100
+
+/** Blocks changed in the receiver's copy for the delta settings, the
+ *  receiver's block size for files of up to 64 GB */
+#define BENCH_DELTA_BLOCK (64 * 1024)
+
+/** Threads of both processes followed by the traced run */
+#define BENCH_THREADS 256
+
+#define MB ((double)(1 << 20))
+#define GB ((double)(1 << 30))
+
+static const char *bench_files[] = {
+    "file-0.dat",
+    "file-1k.dat",
+    "file-1M.dat",
+    "file-10M.dat",
+    "file-10M-rand.dat",
+    "file-100M.dat",
+    "file-1G.dat",
+    "file-5G.dat",
+    "file-10G.dat",
+};
+
+/** Options of both sides, each list ending with `NULL` */
+typedef struct {
+    const char *name;
+    const char *serve[4];
+    const char *send[4];
+    double      changed;  /**< Share of the receiver's copy changed, -1 for no copy */
+} bench_setting;
+
+static const bench_setting bench_settings[] = {
+    {"default",      {NULL},                       {NULL},                      -1},
+    {"streams-4",    {NULL},                       {"--streams", "4", NULL},    -1},
+    {"pipeline",     {"--pipeline", NULL},         {"--pipeline", NULL},        -1},
+    {"io-uring",     {"--io-uring", NULL},         {"--io-uring", NULL},        -1},
+    {"cache-direct", {"--cache", "direct", NULL},  {"--cache", "direct", NULL}, -1},
+    {"verify",       {NULL},                       {"--verify", NULL},          -1},
+    {"delta-10",     {NULL},                       {"--delta", NULL},           0.1},
+    {"delta-30",     {NULL},                       {"--delta", NULL},           0.3},
+};
+
+#define COUNT(a) (sizeof(a) / sizeof((a)[0]))
+
+/** Measurements of one side */
+typedef struct {
+    double cpu;       /**< CPU seconds */
+    double rss;       /**< Peak RSS, KB */
+} bench_side;
+
+/** Measurements of one run */
+typedef struct {
+    double     seconds;
+    double     ttfb;     /**< Seconds until the first byte */
+    bench_side side[2];  /**< Sender, receiver */
+} bench_run;
+
+static char fling_path[PATH_MAX];
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/**
+ * Start fling with the given options
+ *
+ * @param mode    "serve" or "send"
+ * @param opts    Options, ending with `NULL`
+ * @param path    File to send, or `NULL`
+ * @param dir     Directory to run in, or `NULL`
+ * @param traced  Nonzero to stop the process for `ptrace()` before exec
+ *
+ * @return Process ID, or -1 on error
+ */
+static pid_t spawn(const char *mode, const char *const opts[], const char *path,
+                   const char *dir, int traced)
+{
+    const char *argv[16];
+    size_t argc = 0;
+    pid_t pid;
+
+    argv[argc++] = fling_path;
+    argv[argc++] = mode;
+    while (*opts) {
+        argv[argc++] = *opts++;
+    }
+    if (path) {
+        argv[argc++] = path;
+        argv[argc++] = "127.0.0.1";
+    }
+    argv[argc++] = BENCH_PORT;
+    argv[argc] = NULL;
+
+    pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return -1;
+    }
+    if (pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+
+        /* Progress bars and the like would only slow things down */
+        if (null >= 0) {
+            dup2(null, STDOUT_FILENO);
+        }
+        if (dir && chdir(dir) < 0) {
+            perror("chdir");
+            _exit(127);
+        }
+        if (traced) {
+            ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+            raise(SIGSTOP);
+        }
+        execv(fling_path, (char *const *)argv);
+        perror("execv");
+        _exit(127);
+    }
+    return pid;
+}
+
+/**
+ * Wait until the server accepts connections
+ *
+ * @return 0 on success, -1 if it doesn't within a few seconds
+ */
+static int wait_listening(pid_t server)
+{
+    struct addrinfo hints = {.ai_family = AF_INET, .ai_socktype = SOCK_STREAM}, *ai;
+    int i, rc = -1;
+
+    if (getaddrinfo("127.0.0.1", BENCH_PORT, &hints, &ai) != 0) {
+        return -1;
+    }
+    for (i = 0; i < 500 && rc < 0; i++) {
+        int sock = socket(AF_INET, SOCK_STREAM, 0);
+
+        if (sock >= 0 && connect(sock, ai->ai_addr, ai->ai_addrlen) == 0) {
+            rc = 0;
+        } else if (waitpid(server, NULL, WNOHANG) == server) {
+            i = 500;
+        } else {
+            usleep(10000);
+        }
+        if (sock >= 0) {
+            close(sock);
+        }
+    }
+    freeaddrinfo(ai);
+    return rc;
+}
+
+/**
+ * Read a file of `/proc` into a buffer
+ *
+ * @return 0 on success, -1 on error
+ */
+static int read_proc(pid_t pid, const char *name, char *buf, size_t size)
+{
+    char path[64];
+    ssize_t n;
+    int fd;
+
+    snprintf(path, sizeof(path), "/proc/%d/%s", (int)pid, name);
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    n = read(fd, buf, size - 1);
+    close(fd);
+    if (n < 0) {
+        return -1;
+    }
+    buf[n] = '\0';
+    return 0;
+}
+
+/**
+ * Value of a field of a `/proc/<pid>` file of "name: value" lines, -1 if
+ * there's none
+ */
+static long proc_field(pid_t pid, const char *name, const char *field)
+{
+    char buf[4096], *p;
+    size_t len = strlen(field);
+
+    if (read_proc(pid, name, buf, sizeof(buf)) < 0) {
+        return -1;
+    }
+    for (p = buf; strncmp(p, field, len) != 0; p++) {
+        p = strchr(p, '\n');
+        if (p == NULL) {
+            return -1;
+        }
+    }
+    return strtol(p + len, NULL, 10);
+}
+
+/**
+ * Value of a field of `/proc/<pid>/status`, -1 if there's none
+ */
+static long proc_status(pid_t pid, const char *field)
+{
+    return proc_field(pid, "status", field);
+}
+
+/**
+ * Bytes a process has written to files, counted as it dirties the pages
+ * or writes them directly, whatever the syscall; -1 if not known
+ */
+static long long proc_written(pid_t pid)
+{
+    return proc_field(pid, "io", "write_bytes:");
+}
+
+/**
+ * CPU seconds of all the threads of a process, dead ones included
+ */
+static double proc_cpu(pid_t pid)
+{
+    char buf[1024], *p;
+    unsigned long utime, stime;
+
+    /* Fields 14 and 15, counting from the state after the command name */
+    if (read_proc(pid, "stat", buf, sizeof(buf)) < 0 || (p = strrchr(buf, ')')) == NULL
+        || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+                  &utime, &stime) != 2) {
+        return 0;
+    }
+    return (double)(utime + stime) / (double)sysconf(_SC_CLK_TCK);
+}
+
+/**
+ * Reset the peak RSS of a process, where the kernel allows it
+ */
+static void proc_reset_peak(pid_t pid)
+{
+    char path[64];
+    int fd;
+
+    snprintf(path, sizeof(path), "/proc/%d/clear_refs", (int)pid);
+    fd = open(path, O_WRONLY);
+    if (fd >= 0) {
+        if (write(fd, "5", 1) < 0) {
+            /* Older kernels, the peak is the one since the start */
+        }
+        close(fd);
+    }
+}
+
+/**
+ * Give the receiver a copy of the file to send, with some blocks changed
+ *
+ * The changed blocks are spread evenly over the file, every byte of
+ * them flipped.
+ *
+ * @param src     File to send
+ * @param dst     Receiver's copy
+ * @param changed Share of the blocks to change
+ *
+ * @return 0 on success, -1 on error
+ */
+static int make_basis(const char *src, const char *dst, double changed)
+{
+    static unsigned char block[BENCH_DELTA_BLOCK];
+    int in, out, rc = -1;
+    ssize_t n;
+
+    in = open(src, O_RDONLY);
+    out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (in < 0 || out < 0) {
+        perror("open");
+        goto out;
+    }
+    for (size_t i = 0; (n = read(in, block, sizeof(block))) > 0; i++) {
+        if ((size_t)((double)(i + 1) * changed) > (size_t)((double)i * changed)) {
+            for (ssize_t j = 0; j < n; j++) {
+                block[j] ^= 0x5a;
+            }
+        }
+        if (write(out, block, (size_t)n) != n) {
+            perror("write");
+            goto out;
+        }
+    }
+    rc = n < 0 ? -1 : 0;
+out:
+    if (in >= 0) {
+        close(in);
+    }
+    if (out >= 0) {
+        close(out);
+    }
+    return rc;
+}
+
+/**
+ * Get the receiver's side ready for a transfer of a file
+ *
+ * @return 0 on success, -1 on error
+ */
+static int prepare_dst(const bench_setting *s, const char *src, const char *dst)
+{
+    unlink(dst);
+    return s->changed >= 0 ? make_basis(src, dst, s->changed) : 0;
+}
+
+/**
+ * Time one transfer of a file
+ *
+ * @param s        Setting
+ * @param file     Name of the file
+ * @param server   Receiver process
+ * @param run      Measurements to fill in
+ *
+ * @return 0 on success, -1 if the transfer failed
+ */
+static int bench_timed(const bench_setting *s, const char *file, pid_t server,
+                       bench_run *run)
+{
+    char src[PATH_MAX], dst[PATH_MAX];
+    double start, cpu;
+    long long written;
+    struct rusage ru;
+    pid_t sender;
+    int status;
+
+    snprintf(src, sizeof(src), "tests/gen-data/%s", file);
+    snprintf(dst, sizeof(dst), BENCH_DIR "/%s", file);
+    if (prepare_dst(s, src, dst) < 0) {
+        return -1;
+    }
+    proc_reset_peak(server);
+    cpu = proc_cpu(server);
+    written = proc_written(server);
+
+    start = now();
+    run->ttfb = -1;
+    sender = spawn("send", s->send, src, NULL, 0);
+    if (sender < 0) {
+        return -1;
+    }
+    while (wait4(sender, &status, WNOHANG, &ru) == 0) {
+        if (run->ttfb < 0 && written >= 0 && proc_written(server) > written) {
+            run->ttfb = now() - start;
+        }
+        usleep(BENCH_POLL);
+    }
+    run->seconds = now() - start;
+    if (run->ttfb < 0) {
+        /* Empty files, ones arriving within the last poll, no I/O accounting */
+        run->ttfb = run->seconds;
+    }
+
+    run->side[0].cpu = (double)ru.ru_utime.tv_sec + (double)ru.ru_utime.tv_usec / 1e6
+                       + (double)ru.ru_stime.tv_sec + (double)ru.ru_stime.tv_usec / 1e6;
+    run->side[0].rss = (double)ru.ru_maxrss;
+    run->side[1].cpu = proc_cpu(server) - cpu;
+    run->side[1].rss = (double)proc_status(server, "VmHWM:");
+
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+/** Thread followed by the traced run */
+typedef struct {
+    pid_t tid;
+    int   side;        /**< 0 for the sender, 1 for the receiver */
+    int   in_syscall;  /**< Between the entry and the exit of a syscall */
+} bench_thread;
+
+static bench_thread threads[BENCH_THREADS];
+static size_t nthreads;
+
+/**
+ * Find a traced thread, adding it if it's new
+ *
+ * @param tid    Thread ID
+ * @param sender Sender process, to tell the side of a new thread
+ * @param added  Set to 1 if the thread is new
+ */
+static bench_thread *find_thread(pid_t tid, pid_t sender, int *added)
+{
+    size_t i;
+
+    *added = 0;
+    for (i = 0; i < nthreads; i++) {
+        if (threads[i].tid == tid) {
+            return &threads[i];
+        }
+    }
+    if (nthreads == BENCH_THREADS) {
+        return NULL;
+    }
+    *added = 1;
+    threads[nthreads].tid = tid;
+    threads[nthreads].side = proc_status(tid, "Tgid:") != sender;
+    threads[nthreads].in_syscall = 0;
+    return &threads[nthreads++];
+}
+
+/**
+ * Start tracing the syscalls of all the threads of the running receiver
+ *
+ * @return 0 on success, -1 on error
+ */
+static int trace_server(pid_t server)
+{
+    const long options = PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE | PTRACE_O_EXITKILL;
+    char path[64];
+    struct dirent *d;
+    int attached = 0;
+    DIR *dir;
+
+    snprintf(path, sizeof(path), "/proc/%d/task", (int)server);
+    dir = opendir(path);
+    if (dir == NULL) {
+        perror(path);
+        return -1;
+    }
+    /* Threads the kernel refuses to trace, like io_uring workers, are left out */
+    while ((d = readdir(dir)) != NULL) {
+        pid_t tid = atoi(d->d_name);
+
+        if (tid > 0 && ptrace(PTRACE_SEIZE, tid, NULL, (void *)options) == 0
+            && ptrace(PTRACE_INTERRUPT, tid, NULL, NULL) == 0) {
+            attached++;
+        }
+    }
+    closedir(dir);
+    return attached > 0 ? 0 : -1;
+}
+
+/**
+ * Count the syscalls of one transfer of a file
+ *
+ * The receiver is to be traced already, its threads stay stopped between
+ * the transfers.
+ *
+ * @param s      Setting
+ * @param file   Name of the file
+ * @param counts Syscalls of the sender and of the receiver
+ *
+ * @return 0 on success, -1 if the transfer failed
+ */
+static int bench_traced(const bench_setting *s, const char *file, double counts[2])
+{
+    const long options = PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE | PTRACE_O_TRACEEXEC
+                         | PTRACE_O_EXITKILL;
+    char src[PATH_MAX], dst[PATH_MAX];
+    pid_t sender;
+    int status;
+
+    snprintf(src, sizeof(src), "tests/gen-data/%s", file);
+    snprintf(dst, sizeof(dst), BENCH_DIR "/%s", file);
+    if (prepare_dst(s, src, dst) < 0) {
+        return -1;
+    }
+    counts[0] = counts[1] = 0;
+
+    sender = spawn("send", s->send, src, NULL, 1);
+    if (sender < 0 || waitpid(sender, &status, __WALL) != sender || !WIFSTOPPED(status)) {
+        return -1;
+    }
+    ptrace(PTRACE_SETOPTIONS, sender, NULL, (void *)options);
+    ptrace(PTRACE_SYSCALL, sender, NULL, NULL);
+
+    while (1) {
+        pid_t tid = waitpid(-1, &status, __WALL);
+        bench_thread *t;
+        int sig, added;
+
+        if (tid < 0) {
+            perror("waitpid");
+            return -1;
+        }
+        if (WIFEXITED(status) || WIFSIGNALED(status)) {
+            if (tid == sender) {
+                break;
+            }
+            continue;
+        }
+
+        t = find_thread(tid, sender, &added);
+        sig = WSTOPSIG(status);
+        if (sig == (SIGTRAP | 0x80)) {
+            /* Entries and exits alternate, only entries are counted */
+            if (t && !t->in_syscall) {
+                counts[t->side]++;
+            }
+            if (t) {
+                t->in_syscall = !t->in_syscall;
+            }
+            sig = 0;
+        } else if (status >> 16 != 0 || (added && sig == SIGSTOP)) {
+            /* Clones, exec, attaching: not signals to deliver */
+            sig = 0;
+        }
+        ptrace(PTRACE_SYSCALL, tid, NULL, (void *)(long)sig);
+    }
+
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+static void stop_server(pid_t server, int sig)
+{
+    kill(server, sig);
+    /* The receiver's threads, if traced, are reported one by one */
+    while (waitpid(-1, NULL, __WALL) > 0 || errno == EINTR) {
+    }
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+static double median(double *v, size_t n)
+{
+    qsort(v, n, sizeof(*v), cmp_double);
+    return n % 2 ? v[n / 2] : (v[n / 2 - 1] + v[n / 2]) / 2;
+}
+
+/**
+ * Write a value per GB, `null` for empty files
+ */
+static void json_per_gb(FILE *out, const char *name, double value, double bytes)
+{
+    if (bytes > 0) {
+        fprintf(out, "\"%s\": %.3f", name, value * GB / bytes);
+    } else {
+        fprintf(out, "\"%s\": null", name);
+    }
+}
+
+static void json_args(FILE *out, const char *name, const char *const opts[])
+{
+    fprintf(out, "\"%s\": \"", name);
+    for (size_t i = 0; opts[i]; i++) {
+        fprintf(out, "%s%s", i ? " " : "", opts[i]);
+    }
+    fprintf(out, "\"");
+}
+
+/**
+ * Write the results of a file with a setting
+ */
+static void json_result(FILE *out, const bench_setting *s, const char *file, off_t bytes,
+                        bench_run *runs, size_t n, const double counts[2], int first)
+{
+    static const char *sides[] = {"sender", "receiver"};
+    double v[2][3][64], secs[64], ttfb[64];
+    double seconds, b = (double)bytes;
+
+    for (size_t i = 0; i < n; i++) {
+        secs[i] = runs[i].seconds;
+        ttfb[i] = runs[i].ttfb;
+        for (int j = 0; j < 2; j++) {
+            v[j][0][i] = runs[i].side[j].cpu;
+            v[j][1][i] = runs[i].side[j].rss;
+        }
+    }
+    seconds = median(secs, n);
+
+    fprintf(out, "%s\n    {\"file\": \"%s\", \"bytes\": %lld, \"setting\": \"%s\", ",
+            first ? "" : ",", file, (long long)bytes, s->name);
+    json_args(out, "serve_args", s->serve);
+    fprintf(out, ", ");
+    json_args(out, "send_args", s->send);
+    if (s->changed >= 0) {
+        fprintf(out, ", \"changed\": %.2f", s->changed);
+    } else {
+        fprintf(out, ", \"changed\": null");
+    }
+    fprintf(out, ",\n     \"runs\": %zu, \"seconds\": %.6f, \"mb_per_s\": %.2f, "
+            "\"ttfb_ms\": %.3f", n, seconds, seconds > 0 ? b / MB / seconds : 0,
+            median(ttfb, n) * 1e3);
+    for (int j = 0; j < 2; j++) {
+        fprintf(out, ",\n     \"%s\": {", sides[j]);
+        json_per_gb(out, "cpu_s_per_gb", median(v[j][0], n), b);
+        fprintf(out, ", ");
+        if (counts) {
+            json_per_gb(out, "syscalls_per_gb", counts[j], b);
+        } else {
+            fprintf(out, "\"syscalls_per_gb\": null");
+        }
+        fprintf(out, ", \"peak_rss_kb\": %.0f}", median(v[j][1], n));
+    }
+    fprintf(out, "}");
+}
+
+int main(int argc, char *argv[])
+{
+    const char *output = "bench.json";
+    size_t nruns = BENCH_RUNS;
+    static bench_run runs[COUNT(bench_settings)][COUNT(bench_files)][64];
+    static int failed[COUNT(bench_settings)][COUNT(bench_files)];
+    off_t sizes[COUNT(bench_files)];
+    char date[32];
+    struct utsname uts;
+    time_t t = time(NULL);
+    int first = 1, failures = 0;
+    FILE *out;
+
+    if (argc > 3 || (argc > 1 && argv[1][0] == '-')) {
+        fprintf(stderr, "Usage: %s [output.json] [runs]\n", argv[0]);
+        return 1;
+    }
+    if (argc > 1) {
+        output = argv[1];
+    }
+    if (argc > 2) {
+        char *end;
+        unsigned long n = strtoul(argv[2], &end, 10);
+
+        if (end == argv[2] || *end != '\0' || n < 1 || n > COUNT(runs[0][0])) {
+            fprintf(stderr, "Incorrect number of runs '%s', 1 to %zu\n",
+                    argv[2], COUNT(runs[0][0]));
+            return 1;
+        }
+        nruns = n;
+    }
+    if (realpath("bin/fling", fling_path) == NULL) {
+        perror("bin/fling");
+        return 1;
+    }
+    if (mkdir(BENCH_DIR, 0755) < 0 && errno != EEXIST) {
+        perror("mkdir " BENCH_DIR);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    for (size_t f = 0; f < COUNT(bench_files); f++) {
+        char path[PATH_MAX];
+        struct stat st;
+
+        snprintf(path, sizeof(path), "tests/gen-data/%s", bench_files[f]);
+        sizes[f] = stat(path, &st) == 0 ? st.st_size : -1;
+        if (sizes[f] < 0) {
+            fprintf(stderr, "Skipping %s, not generated (make test-data)\n", bench_files[f]);
+        }
+    }
+
+    out = fopen(output, "w");
+    if (out == NULL) {
+        perror(output);
+        return 1;
+    }
+    uname(&uts);
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", gmtime(&t));
+    fprintf(out, "{\n  \"version\": \"%s\",\n  \"date\": \"%s\",\n"
+            "  \"host\": {\"system\": \"%s %s\", \"machine\": \"%s\", \"cpus\": %ld},\n"
+            "  \"results\": [", FLING_VERSION, date, uts.sysname, uts.release,
+            uts.machine, sysconf(_SC_NPROCESSORS_ONLN));
+
+    for (size_t s = 0; s < COUNT(bench_settings); s++) {
+        const bench_setting *set = &bench_settings[s];
+        double counts[COUNT(bench_files)][2];
+        int counted[COUNT(bench_files)] = {0};
+        pid_t server = spawn("serve", set->serve, NULL, BENCH_DIR, 0);
+
+        if (server < 0 || wait_listening(server) < 0) {
+            fprintf(stderr, "%s: the receiver didn't start\n", set->name);
+            failures++;
+            continue;
+        }
+
+        for (size_t f = 0; f < COUNT(bench_files); f++) {
+            if (sizes[f] < 0) {
+                continue;
+            }
+            fprintf(stderr, "%-14s %-18s", set->name, bench_files[f]);
+            for (size_t r = 0; r < nruns && !failed[s][f]; r++) {
+                failed[s][f] = bench_timed(set, bench_files[f], server,
+                                           &runs[s][f][r]) < 0;
+            }
+            if (failed[s][f]) {
+                fprintf(stderr, " FAILED\n");
+                failures++;
+            } else {
+                fprintf(stderr, " %10.2f MB/s\n",
+                        (double)sizes[f] / MB / runs[s][f][nruns - 1].seconds);
+            }
+        }
+
+        /* One more round for the syscalls, with both sides traced */
+        nthreads = 0;
+        if (trace_server(server) == 0) {
+            for (size_t f = 0; f < COUNT(bench_files); f++) {
+                if (sizes[f] >= 0 && !failed[s][f]) {
+                    counted[f] = bench_traced(set, bench_files[f], counts[f]) == 0;
+                }
+            }
+        } else {
+            fprintf(stderr, "%s: can't trace the receiver, no syscall counts\n", set->name);
+        }
+        stop_server(server, SIGKILL);
+
+        for (size_t f = 0; f < COUNT(bench_files); f++) {
+            if (sizes[f] >= 0 && !failed[s][f]) {
+                json_result(out, set, bench_files[f], sizes[f], runs[s][f], nruns,
+                            counted[f] ? counts[f] : NULL, first);
+                first = 0;
+            }
+        }
+        /* Don't keep gigabytes of received files around */
+        for (size_t f = 0; f < COUNT(bench_files); f++) {
+            char dst[PATH_MAX];
+
+            snprintf(dst, sizeof(dst), BENCH_DIR "/%s", bench_files[f]);
+            unlink(dst);
+        }
+    }
+
+    fprintf(out, "\n  ]\n}\n");
+    fclose(out);
+    fprintf(stderr, "Results written to %s\n", output);
+    return failures > 0 ? 1 : 0;
+}
@@ -13,6 +13,12 @@
 #include "test_e2e.h"
 #include "test_receiver_payload.h"
 #include "test_file.h"
+#include "test_hash.h"
+#include "test_limit.h"
+#include "test_sparse.h"
+#include "test_tune.h"
+#include "test_udp.h"
+#include "test_zerocopy.h"
 
 int run_slow_tests = 0;
 pid_t pid_test_server;
@@ -23,6 +29,12 @@ static void run_tests(void)
     run_e2e();
     run_receiver_payload_tests();
     run_file_tests();
+    run_hash_tests();
+    run_limit_tests();
+    run_sparse_tests();
+    run_tune_tests();
+    run_udp_tests();
+    run_zerocopy_tests();
 }
 
 static void _cleanup(void)
@@ -67,7 +79,7 @@ int main(int argc, const char *argv[])
     if (argc > 1 && argv[1][0] == 's') {
         run_slow_tests = 1;
     }
-    system("rm -f tests/data/*.dat");
+    system("rm -rf tests/data/* tests/data/.??*");
 
     pid_test_server = fork();
     if (pid_test_server < 0) {
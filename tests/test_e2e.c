@@ -1,11 +1,137 @@
+#include <sys/stat.h>
+#include <time.h>
+
 #include "test_e2e.h"
 
+/** Rate of the receiver shared by the clients of `test_limit_clients()` */
+#define TEST_E2E_LIMIT (20 * 1024 * 1024)
+
+/**
+ * Send three files at once to a receiver with `--limit`
+ *
+ * Every client has to complete, and together they have to get about the
+ * receiver's rate: the receiver pauses each connection over its share
+ * instead of any of them stalling, or being dropped as idle.
+ */
+static void test_limit_clients(void)
+{
+    const char *files[] = {"file-10M.dat", "file-10M-rand.dat", "file-1M.dat"};
+    struct timespec start, end;
+    double total = 0, seconds, rate;
+    struct stat st;
+    size_t i;
+    int rc;
+
+    for (i = 0; i < sizeof(files) / sizeof(files[0]); i++) {
+        char path[256];
+
+        snprintf(path, sizeof(path), "tests/gen-data/%s", files[i]);
+        total += stat(path, &st) == 0 ? (double)st.st_size : 0;
+    }
+
+    system("mkdir -p tests/data-limit && cd tests/data-limit "
+           "&& { ../../bin/fling serve --limit 20M 54324 >/dev/null "
+           "& echo $! > ../limit.pid; }");
+    WAITABIT();
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    rc = system("bin/fling send tests/gen-data/file-10M.dat 127.0.0.1 54324 >/dev/null & a=$!; "
+                "bin/fling send tests/gen-data/file-10M-rand.dat 127.0.0.1 54324 >/dev/null & b=$!; "
+                "bin/fling send tests/gen-data/file-1M.dat 127.0.0.1 54324 >/dev/null & c=$!; "
+                "wait $a && wait $b && wait $c");
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    seconds = (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+    rate = total / seconds;
+
+    CHECK(rc == 0, "A client has failed");
+    CHECK(system("diff tests/data-limit/file-10M.dat tests/gen-data/file-10M.dat "
+                 "&& diff tests/data-limit/file-10M-rand.dat tests/gen-data/file-10M-rand.dat "
+                 "&& diff tests/data-limit/file-1M.dat tests/gen-data/file-1M.dat") == 0,
+          "A file differs");
+    CHECK(rate <= TEST_E2E_LIMIT * 1.1 && rate >= TEST_E2E_LIMIT * 0.7,
+          "Received %.2f MB/s for a limit of 20 MB/s", rate / (1024 * 1024));
+    system("kill $(cat tests/limit.pid); rm -rf tests/data-limit tests/limit.pid");
+}
+
 void run_e2e(void)
 {
     FLING_TEST_SEND("file-0.dat");
     FLING_TEST_SEND("file-1k.dat");
     FLING_TEST_SEND("file-1M.dat");
     FLING_TEST_SEND("file-10M.dat");
+    FLING_TEST_SEND_ARGS("file-10M-rand.dat", "--streams 4");
+    FLING_TEST_SEND_ARGS("file-10M-rand.dat", "--io-uring");
+    FLING_TEST_SEND_ARGS("file-10M-rand.dat", "--pipeline");
+    FLING_TEST_SEND_ARGS("file-10M-rand.dat", "--cache drop");
+    FLING_TEST_SEND_ARGS("file-10M-rand.dat", "--cache direct");
+    FLING_TEST_SEND_ARGS("file-10M-rand.dat", "--cache direct --streams 3 --verify");
+    FLING_TEST_SEND_ARGS("file-sparse.dat", "--sparse");
+    FLING_TEST_SEND_ARGS("file-sparse.dat", "--sparse --verify --streams 3");
+    FLING_TEST_SEND_ARGS("file-sparse.dat", "--sparse --cache direct");
+    FLING_TEST_SEND_ARGS("file-10M.dat", "--sparse --resume");
+    FLING_TEST_SEND_ARGS("file-10M-rand.dat", "--resume");
+    FLING_TEST_SEND_ARGS("file-10M.dat", "--compress");
+    FLING_TEST_SEND_ARGS("file-10M-rand.dat", "--compress --streams 4");
+    FLING_TEST_SEND_ARGS("file-10M-rand.dat", "--verify");
+    FLING_TEST_SEND_ARGS("file-10M-rand.dat", "--verify --streams 4");
+    FLING_TEST_SEND_ARGS("file-10M-rand.dat", "--verify --io-uring");
+    FLING_TEST_SEND_ARGS("file-10M-rand.dat", "--verify --pipeline");
+    FLING_TEST_SEND_ARGS("file-10M.dat", "--verify --compress");
+    FLING_TEST_SEND_ARGS("file-10M-rand.dat", "--stats");
+    FLING_TEST_SEND_ARGS("file-10M-rand.dat", "--stats --streams 3 --pipeline");
+    FLING_TEST_SEND_ARGS("file-10M-rand.dat", "--progress json --streams 3");
+    FLING_TEST_SEND_ARGS("file-sparse.dat", "--progress none --sparse");
+    FLING_TEST_SEND_ARGS("file-10M-rand.dat", "--autotune --streams 3");
+    FLING_TEST_SEND_ARGS("file-10M-rand.dat", "--autotune=8M");
+    FLING_TEST_SEND_ARGS("file-10M.dat", "--zerocopy --compress --verify");
+    FLING_TEST_SEND_ARGS("file-10M-rand.dat", "--zerocopy --pipeline");
+    FLING_TEST_SEND_ARGS("file-10M-rand.dat", "--limit 40M --streams 2");
+
+    /* Damage the receiver's copy, so the delta has to repair it */
+    system("printf 'changed' | dd of=tests/data/file-10M-rand.dat "
+           "bs=1 seek=5000000 conv=notrunc status=none");
+    FLING_TEST_SEND_ARGS("file-10M-rand.dat", "--delta");
+    FLING_TEST_SEND("tree");
+    FLING_TEST_SEND_ARGS("tree", "--compress");
+    FLING_TEST_SEND_ARGS("tree", "--verify");
+    FLING_TEST_SEND_ARGS("tree", "--sparse");
+    FLING_TEST_SEND_ARGS("tree", "--multiplex");
+    FLING_TEST_SEND_ARGS("tree", "--multiplex --verify");
+
+    /* A second receiver for the fan-out, in a directory of its own */
+    system("rm -f tests/data/file-10M-rand.dat && mkdir -p tests/data-fanout "
+           "&& cd tests/data-fanout "
+           "&& { ../../bin/fling serve 54322 >/dev/null & echo $! > ../fanout.pid; }");
+    WAITABIT();
+    system("bin/fling send --verify tests/gen-data/file-10M-rand.dat "
+           "127.0.0.1:54321 127.0.0.1:54322");
+    system("diff tests/data/file-10M-rand.dat tests/gen-data/file-10M-rand.dat "
+           "&& diff tests/data-fanout/file-10M-rand.dat tests/gen-data/file-10M-rand.dat "
+           "&& printf '" OK " - file-10M-rand.dat to two receivers\n' "
+           "|| printf '" FAIL " - file-10M-rand.dat to two receivers\n'");
+    system("kill $(cat tests/fanout.pid); rm -rf tests/data-fanout tests/fanout.pid");
+
+    /* A relay in front of the test receiver, each keeping a copy */
+    system("rm -f tests/data/file-10M-rand.dat && mkdir -p tests/data-relay "
+           "&& cd tests/data-relay "
+           "&& { ../../bin/fling serve --relay 127.0.0.1:54321 54323 >/dev/null "
+           "& echo $! > ../relay.pid; }");
+    WAITABIT();
+    system("bin/fling send --verify --streams 3 tests/gen-data/file-10M-rand.dat "
+           "127.0.0.1 54323");
+    system("diff tests/data/file-10M-rand.dat tests/gen-data/file-10M-rand.dat "
+           "&& diff tests/data-relay/file-10M-rand.dat tests/gen-data/file-10M-rand.dat "
+           "&& printf '" OK " - file-10M-rand.dat through a relay\n' "
+           "|| printf '" FAIL " - file-10M-rand.dat through a relay\n'");
+    system("kill $(cat tests/relay.pid); rm -rf tests/data-relay tests/relay.pid");
+
+    test_limit_clients();
+
+    /* Both families of localhost race to the dual-stack receiver */
+    system("rm -f tests/data/file-10M-rand.dat "
+           "&& bin/fling send tests/gen-data/file-10M-rand.dat localhost:54321");
+    system("diff tests/data/file-10M-rand.dat tests/gen-data/file-10M-rand.dat "
+           "&& printf '" OK " - file-10M-rand.dat to localhost\n' "
+           "|| printf '" FAIL " - file-10M-rand.dat to localhost\n'");
 
     if (run_slow_tests) {
         FLING_TEST_SEND("file-100M.dat");
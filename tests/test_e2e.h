@@ -6,8 +6,10 @@
 
 void run_e2e(void);
 
-#define FLING_TEST_SEND(fname) \
-    system("bin/fling send tests/gen-data/" fname " 127.0.0.1 54321"); \
-    system("diff tests/data/" fname " tests/gen-data/" fname " " \
-           "&& printf '" OK " - "fname"\n' " \
-           "|| printf '" FAIL " - "fname"\n'");
+#define FLING_TEST_SEND(fname) FLING_TEST_SEND_ARGS(fname, "")
+
+#define FLING_TEST_SEND_ARGS(fname, args) \
+    system("bin/fling send " args " tests/gen-data/" fname " 127.0.0.1 54321"); \
+    system("diff -r tests/data/" fname " tests/gen-data/" fname " " \
+           "&& printf '" OK " - "fname" "args"\n' " \
+           "|| printf '" FAIL " - "fname" "args"\n'");
@@ -0,0 +1,132 @@
+#include <inttypes.h>
+#include <string.h>
+
+#include "../hash.h"
+
+#include "test.h"
+#include "test_hash.h"
+
+/** Enough for a few leaves, with a partial one at the end */
+#define TEST_HASH_SIZE (HASH_LEAF * 5 + 1234)
+
+static unsigned char data[TEST_HASH_SIZE];
+
+static void fill_data(void)
+{
+    uint64_t x = 1;
+    size_t i;
+
+    for (i = 0; i < sizeof(data); i++) {
+        x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+        data[i] = (unsigned char)(x >> 56);
+    }
+}
+
+static void test_hash64__kernels_agree(void)
+{
+    static const size_t lengths[] = {0, 1, 31, 32, 33, 511, 512, 513, 4096 + 7,
+                                     HASH_LEAF, TEST_HASH_SIZE};
+    static const hash_kernel kernels[] = {HASH_KERNEL_SSE2, HASH_KERNEL_AVX2};
+    uint64_t expected[sizeof(lengths) / sizeof(lengths[0])];
+    size_t i, k;
+
+    hash_use_kernel(HASH_KERNEL_SCALAR);
+    for (i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+        expected[i] = hash64(data, lengths[i]);
+    }
+
+    for (k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+        int mismatches = 0;
+
+        if (hash_use_kernel(kernels[k]) < 0) {
+            printf("Hash kernel %zu is not supported, skipping\n", k);
+            continue;
+        }
+        for (i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+            mismatches += hash64(data, lengths[i]) != expected[i];
+        }
+        CHECK(mismatches == 0, "Kernel %zu differs from scalar for %d lengths",
+              k, mismatches);
+    }
+}
+
+static void test_hash64__incremental(void)
+{
+    static const size_t steps[] = {1, 7, 32, 100, 4099};
+    uint64_t expected = hash64(data, sizeof(data));
+    size_t i;
+
+    for (i = 0; i < sizeof(steps) / sizeof(steps[0]); i++) {
+        hash_state st;
+        size_t pos = 0;
+
+        hash64_init(&st);
+        while (pos < sizeof(data)) {
+            size_t n = sizeof(data) - pos < steps[i] ? sizeof(data) - pos : steps[i];
+            hash64_update(&st, data + pos, n);
+            pos += n;
+        }
+        CHECK(hash64_digest(&st) == expected, "Steps of %zu bytes: %016" PRIx64,
+              steps[i], hash64_digest(&st));
+    }
+}
+
+static void test_hash64__sensitive(void)
+{
+    uint64_t before = hash64(data, sizeof(data)), after;
+    unsigned char stripe[HASH_STRIPE];
+
+    /* Swap two stripes of the same block */
+    memcpy(stripe, data + 4096, HASH_STRIPE);
+    memcpy(data + 4096, data + 4096 + 64, HASH_STRIPE);
+    memcpy(data + 4096 + 64, stripe, HASH_STRIPE);
+    after = hash64(data, sizeof(data));
+    fill_data();
+
+    CHECK(before != after, "Hash didn't change: %016" PRIx64, after);
+}
+
+static void test_hash_tree__leaves(void)
+{
+    hash_tree streamed, parallel;
+    hash_trailer a, b;
+    size_t pos;
+
+    hash_tree_init(&streamed);
+    hash_tree_update(&streamed, data, 1000);
+    hash_tree_update(&streamed, data + 1000, sizeof(data) - 1000);
+    hash_tree_finish(&streamed, &a);
+
+    hash_tree_init(&parallel);
+    for (pos = 0; pos < sizeof(data); pos += HASH_LEAF) {
+        size_t n = sizeof(data) - pos < HASH_LEAF ? sizeof(data) - pos : HASH_LEAF;
+        hash_tree_add_leaf(&parallel, hash64(data + pos, n));
+    }
+    hash_tree_finish(&parallel, &b);
+
+    CHECK(a.leaves == 6, "Unexpected number of leaves: %" PRIu64, a.leaves);
+    CHECK(a.leaves == b.leaves && a.root == b.root,
+          "Roots differ: %016" PRIx64 " and %016" PRIx64, a.root, b.root);
+}
+
+static void test_hash_tree__empty(void)
+{
+    hash_tree t;
+    hash_trailer tr;
+
+    hash_tree_init(&t);
+    hash_tree_finish(&t, &tr);
+
+    CHECK(tr.leaves == 1 && tr.root == hash64(NULL, 0),
+          "Unexpected empty tree: %" PRIu64 " leaves", tr.leaves);
+}
+
+void run_hash_tests(void)
+{
+    fill_data();
+    test_hash64__kernels_agree();
+    test_hash64__incremental();
+    test_hash64__sensitive();
+    test_hash_tree__leaves();
+    test_hash_tree__empty();
+}
@@ -0,0 +1,87 @@
+#include <pthread.h>
+#include <time.h>
+
+#include "../limit.h"
+#include "test.h"
+#include "test_limit.h"
+
+#define TEST_LIMIT_RATE (20 * 1024 * 1024)
+#define TEST_LIMIT_SECONDS 0.6
+
+/** A thread sending as fast as its share allows, or at a rate of its own */
+typedef struct {
+    double   own_rate;  /**< Bytes per second it sends at most, 0 for no limit */
+    uint64_t sent;
+} test_limit_sender;
+
+static double test_limit_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void *test_limit_send(void *arg)
+{
+    test_limit_sender *s = arg;
+    double start = test_limit_now(), now;
+    limit_flow *l = limit_join();
+
+    while ((now = test_limit_now()) - start < TEST_LIMIT_SECONDS) {
+        if (s->own_rate > 0 && (double)s->sent > s->own_rate * (now - start)) {
+            struct timespec ts = {.tv_nsec = 1000000};
+
+            nanosleep(&ts, NULL);
+            continue;
+        }
+        limit_take(l, 16 * 1024);
+        s->sent += 16 * 1024;
+    }
+    limit_leave(l);
+    return NULL;
+}
+
+/**
+ * Run two senders side by side
+ */
+static void test_limit_run(test_limit_sender *a, test_limit_sender *b)
+{
+    pthread_t ta, tb;
+
+    pthread_create(&ta, NULL, test_limit_send, a);
+    pthread_create(&tb, NULL, test_limit_send, b);
+    pthread_join(ta, NULL);
+    pthread_join(tb, NULL);
+}
+
+/**
+ * Share the limit between two greedy senders, then between a greedy one
+ * and one needing little
+ */
+static void test_limit_fair(void)
+{
+    test_limit_sender a = {0}, b = {0}, small = {.own_rate = TEST_LIMIT_RATE / 10}, big = {0};
+    double total, mb = (double)TEST_LIMIT_RATE * TEST_LIMIT_SECONDS / 100;
+
+    limit_enabled = 1;
+    atomic_store(&limit_rate, TEST_LIMIT_RATE);
+
+    test_limit_run(&a, &b);
+    total = (double)(a.sent + b.sent);
+    CHECK(total > 80 * mb && total < 110 * mb && a.sent > b.sent / 2 && b.sent > a.sent / 2,
+          "Sent %.0f%% and %.0f%% of the limit", (double)a.sent / mb, (double)b.sent / mb);
+
+    /* What one doesn't use goes to the other */
+    test_limit_run(&small, &big);
+    CHECK(big.sent > 70 * mb && small.sent > 8 * mb && small.sent + big.sent < 110 * mb,
+          "Sent %.0f%% and %.0f%% of the limit", (double)small.sent / mb, (double)big.sent / mb);
+
+    atomic_store(&limit_rate, 0);
+    limit_enabled = 0;
+}
+
+void run_limit_tests(void)
+{
+    test_limit_fair();
+}
@@ -1,5 +1,6 @@
 #include <assert.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -8,9 +9,15 @@
 #include <signal.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 
 #include "../client.h"
+#include "../compress.h"
 #include "../file.h"
+#include "../hash.h"
+#include "../resume.h"
+#include "../session.h"
 
 #include "test.h"
 #include "test_file.h"
@@ -171,6 +178,454 @@ static void test_file_size_mismatch__actual_size_is_smaller(void)
     TEARDOWN();
 }
 
+/**
+ * Send two stripes of a file in reverse order over one connection
+ * and check that the receiver puts them in place.
+ */
+static void test_stripes_out_of_order(void)
+{
+    SETUP();
+
+    size_t stripe_size = 5;
+    int fd;
+    ssize_t len;
+    file_header hdr = {
+        .fname = TEST_FNAME_STRIPES,
+        .fsize = stripe_size * 2,
+        .offset = stripe_size,
+        .length = stripe_size,
+        .flags = FHDR_STRIPE,
+    };
+
+    /* Action */
+    memset(ctx.buf, 'b', stripe_size);
+    SEND(ctx.sock, &hdr, FHEADER_SIZE);
+    SEND(ctx.sock, ctx.buf, stripe_size);
+
+    hdr.offset = 0;
+    memset(ctx.buf, 'a', stripe_size);
+    SEND(ctx.sock, &hdr, FHEADER_SIZE);
+    SEND(ctx.sock, ctx.buf, stripe_size);
+
+    /* Check */
+    WAITABIT();
+    memset(ctx.buf, 0, stripe_size * 2);
+    OPEN(fd, "tests/data/" TEST_FNAME_STRIPES, O_RDONLY);
+    len = read(fd, ctx.buf, stripe_size * 3);
+    CHECK((size_t)len == stripe_size * 2, "File size is incorrect (%zd)", len);
+    CHECK(memcmp(ctx.buf, "aaaaabbbbb", stripe_size * 2) == 0,
+          "Unexpected content: %.10s", ctx.buf);
+    close(fd);
+
+    TEARDOWN();
+}
+
+/**
+ * Send a tree entry whose path climbs out of the receiver's directory
+ */
+static void test_tree_path_traversal(void)
+{
+    SETUP();
+
+    const char path[] = "tree/../../" TEST_TREE_TRAVERSAL;
+    file_header hdr = {
+        .fname = TEST_TREE_TRAVERSAL,
+        .flags = FHDR_TREE,
+        .mode = S_IFREG | 0644,
+        .path_len = sizeof(path) - 1,
+    };
+
+    SEND(ctx.sock, &hdr, FHEADER_SIZE);
+    SEND(ctx.sock, path, hdr.path_len);
+    WAITABIT();
+
+    CHECK(access(TEST_TREE_TRAVERSAL, F_OK) != 0,
+          "File was found outside the test dir");
+
+    TEARDOWN();
+}
+
+/**
+ * Send a file deep in a tree whose directories weren't sent before
+ */
+static void test_tree_nested_file(void)
+{
+    SETUP();
+
+    const char path[] = TEST_TREE_NESTED;
+    size_t size = 5;
+    int fd;
+    ssize_t len;
+    file_header hdr = {
+        .fname = "file.dat",
+        .fsize = size,
+        .flags = FHDR_TREE,
+        .mode = S_IFREG | 0644,
+        .path_len = sizeof(path) - 1,
+    };
+    memset(ctx.buf, 'a', size);
+
+    SEND(ctx.sock, &hdr, FHEADER_SIZE);
+    SEND(ctx.sock, path, hdr.path_len);
+    SEND(ctx.sock, ctx.buf, size);
+    WAITABIT();
+
+    OPEN(fd, "tests/data/" TEST_TREE_NESTED, O_RDONLY);
+    len = read(fd, ctx.buf, size * 2);
+    CHECK((size_t)len == size, "File size is incorrect (%zd)", len);
+    close(fd);
+
+    TEARDOWN();
+}
+
+/**
+ * Interrupt a resumable transfer past its first block and check that
+ * the receiver offers to continue from the end of that block.
+ */
+static void test_resume_offer(void)
+{
+    SETUP();
+
+    size_t sent = 0, partial = RESUME_BLOCK + CHUNK_SIZE;
+    uint64_t start = 0;
+    resume_offer offer;
+    ssize_t len;
+    file_header hdr = {
+        .fname = TEST_FNAME_RESUME,
+        .fsize = RESUME_BLOCK * 2,
+        .flags = FHDR_RESUME,
+    };
+    memset(ctx.buf, 'a', CHUNK_SIZE);
+
+    /* Action */
+    SEND(ctx.sock, &hdr, FHEADER_SIZE);
+    len = recv(ctx.sock, &offer, sizeof(offer), MSG_WAITALL);
+    CHECK(len == sizeof(offer) && offer.offset == 0,
+          "Unexpected first offer: %" PRIu64, offer.offset);
+    SEND(ctx.sock, &start, sizeof(start));
+    while (sent < partial) {
+        SEND(ctx.sock, ctx.buf, CHUNK_SIZE);
+        sent += CHUNK_SIZE;
+    }
+    WAITABIT();
+    close(ctx.sock);
+    WAITABIT();
+
+    ctx.sock = establish_connection("127.0.0.1", "54321");
+    assert(ctx.sock >= 0);
+    SEND(ctx.sock, &hdr, FHEADER_SIZE);
+    len = recv(ctx.sock, &offer, sizeof(offer), MSG_WAITALL);
+
+    /* Check */
+    CHECK(len == sizeof(offer) && offer.offset == RESUME_BLOCK,
+          "Unexpected offer: %" PRIu64, offer.offset);
+
+    TEARDOWN();
+}
+
+/**
+ * Send a compressed block followed by a block stored as is, and check
+ * that the receiver puts both together.
+ */
+static void test_compressed_frames(void)
+{
+    SETUP();
+
+    static unsigned char packed[COMPRESS_BLOCK];
+    size_t stored = 5;
+    compress_frame frame;
+    int fd;
+    ssize_t len;
+    file_header hdr = {
+        .fname = TEST_FNAME_COMPRESS,
+        .fsize = COMPRESS_BLOCK + stored,
+        .flags = FHDR_COMPRESS,
+    };
+    memset(ctx.buf, 'a', COMPRESS_BLOCK);
+    memset(ctx.buf + COMPRESS_BLOCK, 'b', stored);
+    frame.raw = COMPRESS_BLOCK;
+    frame.packed = (uint32_t)compress_block((unsigned char*)ctx.buf, COMPRESS_BLOCK,
+                                            packed, sizeof(packed));
+    CHECK(frame.packed > 0 && frame.packed < COMPRESS_BLOCK / 100,
+          "Block didn't compress: %" PRIu32, frame.packed);
+
+    /* Action */
+    SEND(ctx.sock, &hdr, FHEADER_SIZE);
+    SEND(ctx.sock, &frame, sizeof(frame));
+    SEND(ctx.sock, packed, frame.packed);
+    frame.raw = frame.packed = (uint32_t)stored;
+    SEND(ctx.sock, &frame, sizeof(frame));
+    SEND(ctx.sock, ctx.buf + COMPRESS_BLOCK, stored);
+
+    /* Check */
+    WAITABIT();
+    memset(ctx.buf, 0, sizeof(ctx.buf));
+    OPEN(fd, "tests/data/" TEST_FNAME_COMPRESS, O_RDONLY);
+    len = read(fd, ctx.buf, sizeof(ctx.buf));
+    close(fd);
+    CHECK((size_t)len == hdr.fsize, "File size is incorrect (%zd)", len);
+    CHECK(ctx.buf[0] == 'a' && ctx.buf[COMPRESS_BLOCK - 1] == 'a'
+          && ctx.buf[COMPRESS_BLOCK] == 'b' && ctx.buf[hdr.fsize - 1] == 'b',
+          "File contents are incorrect");
+
+    TEARDOWN();
+}
+
+/**
+ * Send a compressed block that references data before its start, and
+ * check that the receiver drops it instead of writing anything.
+ */
+static void test_compressed_frame_malformed(void)
+{
+    SETUP();
+
+    /* A match 16 bytes back, right at the start of the block */
+    unsigned char packed[] = {0x0f, 16, 0, 0xff, 0xff};
+    compress_frame frame = {.raw = 100, .packed = sizeof(packed)};
+    struct stat st;
+    file_header hdr = {
+        .fname = TEST_FNAME_COMPRESS_BAD,
+        .fsize = frame.raw,
+        .flags = FHDR_COMPRESS,
+    };
+
+    /* Action */
+    SEND(ctx.sock, &hdr, FHEADER_SIZE);
+    SEND(ctx.sock, &frame, sizeof(frame));
+    SEND(ctx.sock, packed, sizeof(packed));
+
+    /* Check */
+    WAITABIT();
+    CHECK(stat("tests/data/" TEST_FNAME_COMPRESS_BAD, &st) == 0 && st.st_size == 0,
+          "Malformed block was written");
+
+    TEARDOWN();
+}
+
+/**
+ * Send data followed by a hash of different data, and check that the
+ * receiver reports the mismatch and doesn't keep the data.
+ */
+static void test_hash_mismatch(void)
+{
+    SETUP();
+
+    size_t size = 5;
+    unsigned char verdict = 0;
+    hash_tree t;
+    hash_trailer tr;
+    ssize_t len;
+    file_header hdr = {
+        .fname = TEST_FNAME_HASH_BAD,
+        .fsize = size,
+        .flags = FHDR_HASH,
+    };
+
+    hash_tree_init(&t);
+    hash_tree_update(&t, "bbbbb", size);
+    hash_tree_finish(&t, &tr);
+    memset(ctx.buf, 'a', size);
+
+    /* Action */
+    SEND(ctx.sock, &hdr, FHEADER_SIZE);
+    SEND(ctx.sock, ctx.buf, size);
+    SEND(ctx.sock, &tr, sizeof(tr));
+    len = recv(ctx.sock, &verdict, sizeof(verdict), 0);
+
+    /* Check */
+    CHECK(len == 1 && verdict == HASH_MISMATCH,
+          "Unexpected reply: %zd bytes, %d", len, verdict);
+    CHECK(access("tests/data/" TEST_FNAME_HASH_BAD, F_OK) != 0,
+          "Corrupted file was kept");
+
+    TEARDOWN();
+}
+
+/**
+ * Announce a file larger than the disk, and check that the receiver
+ * refuses it before any data is sent.
+ */
+static void test_file_no_space(void)
+{
+    SETUP();
+
+    char byte;
+    ssize_t len;
+    file_header hdr = {
+        .fname = TEST_FNAME_NO_SPACE,
+        .fsize = (size_t)1 << 50,
+    };
+
+    /* Action */
+    SEND(ctx.sock, &hdr, FHEADER_SIZE);
+    len = recv(ctx.sock, &byte, sizeof(byte), 0);
+
+    /* Check */
+    CHECK(len <= 0, "Connection wasn't closed: %zd bytes received", len);
+
+    TEARDOWN();
+}
+
+/**
+ * Send a frame of a session
+ *
+ * @return 0 on success, -1 on error
+ */
+static int send_session_frame(int sock, uint32_t id, uint32_t type,
+                              const void *payload, size_t length)
+{
+    session_frame fr = {.id = id, .type = type, .length = length};
+
+    if (send(sock, &fr, sizeof(fr), 0) < 0
+        || (length > 0 && send(sock, payload, length, 0) < 0)) {
+        perror("send");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Open a file of a session in a slot
+ *
+ * @return 0 on success, -1 on error
+ */
+static int send_session_open(int sock, uint32_t id, const char *path, size_t size,
+                             uint32_t flags)
+{
+    unsigned char payload[FHEADER_SIZE + MAX_PATH_LEN];
+    file_header hdr = {
+        .fsize = size,
+        .flags = FHDR_TREE | flags,
+        .mode = S_IFREG | 0644,
+        .path_len = (uint32_t)strlen(path),
+    };
+
+    memcpy(payload, &hdr, FHEADER_SIZE);
+    memcpy(payload + FHEADER_SIZE, path, hdr.path_len);
+    return send_session_frame(sock, id, SESSION_OPEN, payload, FHEADER_SIZE + hdr.path_len);
+}
+
+/**
+ * Receive the acknowledgements of a session, giving up after a while
+ *
+ * @return Number of acknowledgements received
+ */
+static size_t recv_session_acks(int sock, session_ack *acks, size_t n)
+{
+    struct timeval timeout = {.tv_sec = 5};
+    ssize_t len;
+
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    len = recv(sock, acks, n * sizeof(*acks), MSG_WAITALL);
+    return len > 0 ? (size_t)len / sizeof(*acks) : 0;
+}
+
+/**
+ * Send two files of a session a slice each in turn, and check that the
+ * receiver puts every slice in its file and acknowledges the files in
+ * the order they end.
+ */
+static void test_session_interleaved(void)
+{
+    SETUP();
+
+    size_t size = 10, n;
+    session_ack acks[2];
+    int fd;
+    ssize_t len;
+    file_header hdr = {.flags = FHDR_SESSION};
+
+    /* Action */
+    SEND(ctx.sock, &hdr, FHEADER_SIZE);
+    if (send_session_open(ctx.sock, 0, TEST_SESSION_A, size, 0) < 0
+        || send_session_open(ctx.sock, 1, TEST_SESSION_B, size, 0) < 0
+        || send_session_frame(ctx.sock, 0, SESSION_DATA, "aaaaa", 5) < 0
+        || send_session_frame(ctx.sock, 1, SESSION_DATA, "bbbbb", 5) < 0
+        || send_session_frame(ctx.sock, 0, SESSION_DATA, "AAAAA", 5) < 0
+        || send_session_frame(ctx.sock, 1, SESSION_DATA, "BBBBB", 5) < 0
+        || send_session_frame(ctx.sock, 1, SESSION_END, NULL, 0) < 0
+        || send_session_frame(ctx.sock, 0, SESSION_END, NULL, 0) < 0) {
+        goto _teardown;
+    }
+    n = recv_session_acks(ctx.sock, acks, 2);
+
+    /* Check */
+    CHECK(n == 2 && acks[0].id == 1 && acks[0].status == 0
+          && acks[1].id == 0 && acks[1].status == 0,
+          "Unexpected acknowledgements: %zu", n);
+    OPEN(fd, "tests/data/" TEST_SESSION_A, O_RDONLY);
+    len = read(fd, ctx.buf, size * 2);
+    close(fd);
+    CHECK((size_t)len == size && memcmp(ctx.buf, "aaaaaAAAAA", size) == 0,
+          "Unexpected content: %.*s", (int)(len > 0 ? len : 0), ctx.buf);
+    OPEN(fd, "tests/data/" TEST_SESSION_B, O_RDONLY);
+    len = read(fd, ctx.buf, size * 2);
+    close(fd);
+    CHECK((size_t)len == size && memcmp(ctx.buf, "bbbbbBBBBB", size) == 0,
+          "Unexpected content: %.*s", (int)(len > 0 ? len : 0), ctx.buf);
+
+    TEARDOWN();
+}
+
+/**
+ * Send a session with a file the receiver can't create and one whose
+ * hash doesn't match among good ones, and check that only those two fail
+ * while the session goes on.
+ */
+static void test_session_failing_files(void)
+{
+    SETUP();
+
+    const char traversal[] = "session/../../" TEST_SESSION_TRAVERSAL;
+    size_t size = 5, n;
+    session_ack acks[4];
+    hash_tree t;
+    hash_trailer tr;
+    int fd;
+    ssize_t len;
+    file_header hdr = {.flags = FHDR_SESSION};
+
+    hash_tree_init(&t);
+    hash_tree_update(&t, "bbbbb", size);
+    hash_tree_finish(&t, &tr);
+
+    /* Action */
+    SEND(ctx.sock, &hdr, FHEADER_SIZE);
+    if (send_session_open(ctx.sock, 0, traversal, size, 0) < 0
+        || send_session_open(ctx.sock, 1, TEST_SESSION_HASH_BAD, size, FHDR_HASH) < 0
+        || send_session_open(ctx.sock, 2, TEST_SESSION_A, size, 0) < 0
+        || send_session_frame(ctx.sock, 0, SESSION_DATA, "xxxxx", size) < 0
+        || send_session_frame(ctx.sock, 1, SESSION_DATA, "aaaaa", size) < 0
+        || send_session_frame(ctx.sock, 2, SESSION_DATA, "ccccc", size) < 0
+        || send_session_frame(ctx.sock, 0, SESSION_END, NULL, 0) < 0
+        || send_session_frame(ctx.sock, 1, SESSION_END, &tr, sizeof(tr)) < 0
+        || send_session_frame(ctx.sock, 2, SESSION_END, NULL, 0) < 0
+        || send_session_open(ctx.sock, 0, TEST_SESSION_GOOD, size, 0) < 0
+        || send_session_frame(ctx.sock, 0, SESSION_DATA, "ddddd", size) < 0
+        || send_session_frame(ctx.sock, 0, SESSION_END, NULL, 0) < 0) {
+        goto _teardown;
+    }
+    n = recv_session_acks(ctx.sock, acks, 4);
+
+    /* Check */
+    CHECK(n == 4 && acks[0].id == 0 && acks[0].status != 0
+          && acks[1].id == 1 && acks[1].status != 0
+          && acks[2].id == 2 && acks[2].status == 0
+          && acks[3].id == 0 && acks[3].status == 0,
+          "Unexpected acknowledgements: %zu", n);
+    CHECK(access(TEST_SESSION_TRAVERSAL, F_OK) != 0,
+          "File was found outside the test dir");
+    CHECK(access("tests/data/" TEST_SESSION_HASH_BAD, F_OK) != 0,
+          "Corrupted file was kept");
+    OPEN(fd, "tests/data/" TEST_SESSION_GOOD, O_RDONLY);
+    len = read(fd, ctx.buf, size * 2);
+    close(fd);
+    CHECK((size_t)len == size && memcmp(ctx.buf, "ddddd", size) == 0,
+          "Unexpected content: %.*s", (int)(len > 0 ? len : 0), ctx.buf);
+
+    TEARDOWN();
+}
+
 /**
  * Run tests composing different kinds of payload,
  * including incorrect and malicious ones
@@ -182,4 +637,14 @@ void run_receiver_payload_tests(void)
     test_file_size_mismatch__actual_size_is_larger_2();
     test_file_size_mismatch__actual_size_is_smaller();
     test_file_name_without_null_termination();
+    test_stripes_out_of_order();
+    test_tree_path_traversal();
+    test_tree_nested_file();
+    test_resume_offer();
+    test_compressed_frames();
+    test_compressed_frame_malformed();
+    test_hash_mismatch();
+    test_file_no_space();
+    test_session_interleaved();
+    test_session_failing_files();
 }
@@ -6,6 +6,19 @@
 #define TEST_FNAME_SIZE_MISMATCH_1_1 "file-size-mismatch-1-1.dat"
 #define TEST_FNAME_SIZE_MISMATCH_1_2 "file-size-mismatch-1-2.dat"
 #define TEST_FNAME_SIZE_MISMATCH_2   "file-size-mismatch-2.dat"
+#define TEST_FNAME_STRIPES           "file-stripes.dat"
+#define TEST_TREE_TRAVERSAL          "tree-traversal.dat"
+#define TEST_TREE_NESTED             "tree-nested/a/b/file.dat"
+#define TEST_FNAME_RESUME            "file-resume.dat"
+#define TEST_FNAME_COMPRESS          "file-compress.dat"
+#define TEST_FNAME_COMPRESS_BAD      "file-compress-bad.dat"
+#define TEST_FNAME_HASH_BAD          "file-hash-bad.dat"
+#define TEST_FNAME_NO_SPACE          "file-no-space.dat"
+#define TEST_SESSION_A               "session/file-a.dat"
+#define TEST_SESSION_B               "session/file-b.dat"
+#define TEST_SESSION_TRAVERSAL       "session-traversal.dat"
+#define TEST_SESSION_HASH_BAD        "session/file-hash-bad.dat"
+#define TEST_SESSION_GOOD            "session/file-good.dat"
 
 #define SEND(sock, buf, size) \
     do { \
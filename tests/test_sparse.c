@@ -0,0 +1,89 @@
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "../hash.h"
+#include "../sparse.h"
+
+#include "test.h"
+#include "test_sparse.h"
+
+#define TEST_SPARSE_FILE "tests/data/sparse-punch.dat"
+
+static void test_sparse_is_zero(void)
+{
+    static char buf[SPARSE_BLOCK + 7];
+    size_t i;
+    int misses = 0;
+
+    CHECK(sparse_is_zero(buf, sizeof(buf)), "Zeros aren't zero");
+    CHECK(sparse_is_zero(buf, 0), "An empty buffer isn't zero");
+
+    /* A single byte anywhere, in the vector part or the tail */
+    for (i = 0; i < sizeof(buf); i++) {
+        buf[i] = 1;
+        misses += sparse_is_zero(buf, sizeof(buf));
+        buf[i] = 0;
+    }
+    CHECK(misses == 0, "%d nonzero bytes missed", misses);
+}
+
+static void test_hash_tree_update_zeros(void)
+{
+    static char zeros[HASH_LEAF * 2 + 100];
+    hash_tree a, b;
+    hash_trailer ta, tb;
+
+    hash_tree_init(&a);
+    hash_tree_update(&a, "x", 1);
+    hash_tree_update(&a, zeros, sizeof(zeros));
+    hash_tree_finish(&a, &ta);
+
+    hash_tree_init(&b);
+    hash_tree_update(&b, "x", 1);
+    hash_tree_update_zeros(&b, 10);
+    hash_tree_update_zeros(&b, sizeof(zeros) - 10);
+    hash_tree_finish(&b, &tb);
+
+    CHECK(ta.leaves == tb.leaves && ta.root == tb.root, "Zeros hash differently");
+}
+
+static void test_sparse_punch(void)
+{
+    char buf[3 * SPARSE_BLOCK];
+    struct stat st;
+    int fd, rc;
+
+    fd = open(TEST_SPARSE_FILE, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    CHECK(fd >= 0, "Can't create the test file");
+    if (fd < 0) {
+        return;
+    }
+    memset(buf, 'a', sizeof(buf));
+    rc = (int)write(fd, buf, sizeof(buf));
+
+    /* Over the data in the middle, then past the end */
+    rc = rc == (int)sizeof(buf) ? sparse_punch(fd, SPARSE_BLOCK, SPARSE_BLOCK) : -1;
+    CHECK(rc == 0, "Unexpected result code: %d", rc);
+    rc = sparse_punch(fd, sizeof(buf), 5 * SPARSE_BLOCK);
+    CHECK(rc == 0, "Unexpected result code: %d", rc);
+
+    fstat(fd, &st);
+    CHECK(st.st_size == 8 * SPARSE_BLOCK, "Unexpected size: %jd", (intmax_t)st.st_size);
+    rc = (int)pread(fd, buf, sizeof(buf), 0);
+    CHECK(rc == (int)sizeof(buf) && buf[0] == 'a' && buf[SPARSE_BLOCK - 1] == 'a'
+          && sparse_is_zero(buf + SPARSE_BLOCK, SPARSE_BLOCK)
+          && buf[2 * SPARSE_BLOCK] == 'a', "Unexpected contents");
+
+    close(fd);
+    unlink(TEST_SPARSE_FILE);
+}
+
+void run_sparse_tests(void)
+{
+    test_sparse_is_zero();
+    test_hash_tree_update_zeros();
+    test_sparse_punch();
+}
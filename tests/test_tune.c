@@ -0,0 +1,86 @@
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "../tune.h"
+
+#include "test.h"
+#include "test_tune.h"
+
+static void test_tune_parse_size(void)
+{
+    CHECK(tune_parse_size("4096") == 4096, "Plain bytes misparsed");
+    CHECK(tune_parse_size("64K") == 64 * 1024, "Kilobytes misparsed");
+    CHECK(tune_parse_size("32m") == 32 * 1024 * 1024, "Megabytes misparsed");
+    CHECK(tune_parse_size("1G") == 1024 * 1024 * 1024, "Gigabytes misparsed");
+    CHECK(tune_parse_size("0") == 0, "Zero accepted");
+    CHECK(tune_parse_size("M") == 0, "A suffix alone accepted");
+    CHECK(tune_parse_size("12MB") == 0, "Trailing garbage accepted");
+    CHECK(tune_parse_size("8G") == 0, "A size past the socket limits accepted");
+}
+
+/**
+ * Measure both ends of a loopback connection that has moved some data
+ */
+static void test_tune_loopback(void)
+{
+    struct sockaddr_in addr = {.sin_family = AF_INET};
+    socklen_t len = sizeof(addr);
+    static char buf[1024 * 1024];
+    tune_socket tx, rx;
+    int listener, a, b = -1;
+    size_t moved = 0;
+
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    listener = socket(AF_INET, SOCK_STREAM, 0);
+    a = socket(AF_INET, SOCK_STREAM, 0);
+    if (bind(listener, (struct sockaddr*)&addr, sizeof(addr)) == 0
+        && listen(listener, 1) == 0
+        && getsockname(listener, (struct sockaddr*)&addr, &len) == 0
+        && connect(a, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+        b = accept(listener, NULL, NULL);
+    }
+    CHECK(b >= 0, "Can't set up a loopback connection");
+    if (b < 0) {
+        close(a);
+        close(listener);
+        return;
+    }
+
+    tune_start(&tx, a, 1);
+    tune_start(&rx, b, 0);
+    while (moved < sizeof(buf)) {
+        ssize_t n = send(a, buf, sizeof(buf) / 16, 0);
+
+        moved += n > 0 ? (size_t)n : sizeof(buf);
+        while (n > 0 && recv(b, buf, sizeof(buf) / 16, MSG_DONTWAIT) > 0)
+            ;
+    }
+
+    /* Measure right away, the way it's done every `TUNE_INTERVAL_MS` */
+    tx.next = rx.next = 0;
+    tune_poll(&tx);
+    tune_poll(&rx);
+    CHECK(!tx.done && tx.rtt_us > 0 && tx.rate > 0,
+          "Sender not measured: rtt %u us, rate %llu", tx.rtt_us, (unsigned long long)tx.rate);
+    CHECK(!rx.done && rx.rtt_us > 0 && rx.rate > 0,
+          "Receiver not measured: rtt %u us, rate %llu", rx.rtt_us, (unsigned long long)rx.rate);
+    CHECK(tx.chunk >= 256 * 1024 && tx.chunk <= TUNE_MAX_CHUNK,
+          "Chunk out of bounds: %zu", tx.chunk);
+    CHECK(tx.buffer <= tune_max_buffer && rx.buffer <= tune_max_buffer,
+          "Buffers past the limit: %zu, %zu", tx.buffer, rx.buffer);
+
+    close(b);
+    close(a);
+    close(listener);
+}
+
+void run_tune_tests(void)
+{
+    test_tune_parse_size();
+#ifdef __linux__
+    test_tune_loopback();
+#endif
+}
@@ -0,0 +1,107 @@
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../udp.h"
+#include "test.h"
+#include "test_udp.h"
+
+#define TEST_UDP_PORT 54360
+#define TEST_UDP_SIZE (4 * 1024 * 1024 + 123)
+
+/**
+ * Check that a received file has the contents sent
+ *
+ * @return 1 if it has, 0 otherwise
+ */
+static int test_udp_same(const char *sent, const char *received)
+{
+    static char a[64 * 1024], b[64 * 1024];
+    FILE *fa = fopen(sent, "rb"), *fb = fopen(received, "rb");
+    int same = fa != NULL && fb != NULL;
+
+    while (same) {
+        size_t na = fread(a, 1, sizeof(a), fa), nb = fread(b, 1, sizeof(b), fb);
+
+        same = na == nb && memcmp(a, b, na) == 0;
+        if (na == 0) {
+            break;
+        }
+    }
+    if (fa) {
+        fclose(fa);
+    }
+    if (fb) {
+        fclose(fb);
+    }
+    return same;
+}
+
+/**
+ * Send files over loopback to a server of this process, losing and
+ * delaying packets on purpose
+ */
+static void test_udp_lossy(void)
+{
+    static char buf[64 * 1024];
+    unsigned seed = 1;
+    udp_server *s;
+    FILE *out;
+    file f = {0}, empty = {0};
+    size_t left = TEST_UDP_SIZE, i;
+    ssize_t sent = -1, sent_empty = -1;
+    char port[16];
+
+    system("rm -rf tests/data-udp && mkdir -p tests/data-udp && : > tests/udp-empty.dat");
+    out = fopen("tests/udp.dat", "wb");
+    CHECK(out != NULL, "Can't create tests/udp.dat");
+    if (out == NULL) {
+        return;
+    }
+    while (left > 0) {
+        size_t n = left < sizeof(buf) ? left : sizeof(buf);
+
+        for (i = 0; i < n; i++) {
+            buf[i] = (char)rand_r(&seed);
+        }
+        fwrite(buf, 1, n, out);
+        left -= n;
+    }
+    fclose(out);
+
+    /* Opened before moving to where the server writes */
+    CHECK(file_open(&f, "tests/udp.dat") == 0 && file_open(&empty, "tests/udp-empty.dat") == 0,
+          "Can't open the files to send");
+    if (chdir("tests/data-udp") < 0) {
+        perror("chdir");
+        return;
+    }
+    s = udp_server_start(TEST_UDP_PORT, 10);
+    CHECK(s != NULL, "Can't start the UDP server");
+    if (s != NULL) {
+        snprintf(port, sizeof(port), "%d", TEST_UDP_PORT);
+        udp_shim_loss = 0.05;
+        udp_shim_delay_ms = 10;
+        sent = udp_send(&f, "127.0.0.1", port);
+        sent_empty = udp_send(&empty, "127.0.0.1", port);
+        udp_shim_loss = 0;
+        udp_shim_delay_ms = 0;
+        udp_server_stop(s);
+    }
+    if (chdir("../..") < 0) {
+        perror("chdir");
+    }
+    file_close(&f);
+    file_close(&empty);
+
+    CHECK(sent == TEST_UDP_SIZE && test_udp_same("tests/udp.dat", "tests/data-udp/udp.dat"),
+          "Sent %zd bytes", sent);
+    CHECK(sent_empty == 0 && test_udp_same("tests/udp-empty.dat", "tests/data-udp/udp-empty.dat"),
+          "Sent %zd bytes of an empty file", sent_empty);
+    system("rm -rf tests/data-udp tests/udp.dat tests/udp-empty.dat");
+}
+
+void run_udp_tests(void)
+{
+    test_udp_lossy();
+}
@@ -0,0 +1,89 @@
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "../zerocopy.h"
+#include "test.h"
+#include "test_zerocopy.h"
+
+/**
+ * Send buffers over a loopback connection and change them once released
+ */
+static void test_zerocopy_loopback(void)
+{
+    struct sockaddr_in addr = {.sin_family = AF_INET};
+    socklen_t len = sizeof(addr);
+    static unsigned char buf[64 * 1024], got[16 * 64 * 1024];
+    zerocopy_socket z;
+    uint32_t token = 0, small;
+    size_t received = 0, i;
+    int listener, a, b = -1, enabled, released = 1, intact = 1;
+    ssize_t sent = 0;
+
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    listener = socket(AF_INET, SOCK_STREAM, 0);
+    a = socket(AF_INET, SOCK_STREAM, 0);
+    if (bind(listener, (struct sockaddr*)&addr, sizeof(addr)) == 0
+        && listen(listener, 1) == 0
+        && getsockname(listener, (struct sockaddr*)&addr, &len) == 0
+        && connect(a, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+        b = accept(listener, NULL, NULL);
+    }
+    CHECK(b >= 0, "Can't set up a loopback connection");
+    if (b < 0) {
+        close(a);
+        close(listener);
+        return;
+    }
+
+    zerocopy_enabled = 1;
+    zerocopy_start(&z, a);
+    enabled = z.enabled;
+    for (i = 0; i < 16; i++) {
+        ssize_t n;
+
+        /* The buffer is filled again only once the kernel is done with it */
+        released &= zerocopy_flush(&z) == 0 && zerocopy_done(&z, token);
+        memset(buf, (int)i, sizeof(buf));
+        n = zerocopy_send(&z, buf, sizeof(buf), &token);
+        sent += n > 0 ? n : 0;
+        while ((n = recv(b, got + received, sizeof(got) - received, MSG_DONTWAIT)) > 0) {
+            received += (size_t)n;
+        }
+    }
+    released &= zerocopy_flush(&z) == 0 && zerocopy_done(&z, token);
+    CHECK(sent == (ssize_t)sizeof(got) && released, "Sent %zd bytes, released %d", sent, released);
+    while (received < sizeof(got)) {
+        ssize_t n = recv(b, got + received, sizeof(got) - received, 0);
+
+        if (n <= 0) {
+            break;
+        }
+        received += (size_t)n;
+    }
+    for (i = 0; i < received; i++) {
+        intact &= got[i] == i / sizeof(buf);
+    }
+    CHECK(received == sizeof(got) && intact, "Received %zu bytes, intact %d", received, intact);
+
+    /* Loopback copies the data anyway, which turns zero-copy off */
+    CHECK(!enabled || (z.next > 0 && !z.enabled),
+          "Zero-copy still on after %u sends", (unsigned)z.next);
+    small = z.next;
+    CHECK(zerocopy_send(&z, buf, ZEROCOPY_MIN_SIZE - 1, &token) == ZEROCOPY_MIN_SIZE - 1
+          && z.next == small && zerocopy_done(&z, token), "A small send not copied");
+
+    zerocopy_enabled = 0;
+    close(b);
+    close(a);
+    close(listener);
+}
+
+void run_zerocopy_tests(void)
+{
+#ifdef __linux__
+    test_zerocopy_loopback();
+#endif
+}
@@ -0,0 +1,408 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "file.h"
+#include "progress.h"
+#include "session.h"
+#include "tree.h"
+
+/** Directory or opened file waiting to be sent */
+typedef struct {
+    char    *path;   /**< Path relative to the parent of the tree root */
+    int      fd;     /**< Opened file, -1 for directories */
+    mode_t   mode;
+    size_t   size;
+} tree_entry;
+
+/**
+ * Queue between the walker thread and the connection
+ *
+ * The walker blocks while the queue is full, the sender while it's empty.
+ * `failed` tells the walker to give up once the connection is broken.
+ */
+typedef struct {
+    tree_entry      queue[TREE_QUEUE_SIZE];
+    size_t          head, count;
+    pthread_mutex_t lock;
+    pthread_cond_t  not_empty, not_full;
+    int             done;      /**< The walker has pushed its last entry */
+    int             failed;
+    char            local[PATH_MAX + MAX_PATH_LEN + 2]; /**< Path being walked */
+    size_t          base;      /**< Offset of the relative path in `local` */
+    atomic_size_t   total;     /**< Bytes of all files found so far */
+    progress_transfer *progress; /**< Progress to report `total` to */
+    size_t          sent;      /**< Bytes of the files sent completely */
+    uint32_t        flags;     /**< Header flags to add to every entry */
+} tree_ctx;
+
+/**
+ * Add an entry to the queue, waiting for room if needed
+ *
+ * @param ctx   Tree context
+ * @param entry Entry to add, owned by the queue on success
+ *
+ * @return 0 on success, -1 if the transfer has failed
+ */
+static int tree_push(tree_ctx *ctx, const tree_entry *entry)
+{
+    int rc = 0;
+
+    pthread_mutex_lock(&ctx->lock);
+    while (ctx->count == TREE_QUEUE_SIZE && !ctx->failed) {
+        pthread_cond_wait(&ctx->not_full, &ctx->lock);
+    }
+    if (ctx->failed) {
+        rc = -1;
+    } else {
+        ctx->queue[(ctx->head + ctx->count) % TREE_QUEUE_SIZE] = *entry;
+        ctx->count++;
+        pthread_cond_signal(&ctx->not_empty);
+    }
+    pthread_mutex_unlock(&ctx->lock);
+    return rc;
+}
+
+/**
+ * Take the next entry from the queue
+ *
+ * @param ctx   Tree context
+ * @param entry Set to the entry taken
+ * @param wait  Nonzero to wait for an entry if the queue is empty
+ *
+ * @return 1 if an entry was taken, 0 if none is queued yet (only without
+ *         `wait`), -1 if the walker is done
+ */
+static int tree_pop(tree_ctx *ctx, tree_entry *entry, int wait)
+{
+    int rc;
+
+    pthread_mutex_lock(&ctx->lock);
+    while (wait && ctx->count == 0 && !ctx->done) {
+        pthread_cond_wait(&ctx->not_empty, &ctx->lock);
+    }
+    rc = ctx->count == 0 && ctx->done ? -1 : 0;
+    if (ctx->count > 0) {
+        *entry = ctx->queue[ctx->head];
+        ctx->head = (ctx->head + 1) % TREE_QUEUE_SIZE;
+        ctx->count--;
+        pthread_cond_signal(&ctx->not_full);
+        rc = 1;
+    }
+    pthread_mutex_unlock(&ctx->lock);
+    return rc;
+}
+
+/**
+ * Queue the entry at `ctx->local`
+ *
+ * @param ctx Tree context
+ * @param st  Status of the entry
+ *
+ * @return 0 on success, -1 on error
+ */
+static int tree_push_local(tree_ctx *ctx, const struct stat *st)
+{
+    tree_entry entry = {.fd = -1, .mode = st->st_mode};
+
+    if (S_ISREG(st->st_mode)) {
+        entry.fd = open(ctx->local, O_RDONLY);
+        if (entry.fd < 0) {
+            perror(ctx->local);
+            return -1;
+        }
+        entry.size = (size_t)st->st_size;
+    }
+    entry.path = strdup(ctx->local + ctx->base);
+    if (!entry.path) {
+        perror("strdup");
+        goto err;
+    }
+    if (tree_push(ctx, &entry) < 0) {
+        free(entry.path);
+        goto err;
+    }
+    atomic_fetch_add(&ctx->total, entry.size);
+    progress_set_total(ctx->progress, ctx->total);
+    return 0;
+
+err:
+    if (entry.fd >= 0) {
+        close(entry.fd);
+    }
+    return -1;
+}
+
+/**
+ * Queue the contents of the directory at `ctx->local`, recursively
+ *
+ * @param ctx Tree context
+ * @param len Length of the path in `ctx->local`
+ *
+ * @return 0 on success, -1 on error
+ */
+static int tree_walk(tree_ctx *ctx, size_t len)
+{
+    struct dirent *de;
+    struct stat st;
+    DIR *dir;
+    int rc = 0;
+
+    dir = opendir(ctx->local);
+    if (!dir) {
+        perror(ctx->local);
+        return -1;
+    }
+
+    while (rc == 0 && (de = readdir(dir)) != NULL) {
+        size_t name_len = strlen(de->d_name);
+
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+            continue;
+        }
+        if (len + 1 + name_len - ctx->base > MAX_PATH_LEN) {
+            printf("Skipping %s/%s: path too long\n", ctx->local, de->d_name);
+            continue;
+        }
+        ctx->local[len] = '/';
+        memcpy(ctx->local + len + 1, de->d_name, name_len + 1);
+
+        if (lstat(ctx->local, &st) < 0) {
+            perror(ctx->local);
+            rc = -1;
+        } else if (S_ISDIR(st.st_mode)) {
+            rc = tree_push_local(ctx, &st);
+            if (rc == 0) {
+                rc = tree_walk(ctx, len + 1 + name_len);
+            }
+        } else if (S_ISREG(st.st_mode)) {
+            rc = tree_push_local(ctx, &st);
+        } else {
+            printf("Skipping %s: not a regular file or directory\n", ctx->local);
+        }
+        ctx->local[len] = '\0';
+    }
+
+    closedir(dir);
+    return rc;
+}
+
+/**
+ * Walker thread: queue the whole tree, then mark the queue done
+ *
+ * @param arg Pointer to the `tree_ctx` with the root in `local`
+ *
+ * @return Always `NULL`
+ */
+static void *tree_walker(void *arg)
+{
+    tree_ctx *ctx = arg;
+    struct stat st;
+    int rc;
+
+    rc = lstat(ctx->local, &st);
+    if (rc < 0) {
+        perror(ctx->local);
+    } else {
+        rc = tree_push_local(ctx, &st);
+    }
+    if (rc == 0) {
+        rc = tree_walk(ctx, strlen(ctx->local));
+    }
+
+    pthread_mutex_lock(&ctx->lock);
+    if (rc < 0) {
+        ctx->failed = 1;
+    }
+    ctx->done = 1;
+    pthread_cond_signal(&ctx->not_empty);
+    pthread_mutex_unlock(&ctx->lock);
+    return NULL;
+}
+
+/**
+ * Prepare a queued entry for sending
+ *
+ * @param entry Entry taken from the queue
+ * @param flags Header flags to add
+ * @param f     Set to the entry's file, sharing its descriptor and path
+ */
+static void tree_entry_file(const tree_entry *entry, uint32_t flags, file *f)
+{
+    const char *name = strrchr(entry->path, '/');
+
+    memset(f, 0, sizeof(*f));
+    f->fd = entry->fd;
+    f->path = entry->path;
+    strncpy(f->hdr.fname, name ? name + 1 : entry->path, MAX_FILE_NAME);
+    f->hdr.fsize = entry->size;
+    f->hdr.length = entry->size;
+    f->hdr.flags = FHDR_TREE | flags;
+    f->hdr.mode = (uint32_t)entry->mode;
+    f->hdr.path_len = (uint32_t)strlen(entry->path);
+}
+
+/**
+ * Send a queued entry
+ *
+ * @param entry Entry taken from the queue
+ * @param sock  Connected socket descriptor
+ * @param flags Header flags to add
+ *
+ * @return Bytes of file contents sent on success, -1 on error
+ */
+static ssize_t tree_send_entry(const tree_entry *entry, int sock, uint32_t flags)
+{
+    file f;
+
+    tree_entry_file(entry, flags, &f);
+    return file_send(&f, sock);
+}
+
+/**
+ * Hand the next entry over to a session, see `session_next`
+ *
+ * The session owns the entry's descriptor and path from then on.
+ */
+static int tree_next(void *arg, file *f, int wait)
+{
+    tree_ctx *ctx = arg;
+    tree_entry entry;
+    int rc = tree_pop(ctx, &entry, wait);
+
+    if (rc > 0) {
+        tree_entry_file(&entry, ctx->flags, f);
+    }
+    return rc;
+}
+
+/**
+ * Send the queued entries one after another
+ *
+ * @param ctx     Tree context with the walker started
+ * @param sock    Connected socket descriptor
+ * @param entries Set to the number of entries sent
+ *
+ * @return 0 on success, -1 on error
+ */
+static int tree_send_queue(tree_ctx *ctx, int sock, size_t *entries)
+{
+    tree_entry entry;
+    int rc = 0;
+
+    while (tree_pop(ctx, &entry, 1) > 0) {
+        if (rc == 0 && tree_send_entry(&entry, sock, ctx->flags) < 0) {
+            /* Keep popping to release what the walker has queued */
+            pthread_mutex_lock(&ctx->lock);
+            ctx->failed = 1;
+            pthread_cond_signal(&ctx->not_full);
+            pthread_mutex_unlock(&ctx->lock);
+            rc = -1;
+        } else if (rc == 0) {
+            ctx->sent += entry.size;
+            (*entries)++;
+        }
+        if (entry.fd >= 0) {
+            close(entry.fd);
+        }
+        free(entry.path);
+    }
+    return rc;
+}
+
+/**
+ * Send the queued entries over a session, see `session.h`
+ *
+ * @param ctx     Tree context with the walker started
+ * @param sock    Connected socket descriptor
+ * @param entries Set to the number of entries received
+ *
+ * @return 0 on success, -1 on error
+ */
+static int tree_send_session(tree_ctx *ctx, int sock, size_t *entries)
+{
+    tree_entry entry;
+    ssize_t sent = session_send(sock, tree_next, ctx, entries);
+
+    if (sent >= 0) {
+        ctx->sent = (size_t)sent;
+        return 0;
+    }
+
+    /* Release what the walker has queued */
+    pthread_mutex_lock(&ctx->lock);
+    ctx->failed = 1;
+    pthread_cond_signal(&ctx->not_full);
+    pthread_mutex_unlock(&ctx->lock);
+    while (tree_pop(ctx, &entry, 1) > 0) {
+        if (entry.fd >= 0) {
+            close(entry.fd);
+        }
+        free(entry.path);
+    }
+    return -1;
+}
+
+ssize_t tree_send(const char *root, int sock, uint32_t flags, size_t *entries)
+{
+    tree_ctx *ctx;
+    pthread_t walker;
+    ssize_t rc = 0;
+    char *slash;
+
+    *entries = 0;
+    ctx = calloc(1, sizeof(*ctx));
+    if (!ctx) {
+        perror("calloc");
+        return -1;
+    }
+    if (!realpath(root, ctx->local)) {
+        perror(root);
+        free(ctx);
+        return -1;
+    }
+    slash = strrchr(ctx->local, '/');
+    if (!slash || slash[1] == '\0') {
+        printf("Refusing to send the root directory\n");
+        free(ctx);
+        return -1;
+    }
+    ctx->base = (size_t)(slash + 1 - ctx->local);
+    ctx->progress = progress_current;
+    ctx->flags = flags & ~(uint32_t)FHDR_SESSION;
+
+    pthread_mutex_init(&ctx->lock, NULL);
+    pthread_cond_init(&ctx->not_empty, NULL);
+    pthread_cond_init(&ctx->not_full, NULL);
+
+    if (pthread_create(&walker, NULL, tree_walker, ctx) != 0) {
+        perror("pthread_create");
+        rc = -1;
+        goto out;
+    }
+
+    if (flags & FHDR_SESSION) {
+        rc = tree_send_session(ctx, sock, entries);
+    } else {
+        rc = tree_send_queue(ctx, sock, entries);
+    }
+
+    pthread_join(walker, NULL);
+    if (rc == 0) {
+        rc = ctx->failed ? -1 : (ssize_t)ctx->sent;
+    }
+
+out:
+    pthread_cond_destroy(&ctx->not_full);
+    pthread_cond_destroy(&ctx->not_empty);
+    pthread_mutex_destroy(&ctx->lock);
+    free(ctx);
+    return rc;
+}
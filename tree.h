@@ -0,0 +1,39 @@
+/**
+ * @file tree.h
+ * @brief Sending a directory tree over a single connection
+ *
+ * Every directory and regular file of the tree is sent as a `FHDR_TREE`
+ * entry carrying its path relative to the parent of the tree root.
+ * A walker thread scans the tree and opens the files ahead of the
+ * connection, so the directory traversal overlaps with the transfer
+ * instead of stalling it between small files.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/** Number of entries the walker may get ahead of the connection */
+#define TREE_QUEUE_SIZE 64
+
+/**
+ * Send a directory with all its contents
+ *
+ * Symbolic links and special files are skipped with a message. The
+ * total of the progress of the calling thread follows the bytes
+ * discovered so far.
+ *
+ * With `FHDR_SESSION` the entries are sent interleaved over a session,
+ * see `session.h`, which also waits for the receiver to acknowledge
+ * them; `FHDR_HASH` is the only other flag that applies then.
+ *
+ * @param root    Path to the directory to send
+ * @param sock    Connected socket descriptor
+ * @param flags   Header flags to add to every entry, such as `FHDR_COMPRESS`
+ * @param entries Set to the number of entries sent, or acknowledged
+ *                over a session
+ *
+ * @return Total bytes of file contents sent on success, -1 on error
+ */
+ssize_t tree_send(const char *root, int sock, uint32_t flags, size_t *entries);
@@ -0,0 +1,442 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#ifdef __linux__
+# include <linux/tcp.h>
+#endif
+
+#include "file.h"
+#include "progress.h"
+#include "tune.h"
+
+/** Connections of a transfer that are tuned, later ones are left as they are */
+#define TUNE_MAX_STREAMS 32
+
+/** Least bytes sent per call */
+#define TUNE_MIN_CHUNK ((size_t)(CHUNK_SIZE))
+
+_Thread_local tune_transfer *tune_current;
+int tune_enabled = 0;
+size_t tune_max_buffer = TUNE_MAX_BUFFER;
+
+struct tune_transfer {
+    atomic_size_t   chunk;      /**< Bytes to send per call, the most of any connection */
+    pthread_mutex_t lock;       /**< Protects everything below */
+    pthread_cond_t  cond;
+    pthread_t       tuner;
+    int             tuning;     /**< The tuner thread is running */
+    int             stop;       /**< The tuner thread is to exit */
+    int             socks[TUNE_MAX_STREAMS];  /**< Watched sockets by stream, -1 once unwatched */
+    tune_socket     streams[TUNE_MAX_STREAMS];
+    int             nstreams;   /**< Streams watched so far */
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+size_t tune_parse_size(const char *arg)
+{
+    char *end;
+    unsigned long long size = strtoull(arg, &end, 10);
+
+    switch (*end) {
+    case 'G': case 'g':
+        size *= 1024;
+        /* fall through */
+    case 'M': case 'm':
+        size *= 1024;
+        /* fall through */
+    case 'K': case 'k':
+        size *= 1024;
+        end++;
+        break;
+    }
+    if (end == arg || *end != '\0' || size == 0 || size > INT_MAX) {
+        return 0;
+    }
+    return (size_t)size;
+}
+
+void tune_start(tune_socket *t, int sock, int sending)
+{
+    memset(t, 0, sizeof(*t));
+    t->sock = sock;
+    t->sending = sending;
+    t->start = t->last = now_ns();
+    t->next = t->start + (uint64_t)TUNE_INTERVAL_MS * 1000000u;
+    t->chunk = TUNE_MIN_CHUNK;
+}
+
+#ifdef __linux__
+/**
+ * Read a number from a file under /proc/sys
+ *
+ * @return The number, 0 if it can't be read
+ */
+static size_t tune_sysctl(const char *path)
+{
+    unsigned long long value = 0;
+    FILE *f = fopen(path, "r");
+
+    if (f) {
+        if (fscanf(f, "%llu", &value) != 1) {
+            value = 0;
+        }
+        fclose(f);
+    }
+    return (size_t)value;
+}
+
+/**
+ * Size of the socket buffer, as set with `SO_SNDBUF` or `SO_RCVBUF`
+ *
+ * The kernel reports twice that, the rest being its bookkeeping.
+ */
+static size_t tune_buffer_size(const tune_socket *t)
+{
+    int size = 0;
+    socklen_t len = sizeof(size);
+
+    if (getsockopt(t->sock, SOL_SOCKET, t->sending ? SO_SNDBUF : SO_RCVBUF,
+                   &size, &len) < 0) {
+        return 0;
+    }
+    return (size_t)size / 2;
+}
+
+/**
+ * Grow the socket buffer to a size, if that is growing it
+ *
+ * Setting the size turns the kernel's autotuning of the buffer off, so
+ * it's only done for a size past the one the kernel has picked.
+ * Unprivileged processes are limited to `net.core.wmem_max` and
+ * `net.core.rmem_max`.
+ *
+ * @param t    Tuning state
+ * @param size Wanted size
+ */
+static void tune_grow(tune_socket *t, size_t size)
+{
+    int opt = t->sending ? SO_SNDBUF : SO_RCVBUF;
+    size_t current = tune_buffer_size(t), limit;
+    int value;
+
+    if (size > tune_max_buffer) {
+        size = tune_max_buffer;
+    }
+    if (size <= current) {
+        return;
+    }
+    value = (int)size;
+#ifdef SO_SNDBUFFORCE
+    if (setsockopt(t->sock, SOL_SOCKET, t->sending ? SO_SNDBUFFORCE : SO_RCVBUFFORCE,
+                   &value, sizeof(value)) == 0) {
+        t->buffer = tune_buffer_size(t);
+        return;
+    }
+#endif
+    /* A bigger size would be cut to the limit, which may shrink the buffer */
+    limit = tune_sysctl(t->sending ? "/proc/sys/net/core/wmem_max"
+                                   : "/proc/sys/net/core/rmem_max");
+    if (size > limit) {
+        size = limit;
+    }
+    if (size <= current) {
+        return;
+    }
+    value = (int)size;
+    if (setsockopt(t->sock, SOL_SOCKET, opt, &value, sizeof(value)) < 0) {
+        perror(t->sending ? "setsockopt SO_SNDBUF" : "setsockopt SO_RCVBUF");
+        return;
+    }
+    t->buffer = tune_buffer_size(t);
+}
+
+/**
+ * Switch the connection to BBR if the path calls for it
+ *
+ * Looked at once, on the first measurement showing a long or lossy path.
+ */
+static void tune_congestion(tune_socket *t, const struct tcp_info *ti, uint32_t rtt)
+{
+    char current[sizeof(t->cc)] = "";
+    socklen_t len = sizeof(current) - 1;
+
+    if (t->cc_tried || rtt == 0
+        || (rtt < TUNE_BBR_RTT_US
+            && (double)ti->tcpi_total_retrans <= (double)ti->tcpi_segs_out * TUNE_LOSSY)) {
+        return;
+    }
+    t->cc_tried = 1;
+    if (getsockopt(t->sock, IPPROTO_TCP, TCP_CONGESTION, current, &len) == 0
+        && strcmp(current, "bbr") == 0) {
+        return;
+    }
+    if (setsockopt(t->sock, IPPROTO_TCP, TCP_CONGESTION, "bbr", 3) == 0) {
+        strcpy(t->cc, "bbr");
+    }
+}
+
+/**
+ * Measure the connection and tune it to the bandwidth-delay product
+ *
+ * @param t   Tuning state
+ * @param now Current time, ns
+ */
+static void tune_measure(tune_socket *t, uint64_t now)
+{
+    struct tcp_info ti;
+    socklen_t len = sizeof(ti);
+    uint64_t bdp, rate;
+    size_t buffer, size;
+    uint32_t rtt;
+    int limited;
+
+    memset(&ti, 0, sizeof(ti));
+    if (getsockopt(t->sock, IPPROTO_TCP, TCP_INFO, &ti, &len) < 0) {
+        t->done = 1;
+        return;
+    }
+
+    if (t->sending) {
+        uint64_t busy = ti.tcpi_busy_time - t->busy_us;
+
+        rtt = ti.tcpi_min_rtt ? ti.tcpi_min_rtt : ti.tcpi_rtt;
+        rate = ti.tcpi_delivery_rate;
+        limited = busy > 0
+                  && (double)(ti.tcpi_sndbuf_limited - t->limited_us) > (double)busy * TUNE_LIMITED;
+        t->busy_us = ti.tcpi_busy_time;
+        t->limited_us = ti.tcpi_sndbuf_limited;
+    } else {
+        rtt = ti.tcpi_rcv_rtt ? ti.tcpi_rcv_rtt : ti.tcpi_rtt;
+        rate = now > t->last ? (ti.tcpi_bytes_received - t->bytes) * 1000000000u / (now - t->last)
+                             : 0;
+        t->bytes = ti.tcpi_bytes_received;
+        limited = -1;
+    }
+    t->last = now;
+    if (rtt == 0 || rate == 0) {
+        return;
+    }
+    t->rtt_us = rtt;
+    t->rate = rate;
+
+    bdp = rate * rtt / 1000000u;
+    buffer = tune_buffer_size(t);
+    if (limited < 0) {
+        /* A receiver filling half its window is limited by it */
+        limited = bdp >= buffer / 2;
+    }
+    /* Twice the product, so the rate measured can grow; a limiting buffer doubles */
+    size = 2 * bdp;
+    if (limited && size < 2 * buffer) {
+        size = 2 * buffer;
+    }
+    tune_grow(t, size);
+
+    if (t->sending) {
+        size_t chunk = (size_t)(bdp / 4) / TUNE_MIN_CHUNK * TUNE_MIN_CHUNK;
+
+        buffer = tune_buffer_size(t);
+        if (chunk > TUNE_MAX_CHUNK) {
+            chunk = TUNE_MAX_CHUNK;
+        }
+        if (chunk > buffer / 2) {
+            chunk = buffer / 2 / TUNE_MIN_CHUNK * TUNE_MIN_CHUNK;
+        }
+        t->chunk = chunk > TUNE_MIN_CHUNK ? chunk : TUNE_MIN_CHUNK;
+        tune_congestion(t, &ti, rtt);
+    }
+}
+#endif
+
+void tune_poll(tune_socket *t)
+{
+    uint64_t now;
+
+    if (t->start == 0 || t->done) {
+        return;
+    }
+    now = now_ns();
+    if (now < t->next) {
+        return;
+    }
+    t->next = now + (uint64_t)TUNE_INTERVAL_MS * 1000000u;
+    if (now - t->start >= (uint64_t)TUNE_PERIOD_MS * 1000000u) {
+        t->done = 1;
+    }
+#ifdef __linux__
+    tune_measure(t, now);
+#else
+    t->done = 1;
+#endif
+}
+
+void tune_report(const tune_socket *t, const char *label)
+{
+    const char *side = t->sending ? "send" : "receive";
+
+    if (t->start == 0) {
+        return;
+    }
+    printf("Autotuned%s%s:", label ? " " : "", label ? label : "");
+    if (t->rtt_us == 0) {
+        printf(" too short to measure\n");
+        return;
+    }
+    printf(" rtt %.3f ms, %.2f MB/s", t->rtt_us / 1000.0, (double)t->rate / SIZE_MB);
+    if (t->buffer) {
+        printf(", %s buffer %.2f MB", side, (double)t->buffer / SIZE_MB);
+    } else {
+        printf(", %s buffer left to the kernel", side);
+    }
+    if (t->chunk > TUNE_MIN_CHUNK) {
+        printf(", %.2f MB per call", (double)t->chunk / SIZE_MB);
+    }
+    if (t->cc[0]) {
+        printf(", congestion control %s", t->cc);
+    } else if (t->cc_tried) {
+        printf(", BBR unavailable");
+    }
+    printf("\n");
+}
+
+/**
+ * Measure and tune the watched connections until stopped
+ *
+ * @param arg Pointer to the `tune_transfer`
+ *
+ * @return Always `NULL`
+ */
+static void *tune_tuner(void *arg)
+{
+    tune_transfer *tt = arg;
+
+    pthread_mutex_lock(&tt->lock);
+    while (!tt->stop) {
+        struct timespec deadline;
+        size_t chunk = TUNE_MIN_CHUNK;
+        int i;
+
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += (long)(TUNE_INTERVAL_MS % 1000) * 1000000;
+        deadline.tv_sec += TUNE_INTERVAL_MS / 1000 + deadline.tv_nsec / 1000000000;
+        deadline.tv_nsec %= 1000000000;
+        while (!tt->stop && pthread_cond_timedwait(&tt->cond, &tt->lock, &deadline) != ETIMEDOUT)
+            ;
+        if (tt->stop) {
+            break;
+        }
+
+        for (i = 0; i < tt->nstreams; i++) {
+            if (tt->socks[i] >= 0) {
+                tune_poll(&tt->streams[i]);
+            }
+            if (tt->streams[i].chunk > chunk) {
+                chunk = tt->streams[i].chunk;
+            }
+        }
+        atomic_store_explicit(&tt->chunk, chunk, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&tt->lock);
+    return NULL;
+}
+
+tune_transfer *tune_begin(void)
+{
+    tune_transfer *tt = calloc(1, sizeof(*tt));
+
+    if (tt == NULL) {
+        perror("calloc");
+        return NULL;
+    }
+    atomic_init(&tt->chunk, TUNE_MIN_CHUNK);
+    pthread_mutex_init(&tt->lock, NULL);
+    pthread_cond_init(&tt->cond, NULL);
+
+    if (pthread_create(&tt->tuner, NULL, tune_tuner, tt) == 0) {
+        tt->tuning = 1;
+    } else {
+        perror("pthread_create");
+    }
+    return tt;
+}
+
+void tune_watch(tune_transfer *tt, int sock)
+{
+    if (tt == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&tt->lock);
+    if (tt->nstreams < TUNE_MAX_STREAMS) {
+        tt->socks[tt->nstreams] = sock;
+        tune_start(&tt->streams[tt->nstreams], sock, 1);
+        tt->nstreams++;
+    }
+    pthread_mutex_unlock(&tt->lock);
+}
+
+void tune_unwatch(tune_transfer *tt, int sock)
+{
+    int i;
+
+    if (tt == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&tt->lock);
+    for (i = 0; i < tt->nstreams; i++) {
+        if (tt->socks[i] == sock) {
+            tt->socks[i] = -1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&tt->lock);
+}
+
+size_t tune_chunk(void)
+{
+    if (tune_current == NULL) {
+        return TUNE_MIN_CHUNK;
+    }
+    return atomic_load_explicit(&tune_current->chunk, memory_order_relaxed);
+}
+
+void tune_end(tune_transfer *tt)
+{
+    char label[32];
+    int i;
+
+    if (tt == NULL) {
+        return;
+    }
+    if (tt->tuning) {
+        pthread_mutex_lock(&tt->lock);
+        tt->stop = 1;
+        pthread_cond_signal(&tt->cond);
+        pthread_mutex_unlock(&tt->lock);
+        pthread_join(tt->tuner, NULL);
+    }
+
+    for (i = 0; i < tt->nstreams; i++) {
+        snprintf(label, sizeof(label), "stream %d", i + 1);
+        tune_report(&tt->streams[i], tt->nstreams > 1 ? label : NULL);
+    }
+
+    pthread_cond_destroy(&tt->cond);
+    pthread_mutex_destroy(&tt->lock);
+    free(tt);
+}
@@ -0,0 +1,160 @@
+/**
+ * @file tune.h
+ * @brief Sizing the connections to the path they go over
+ *
+ * The fixed 512 KB socket buffers cap a connection at 512 KB per round
+ * trip, a few MB/s across an ocean. With `--autotune` the buffers are
+ * left to the kernel's own autotuning at first, and for the first
+ * `TUNE_PERIOD_MS` of every connection its round-trip time and delivery
+ * rate are measured with `TCP_INFO` (Linux) every `TUNE_INTERVAL_MS`.
+ * From their product, the bandwidth-delay product, the socket buffer is
+ * grown past what the kernel would pick, up to `tune_max_buffer`; a
+ * buffer found holding the data back is doubled. The sender also sends
+ * bigger pieces per call on fat paths, and switches to BBR congestion
+ * control, where the kernel has it, on long or lossy paths.
+ *
+ * The sender measures its connections on a thread of its own, the
+ * receiver between the bursts of data of each connection.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** Interval between measurements */
+#define TUNE_INTERVAL_MS 100
+
+/** How long a connection is measured and tuned after it starts */
+#define TUNE_PERIOD_MS 3000
+
+/** Default limit of the socket buffers */
+#define TUNE_MAX_BUFFER ((size_t)64 * 1024 * 1024)
+
+/** Most bytes sent per call, the least being `CHUNK_SIZE` */
+#define TUNE_MAX_CHUNK ((size_t)4 * 1024 * 1024)
+
+/** Round-trip time from which BBR is preferred, us */
+#define TUNE_BBR_RTT_US 10000
+
+/** Share of retransmitted segments from which BBR is preferred */
+#define TUNE_LOSSY 0.01
+
+/** Share of the sending time held back by the send buffer that doubles it */
+#define TUNE_LIMITED 0.3
+
+/**
+ * Tune the connections of the transfers
+ *
+ * Off by default. Set from the command line before any transfer starts.
+ */
+extern int tune_enabled;
+
+/** Limit of the socket buffers, `TUNE_MAX_BUFFER` by default */
+extern size_t tune_max_buffer;
+
+/** Tuning state of a connection */
+typedef struct {
+    int      sock;           /**< Socket being tuned */
+    int      sending;        /**< The socket sends the data */
+    int      done;           /**< `TUNE_PERIOD_MS` has passed */
+    uint64_t start;          /**< When tuning started, ns, 0 if not tuned */
+    uint64_t next;           /**< When to measure next, ns */
+    uint64_t last;           /**< When measured last, ns */
+    uint64_t bytes;          /**< Bytes received by then */
+    uint64_t busy_us;        /**< Time with data to send by then */
+    uint64_t limited_us;     /**< Of it, held back by the send buffer */
+    uint32_t rtt_us;         /**< Round-trip time measured last */
+    uint64_t rate;           /**< Delivery rate measured last, bytes per second */
+    size_t   buffer;         /**< Buffer size set, 0 if left to the kernel */
+    size_t   chunk;          /**< Bytes to send per call */
+    int      cc_tried;       /**< The congestion control has been looked at */
+    char     cc[16];         /**< Congestion control switched to, or "" */
+} tune_socket;
+
+/** Tuning of the connections of a sender's transfer */
+typedef struct tune_transfer tune_transfer;
+
+/**
+ * Tuning the calling thread sends under, or `NULL`
+ *
+ * Threads sending the data of a transfer set it to the transfer's tuning
+ * before sending any of it.
+ */
+extern _Thread_local tune_transfer *tune_current;
+
+/**
+ * Parse a size with an optional K, M or G suffix
+ *
+ * @param arg Size, e.g. "64M"
+ *
+ * @return Size in bytes, 0 if invalid or past what a socket option takes
+ */
+size_t tune_parse_size(const char *arg);
+
+/**
+ * Start tuning a connection
+ *
+ * @param t       Tuning state to initialize
+ * @param sock    Connected socket
+ * @param sending Nonzero for the sender's side of the connection
+ */
+void tune_start(tune_socket *t, int sock, int sending);
+
+/**
+ * Measure and tune the connection if it's time to
+ *
+ * Cheap until `next`, nothing at all once tuning is done.
+ *
+ * @param t Tuning state from `tune_start()`
+ */
+void tune_poll(tune_socket *t);
+
+/**
+ * Print what the tuning has found and changed
+ *
+ * @param t     Tuning state, nothing is printed if it wasn't started
+ * @param label Connection the line is about, e.g. "stream 2", or `NULL`
+ */
+void tune_report(const tune_socket *t, const char *label);
+
+/**
+ * Start tuning the connections of a transfer
+ *
+ * Starts a thread measuring the watched connections.
+ *
+ * @return Tuning to end with `tune_end()`, or `NULL` on error
+ */
+tune_transfer *tune_begin(void);
+
+/**
+ * Start tuning a connection of the transfer
+ *
+ * @param tt   Tuning, or `NULL` to do nothing
+ * @param sock Connected socket
+ */
+void tune_watch(tune_transfer *tt, int sock);
+
+/**
+ * Stop tuning a connection of the transfer
+ *
+ * Must be called before the socket is closed.
+ *
+ * @param tt   Tuning, or `NULL` to do nothing
+ * @param sock Socket passed to `tune_watch()`
+ */
+void tune_unwatch(tune_transfer *tt, int sock);
+
+/**
+ * Bytes to send per call for the transfer of the calling thread
+ *
+ * @return `CHUNK_SIZE` unless tuned to more
+ */
+size_t tune_chunk(void);
+
+/**
+ * Stop tuning, report the connections and free the tuning
+ *
+ * @param tt Tuning, or `NULL` to do nothing
+ */
+void tune_end(tune_transfer *tt);
@@ -0,0 +1,1306 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <inttypes.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+
+#include "client.h"
+#include "limit.h"
+#include "progress.h"
+#include "server.h"
+#include "udp.h"
+
+double udp_shim_loss = 0;
+int udp_shim_delay_ms = 0;
+
+/** Largest packet, a `UDP_DATA` one */
+#define UDP_MAX_PACKET (sizeof(udp_header) + UDP_PAYLOAD)
+
+_Static_assert(sizeof(udp_ack) <= UDP_MAX_PACKET, "An ack must fit in a packet");
+_Static_assert(sizeof(udp_header) + FHEADER_SIZE <= UDP_MAX_PACKET, "A hello must fit in a packet");
+
+/** Seconds without acks before the sender gives up */
+#define UDP_TIMEOUT 30
+
+/** Least time a block sent before a delivered one is given to arrive, us */
+#define UDP_REORDER_MIN_US 1000
+
+/** Least sending rate, bytes per second */
+#define UDP_MIN_RATE (64 * 1024)
+
+/** Rate gain while looking for the bandwidth, then of each round trip of a cycle */
+#define UDP_STARTUP_GAIN 2.0
+static const double udp_cycle_gains[] = {1.25, 0.75, 1, 1, 1, 1, 1, 1};
+
+#ifndef __linux__
+struct mmsghdr {
+    struct msghdr msg_hdr;
+    unsigned int  msg_len;
+};
+#endif
+
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000u + (uint64_t)ts.tv_nsec / 1000u;
+}
+
+/**
+ * Set the bits of a range, counting the ones that weren't set
+ *
+ * @return Number of bits newly set
+ */
+static uint64_t bitmap_set_range(uint64_t *bm, uint64_t from, uint64_t to)
+{
+    uint64_t count = 0;
+
+    while (from < to) {
+        uint64_t bits = to - from < 64 - from % 64 ? to - from : 64 - from % 64;
+        uint64_t mask = (bits == 64 ? ~0ull : (1ull << bits) - 1) << (from % 64);
+
+        count += (uint64_t)__builtin_popcountll(mask & ~bm[from / 64]);
+        bm[from / 64] |= mask;
+        from += bits;
+    }
+    return count;
+}
+
+static int bitmap_get(const uint64_t *bm, uint64_t i)
+{
+    return (bm[i / 64] >> (i % 64)) & 1;
+}
+
+/**
+ * Find the next bit of a value
+ *
+ * @return Index of the first bit from `from` equal to `value`, or `limit`
+ */
+static uint64_t bitmap_next(const uint64_t *bm, uint64_t from, uint64_t limit, int value)
+{
+    while (from < limit) {
+        uint64_t word = value ? bm[from / 64] : ~bm[from / 64];
+
+        word &= ~0ull << (from % 64);
+        if (word) {
+            uint64_t i = from / 64 * 64 + (uint64_t)__builtin_ctzll(word);
+
+            return i < limit ? i : limit;
+        }
+        from = from / 64 * 64 + 64;
+    }
+    return limit;
+}
+
+/** A packet held back by the delay shim */
+typedef struct {
+    uint64_t                due;      /**< When to send it, us */
+    struct sockaddr_storage addr;
+    socklen_t               addrlen;  /**< 0 on a connected socket */
+    size_t                  length;
+    unsigned char           data[UDP_MAX_PACKET];
+} udp_delayed;
+
+/** Socket sending the packets, through the shim when it's on */
+typedef struct {
+    int          sock;
+    unsigned     seed;     /**< State of the shim's drops */
+    udp_delayed *delayed;  /**< Ring of the packets held back, by `due` */
+    size_t       head, count, cap;
+} udp_link;
+
+static void udp_link_init(udp_link *l, int sock)
+{
+    memset(l, 0, sizeof(*l));
+    l->sock = sock;
+    l->seed = (unsigned)now_us();
+}
+
+static void udp_link_free(udp_link *l)
+{
+    free(l->delayed);
+}
+
+static int udp_sendmmsg(int sock, struct mmsghdr *msgs, unsigned n)
+{
+#ifdef __linux__
+    return sendmmsg(sock, msgs, n, 0);
+#else
+    (void)n;
+    return sendmsg(sock, &msgs[0].msg_hdr, 0) < 0 ? -1 : 1;
+#endif
+}
+
+/**
+ * Hold a packet back for `udp_shim_delay_ms`
+ *
+ * @return 0 on success, -1 on error
+ */
+static int udp_link_hold(udp_link *l, const struct msghdr *msg)
+{
+    udp_delayed *d;
+    size_t i;
+
+    if (l->count == l->cap) {
+        size_t cap = l->cap ? l->cap * 2 : 1024;
+        udp_delayed *ring = malloc(cap * sizeof(*ring));
+
+        if (ring == NULL) {
+            perror("malloc");
+            return -1;
+        }
+        for (i = 0; i < l->count; i++) {
+            ring[i] = l->delayed[(l->head + i) % l->cap];
+        }
+        free(l->delayed);
+        l->delayed = ring;
+        l->head = 0;
+        l->cap = cap;
+    }
+
+    d = &l->delayed[(l->head + l->count++) % l->cap];
+    d->due = now_us() + (uint64_t)udp_shim_delay_ms * 1000u;
+    d->addrlen = msg->msg_namelen;
+    if (d->addrlen > 0) {
+        memcpy(&d->addr, msg->msg_name, d->addrlen);
+    }
+    d->length = 0;
+    for (i = 0; i < msg->msg_iovlen; i++) {
+        memcpy(d->data + d->length, msg->msg_iov[i].iov_base, msg->msg_iov[i].iov_len);
+        d->length += msg->msg_iov[i].iov_len;
+    }
+    return 0;
+}
+
+/**
+ * Send the packets held back whose time has come
+ */
+static void udp_link_flush(udp_link *l)
+{
+    uint64_t now = now_us();
+
+    while (l->count > 0 && l->delayed[l->head].due <= now) {
+        udp_delayed *d = &l->delayed[l->head];
+
+        /* Lost like any other packet if it fails */
+        sendto(l->sock, d->data, d->length, 0,
+               d->addrlen ? (struct sockaddr*)&d->addr : NULL, d->addrlen);
+        l->head = (l->head + 1) % l->cap;
+        l->count--;
+    }
+}
+
+/**
+ * When the next packet held back is due
+ *
+ * @return Time in us, 0 if none is held back
+ */
+static uint64_t udp_link_due(const udp_link *l)
+{
+    return l->count > 0 ? l->delayed[l->head].due : 0;
+}
+
+/**
+ * Send packets, dropping or holding them back if the shim says so
+ *
+ * @param l    Link
+ * @param msgs Packets, reordered on return
+ * @param n    Number of packets
+ *
+ * @return 0 on success, -1 on error
+ */
+static int udp_link_send(udp_link *l, struct mmsghdr *msgs, unsigned n)
+{
+    unsigned i, kept = 0, sent = 0;
+
+    if (udp_shim_loss > 0 || udp_shim_delay_ms > 0) {
+        for (i = 0; i < n; i++) {
+            if ((double)rand_r(&l->seed) / RAND_MAX < udp_shim_loss) {
+                continue;
+            }
+            if (udp_shim_delay_ms > 0) {
+                if (udp_link_hold(l, &msgs[i].msg_hdr) < 0) {
+                    return -1;
+                }
+                continue;
+            }
+            msgs[kept++] = msgs[i];
+        }
+        n = kept;
+    }
+    while (sent < n) {
+        int rc = udp_sendmmsg(l->sock, msgs + sent, n - sent);
+
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("sendmmsg");
+            return -1;
+        }
+        sent += (unsigned)rc;
+    }
+    return 0;
+}
+
+/**
+ * Send a single packet
+ *
+ * @return 0 on success, -1 on error
+ */
+static int udp_link_send_one(udp_link *l, const void *buf, size_t length,
+                             const struct sockaddr_storage *addr, socklen_t addrlen)
+{
+    struct iovec iov = {.iov_base = (void*)buf, .iov_len = length};
+    struct mmsghdr msg = {
+        .msg_hdr = {
+            .msg_name = (void*)addr,
+            .msg_namelen = addrlen,
+            .msg_iov = &iov,
+            .msg_iovlen = 1,
+        },
+    };
+
+    return udp_link_send(l, &msg, 1);
+}
+
+/**
+ * Receive the packets waiting on a socket, without blocking
+ *
+ * @param sock  Socket
+ * @param bufs  `UDP_BATCH` buffers of `UDP_MAX_PACKET` bytes
+ * @param addrs Set to the senders' addresses, or `NULL`
+ * @param lens  Set to the packets' lengths
+ *
+ * @return Number of packets received, -1 on error
+ */
+static int udp_recv_batch(int sock, unsigned char (*bufs)[UDP_MAX_PACKET],
+                          struct sockaddr_storage *addrs, socklen_t *addrlens, size_t *lens)
+{
+    struct mmsghdr msgs[UDP_BATCH];
+    struct iovec iovs[UDP_BATCH];
+    int i, n;
+
+    memset(msgs, 0, sizeof(msgs));
+    for (i = 0; i < UDP_BATCH; i++) {
+        iovs[i].iov_base = bufs[i];
+        iovs[i].iov_len = UDP_MAX_PACKET;
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        if (addrs) {
+            msgs[i].msg_hdr.msg_name = &addrs[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+        }
+    }
+#ifdef __linux__
+    do {
+        n = recvmmsg(sock, msgs, UDP_BATCH, MSG_DONTWAIT, NULL);
+    } while (n < 0 && errno == EINTR);
+#else
+    for (n = 0; n < UDP_BATCH; n++) {
+        ssize_t rc = recvmsg(sock, &msgs[n].msg_hdr, MSG_DONTWAIT);
+
+        if (rc < 0) {
+            if (n > 0 || errno == EINTR) {
+                break;
+            }
+            n = -1;
+            break;
+        }
+        msgs[n].msg_len = (unsigned)rc;
+    }
+#endif
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            return 0;
+        }
+        perror("recvmmsg");
+        return -1;
+    }
+    for (i = 0; i < n; i++) {
+        lens[i] = msgs[i].msg_len;
+        if (addrs) {
+            addrlens[i] = msgs[i].msg_hdr.msg_namelen;
+        }
+    }
+    return n;
+}
+
+/**
+ * Wait for a socket to have packets
+ *
+ * @param sock    Socket
+ * @param wait_us How long to wait at most
+ */
+static void udp_wait(int sock, uint64_t wait_us)
+{
+    struct pollfd pfd = {.fd = sock, .events = POLLIN};
+
+    if (wait_us < 1000) {
+        /* Shorter than `poll()` can wait, the packets wait instead */
+        struct timespec ts = {.tv_nsec = (long)wait_us * 1000};
+
+        nanosleep(&ts, NULL);
+        return;
+    }
+    poll(&pfd, 1, (int)((wait_us + 999) / 1000));
+}
+
+/**
+ * Make the socket buffers fit bursts of packets
+ */
+static void udp_set_buffers(int sock)
+{
+    int size = UDP_SOCKET_BUF;
+
+    if (setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size)) < 0) {
+        perror("setsockopt SO_SNDBUF");
+    }
+    if (setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) < 0) {
+        perror("setsockopt SO_RCVBUF");
+    }
+}
+
+/** Transmission of a block, in the order they were sent */
+typedef struct {
+    uint64_t block;
+    uint64_t sent;  /**< us */
+} udp_sent;
+
+/** Sending side of a transfer */
+typedef struct {
+    const file          *f;
+    udp_link             link;
+    uint32_t             session;
+    const unsigned char *map;       /**< The file, mapped */
+    uint64_t             nblocks;
+    uint64_t            *acked;     /**< Bitmap of the blocks acknowledged */
+    uint64_t             nacked;
+    uint64_t             next;      /**< First block never sent */
+    udp_sent            *flight;    /**< Ring of the transmissions not resolved yet */
+    size_t               flight_head, flight_count, flight_cap;
+    uint64_t            *lost;      /**< Ring of the blocks to send again */
+    size_t               lost_head, lost_count, lost_cap;
+
+    double               rate;      /**< Pacing rate, bytes per second */
+    double               bw[UDP_BW_ROUNDS]; /**< Delivery rates of the last rounds */
+    double               btlbw;     /**< The highest of them */
+    double               full_bw;   /**< Delivery rate the startup last grew to */
+    int                  full_rounds; /**< Rounds since it has grown by a quarter */
+    int                  startup;   /**< Doubling the rate every round */
+    uint64_t             rounds;
+    uint64_t             min_rtt;   /**< us, 0 until measured */
+    uint64_t             srtt;      /**< us */
+    uint64_t             latest;    /**< Send time of the latest block delivered */
+    uint64_t             top;       /**< Past the highest block an ack has covered */
+    uint64_t             round_start;     /**< Round ends with a block sent after it delivered */
+    uint64_t             round_delivered; /**< `nacked` when it started */
+    uint64_t             round_sent, round_lost;
+    uint64_t             next_send; /**< When pacing allows the next batch, us */
+    uint64_t             last_ack;  /**< When the receiver was last heard from, us */
+    uint64_t             last_progress; /**< When blocks were last acknowledged or given up on */
+    int                  backoff;   /**< Timeouts in a row */
+    uint64_t             sent, resent;
+    double               top_rate;  /**< Highest delivery rate measured */
+} udp_tx;
+
+/**
+ * Append to a ring of items, growing it as needed
+ *
+ * @return 0 on success, -1 on error
+ */
+static int udp_ring_push(void **ring, size_t size, size_t *head, size_t *count, size_t *cap,
+                         const void *item)
+{
+    if (*count == *cap) {
+        size_t n = *cap ? *cap * 2 : 4096, i;
+        char *grown = malloc(n * size);
+
+        if (grown == NULL) {
+            perror("malloc");
+            return -1;
+        }
+        for (i = 0; i < *count; i++) {
+            memcpy(grown + i * size, (char*)*ring + (*head + i) % *cap * size, size);
+        }
+        free(*ring);
+        *ring = grown;
+        *head = 0;
+        *cap = n;
+    }
+    memcpy((char*)*ring + (*head + (*count)++) % *cap * size, item, size);
+    return 0;
+}
+
+static int udp_tx_lose(udp_tx *tx, uint64_t block)
+{
+    tx->round_lost++;
+    return udp_ring_push((void**)&tx->lost, sizeof(*tx->lost), &tx->lost_head,
+                         &tx->lost_count, &tx->lost_cap, &block);
+}
+
+/**
+ * Data in flight allowed, twice the bandwidth-delay product
+ *
+ * @return Packets
+ */
+static size_t udp_tx_window(const udp_tx *tx)
+{
+    double bdp = tx->rate * (double)tx->min_rtt / 1e6;
+    size_t packets = (size_t)(2 * bdp / UDP_PAYLOAD);
+
+    return packets > UDP_MIN_WINDOW ? packets : UDP_MIN_WINDOW;
+}
+
+/**
+ * End a round trip: measure the delivery rate and set the next sending rate
+ *
+ * @param tx  Transfer
+ * @param now Current time, us
+ */
+static void udp_tx_round(udp_tx *tx, uint64_t now)
+{
+    double sample = (double)(tx->nacked - tx->round_delivered) * UDP_PAYLOAD * 1e6
+                    / (double)(now - tx->round_start + 1);
+    double gain;
+    int i;
+
+    tx->bw[tx->rounds++ % UDP_BW_ROUNDS] = sample;
+    if (tx->round_sent > 0 && (double)tx->round_lost > UDP_LOSS_LIMIT * (double)tx->round_sent) {
+        /* More is lost than random loss explains: slow down to what got through */
+        for (i = 0; i < UDP_BW_ROUNDS; i++) {
+            tx->bw[i] = sample;
+        }
+        tx->startup = 0;
+    }
+    tx->btlbw = 0;
+    for (i = 0; i < UDP_BW_ROUNDS; i++) {
+        if (tx->bw[i] > tx->btlbw) {
+            tx->btlbw = tx->bw[i];
+        }
+    }
+    if (tx->btlbw > tx->top_rate) {
+        tx->top_rate = tx->btlbw;
+    }
+
+    if (tx->startup) {
+        if (tx->btlbw >= tx->full_bw * 1.25) {
+            tx->full_bw = tx->btlbw;
+            tx->full_rounds = 0;
+        } else if (++tx->full_rounds >= 3) {
+            /* The bandwidth is found, start the cycles with the draining round */
+            tx->startup = 0;
+            tx->rounds = 1;
+        }
+    }
+    gain = tx->startup ? UDP_STARTUP_GAIN : udp_cycle_gains[tx->rounds % 8];
+    tx->rate = gain * tx->btlbw;
+    if (tx->rate < UDP_MIN_RATE) {
+        tx->rate = UDP_MIN_RATE;
+    }
+
+    tx->round_start = now;
+    tx->round_delivered = tx->nacked;
+    tx->round_sent = tx->round_lost = 0;
+}
+
+/**
+ * Take an acknowledgement into account
+ *
+ * @return 0 on success, -1 on error
+ */
+static int udp_tx_ack(udp_tx *tx, const udp_ack *ack, size_t length, uint64_t now)
+{
+    uint64_t cum = ack->hdr.seq, before = tx->nacked, reorder, done_bytes;
+    uint32_t i;
+
+    if (length < offsetof(udp_ack, ranges) || ack->nranges > UDP_SACK_RANGES
+        || length < offsetof(udp_ack, ranges) + ack->nranges * sizeof(udp_range)) {
+        return 0;
+    }
+    if (cum > tx->nblocks) {
+        cum = tx->nblocks;
+    }
+    tx->nacked += bitmap_set_range(tx->acked, 0, cum);
+    if (cum > tx->top) {
+        tx->top = cum;
+    }
+    for (i = 0; i < ack->nranges; i++) {
+        uint64_t start = cum + ack->ranges[i].start, end = start + ack->ranges[i].length;
+
+        if (end > tx->nblocks) {
+            end = tx->nblocks;
+        }
+        if (start < end) {
+            tx->nacked += bitmap_set_range(tx->acked, start, end);
+            if (end > tx->top) {
+                tx->top = end;
+            }
+        }
+    }
+    tx->last_ack = now;
+    if (tx->nacked > before) {
+        tx->last_progress = now;
+        tx->backoff = 0;
+        done_bytes = tx->nacked * UDP_PAYLOAD < tx->f->hdr.fsize
+                     ? tx->nacked * UDP_PAYLOAD : tx->f->hdr.fsize;
+        progress_add(done_bytes - (before * UDP_PAYLOAD < tx->f->hdr.fsize
+                                   ? before * UDP_PAYLOAD : tx->f->hdr.fsize));
+    }
+
+    /* The echoed send time tells the round-trip time */
+    if (ack->hdr.stamp > 0 && ack->hdr.stamp <= now) {
+        uint64_t rtt = now - ack->hdr.stamp;
+
+        if (tx->min_rtt == 0 || rtt < tx->min_rtt) {
+            tx->min_rtt = rtt ? rtt : 1;
+        }
+        tx->srtt = tx->srtt ? (tx->srtt * 7 + rtt) / 8 : rtt;
+        if (ack->hdr.stamp > tx->latest) {
+            tx->latest = ack->hdr.stamp;
+        }
+    }
+
+    /*
+     * Blocks sent well before one delivered have been lost, unless past
+     * the ranges the ack had room for
+     */
+    reorder = tx->min_rtt / 4 > UDP_REORDER_MIN_US ? tx->min_rtt / 4 : UDP_REORDER_MIN_US;
+    while (tx->flight_count > 0) {
+        udp_sent *s = &tx->flight[tx->flight_head];
+
+        if (!bitmap_get(tx->acked, s->block)) {
+            if (s->sent + reorder >= tx->latest || s->block >= tx->top) {
+                break;
+            }
+            if (udp_tx_lose(tx, s->block) < 0) {
+                return -1;
+            }
+        }
+        tx->flight_head = (tx->flight_head + 1) % tx->flight_cap;
+        tx->flight_count--;
+    }
+
+    if (tx->latest >= tx->round_start) {
+        udp_tx_round(tx, now);
+    }
+    return 0;
+}
+
+/**
+ * Receive and take into account the acknowledgements waiting
+ *
+ * @return 0 on success, -1 on error
+ */
+static int udp_tx_recv(udp_tx *tx)
+{
+    static _Thread_local unsigned char bufs[UDP_BATCH][UDP_MAX_PACKET];
+    size_t lens[UDP_BATCH];
+    int n, i;
+
+    do {
+        n = udp_recv_batch(tx->link.sock, bufs, NULL, NULL, lens);
+        if (n < 0) {
+            return -1;
+        }
+        for (i = 0; i < n; i++) {
+            udp_ack ack;
+
+            memcpy(&ack, bufs[i], lens[i] < sizeof(ack) ? lens[i] : sizeof(ack));
+            if (lens[i] < sizeof(udp_header) || ack.hdr.session != tx->session
+                || ack.hdr.type != UDP_ACK) {
+                continue;
+            }
+            if (udp_tx_ack(tx, &ack, lens[i], now_us()) < 0) {
+                return -1;
+            }
+        }
+    } while (n == UDP_BATCH);
+    return 0;
+}
+
+/**
+ * Send the next batch of blocks, the lost ones first
+ *
+ * @return Number of packets sent, -1 on error
+ */
+static int udp_tx_send(udp_tx *tx, uint64_t now)
+{
+    udp_header hdrs[UDP_BATCH];
+    struct iovec iovs[UDP_BATCH][2];
+    struct mmsghdr msgs[UDP_BATCH];
+    size_t window = udp_tx_window(tx), bytes = 0;
+    unsigned n = 0;
+
+    memset(msgs, 0, sizeof(msgs));
+    while (n < UDP_BATCH && tx->flight_count < window) {
+        udp_sent s = {.sent = now};
+        size_t length;
+
+        if (tx->lost_count > 0) {
+            s.block = tx->lost[tx->lost_head];
+            tx->lost_head = (tx->lost_head + 1) % tx->lost_cap;
+            tx->lost_count--;
+            if (bitmap_get(tx->acked, s.block)) {
+                continue;
+            }
+            tx->resent++;
+        } else if (tx->next < tx->nblocks) {
+            s.block = tx->next++;
+        } else {
+            break;
+        }
+        if (udp_ring_push((void**)&tx->flight, sizeof(s), &tx->flight_head,
+                          &tx->flight_count, &tx->flight_cap, &s) < 0) {
+            return -1;
+        }
+
+        length = tx->f->hdr.fsize - s.block * UDP_PAYLOAD;
+        if (length > UDP_PAYLOAD) {
+            length = UDP_PAYLOAD;
+        }
+        hdrs[n] = (udp_header){.type = UDP_DATA, .session = tx->session,
+                               .seq = s.block, .stamp = now};
+        iovs[n][0] = (struct iovec){.iov_base = &hdrs[n], .iov_len = sizeof(hdrs[n])};
+        iovs[n][1] = (struct iovec){.iov_base = (void*)(tx->map + s.block * UDP_PAYLOAD),
+                                    .iov_len = length};
+        msgs[n].msg_hdr.msg_iov = iovs[n];
+        msgs[n].msg_hdr.msg_iovlen = 2;
+        bytes += sizeof(udp_header) + length;
+        n++;
+    }
+    if (n == 0) {
+        return 0;
+    }
+    if (udp_link_send(&tx->link, msgs, n) < 0) {
+        return -1;
+    }
+    tx->sent += n;
+    tx->round_sent += n;
+    if (tx->last_progress == 0) {
+        tx->last_progress = now;
+    }
+
+    /* Pace the next batch to the rate */
+    if (tx->next_send < now) {
+        tx->next_send = now;
+    }
+    tx->next_send += (uint64_t)((double)bytes * 1e6 / tx->rate);
+    limit_wait(bytes);
+    return (int)n;
+}
+
+/**
+ * Give up on the data in flight after a while without acknowledgements
+ *
+ * @return 0 on success, -1 on error
+ */
+static int udp_tx_timeout(udp_tx *tx, uint64_t now)
+{
+    uint64_t rto = 2 * tx->srtt > UDP_RTO_MIN_MS * 1000u ? 2 * tx->srtt : UDP_RTO_MIN_MS * 1000u;
+
+    rto <<= tx->backoff < 6 ? tx->backoff : 6;
+    if (tx->flight_count == 0 || now - tx->last_progress < rto) {
+        return 0;
+    }
+    while (tx->flight_count > 0) {
+        udp_sent *s = &tx->flight[tx->flight_head];
+
+        if (!bitmap_get(tx->acked, s->block) && udp_tx_lose(tx, s->block) < 0) {
+            return -1;
+        }
+        tx->flight_head = (tx->flight_head + 1) % tx->flight_cap;
+        tx->flight_count--;
+    }
+    tx->backoff++;
+    tx->last_progress = now;
+    return 0;
+}
+
+/**
+ * Connect a UDP socket to the receiver
+ *
+ * @return Socket, or -1 on error
+ */
+static int udp_connect(const char *host, const char *port)
+{
+    struct addrinfo hints = {0}, *res, *ai;
+    int sock = -1, err;
+
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    err = getaddrinfo(host, port, &hints, &res);
+    if (err) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(err));
+        return -1;
+    }
+    for (ai = res; ai != NULL && sock < 0; ai = ai->ai_next) {
+        sock = socket(ai->ai_family, SOCK_DGRAM, 0);
+        if (sock >= 0 && connect(sock, ai->ai_addr, ai->ai_addrlen) < 0) {
+            close(sock);
+            sock = -1;
+        }
+    }
+    freeaddrinfo(res);
+    if (sock < 0) {
+        perror("connect");
+        return -1;
+    }
+    udp_set_buffers(sock);
+    return sock;
+}
+
+/**
+ * Start the transfer: send the header until the receiver accepts it
+ *
+ * Gives up after `connect_timeout` seconds.
+ *
+ * @return 0 on success, -1 on error or if the receiver has refused it
+ */
+static int udp_tx_hello(udp_tx *tx)
+{
+    static _Thread_local unsigned char bufs[UDP_BATCH][UDP_MAX_PACKET];
+    unsigned char hello[sizeof(udp_header) + FHEADER_SIZE];
+    udp_header hdr = {.type = UDP_HELLO, .session = tx->session};
+    uint64_t deadline = now_us() + (uint64_t)connect_timeout * 1000000u, resend = 0;
+    size_t lens[UDP_BATCH];
+
+    memcpy(hello, &hdr, sizeof(hdr));
+    memcpy(hello + sizeof(hdr), &tx->f->hdr, FHEADER_SIZE);
+    for (;;) {
+        uint64_t now = now_us(), due;
+        int n, i;
+
+        if (now >= deadline) {
+            printf("The receiver doesn't answer over UDP\n");
+            return -1;
+        }
+        if (now >= resend) {
+            if (udp_link_send_one(&tx->link, hello, sizeof(hello), NULL, 0) < 0) {
+                return -1;
+            }
+            resend = now + UDP_HELLO_INTERVAL_MS * 1000u;
+        }
+        udp_link_flush(&tx->link);
+        n = udp_recv_batch(tx->link.sock, bufs, NULL, NULL, lens);
+        if (n < 0) {
+            return -1;
+        }
+        for (i = 0; i < n; i++) {
+            udp_header reply;
+
+            if (lens[i] < sizeof(reply)) {
+                continue;
+            }
+            memcpy(&reply, bufs[i], sizeof(reply));
+            if (reply.type != UDP_HELLO_ACK || reply.session != tx->session) {
+                continue;
+            }
+            if (reply.seq != 0) {
+                printf("The receiver has refused the file\n");
+                return -1;
+            }
+            return 0;
+        }
+        due = udp_link_due(&tx->link);
+        udp_wait(tx->link.sock, (due && due < resend ? due : resend) - now_us() + 1);
+    }
+}
+
+/**
+ * Send all the blocks until they're all acknowledged
+ *
+ * @return 0 on success, -1 on error
+ */
+static int udp_tx_run(udp_tx *tx)
+{
+    tx->last_ack = tx->last_progress = now_us();
+    tx->round_start = tx->last_ack;
+    while (tx->nacked < tx->nblocks) {
+        uint64_t now, wake, due;
+        int more;
+
+        udp_link_flush(&tx->link);
+        if (udp_tx_recv(tx) < 0) {
+            return -1;
+        }
+        if (tx->nacked == tx->nblocks) {
+            break;
+        }
+
+        now = now_us();
+        if (now - tx->last_ack > UDP_TIMEOUT * 1000000ull) {
+            printf("The receiver has stopped answering\n");
+            return -1;
+        }
+        if (udp_tx_timeout(tx, now) < 0) {
+            return -1;
+        }
+        more = (tx->lost_count > 0 || tx->next < tx->nblocks)
+               && tx->flight_count < udp_tx_window(tx);
+        if (more && now >= tx->next_send) {
+            if (udp_tx_send(tx, now) < 0) {
+                return -1;
+            }
+            continue;
+        }
+
+        /* Wait for the acks, the pacing, the timeout or the shim */
+        wake = now + UDP_RTO_MIN_MS * 1000u;
+        if (more && tx->next_send < wake) {
+            wake = tx->next_send;
+        }
+        due = udp_link_due(&tx->link);
+        if (due && due < wake) {
+            wake = due;
+        }
+        if (wake > now) {
+            udp_wait(tx->link.sock, wake - now);
+        }
+    }
+    return 0;
+}
+
+ssize_t udp_send(file *f, const char *host, const char *port)
+{
+    udp_tx *tx;
+    ssize_t rc = -1;
+    int sock;
+
+    tx = calloc(1, sizeof(*tx));
+    if (tx == NULL) {
+        perror("calloc");
+        return -1;
+    }
+    tx->f = f;
+    tx->nblocks = (f->hdr.fsize + UDP_PAYLOAD - 1) / UDP_PAYLOAD;
+    tx->session = (uint32_t)(now_us() ^ ((uint64_t)getpid() << 16));
+    tx->rate = UDP_INITIAL_RATE;
+    tx->startup = 1;
+    f->hdr.flags = 0;
+    f->hdr.offset = 0;
+    f->hdr.length = f->hdr.fsize;
+
+    tx->acked = calloc((size_t)(tx->nblocks + 63) / 64 + 1, sizeof(*tx->acked));
+    if (tx->acked == NULL) {
+        perror("calloc");
+        free(tx);
+        return -1;
+    }
+    if (f->hdr.fsize > 0) {
+        void *map = mmap(NULL, f->hdr.fsize, PROT_READ, MAP_SHARED, f->fd, 0);
+
+        if (map == MAP_FAILED) {
+            perror("mmap");
+            free(tx->acked);
+            free(tx);
+            return -1;
+        }
+        madvise(map, f->hdr.fsize, MADV_SEQUENTIAL);
+        tx->map = map;
+    }
+
+    sock = udp_connect(host, port);
+    if (sock >= 0) {
+        udp_link_init(&tx->link, sock);
+        if (udp_tx_hello(tx) == 0 && udp_tx_run(tx) == 0) {
+            rc = (ssize_t)f->hdr.fsize;
+        }
+        if (rc >= 0 && tx->sent > 0) {
+            printf("UDP: rtt %.3f ms, up to %.2f MB/s, %" PRIu64 " of %" PRIu64
+                   " packets sent again\n", (double)tx->min_rtt / 1000,
+                   tx->top_rate / SIZE_MB, tx->resent, tx->sent);
+        }
+        udp_link_free(&tx->link);
+        close(sock);
+    }
+
+    if (tx->map) {
+        munmap((void*)tx->map, f->hdr.fsize);
+    }
+    free(tx->flight);
+    free(tx->lost);
+    free(tx->acked);
+    free(tx);
+    return rc;
+}
+
+/** Transfer being received */
+typedef struct {
+    int                     used;
+    struct sockaddr_storage addr;      /**< Sender */
+    socklen_t               addrlen;
+    uint32_t                session;
+    file                    f;
+    uint64_t                nblocks;
+    uint64_t               *received;  /**< Bitmap of the blocks received */
+    uint64_t                nreceived;
+    uint64_t                cum;       /**< All the blocks below it received */
+    uint64_t                top;       /**< Past the highest block received */
+    uint64_t                echo;      /**< Send time of the latest block received */
+    uint64_t                last;      /**< When the sender was last heard from, us */
+    int                     done;      /**< All received, the file is closed */
+    int                     dirty;     /**< Received packets since the last ack */
+    limit_flow             *limit;     /**< Share of the bandwidth limit, or `NULL` */
+} udp_rx;
+
+struct udp_server {
+    udp_link    link;
+    pthread_t   thread;
+    atomic_int  stop;
+    int         idle_timeout;
+    udp_rx      rx[UDP_MAX_SESSIONS];
+};
+
+/**
+ * Find the transfer a packet belongs to
+ *
+ * @return Transfer, or `NULL` if there's none
+ */
+static udp_rx *udp_server_find(udp_server *s, const struct sockaddr_storage *addr,
+                               socklen_t addrlen, uint32_t session)
+{
+    int i;
+
+    for (i = 0; i < UDP_MAX_SESSIONS; i++) {
+        udp_rx *rx = &s->rx[i];
+
+        if (rx->used && rx->session == session && rx->addrlen == addrlen
+            && memcmp(&rx->addr, addr, addrlen) == 0) {
+            return rx;
+        }
+    }
+    return NULL;
+}
+
+static void udp_rx_free(udp_rx *rx)
+{
+    if (!rx->done) {
+        file_close(&rx->f);
+    }
+    limit_leave(rx->limit);
+    free(rx->received);
+    memset(rx, 0, sizeof(*rx));
+}
+
+/**
+ * Close the file once all of it has been received
+ */
+static void udp_rx_check_done(udp_rx *rx)
+{
+    if (!rx->done && rx->nreceived == rx->nblocks) {
+        printf("File %s received successfully\n", rx->f.hdr.fname);
+        file_close(&rx->f);
+        rx->done = 1;
+    }
+}
+
+/**
+ * Acknowledge the blocks received
+ */
+static void udp_rx_ack(udp_server *s, udp_rx *rx)
+{
+    udp_ack ack = {.hdr = {.type = UDP_ACK, .session = rx->session, .seq = rx->cum,
+                           .stamp = rx->echo}};
+    uint64_t pos = rx->cum;
+
+    while (ack.nranges < UDP_SACK_RANGES) {
+        uint64_t start = bitmap_next(rx->received, pos, rx->top, 1), end;
+
+        if (start == rx->top || start - rx->cum > UINT32_MAX) {
+            break;
+        }
+        end = bitmap_next(rx->received, start, rx->top, 0);
+        if (end - start > UINT32_MAX) {
+            end = start + UINT32_MAX;
+        }
+        ack.ranges[ack.nranges++] = (udp_range){.start = (uint32_t)(start - rx->cum),
+                                                .length = (uint32_t)(end - start)};
+        pos = end;
+    }
+    udp_link_send_one(&s->link, &ack, offsetof(udp_ack, ranges) + ack.nranges * sizeof(udp_range),
+                      &rx->addr, rx->addrlen);
+    rx->dirty = 0;
+}
+
+/**
+ * Start receiving a file, or answer a `UDP_HELLO` sent again
+ */
+static void udp_server_hello(udp_server *s, const unsigned char *buf, size_t length,
+                             const struct sockaddr_storage *addr, socklen_t addrlen)
+{
+    udp_header hdr;
+    udp_rx *rx;
+    int i;
+
+    memcpy(&hdr, buf, sizeof(hdr));
+    rx = udp_server_find(s, addr, addrlen, hdr.session);
+    if (rx == NULL && length >= sizeof(hdr) + FHEADER_SIZE) {
+        for (i = 0; i < UDP_MAX_SESSIONS && s->rx[i].used; i++)
+            ;
+        if (i == UDP_MAX_SESSIONS) {
+            printf("Too many transfers over UDP\n");
+        } else {
+            rx = &s->rx[i];
+            memcpy(&rx->f.hdr, buf + sizeof(hdr), FHEADER_SIZE);
+            rx->f.path = NULL;
+            if (rx->f.hdr.flags != 0) {
+                printf("Transfers over UDP send the file as is\n");
+                rx = NULL;
+            } else if (file_accept(&rx->f) < 0) {
+                rx = NULL;
+            } else {
+                rx->nblocks = (rx->f.hdr.fsize + UDP_PAYLOAD - 1) / UDP_PAYLOAD;
+                rx->received = calloc((size_t)(rx->nblocks + 63) / 64 + 1, sizeof(*rx->received));
+                if (rx->received == NULL) {
+                    perror("calloc");
+                    file_close(&rx->f);
+                    rx = NULL;
+                }
+            }
+            if (rx != NULL) {
+                rx->used = 1;
+                rx->session = hdr.session;
+                rx->addr = *addr;
+                rx->addrlen = addrlen;
+                rx->last = now_us();
+                rx->limit = limit_join();
+                udp_rx_check_done(rx);
+            } else {
+                memset(&s->rx[i], 0, sizeof(s->rx[i]));
+            }
+        }
+    }
+
+    hdr.type = UDP_HELLO_ACK;
+    hdr.seq = rx == NULL;
+    udp_link_send_one(&s->link, &hdr, sizeof(hdr), addr, addrlen);
+}
+
+/** Blocks received in a row, to be written with a single call */
+typedef struct {
+    udp_rx      *rx;
+    uint64_t     first;
+    int          count;
+    size_t       length;
+    struct iovec iov[UDP_BATCH];
+} udp_run;
+
+/**
+ * Write a run of blocks to the file
+ */
+static void udp_run_write(udp_run *run)
+{
+    udp_rx *rx = run->rx;
+    off_t offset = (off_t)(run->first * UDP_PAYLOAD);
+    size_t done = 0;
+    int i = 0;
+
+    if (rx == NULL || run->count == 0) {
+        return;
+    }
+    while (done < run->length) {
+        ssize_t n = pwritev(rx->f.fd, run->iov + i, run->count - i, offset + (off_t)done);
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            perror("pwritev");
+            printf("Dropping the transfer of %s\n", rx->f.hdr.fname);
+            udp_rx_free(rx);
+            break;
+        }
+        done += (size_t)n;
+        /* Skip what's written, the rest of a block partly written */
+        while (i < run->count && (size_t)n >= run->iov[i].iov_len) {
+            n -= (ssize_t)run->iov[i++].iov_len;
+        }
+        if (n > 0) {
+            run->iov[i].iov_base = (char*)run->iov[i].iov_base + n;
+            run->iov[i].iov_len -= (size_t)n;
+        }
+    }
+    run->rx = NULL;
+    run->count = 0;
+    run->length = 0;
+}
+
+/**
+ * Take a block into its transfer, writing it along with the ones next to it
+ */
+static void udp_server_data(udp_server *s, udp_run *run, unsigned char *buf, size_t length,
+                            const struct sockaddr_storage *addr, socklen_t addrlen)
+{
+    udp_header hdr;
+    udp_rx *rx;
+    size_t expected;
+
+    memcpy(&hdr, buf, sizeof(hdr));
+    rx = udp_server_find(s, addr, addrlen, hdr.session);
+    if (rx == NULL) {
+        return;
+    }
+    rx->last = now_us();
+    rx->dirty = 1;
+    if (rx->done || hdr.seq >= rx->nblocks || bitmap_get(rx->received, hdr.seq)) {
+        return;
+    }
+    expected = rx->f.hdr.fsize - hdr.seq * UDP_PAYLOAD;
+    if (expected > UDP_PAYLOAD) {
+        expected = UDP_PAYLOAD;
+    }
+    if (length - sizeof(hdr) != expected) {
+        return;
+    }
+    if (rx->limit && rx->limit->tokens < 0 && limit_delay(rx->limit) > 0) {
+        /* Over its share: dropped, the sender backs off from the loss */
+        return;
+    }
+    if (rx->limit) {
+        limit_charge(rx->limit, expected);
+    }
+
+    if (run->rx != rx || run->first + (uint64_t)run->count != hdr.seq) {
+        udp_run_write(run);
+        if (!rx->used) {
+            return;
+        }
+        run->rx = rx;
+        run->first = hdr.seq;
+    }
+    run->iov[run->count++] = (struct iovec){.iov_base = buf + sizeof(hdr), .iov_len = expected};
+    run->length += expected;
+
+    bitmap_set_range(rx->received, hdr.seq, hdr.seq + 1);
+    rx->nreceived++;
+    if (hdr.seq >= rx->top) {
+        rx->top = hdr.seq + 1;
+    }
+    if (hdr.stamp > rx->echo) {
+        rx->echo = hdr.stamp;
+    }
+    rx->cum = bitmap_next(rx->received, rx->cum, rx->nblocks, 0);
+}
+
+/**
+ * Serve the transfers until stopped
+ *
+ * @param arg Pointer to the `udp_server`
+ *
+ * @return Always `NULL`
+ */
+static void *udp_server_loop(void *arg)
+{
+    static unsigned char bufs[UDP_BATCH][UDP_MAX_PACKET];
+    struct sockaddr_storage addrs[UDP_BATCH];
+    socklen_t addrlens[UDP_BATCH];
+    size_t lens[UDP_BATCH];
+    udp_server *s = arg;
+    udp_run run = {0};
+
+    while (!atomic_load(&s->stop)) {
+        uint64_t now = now_us(), due = udp_link_due(&s->link);
+        int n, i;
+
+        udp_wait(s->link.sock, due ? (due > now ? due - now : 0) : 100000);
+        udp_link_flush(&s->link);
+
+        n = udp_recv_batch(s->link.sock, bufs, addrs, addrlens, lens);
+        for (i = 0; i < n; i++) {
+            udp_header hdr;
+
+            if (lens[i] < sizeof(hdr)) {
+                continue;
+            }
+            memcpy(&hdr, bufs[i], sizeof(hdr));
+            if (hdr.type == UDP_HELLO) {
+                udp_server_hello(s, bufs[i], lens[i], &addrs[i], addrlens[i]);
+            } else if (hdr.type == UDP_DATA) {
+                udp_server_data(s, &run, bufs[i], lens[i], &addrs[i], addrlens[i]);
+            }
+        }
+        udp_run_write(&run);
+
+        now = now_us();
+        for (i = 0; i < UDP_MAX_SESSIONS; i++) {
+            udp_rx *rx = &s->rx[i];
+
+            if (!rx->used) {
+                continue;
+            }
+            udp_rx_check_done(rx);
+            if (rx->dirty) {
+                udp_rx_ack(s, rx);
+            }
+            if (rx->done && now - rx->last > UDP_LINGER * 1000000ull) {
+                udp_rx_free(rx);
+            } else if (!rx->done && now - rx->last > (uint64_t)s->idle_timeout * 1000000u) {
+                printf("Dropping the transfer of %s, idle for %d seconds\n",
+                       rx->f.hdr.fname, s->idle_timeout);
+                udp_rx_free(rx);
+            }
+        }
+    }
+    return NULL;
+}
+
+udp_server *udp_server_start(int port, int idle_timeout)
+{
+    udp_server *s;
+    int sock;
+
+    s = calloc(1, sizeof(*s));
+    if (s == NULL) {
+        perror("calloc");
+        return NULL;
+    }
+    sock = start_udp_listener(port);
+    if (sock < 0) {
+        free(s);
+        return NULL;
+    }
+    udp_set_buffers(sock);
+    udp_link_init(&s->link, sock);
+    s->idle_timeout = idle_timeout;
+    atomic_init(&s->stop, 0);
+    if (pthread_create(&s->thread, NULL, udp_server_loop, s) != 0) {
+        perror("pthread_create");
+        close(sock);
+        free(s);
+        return NULL;
+    }
+    return s;
+}
+
+void udp_server_stop(udp_server *s)
+{
+    int i;
+
+    if (s == NULL) {
+        return;
+    }
+    atomic_store(&s->stop, 1);
+    pthread_join(s->thread, NULL);
+    for (i = 0; i < UDP_MAX_SESSIONS; i++) {
+        if (s->rx[i].used) {
+            udp_rx_free(&s->rx[i]);
+        }
+    }
+    udp_link_free(&s->link);
+    close(s->link.sock);
+    free(s);
+}
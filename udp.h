@@ -0,0 +1,164 @@
+/**
+ * @file udp.h
+ * @brief Reliable transfer over UDP with rate-based congestion control
+ *
+ * A TCP flow over a long path halves its window on every loss and takes
+ * minutes to grow it back, so a link losing a packet now and then never
+ * gets filled. With `--udp` a file goes over UDP instead, with its own
+ * reliability and rate control:
+ *
+ * - The file is cut into blocks of `UDP_PAYLOAD` bytes, each sent as a
+ *   `UDP_DATA` packet numbered by its block, in batches of `UDP_BATCH`
+ *   with `sendmmsg()` and received with `recvmmsg()` (Linux).
+ * - The receiver acknowledges every batch it receives with a `UDP_ACK`
+ *   holding the blocks received in full below a cumulative point, and
+ *   up to `UDP_SACK_RANGES` ranges of blocks received past it.
+ * - A block is taken as lost once a block sent well after it has arrived
+ *   but it hasn't, or once nothing has been acknowledged for a while, and
+ *   is sent again ahead of new blocks.
+ * - The sending rate follows the rate at which the receiver gets the
+ *   data, measured every round trip: doubled per round trip at first,
+ *   then probing a quarter above it every eight. Losses as such don't
+ *   slow it down, only a round trip losing over `UDP_LOSS_LIMIT` of its
+ *   packets does. The data in flight is kept within twice the
+ *   bandwidth-delay product.
+ *
+ * A transfer starts with a `UDP_HELLO` carrying the file header, sent
+ * until the receiver answers with a `UDP_HELLO_ACK`, and ends once every
+ * block has been acknowledged. The receiver writes the blocks where they
+ * belong in the file as they come, in any order.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "file.h"
+
+/** Bytes of the file per packet, to fit in an Ethernet frame */
+#define UDP_PAYLOAD 1400
+
+/** Most packets sent or received per system call */
+#define UDP_BATCH 64
+
+/** Most ranges of blocks received past the cumulative point per ack */
+#define UDP_SACK_RANGES 128
+
+/** Socket buffer size asked for on both sides, for bursts of packets */
+#define UDP_SOCKET_BUF (8 * 1024 * 1024)
+
+/** Sending rate before anything is measured, bytes per second */
+#define UDP_INITIAL_RATE (10 * 1024 * 1024)
+
+/** Least data in flight allowed, in packets */
+#define UDP_MIN_WINDOW 256
+
+/** Round trips the delivery rate is taken as the highest of */
+#define UDP_BW_ROUNDS 10
+
+/** Share of lost packets in a round trip that slows the sender down */
+#define UDP_LOSS_LIMIT 0.1
+
+/** Least time without acks before the data in flight is taken as lost */
+#define UDP_RTO_MIN_MS 200
+
+/** Interval between `UDP_HELLO`s until the receiver answers */
+#define UDP_HELLO_INTERVAL_MS 250
+
+/** Seconds a receiver keeps answering for a completed transfer */
+#define UDP_LINGER 5
+
+/** Most transfers a receiver takes at a time */
+#define UDP_MAX_SESSIONS 64
+
+/** Kinds of packets */
+enum {
+    UDP_HELLO     = 1,  /**< Sender: the `file_header`, starting a transfer */
+    UDP_HELLO_ACK = 2,  /**< Receiver: `seq` 0 if accepted, 1 if refused */
+    UDP_DATA      = 3,  /**< Sender: block `seq` of the file */
+    UDP_ACK       = 4,  /**< Receiver: `udp_ack` */
+};
+
+/** Header of every packet */
+typedef struct {
+    uint32_t type;
+    uint32_t session;  /**< Transfer, chosen by the sender */
+    uint64_t seq;      /**< Block of `UDP_DATA`, cumulative point of `UDP_ACK` */
+    uint64_t stamp;    /**< Send time of `UDP_DATA`, echoed by `UDP_ACK`, us */
+} udp_header;
+
+/** A range of blocks received, relative to the cumulative point */
+typedef struct {
+    uint32_t start;
+    uint32_t length;
+} udp_range;
+
+/**
+ * Acknowledgement: all the blocks below `hdr.seq` have been received,
+ * and so have the ones in `ranges`
+ */
+typedef struct {
+    udp_header hdr;
+    uint32_t   nranges;
+    uint32_t   reserved;
+    udp_range  ranges[UDP_SACK_RANGES];
+} udp_ack;
+
+/**
+ * Share of the packets to drop on purpose, for tests on loopback
+ *
+ * Applies to the packets sent from this process by either side. 0 by
+ * default.
+ */
+extern double udp_shim_loss;
+
+/**
+ * Delay to add to every packet on purpose, for tests on loopback, ms
+ *
+ * Applies to the packets sent from this process by either side. 0 by
+ * default.
+ */
+extern int udp_shim_delay_ms;
+
+/** Receiving side, serving transfers on a thread of its own */
+typedef struct udp_server udp_server;
+
+/**
+ * Send a file over UDP
+ *
+ * Sends the whole file as is, counting the data in the progress as it's
+ * acknowledged, and reports the round-trip time, the rate reached and
+ * the packets sent again at the end.
+ *
+ * @param f    Opened file with its header prepared
+ * @param host Host name or IP address of the receiver
+ * @param port Port of the receiver
+ *
+ * @return Total bytes of the file sent, -1 on error
+ */
+ssize_t udp_send(file *f, const char *host, const char *port);
+
+/**
+ * Start receiving transfers over UDP
+ *
+ * Binds the UDP port and serves the transfers from a thread of its own,
+ * writing the files in the working directory. With `--limit` every
+ * transfer is a flow of the bandwidth limit, whose packets past its
+ * share are dropped for the sender to slow down.
+ *
+ * @param port         Port to listen on
+ * @param idle_timeout Seconds a transfer may stay silent before it's dropped
+ *
+ * @return Server to stop with `udp_server_stop()`, or `NULL` on error
+ */
+udp_server *udp_server_start(int port, int idle_timeout);
+
+/**
+ * Stop receiving and free the server
+ *
+ * Transfers in progress are dropped.
+ *
+ * @param s Server, or `NULL` to do nothing
+ */
+void udp_server_stop(udp_server *s);
@@ -0,0 +1,589 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "fsock.h"
+#include "hash.h"
+#include "limit.h"
+#include "progress.h"
+#include "stats.h"
+#include "uring.h"
+
+int uring_enabled = 0;
+
+#if defined(__linux__) && defined(__has_include)
+# if __has_include(<linux/io_uring.h>)
+#  define HAVE_URING 1
+# endif
+#endif
+
+#ifdef HAVE_URING
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+/** Submission and completion queues shared with the kernel */
+typedef struct {
+    int                  fd;
+    unsigned            *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned            *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void                *sq_ptr, *cq_ptr;
+    size_t               sq_size, cq_size, sqes_size;
+    unsigned             sq_entries;
+    unsigned             pending;  /**< Queued SQEs not yet submitted */
+} ring;
+
+/** State of a chunk buffer */
+typedef enum {
+    SLOT_FREE,
+    SLOT_READING,
+    SLOT_READY,
+    SLOT_SENDING,
+    SLOT_WRITING,
+} slot_state;
+
+/** A registered chunk buffer and the operation using it */
+typedef struct {
+    slot_state   state;
+    off_t        offset;  /**< File offset of the chunk */
+    size_t       length;  /**< Chunk length */
+    size_t       done;    /**< Bytes of the chunk already read/sent/written */
+    int          fd;      /**< File the chunk is written to (receiver) */
+    uring_owner *owner;   /**< Receiver waiting for the write */
+} slot;
+
+struct uring_rx {
+    ring  r;
+    char *bufs;
+    slot  slots[URING_DEPTH];
+};
+
+/**
+ * Create an io_uring instance and map its queues
+ *
+ * @param r       Ring to initialize
+ * @param entries Queue depth
+ *
+ * @return 0 on success, -1 if io_uring is not available
+ */
+static int ring_init(ring *r, unsigned entries)
+{
+    struct io_uring_params p;
+
+    memset(&p, 0, sizeof(p));
+    memset(r, 0, sizeof(*r));
+    r->fd = (int)syscall(SYS_io_uring_setup, entries, &p);
+    if (r->fd < 0) {
+        return -1;
+    }
+
+    r->sq_entries = p.sq_entries;
+    r->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_size > r->sq_size) {
+            r->sq_size = r->cq_size;
+        }
+        r->cq_size = r->sq_size;
+    }
+
+    r->sq_ptr = mmap(NULL, r->sq_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ptr == MAP_FAILED) {
+        goto err_close;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_ptr = r->sq_ptr;
+    } else {
+        r->cq_ptr = mmap(NULL, r->cq_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_ptr == MAP_FAILED) {
+            goto err_sq;
+        }
+    }
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        goto err_cq;
+    }
+
+    r->sq_head = (unsigned*)((char*)r->sq_ptr + p.sq_off.head);
+    r->sq_tail = (unsigned*)((char*)r->sq_ptr + p.sq_off.tail);
+    r->sq_mask = (unsigned*)((char*)r->sq_ptr + p.sq_off.ring_mask);
+    r->sq_array = (unsigned*)((char*)r->sq_ptr + p.sq_off.array);
+    r->cq_head = (unsigned*)((char*)r->cq_ptr + p.cq_off.head);
+    r->cq_tail = (unsigned*)((char*)r->cq_ptr + p.cq_off.tail);
+    r->cq_mask = (unsigned*)((char*)r->cq_ptr + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*)((char*)r->cq_ptr + p.cq_off.cqes);
+    return 0;
+
+err_cq:
+    if (r->cq_ptr != r->sq_ptr) {
+        munmap(r->cq_ptr, r->cq_size);
+    }
+err_sq:
+    munmap(r->sq_ptr, r->sq_size);
+err_close:
+    close(r->fd);
+    return -1;
+}
+
+static void ring_exit(ring *r)
+{
+    munmap(r->sqes, r->sqes_size);
+    if (r->cq_ptr != r->sq_ptr) {
+        munmap(r->cq_ptr, r->cq_size);
+    }
+    munmap(r->sq_ptr, r->sq_size);
+    close(r->fd);
+}
+
+/**
+ * Check that the kernel supports every operation the engines use
+ *
+ * @param r Ring to probe
+ *
+ * @return 1 if all the operations are supported, 0 otherwise
+ */
+static int ring_supported(ring *r)
+{
+    static const int ops[] = {IORING_OP_READ_FIXED, IORING_OP_WRITE_FIXED,
+                              IORING_OP_SEND};
+    size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, size);
+    int supported = probe != NULL;
+    size_t i;
+
+    if (supported && syscall(SYS_io_uring_register, r->fd,
+                             IORING_REGISTER_PROBE, probe, 256) < 0) {
+        supported = 0;
+    }
+    for (i = 0; supported && i < sizeof(ops) / sizeof(ops[0]); i++) {
+        if (ops[i] > probe->last_op
+            || !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED)) {
+            supported = 0;
+        }
+    }
+    free(probe);
+    return supported;
+}
+
+/**
+ * Register chunk buffers with the ring
+ *
+ * @param r    Ring
+ * @param bufs `URING_DEPTH` consecutive buffers of `CHUNK_SIZE` bytes
+ *
+ * @return 0 on success, -1 on error
+ */
+static int ring_register_buffers(ring *r, char *bufs)
+{
+    struct iovec iov[URING_DEPTH];
+    int i;
+
+    for (i = 0; i < URING_DEPTH; i++) {
+        iov[i].iov_base = bufs + (size_t)i * CHUNK_SIZE;
+        iov[i].iov_len = CHUNK_SIZE;
+    }
+    return (int)syscall(SYS_io_uring_register, r->fd,
+                        IORING_REGISTER_BUFFERS, iov, URING_DEPTH);
+}
+
+/**
+ * Queue an operation
+ *
+ * There are never more operations in flight than `URING_DEPTH`, which is
+ * the size of the submission queue, so a free SQE is always available.
+ */
+static void ring_queue(ring *r, int op, int fd, int fixed_file, void *addr,
+                       size_t len, off_t offset, int buf_index, uint64_t data)
+{
+    unsigned tail = *r->sq_tail;
+    unsigned idx = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = (__u8)op;
+    sqe->fd = fd;
+    sqe->flags = fixed_file ? IOSQE_FIXED_FILE : 0;
+    sqe->addr = (__u64)(uintptr_t)addr;
+    sqe->len = (__u32)len;
+    sqe->off = (__u64)offset;
+    sqe->buf_index = (__u16)buf_index;
+    sqe->user_data = data;
+    if (op == IORING_OP_SEND) {
+        sqe->msg_flags = MSG_NOSIGNAL;
+    }
+
+    r->sq_array[idx] = idx;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    r->pending++;
+}
+
+/**
+ * Submit the queued operations and optionally wait for a completion
+ *
+ * @param r    Ring
+ * @param wait Number of completions to wait for
+ *
+ * @return 0 on success, -1 on error
+ */
+static int ring_submit(ring *r, unsigned wait)
+{
+    while (1) {
+        uint64_t start = stats_start();
+        long rc = syscall(SYS_io_uring_enter, r->fd, r->pending, wait,
+                          wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+
+        stats_stop(STATS_MOVE, start, 0);
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("io_uring_enter");
+            return -1;
+        }
+        r->pending -= (unsigned)rc;
+        return 0;
+    }
+}
+
+/**
+ * Take the next completion, if there is one
+ *
+ * @param r   Ring
+ * @param cqe Where to copy the completion
+ *
+ * @return 1 if a completion was taken, 0 if the queue is empty
+ */
+static int ring_reap(ring *r, struct io_uring_cqe *cqe)
+{
+    unsigned head = *r->cq_head;
+
+    if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+    *cqe = r->cqes[head & *r->cq_mask];
+    __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/**
+ * Create a ring that supports the engines' operations
+ *
+ * @param r Ring to initialize
+ *
+ * @return 0 on success, -1 if io_uring can't be used
+ */
+static int ring_open(ring *r)
+{
+    if (ring_init(r, URING_DEPTH) < 0) {
+        return -1;
+    }
+    if (!ring_supported(r)) {
+        ring_exit(r);
+        return -1;
+    }
+    return 0;
+}
+
+/** Fixed file indexes of the sender */
+enum { SEND_FILE, SEND_SOCK };
+
+/**
+ * Queue the read of the next chunk into a free slot
+ */
+static void send_queue_read(ring *r, slot *s, int idx, char *bufs)
+{
+    ring_queue(r, IORING_OP_READ_FIXED, SEND_FILE, 1,
+               bufs + (size_t)idx * CHUNK_SIZE + s->done, s->length - s->done,
+               s->offset + (off_t)s->done, idx, (uint64_t)idx);
+}
+
+/**
+ * Queue sending the rest of a ready chunk
+ */
+static void send_queue_send(ring *r, slot *s, int idx, char *bufs)
+{
+    ring_queue(r, IORING_OP_SEND, SEND_SOCK, 1,
+               bufs + (size_t)idx * CHUNK_SIZE + s->done, s->length - s->done,
+               0, 0, (uint64_t)idx);
+}
+
+ssize_t uring_file_send(const file *f, int sock, hash_tree *hash)
+{
+    slot slots[URING_DEPTH] = {0};
+    size_t end = f->hdr.offset + f->hdr.length, sent = 0;
+    off_t next_read = (off_t)f->hdr.offset;
+    unsigned next_slot = 0, send_slot = 0;
+    int fds[2] = {f->fd, sock}, sending = 0;
+    ssize_t retval = -1;
+    char *bufs;
+    ring r;
+
+    if (ring_open(&r) < 0) {
+        return FSOCK_UNSUPPORTED;
+    }
+    if (posix_memalign((void**)&bufs, 4096, (size_t)URING_DEPTH * CHUNK_SIZE) != 0) {
+        ring_exit(&r);
+        return FSOCK_UNSUPPORTED;
+    }
+    if (ring_register_buffers(&r, bufs) < 0
+        || syscall(SYS_io_uring_register, r.fd, IORING_REGISTER_FILES, fds, 2) < 0) {
+        retval = FSOCK_UNSUPPORTED;
+        goto out;
+    }
+
+    while (sent < f->hdr.length) {
+        struct io_uring_cqe cqe;
+        slot *s;
+
+        /* Keep the disk busy: read ahead into every free buffer */
+        while ((size_t)next_read < end && slots[next_slot].state == SLOT_FREE) {
+            s = &slots[next_slot];
+            s->state = SLOT_READING;
+            s->offset = next_read;
+            s->length = end - (size_t)next_read < CHUNK_SIZE
+                        ? end - (size_t)next_read : CHUNK_SIZE;
+            s->done = 0;
+            send_queue_read(&r, s, (int)next_slot, bufs);
+            next_read += (off_t)s->length;
+            next_slot = (next_slot + 1) % URING_DEPTH;
+        }
+        /* Keep the network busy: chunks go out strictly in order */
+        if (!sending && slots[send_slot].state == SLOT_READY) {
+            s = &slots[send_slot];
+            s->state = SLOT_SENDING;
+            s->done = 0;
+            if (hash) {
+                hash_tree_update(hash, bufs + (size_t)send_slot * CHUNK_SIZE, s->length);
+            }
+            send_queue_send(&r, s, (int)send_slot, bufs);
+            sending = 1;
+        }
+
+        if (ring_submit(&r, 1) < 0) {
+            goto out;
+        }
+        while (ring_reap(&r, &cqe)) {
+            int idx = (int)cqe.user_data;
+            s = &slots[idx];
+
+            if (cqe.res < 0) {
+                fprintf(stderr, "io_uring %s: %s\n",
+                        s->state == SLOT_READING ? "read" : "send",
+                        strerror(-cqe.res));
+                goto out;
+            }
+            if (cqe.res == 0 && s->state == SLOT_READING) {
+                fprintf(stderr, "io_uring read: unexpected end of file\n");
+                goto out;
+            }
+            s->done += (size_t)cqe.res;
+            if (s->done < s->length) {
+                if (s->state == SLOT_READING) {
+                    send_queue_read(&r, s, idx, bufs);
+                } else {
+                    send_queue_send(&r, s, idx, bufs);
+                }
+                continue;
+            }
+            if (s->state == SLOT_READING) {
+                s->state = SLOT_READY;
+                continue;
+            }
+
+            s->state = SLOT_FREE;
+            sending = 0;
+            sent += s->length;
+            send_slot = (send_slot + 1) % URING_DEPTH;
+            progress_add(s->length);
+            limit_wait(s->length);
+        }
+    }
+    retval = (ssize_t)sent;
+
+out:
+    ring_exit(&r);
+    free(bufs);
+    return retval;
+}
+
+uring_rx *uring_rx_create(void)
+{
+    uring_rx *rx = calloc(1, sizeof(*rx));
+
+    if (rx == NULL) {
+        return NULL;
+    }
+    if (ring_open(&rx->r) < 0) {
+        free(rx);
+        return NULL;
+    }
+    if (posix_memalign((void**)&rx->bufs, 4096, (size_t)URING_DEPTH * CHUNK_SIZE) != 0) {
+        ring_exit(&rx->r);
+        free(rx);
+        return NULL;
+    }
+    if (ring_register_buffers(&rx->r, rx->bufs) < 0) {
+        ring_exit(&rx->r);
+        free(rx->bufs);
+        free(rx);
+        return NULL;
+    }
+    return rx;
+}
+
+/**
+ * Queue writing the rest of a received chunk
+ */
+static void rx_queue_write(uring_rx *rx, slot *s, int idx)
+{
+    ring_queue(&rx->r, IORING_OP_WRITE_FIXED, s->fd, 0,
+               rx->bufs + (size_t)idx * CHUNK_SIZE + s->done, s->length - s->done,
+               s->offset + (off_t)s->done, idx, (uint64_t)idx);
+}
+
+/**
+ * Process the completed writes
+ *
+ * Frees the buffers of the completed writes, requeues short ones and
+ * updates their owners.
+ *
+ * @param rx Engine
+ */
+static void rx_reap(uring_rx *rx)
+{
+    struct io_uring_cqe cqe;
+
+    while (ring_reap(&rx->r, &cqe)) {
+        int idx = (int)cqe.user_data;
+        slot *s = &rx->slots[idx];
+
+        if (cqe.res > 0) {
+            s->done += (size_t)cqe.res;
+            if (s->done < s->length) {
+                rx_queue_write(rx, s, idx);
+                continue;
+            }
+        } else {
+            fprintf(stderr, "io_uring write: %s\n",
+                    cqe.res ? strerror(-cqe.res) : "no space left");
+            s->owner->failed = 1;
+        }
+        s->owner->inflight--;
+        s->state = SLOT_FREE;
+    }
+}
+
+ssize_t uring_rx_recv(uring_rx *rx, uring_owner *owner, int sock, int fd,
+                      off_t offset, size_t length, hash_tree *hash)
+{
+    ssize_t bytes_read;
+    uint64_t start;
+    slot *s = NULL;
+    int idx;
+
+    while (1) {
+        rx_reap(rx);
+        for (idx = 0; idx < URING_DEPTH; idx++) {
+            if (rx->slots[idx].state == SLOT_FREE) {
+                s = &rx->slots[idx];
+                break;
+            }
+        }
+        if (s) {
+            break;
+        }
+        if (ring_submit(&rx->r, 1) < 0) {
+            return -1;
+        }
+    }
+    if (owner->failed) {
+        return -1;
+    }
+
+    start = stats_start();
+    bytes_read = recv(sock, rx->bufs + (size_t)idx * CHUNK_SIZE,
+                      length < CHUNK_SIZE ? length : CHUNK_SIZE, 0);
+    stats_stop(STATS_RECV, start, bytes_read);
+    if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return FSOCK_AGAIN;
+    }
+    if (bytes_read <= 0) {
+        perror("recv");
+        return -1;
+    }
+    if (hash) {
+        hash_tree_update(hash, rx->bufs + (size_t)idx * CHUNK_SIZE, (size_t)bytes_read);
+    }
+
+    s->state = SLOT_WRITING;
+    s->fd = fd;
+    s->offset = offset;
+    s->length = (size_t)bytes_read;
+    s->done = 0;
+    s->owner = owner;
+    owner->inflight++;
+    rx_queue_write(rx, s, idx);
+    if (ring_submit(&rx->r, 0) < 0) {
+        return -1;
+    }
+    return bytes_read;
+}
+
+int uring_rx_wait(uring_rx *rx, uring_owner *owner)
+{
+    while (owner->inflight > 0) {
+        if (ring_submit(&rx->r, 1) < 0) {
+            return -1;
+        }
+        rx_reap(rx);
+    }
+    return owner->failed ? -1 : 0;
+}
+
+#else /* !HAVE_URING */
+
+ssize_t uring_file_send(const file *f, int sock, hash_tree *hash)
+{
+    (void)f;
+    (void)sock;
+    (void)hash;
+    return FSOCK_UNSUPPORTED;
+}
+
+uring_rx *uring_rx_create(void)
+{
+    return NULL;
+}
+
+ssize_t uring_rx_recv(uring_rx *rx, uring_owner *owner, int sock, int fd,
+                      off_t offset, size_t length, hash_tree *hash)
+{
+    (void)rx;
+    (void)hash;
+    (void)owner;
+    (void)sock;
+    (void)fd;
+    (void)offset;
+    (void)length;
+    return -1;
+}
+
+int uring_rx_wait(uring_rx *rx, uring_owner *owner)
+{
+    (void)rx;
+    (void)owner;
+    return 0;
+}
+
+#endif /* HAVE_URING */
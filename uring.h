@@ -0,0 +1,98 @@
+/**
+ * @file uring.h
+ * @brief Optional io_uring transfer engine
+ *
+ * Keeps several disk and network operations in flight from a single
+ * thread, so the disk and the network work at the same time within one
+ * transfer. Used only when enabled with `uring_enabled`; everything falls
+ * back to the regular `sendfile()`/`splice()` paths when the kernel (or
+ * the platform) doesn't support it.
+ */
+
+#pragma once
+
+#include <sys/types.h>
+
+#include "file.h"
+#include "hash.h"
+
+/** Number of chunks an engine keeps in flight */
+#define URING_DEPTH 8
+
+/**
+ * Use io_uring for transfers when possible
+ *
+ * Off by default. Set from the command line before any transfer starts.
+ */
+extern int uring_enabled;
+
+/**
+ * Completion state of the writes issued for one receiver
+ *
+ * Embedded in the owner's state; the engine updates it as the writes
+ * queued with `uring_rx_recv()` complete.
+ */
+typedef struct {
+    unsigned inflight;  /**< Writes queued but not completed yet */
+    int      failed;    /**< Any of the writes failed */
+} uring_owner;
+
+/** Write-behind engine of a receiver thread */
+typedef struct uring_rx uring_rx;
+
+/**
+ * Send file contents over socket with io_uring
+ *
+ * Sends the `hdr.length` bytes at `hdr.offset` keeping up to
+ * `URING_DEPTH` chunk reads in flight while the previous chunks are
+ * being sent, in order, from registered buffers. The file and the socket
+ * are registered as fixed files. Counts the chunks sent in the progress.
+ * With `hash` every chunk is hashed just before it's sent.
+ *
+ * @param f    Pointer to file structure with open file descriptor
+ * @param sock Socket descriptor to send data to
+ * @param hash Tree to hash the data into, or `NULL`
+ *
+ * @return Total bytes sent on success, `FSOCK_UNSUPPORTED` if io_uring
+ *         can't be used (nothing has been sent then), -1 on error
+ */
+ssize_t uring_file_send(const file *f, int sock, hash_tree *hash);
+
+/**
+ * Create a write-behind engine for a receiver thread
+ *
+ * @return New engine, or `NULL` if io_uring can't be used
+ */
+uring_rx *uring_rx_create(void);
+
+/**
+ * Receive a chunk from socket and queue its write to file
+ *
+ * Receives up to `length` bytes into a free registered buffer and
+ * queues a write of them at `offset`, returning without waiting for
+ * the write. When all buffers are busy, waits for a write to complete.
+ * With `hash` the data is hashed before its write is queued.
+ *
+ * @param rx     Engine of the current thread
+ * @param owner  Completion state of the caller
+ * @param sock   Socket descriptor to receive data from
+ * @param fd     File descriptor to write to
+ * @param offset File offset to write the data at
+ * @param length Maximum number of bytes to receive
+ * @param hash   Tree to hash the data into, or `NULL`
+ *
+ * @return Number of bytes received, `FSOCK_AGAIN` if a non-blocking socket
+ *         has no data, -1 on error
+ */
+ssize_t uring_rx_recv(uring_rx *rx, uring_owner *owner, int sock, int fd,
+                      off_t offset, size_t length, hash_tree *hash);
+
+/**
+ * Wait until all writes queued for the owner have completed
+ *
+ * @param rx    Engine of the current thread
+ * @param owner Completion state of the caller
+ *
+ * @return 0 if all the writes succeeded, -1 otherwise
+ */
+int uring_rx_wait(uring_rx *rx, uring_owner *owner);
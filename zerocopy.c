@@ -0,0 +1,222 @@
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "limit.h"
+#include "stats.h"
+#include "zerocopy.h"
+
+int zerocopy_enabled = 0;
+
+#if defined(__linux__) && defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY) \
+    && defined(__has_include)
+# if __has_include(<linux/errqueue.h>)
+#  define HAVE_ZEROCOPY 1
+# endif
+#endif
+
+#ifdef HAVE_ZEROCOPY
+# include <linux/errqueue.h>
+#endif
+
+void zerocopy_start(zerocopy_socket *z, int sock)
+{
+    memset(z, 0, sizeof(*z));
+    z->sock = sock;
+#ifdef HAVE_ZEROCOPY
+    if (zerocopy_enabled) {
+        int yes = 1;
+
+        if (setsockopt(sock, SOL_SOCKET, SO_ZEROCOPY, &yes, sizeof(yes)) < 0) {
+            perror("setsockopt SO_ZEROCOPY");
+        } else {
+            z->enabled = 1;
+        }
+    }
+#endif
+}
+
+ssize_t zerocopy_send(zerocopy_socket *z, const void *buf, size_t length, uint32_t *token)
+{
+    size_t sent = 0;
+    int copy = 0;
+
+    while (sent < length) {
+        int flags = 0;
+        uint64_t start;
+        ssize_t rc;
+
+#ifdef HAVE_ZEROCOPY
+        if (z->enabled && !copy && length - sent >= ZEROCOPY_MIN_SIZE) {
+            flags = MSG_ZEROCOPY;
+        }
+        if (flags && z->next - z->done == ZEROCOPY_WINDOW) {
+            if (zerocopy_reap(z, -1) < 0) {
+                return -1;
+            }
+            continue;
+        }
+#endif
+        start = stats_start();
+        rc = send(z->sock, (const char*)buf + sent, length - sent, flags);
+        stats_stop(STATS_SEND, start, rc);
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == ENOBUFS && flags) {
+                /* Past the limit of pinned memory, copy this one */
+                copy = 1;
+                continue;
+            }
+            perror("send");
+            return -1;
+        }
+        if (flags) {
+            z->next++;
+        }
+        sent += (size_t)rc;
+        limit_wait((size_t)rc);
+    }
+    *token = z->next;
+    return (ssize_t)sent;
+}
+
+int zerocopy_done(const zerocopy_socket *z, uint32_t token)
+{
+    /* All the sends numbered below the token */
+    return (int32_t)(z->done - token) >= 0;
+}
+
+#ifdef HAVE_ZEROCOPY
+
+/**
+ * Mark a range of sends as completed
+ *
+ * @param z  Zero-copy state
+ * @param lo First send of the range
+ * @param hi Last send of the range
+ */
+static void zerocopy_complete(zerocopy_socket *z, uint32_t lo, uint32_t hi)
+{
+    uint32_t n;
+
+    for (n = lo; n != hi + 1; n++) {
+        if (n - z->done < ZEROCOPY_WINDOW && n - z->done < z->next - z->done) {
+            z->completed[n % ZEROCOPY_WINDOW] = 1;
+        }
+    }
+    while (z->done != z->next && z->completed[z->done % ZEROCOPY_WINDOW]) {
+        z->completed[z->done % ZEROCOPY_WINDOW] = 0;
+        z->done++;
+    }
+}
+
+/**
+ * Read the completions queued on the socket, without waiting
+ *
+ * @param z Zero-copy state
+ *
+ * @return Number of completion messages read, -1 on error
+ */
+static int zerocopy_read_queue(zerocopy_socket *z)
+{
+    int count = 0;
+
+    for (;;) {
+        char control[CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in6))];
+        struct msghdr msg = {.msg_control = control, .msg_controllen = sizeof(control)};
+        struct cmsghdr *cm;
+
+        if (recvmsg(z->sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return count;
+            }
+            perror("recvmsg MSG_ERRQUEUE");
+            return -1;
+        }
+        for (cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+            struct sock_extended_err err;
+
+            if (!(cm->cmsg_level == IPPROTO_IP && cm->cmsg_type == IP_RECVERR)
+                && !(cm->cmsg_level == IPPROTO_IPV6 && cm->cmsg_type == IPV6_RECVERR)) {
+                continue;
+            }
+            memcpy(&err, CMSG_DATA(cm), sizeof(err));
+            if (err.ee_origin != SO_EE_ORIGIN_ZEROCOPY || err.ee_errno != 0) {
+                continue;
+            }
+            if (err.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                /* Pinning the pages has bought nothing */
+                z->enabled = 0;
+            }
+            zerocopy_complete(z, err.ee_info, err.ee_data);
+            count++;
+        }
+    }
+}
+
+int zerocopy_reap(zerocopy_socket *z, int timeout_ms)
+{
+    while (z->done != z->next) {
+        struct pollfd pfd = {.fd = z->sock};
+        int rc = zerocopy_read_queue(z), err = 0;
+        socklen_t len = sizeof(err);
+
+        if (rc != 0 || timeout_ms == 0) {
+            return rc < 0 ? -1 : 0;
+        }
+
+        /* The error queue shows as `POLLERR` */
+        rc = poll(&pfd, 1, timeout_ms);
+        if (rc < 0 && errno != EINTR) {
+            perror("poll");
+            return -1;
+        }
+        if (rc == 0) {
+            return 0;
+        }
+        if (pfd.revents & (POLLHUP | POLLNVAL)) {
+            if (zerocopy_read_queue(z) > 0) {
+                continue;
+            }
+            printf("The connection has ended with data in flight\n");
+            return -1;
+        }
+        if (pfd.revents & POLLERR && zerocopy_read_queue(z) == 0
+            && getsockopt(z->sock, SOL_SOCKET, SO_ERROR, &err, &len) == 0 && err != 0) {
+            /* A failed connection, not a completion */
+            errno = err;
+            perror("send");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+#else
+
+int zerocopy_reap(zerocopy_socket *z, int timeout_ms)
+{
+    (void)z;
+    (void)timeout_ms;
+    return 0;
+}
+
+#endif
+
+int zerocopy_flush(zerocopy_socket *z)
+{
+    while (z->done != z->next) {
+        if (zerocopy_reap(z, -1) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
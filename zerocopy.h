@@ -0,0 +1,115 @@
+/**
+ * @file zerocopy.h
+ * @brief Sending user-space buffers without copying them
+ *
+ * `sendfile()` only helps with data straight from a file. The buffers a
+ * sender fills itself, compressed blocks, the ring of a fan-out or of a
+ * pipeline, are copied into the kernel by every `send()`. With
+ * `zerocopy_enabled` they're sent with `MSG_ZEROCOPY` (Linux) instead:
+ * the kernel pins the pages and sends straight from them, and reports
+ * through the socket's error queue when it's done with them. A buffer
+ * sent that way must be left alone until then, so the senders keep their
+ * buffers from being filled again until `zerocopy_done()` says so.
+ *
+ * Pinning the pages costs more than copying a few KB, so sends under
+ * `ZEROCOPY_MIN_SIZE` are copied as before. A socket whose data the
+ * kernel reports it had to copy after all, as over loopback, goes back
+ * to copying for good.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/** Smallest send worth pinning the pages for */
+#define ZEROCOPY_MIN_SIZE (16 * 1024)
+
+/** Most zero-copy sends of a socket not completed yet */
+#define ZEROCOPY_WINDOW 1024
+
+/** How long a sender with nothing else to do waits for completions at a time */
+#define ZEROCOPY_POLL_MS 1
+
+/**
+ * Send the buffers with `MSG_ZEROCOPY` where possible
+ *
+ * Off by default. Set from the command line before any transfer starts.
+ */
+extern int zerocopy_enabled;
+
+/**
+ * Zero-copy state of a socket
+ *
+ * The kernel numbers the zero-copy sends of a socket from 0 and
+ * completes them in ranges, not always in order.
+ */
+typedef struct {
+    int           sock;
+    int           enabled;   /**< Sending with `MSG_ZEROCOPY` */
+    uint32_t      next;      /**< Number of the next zero-copy send */
+    uint32_t      done;      /**< All the sends before it have completed */
+    unsigned char completed[ZEROCOPY_WINDOW]; /**< Sends after `done` completed */
+} zerocopy_socket;
+
+/**
+ * Start sending over a socket
+ *
+ * Turns `SO_ZEROCOPY` on with `zerocopy_enabled`, where the kernel has
+ * it; the sends are copied otherwise.
+ *
+ * @param z    State to initialize
+ * @param sock Connected socket
+ */
+void zerocopy_start(zerocopy_socket *z, int sock);
+
+/**
+ * Send the whole buffer
+ *
+ * Like `send_all()`, but the buffer may still be in use by the kernel on
+ * return: it may be changed or freed only once `zerocopy_done()` holds
+ * for `token`.
+ *
+ * @param z      State from `zerocopy_start()`
+ * @param buf    Buffer with the data
+ * @param length Number of bytes to send
+ * @param token  Set to what to pass to `zerocopy_done()` for the buffer
+ *
+ * @return Number of bytes sent on success, -1 on error
+ */
+ssize_t zerocopy_send(zerocopy_socket *z, const void *buf, size_t length, uint32_t *token);
+
+/**
+ * Whether the kernel is done with a buffer
+ *
+ * Only looks at the completions already collected by `zerocopy_reap()`.
+ *
+ * @param z     State from `zerocopy_start()`
+ * @param token Token from `zerocopy_send()`
+ *
+ * @return Nonzero if the buffer may be changed
+ */
+int zerocopy_done(const zerocopy_socket *z, uint32_t token);
+
+/**
+ * Collect the completions the kernel has reported
+ *
+ * Returns at once when no send is waiting for one.
+ *
+ * @param z          State from `zerocopy_start()`
+ * @param timeout_ms How long to wait for the first completion, 0 not to
+ *                   wait, -1 to wait as long as it takes
+ *
+ * @return 0 on success, even if none have come, -1 if the connection has
+ *         failed
+ */
+int zerocopy_reap(zerocopy_socket *z, int timeout_ms);
+
+/**
+ * Wait until the kernel is done with all the buffers sent
+ *
+ * @param z State from `zerocopy_start()`
+ *
+ * @return 0 on success, -1 if the connection has failed
+ */
+int zerocopy_flush(zerocopy_socket *z);